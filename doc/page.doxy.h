@@ -37,38 +37,44 @@
 
     <h2>Wrapping function declaration</h2>
     - Include original declaration and reimplement
+    - Describe call in usbschema.h
     - Build as shared library
     - Preload with "usbnet".
 
     <h3>Example reimplementation</h3>
-    Initialize remote socket descriptor and synchronize call to ensure thread-safe result.
+    Describe request and reply fields once, client and server share the schema.
+    \code
+    #define SCHEMA_CALLS(X) ... X(OpCode1, handler1, 0)
+    #define OpCode1_REQ(F) F(i32, param)
+    #define OpCode1_REP(F) F(i32, res)
+    \endcode
+    Initialize remote socket descriptor and claim packet buffer of calling thread.
     \code
     int function_call(int param)
     {
-      Packet* pkt_claim();    // Claim shared buffer (efficient and synchronous)
+      Packet* pkt_claim();    // Claim thread buffer (efficient, no locking)
       int fd = session_get(); // Get remote socket descriptor
     \endcode
-    Send packet with opcode and paramter.
-    \code
-      pkt_init(pkt, OpCode1); // Initialize packet
-      pkt_addint(pkt, param); // Append parameter
-      pkt_send(pkt, fd);      // Send packet
-    \endcode
-    Receive and store result value.
+    Send request and store result value. Request is tagged with unique id and
+    the reply is matched by the id, so calls from multiple threads may be in flight at once.
+    Fields are encoded at fixed offsets, stubs are generated from the schema.
     \code
-      Iterator it;
+      OpCode1Req req = { param, NULL, 0 };    // Request fields, no data
+      OpCode1Rep rep;
       int res = -1;
-      if(pkt_recv(fd, pkt) > 0) { // Receive packet
-         pkt_begin(pkt, &it);     // Initialize iterator
-         res = iter_getint(&it);  // Save result
-      }
+      if(OpCode1_call(fd, pkt, &req, &rep)) // Send request and decode reply
+         res = rep.res;                     // Save result
     \endcode
-    Release call lock and return value.
+    Release buffer and return value.
     \code
-      pkt_release(); // Release shared buffer
+      pkt_release(); // Release thread buffer
       return res;
     }
     \endcode
+    Server handler receives decoded request.
+    \code
+    void UsbService::handler1(int fd, Packet& in, OpCode1Req& req);
+    \endcode
     <br/>
     Marek Vavrusa <marek@vavrusa.com><br/>
     Zdenek Vasicek <vasicek@fit.vutbr.cz>
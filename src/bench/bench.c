@@ -0,0 +1,156 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file bench.c
+    \brief Benchmark harness.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+
+volatile uint32_t bench_sink = 0;
+
+/* Heap accounting, atomic as benchmarks may link threaded client. */
+static uint64_t __allocs = 0;
+static uint64_t __live = 0;
+static uint64_t __peak = 0;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void  __libc_free(void* ptr);
+
+/** Account allocated block. */
+static inline void heap_add(void* ptr)
+{
+   if(ptr == NULL)
+      return;
+
+   __sync_fetch_and_add(&__allocs, 1);
+   uint64_t live = __sync_add_and_fetch(&__live, malloc_usable_size(ptr));
+   uint64_t peak = __peak;
+   while(live > peak && !__sync_bool_compare_and_swap(&__peak, peak, live))
+      peak = __peak;
+}
+
+/** Account freed block. */
+static inline void heap_sub(void* ptr)
+{
+   if(ptr != NULL)
+      __sync_fetch_and_sub(&__live, malloc_usable_size(ptr));
+}
+
+void* malloc(size_t size)
+{
+   void* ptr = __libc_malloc(size);
+   heap_add(ptr);
+   return ptr;
+}
+
+void* calloc(size_t n, size_t size)
+{
+   void* ptr = __libc_calloc(n, size);
+   heap_add(ptr);
+   return ptr;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+   heap_sub(ptr);
+   void* res = __libc_realloc(ptr, size);
+   heap_add(res != NULL ? res : (size > 0 ? ptr : NULL));
+   return res;
+}
+
+void free(void* ptr)
+{
+   heap_sub(ptr);
+   __libc_free(ptr);
+}
+
+uint64_t bench_now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_start(Bench* b, const char* suite, const char* bench, const char* name,
+                 uint64_t iterations)
+{
+   b->suite = suite;
+   b->bench = bench;
+   b->name = name;
+   b->iterations = iterations;
+   b->allocs = __allocs;
+   b->live = __live;
+   __peak = __live;
+   b->start = bench_now();
+}
+
+void bench_stop(Bench* b, uint64_t bytes)
+{
+   uint64_t elapsed = bench_now() - b->start;
+   double n = b->iterations > 0 ? (double) b->iterations : 1.0;
+   printf("{\"suite\": \"%s\", \"bench\": \"%s\", \"name\": \"%s\", "
+          "\"iterations\": %llu, \"ns_per_op\": %.2f, \"bytes_per_op\": %llu, "
+          "\"allocs_per_op\": %.3f, \"peak_bytes\": %llu}\n",
+          b->suite, b->bench, b->name, (unsigned long long) b->iterations,
+          elapsed / n, (unsigned long long) bytes, (__allocs - b->allocs) / n,
+          (unsigned long long) (__peak - b->live));
+   fflush(stdout);
+}
+
+/** Compare latency samples. */
+static int sample_cmp(const void* a, const void* b)
+{
+   uint64_t x = *((const uint64_t*) a);
+   uint64_t y = *((const uint64_t*) b);
+   return (x > y) - (x < y);
+}
+
+void bench_stop_latency(Bench* b, uint64_t* samples, uint64_t bytes)
+{
+   uint64_t elapsed = bench_now() - b->start;
+   uint64_t n = b->iterations;
+   double secs = elapsed > 0 ? elapsed / 1e9 : 1e-9;
+   qsort(samples, n, sizeof(uint64_t), sample_cmp);
+   printf("{\"suite\": \"%s\", \"bench\": \"%s\", \"name\": \"%s\", "
+          "\"iterations\": %llu, \"calls_per_s\": %.1f, \"p50_ns\": %llu, "
+          "\"p99_ns\": %llu, \"mb_per_s\": %.2f}\n",
+          b->suite, b->bench, b->name, (unsigned long long) n, n / secs,
+          (unsigned long long) (n > 0 ? samples[n / 2] : 0),
+          (unsigned long long) (n > 0 ? samples[(n * 99) / 100] : 0),
+          (n * bytes) / secs / 1e6);
+   fflush(stdout);
+}
+
+uint64_t bench_iterations(int argc, char** argv, uint64_t def)
+{
+   if(argc > 1 && atoll(argv[1]) > 0)
+      return atoll(argv[1]);
+
+   return def;
+}
+
+/** @} */
@@ -0,0 +1,94 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file bench.h
+    \brief Benchmark harness.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#pragma once
+#ifndef __bench_h__
+#define __bench_h__
+#include <stdint.h>
+
+/** \page bench_page
+    <h2>Benchmarks</h2>
+    Each benchmark prints a single JSON object per line
+    \code
+       {"suite": "urpc", "bench": "encode", "name": "UsbControlMsgReq",
+        "iterations": 1000000, "ns_per_op": 12.3, "bytes_per_op": 22,
+        "allocs_per_op": 0.0, "peak_bytes": 0}
+    \endcode
+    Allocations are counted by interposed malloc(), peak is the highest
+    amount of live heap memory during the benchmark, above the amount at start.
+    Benchmarks of remote calls report call rate, latency percentiles
+    and data rate instead
+    \code
+       {"suite": "usbnet", "bench": "call", "name": "UsbBulkRead",
+        "iterations": 10000, "calls_per_s": 8123.4, "p50_ns": 112000,
+        "p99_ns": 310000, "mb_per_s": 33.27}
+    \endcode
+  */
+
+/** Benchmark state. */
+typedef struct {
+   const char* suite;   //! Library name
+   const char* bench;   //! Benchmark kind
+   const char* name;    //! Benchmarked item
+   uint64_t iterations;
+   uint64_t start;      //! Start time (ns)
+   uint64_t allocs;     //! Allocation count at start
+   uint64_t live;       //! Live heap bytes at start
+} Bench;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Return monotonic time (ns). */
+uint64_t bench_now();
+
+/** Start benchmark, resets allocation peak. */
+void bench_start(Bench* b, const char* suite, const char* bench, const char* name,
+                 uint64_t iterations);
+
+/** Stop benchmark and print result.
+  * \param bytes bytes produced or consumed per operation
+  */
+void bench_stop(Bench* b, uint64_t bytes);
+
+/** Stop benchmark of remote calls and print result.
+  * \param samples latency of each call (ns), sorted in place
+  * \param bytes bytes transferred per call
+  */
+void bench_stop_latency(Bench* b, uint64_t* samples, uint64_t bytes);
+
+/** Parse iteration count from command line, or return default. */
+uint64_t bench_iterations(int argc, char** argv, uint64_t def);
+
+/** Sink for computed values, keeps compiler from dropping the work. */
+extern volatile uint32_t bench_sink;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __bench_h__
+/** @} */
@@ -0,0 +1,141 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file loopbench.c
+    \brief Remote call benchmark.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "bench.h"
+#include "usbnet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Benchmark suite name. */
+#define SUITE "usbnet"
+
+/** Default bulk transfer size. */
+#define BULK_SIZE 4096
+
+/** Transfer timeout (ms). */
+#define TIMEOUT 1000
+
+/** Time each call, stop benchmark on error. */
+#define BENCH_CALLS(name, n, bytes, call) \
+   do { \
+      Bench b; \
+      uint64_t i; \
+      bench_start(&b, SUITE, "call", (name), (n)); \
+      for(i = 0; i < (n); ++i) { \
+         uint64_t t = bench_now(); \
+         int res = (call); \
+         samples[i] = bench_now() - t; \
+         if(res < 0) { \
+            fprintf(stderr, "%s: call %llu failed (%d)\n", (name), \
+                    (unsigned long long) i, res); \
+            return EXIT_FAILURE; \
+         } \
+      } \
+      bench_stop_latency(&b, samples, (bytes)); \
+   } while(0)
+
+/** Return first endpoint of given type and direction, or 0. */
+static int find_endpoint(struct usb_device* dev, int type, int dir)
+{
+   if(dev->config == NULL || dev->config->bNumInterfaces == 0)
+      return 0;
+
+   struct usb_interface_descriptor* alt = &dev->config->interface[0].altsetting[0];
+   int i;
+   for(i = 0; i < alt->bNumEndpoints; ++i) {
+      struct usb_endpoint_descriptor* e = &alt->endpoint[i];
+      if((e->bmAttributes & USB_ENDPOINT_TYPE_MASK) == type &&
+         (e->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == dir)
+         return e->bEndpointAddress;
+   }
+
+   return 0;
+}
+
+int main(int argc, char** argv)
+{
+   uint64_t n = bench_iterations(argc, argv, 10000);
+   int size = BULK_SIZE;
+   int index = 0;
+   if(argc > 2)
+      size = atoi(argv[2]);
+   if(argc > 3)
+      index = atoi(argv[3]);
+
+   uint64_t* samples = malloc(n * sizeof(uint64_t));
+   char* buf = malloc(size);
+   if(samples == NULL || buf == NULL)
+      return EXIT_FAILURE;
+   memset(buf, 0, size);
+
+   // Find device by index
+   usb_init();
+   usb_find_busses();
+   usb_find_devices();
+   struct usb_device* dev = NULL;
+   struct usb_bus* bus;
+   for(bus = usb_get_busses(); bus && dev == NULL; bus = bus->next) {
+      for(dev = bus->devices; dev && index > 0; dev = dev->next)
+         --index;
+   }
+   if(dev == NULL) {
+      fprintf(stderr, "no device found\n");
+      return EXIT_FAILURE;
+   }
+
+   // Device calls
+   uint64_t nslow = n / 10 + 1;
+   BENCH_CALLS("UsbFindDevices", nslow, 0, usb_find_devices());
+   usb_dev_handle** handles = malloc(nslow * sizeof(usb_dev_handle*));
+   if(handles == NULL)
+      return EXIT_FAILURE;
+   BENCH_CALLS("UsbOpen", nslow, 0, (handles[i] = usb_open(dev)) != NULL ? 0 : -1);
+   BENCH_CALLS("UsbClose", nslow - 1, 0, usb_close(handles[i + 1]));
+   usb_dev_handle* h = handles[0];
+   free(handles);
+   BENCH_CALLS("UsbSetConfiguration", n, 0, usb_set_configuration(h, 1));
+   BENCH_CALLS("UsbClaimInterface", n, 0, usb_claim_interface(h, 0));
+   BENCH_CALLS("UsbControlMsg", n, 8, usb_control_msg(h, 0x80, 6, 0x0100, 0, buf, 8, TIMEOUT));
+
+   // Transfers on endpoints found in descriptors
+   int ep = find_endpoint(dev, USB_ENDPOINT_TYPE_BULK, USB_ENDPOINT_IN);
+   if(ep != 0)
+      BENCH_CALLS("UsbBulkRead", n, size, usb_bulk_read(h, ep, buf, size, TIMEOUT));
+   ep = find_endpoint(dev, USB_ENDPOINT_TYPE_BULK, USB_ENDPOINT_OUT);
+   if(ep != 0)
+      BENCH_CALLS("UsbBulkWrite", n, size, usb_bulk_write(h, ep, buf, size, TIMEOUT));
+   ep = find_endpoint(dev, USB_ENDPOINT_TYPE_INTERRUPT, USB_ENDPOINT_IN);
+   if(ep != 0)
+      BENCH_CALLS("UsbInterruptRead", n, 8, usb_interrupt_read(h, ep, buf, 8, TIMEOUT));
+
+   usb_release_interface(h, 0);
+   usb_close(h);
+
+   free(buf);
+   free(samples);
+   return EXIT_SUCCESS;
+}
+
+/** @} */
@@ -0,0 +1,284 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file protobench.c
+    \brief Protocol C API benchmark.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "bench.h"
+#include "protocol.h"
+#include "usbnet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Benchmark suite name. */
+#define SUITE "urpc"
+
+/** Default devices in synthetic topology. */
+#define TOPOLOGY_DEVICES 256
+
+/** Encode message to packet, header included in size. */
+#define BENCH_ENCODE(op, msg) \
+static void bench_encode_##msg(Packet* pkt, uint64_t n) \
+{ \
+   msg m; \
+   memset(&m, 0, sizeof(m)); \
+   Bench b; \
+   bench_start(&b, SUITE, "encode", #msg, n); \
+   uint64_t i; \
+   for(i = 0; i < n; ++i) { \
+      pkt_init(pkt, op); \
+      msg##_pack(pkt_alloc(pkt, msg##Size), &m); \
+      bench_sink += pkt->size; \
+   } \
+   char hdr[PACKET_MINSIZE]; \
+   bench_stop(&b, pkt->size + 3 + pack_size(pkt->size, hdr)); \
+}
+
+/** Decode message from wire format, header parsing included. */
+#define BENCH_DECODE(op, msg) \
+static void bench_decode_##msg(uint64_t n) \
+{ \
+   char wire[PACKET_MINSIZE + msg##Size]; \
+   memset(wire, 0, sizeof(wire)); \
+   wire[2] = op; \
+   uint32_t hlen = 3 + pack_size(msg##Size, wire + 3); \
+   msg m; \
+   Bench b; \
+   bench_start(&b, SUITE, "decode", #msg, n); \
+   uint64_t i; \
+   for(i = 0; i < n; ++i) { \
+      uint32_t size = 0; \
+      unpack_size(wire + 3, &size); \
+      bench_sink += msg##_unpack(wire + hlen, size, &m); \
+   } \
+   bench_stop(&b, hlen + msg##Size); \
+}
+
+#define BENCH_CALL(op, handler, flags) \
+   BENCH_ENCODE(op, op##Req) \
+   BENCH_ENCODE(op, op##Rep) \
+   BENCH_DECODE(op, op##Req) \
+   BENCH_DECODE(op, op##Rep)
+
+SCHEMA_CALLS(BENCH_CALL)
+
+/** Encode numeric values with pkt_addnumeric(). */
+static void bench_addnumeric(Packet* pkt, uint64_t n)
+{
+   Bench b;
+   bench_start(&b, SUITE, "encode", "pkt_addnumeric", n);
+   uint64_t i;
+   for(i = 0; i < n; ++i) {
+      if((i & 63) == 0)
+         pkt_init(pkt, UsbInit);
+      pkt_adduint32(pkt, i);
+   }
+   bench_stop(&b, 4 + sizeof(uint32_t));
+}
+
+/** Encode octet strings with pkt_append(). */
+static void bench_append(Packet* pkt, uint64_t n)
+{
+   static const char str[] = "usb-0000:00:1d.0-1.4";
+   Bench b;
+   bench_start(&b, SUITE, "encode", "pkt_append", n);
+   uint64_t i;
+   for(i = 0; i < n; ++i) {
+      if((i & 63) == 0)
+         pkt_init(pkt, UsbInit);
+      pkt_addstr(pkt, sizeof(str), str);
+   }
+   bench_stop(&b, 4 + sizeof(str));
+}
+
+/** Decode values with iter_next(), values are walked repeatedly. */
+static void bench_iter_next(Packet* pkt, uint64_t n)
+{
+   int count = 64;
+   pkt_init(pkt, UsbInit);
+   int k;
+   for(k = 0; k < count; ++k)
+      pkt_adduint32(pkt, k);
+
+   Bench b;
+   bench_start(&b, SUITE, "decode", "iter_next", n);
+   Iterator it;
+   uint64_t i = 0;
+   while(i < n) {
+      iter_begin(&it, pkt->buf, pkt->size);
+      for(; i < n && !iter_end(&it); ++i) {
+         bench_sink += it.len;
+         iter_next(&it);
+      }
+   }
+   bench_stop(&b, pkt->size / count);
+}
+
+/** Decode packed sizes with unpack_size(). */
+static void bench_unpack_size(uint64_t n)
+{
+   char buf[3][5];
+   pack_size(0x40, buf[0]);
+   pack_size(0x4000, buf[1]);
+   pack_size(0x400000, buf[2]);
+
+   Bench b;
+   bench_start(&b, SUITE, "decode", "unpack_size", n);
+   uint64_t i;
+   for(i = 0; i < n; ++i) {
+      uint32_t val = 0;
+      bench_sink += unpack_size(buf[i % 3], &val);
+      bench_sink += val;
+   }
+   bench_stop(&b, 3);
+}
+
+/** Append device block in server topology layout. */
+static void topology_device(Packet* dst, Packet* dev, int devnum)
+{
+   static char desc[sizeof(struct usb_config_descriptor)];
+   char filename[12];
+   snprintf(filename, sizeof(filename), "%03d", devnum);
+
+   pkt_init(dev, UsbFindDevices);
+   pkt_addstr(dev, strlen(filename) + 1, filename);
+   pkt_adduint8(dev, devnum);
+   pkt_append(dev, RawType, sizeof(struct usb_device_descriptor), desc);
+   pkt_append(dev, RawType, sizeof(struct usb_config_descriptor), desc);
+   pkt_addint32(dev, 1);
+   pkt_append(dev, RawType, sizeof(struct usb_interface_descriptor), desc);
+   pkt_append(dev, RawType, sizeof(struct usb_endpoint_descriptor), desc);
+   pkt_append(dev, RawType, sizeof(struct usb_endpoint_descriptor), desc);
+   pkt_append(dst, SequenceType, dev->size, dev->buf);
+}
+
+/** Build UsbFindDevices reply with given number of devices,
+  * busses hold up to 127 devices.
+  */
+static void topology_build(Packet* pkt, Packet* bus, Packet* dev, int count)
+{
+   UsbFindDevicesRep rep = { 0, 1, NULL, 0 };
+   pkt_init(pkt, UsbFindDevices);
+   UsbFindDevicesRep_pack(pkt_alloc(pkt, UsbFindDevicesRepSize), &rep);
+
+   int location = 1;
+   int devnum = 0;
+   while(count > 0) {
+      pkt_init(bus, UsbFindDevices);
+      pkt_addstr(bus, 4, "001");
+      pkt_adduint32(bus, location++);
+      for(devnum = 1; devnum <= 127 && count > 0; ++devnum, --count)
+         topology_device(bus, dev, devnum);
+      pkt_append(pkt, StructureType, bus->size, bus->buf);
+   }
+}
+
+/** Walk all values in topology, entering structural values.
+  * \return number of values
+  */
+static int topology_walk(Packet* pkt)
+{
+   UsbFindDevicesRep rep;
+   if(!UsbFindDevicesRep_unpack(pkt->buf, pkt->size, &rep))
+      return 0;
+
+   int count = 0;
+   Iterator it;
+   iter_begin(&it, rep.data, rep.len);
+   while(!iter_end(&it)) {
+      ++count;
+      if(it.type == StructureType || it.type == SequenceType)
+         iter_enter(&it);
+      else
+         iter_next(&it);
+   }
+
+   return count;
+}
+
+/** Encode and decode synthetic UsbFindDevices reply. */
+static void bench_topology(uint64_t n, int devices)
+{
+   char name[32];
+   snprintf(name, sizeof(name), "UsbFindDevicesRep/%d", devices);
+
+   // Encode, buffers are created for each reply
+   Bench b;
+   bench_start(&b, SUITE, "encode", name, n);
+   uint64_t i;
+   uint32_t size = 0;
+   for(i = 0; i < n; ++i) {
+      Packet* pkt = pkt_new(BUF_FRAGLEN, UsbFindDevices);
+      Packet* bus = pkt_new(BUF_FRAGLEN, UsbFindDevices);
+      Packet* dev = pkt_new(BUF_FRAGLEN, UsbFindDevices);
+      topology_build(pkt, bus, dev, devices);
+      size = pkt->size;
+      pkt_free(dev);
+      pkt_free(bus);
+      pkt_free(pkt);
+   }
+   bench_stop(&b, size);
+
+   // Decode
+   Packet* pkt = pkt_new(BUF_FRAGLEN, UsbFindDevices);
+   Packet* bus = pkt_new(BUF_FRAGLEN, UsbFindDevices);
+   Packet* dev = pkt_new(BUF_FRAGLEN, UsbFindDevices);
+   topology_build(pkt, bus, dev, devices);
+   bench_start(&b, SUITE, "decode", name, n);
+   for(i = 0; i < n; ++i)
+      bench_sink += topology_walk(pkt);
+   bench_stop(&b, pkt->size);
+
+   pkt_free(dev);
+   pkt_free(bus);
+   pkt_free(pkt);
+}
+
+int main(int argc, char** argv)
+{
+   uint64_t n = bench_iterations(argc, argv, 1000000);
+   int devices = TOPOLOGY_DEVICES;
+   if(argc > 2)
+      devices = atoi(argv[2]);
+   Packet* pkt = pkt_new(BUF_FRAGLEN, UsbInit);
+
+   // Calls
+#define BENCH_RUN(op, handler, flags) \
+   bench_encode_##op##Req(pkt, n); \
+   bench_encode_##op##Rep(pkt, n); \
+   bench_decode_##op##Req(n); \
+   bench_decode_##op##Rep(n);
+   SCHEMA_CALLS(BENCH_RUN)
+#undef BENCH_RUN
+
+   // Primitives
+   bench_addnumeric(pkt, n);
+   bench_append(pkt, n);
+   bench_iter_next(pkt, n);
+   bench_unpack_size(n);
+   bench_topology(n / 1000 + 1, devices);
+
+   pkt_free(pkt);
+   return 0;
+}
+
+/** @} */
@@ -0,0 +1,205 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file protobench_pp.cpp
+    \brief Protocol C++ API benchmark.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "bench.h"
+#include "protocol.hpp"
+#include "usbnet.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+using namespace Proto;
+
+/** Benchmark suite name. */
+#define SUITE "urpc_pp"
+
+/** Default devices in synthetic topology. */
+#define TOPOLOGY_DEVICES 256
+
+/** Encode message with Packet::addMessage(), packet buffer is reused. */
+template <class M> void bench_encode(const char* name, uint8_t op, uint64_t n)
+{
+   M msg;
+   memset(&msg, 0, sizeof(msg));
+   Packet pkt(op);
+   Bench b;
+   bench_start(&b, SUITE, "encode", name, n);
+   for(uint64_t i = 0; i < n; ++i) {
+      pkt.reset(op, i);
+      pkt.addMessage(msg).finalize();
+      bench_sink += pkt.size();
+   }
+   bench_stop(&b, pkt.size() + sizeof(uint16_t));
+}
+
+/** Decode message with Packet::getMessage(). */
+template <class M> void bench_decode(const char* name, uint8_t op, uint64_t n)
+{
+   M msg;
+   memset(&msg, 0, sizeof(msg));
+   Packet pkt(op);
+   pkt.addMessage(msg).finalize();
+   Bench b;
+   bench_start(&b, SUITE, "decode", name, n);
+   for(uint64_t i = 0; i < n; ++i)
+      bench_sink += pkt.getMessage(msg);
+   bench_stop(&b, pkt.size() + sizeof(uint16_t));
+}
+
+/** Encode numeric values with Struct::addNumeric(). */
+static void bench_addnumeric(uint64_t n)
+{
+   Packet pkt(UsbInit);
+   Bench b;
+   bench_start(&b, SUITE, "encode", "Struct::addNumeric", n);
+   for(uint64_t i = 0; i < n; ++i) {
+      if((i & 63) == 0)
+         pkt.reset(UsbInit);
+      pkt.addNumeric(UnsignedType, sizeof(uint32_t), i);
+   }
+   bench_stop(&b, 2 + sizeof(uint32_t));
+}
+
+/** Finalize nested block with Struct::finalize(). */
+static void bench_finalize(uint64_t n)
+{
+   Packet pkt(UsbInit);
+   Struct block = pkt.writeBlock(StructureType);
+   block.addUInt32(0);
+   Bench b;
+   bench_start(&b, SUITE, "encode", "Struct::finalize", n);
+   for(uint64_t i = 0; i < n; ++i)
+      block.finalize();
+   bench_stop(&b, 0);
+}
+
+/** Decode values with Iterator::next(), values are walked repeatedly. */
+static void bench_iter_next(uint64_t n)
+{
+   const int count = 64;
+   Packet pkt(UsbInit);
+   for(int k = 0; k < count; ++k)
+      pkt.addUInt32(k);
+   pkt.finalize();
+
+   Bench b;
+   bench_start(&b, SUITE, "decode", "Iterator::next", n);
+   uint64_t i = 0;
+   while(i < n) {
+      Iterator it(pkt);
+      for(int k = 0; i < n && k < count; ++i, ++k) {
+         bench_sink += it.length();
+         it.next();
+      }
+   }
+   bench_stop(&b, pkt.payloadSize() / count);
+}
+
+/** Write bus blob in server topology layout. */
+static void topology_bus(ByteBuffer& blob, unsigned location, int devices)
+{
+   static char desc[sizeof(struct usb_config_descriptor)];
+   char filename[12];
+
+   Struct root(blob, 0);
+   Struct block = root.writeBlock(StructureType);
+   block.addString("001");
+   block.addUInt32(location);
+   for(int devnum = 1; devnum <= devices; ++devnum) {
+      snprintf(filename, sizeof(filename), "%03d", devnum);
+      Struct devBlock = block.writeBlock(SequenceType);
+      devBlock.addString(filename);
+      devBlock.addUInt8(devnum);
+      devBlock.addData(desc, sizeof(struct usb_device_descriptor));
+      devBlock.addData(desc, sizeof(struct usb_config_descriptor));
+      devBlock.addInt32(1);
+      devBlock.addData(desc, sizeof(struct usb_interface_descriptor));
+      devBlock.addData(desc, sizeof(struct usb_endpoint_descriptor));
+      devBlock.addData(desc, sizeof(struct usb_endpoint_descriptor));
+      devBlock.finalize();
+   }
+   block.finalize();
+}
+
+/** Build UsbFindDevices reply as the server does,
+  * busses hold up to 127 devices.
+  */
+static void topology_build(Packet& pkt, int count)
+{
+   UsbFindDevicesRep rep = { 0, 1, NULL, 0 };
+   pkt.reset(UsbFindDevices);
+   pkt.addMessage(rep);
+
+   unsigned location = 1;
+   while(count > 0) {
+      int devices = count < 127 ? count : 127;
+      ByteBuffer blob;
+      topology_bus(blob, location++, devices);
+      pkt.append(blob.data(), blob.size());
+      count -= devices;
+   }
+   pkt.finalize();
+}
+
+/** Encode synthetic UsbFindDevices reply. */
+static void bench_topology(uint64_t n, int devices)
+{
+   char name[32];
+   snprintf(name, sizeof(name), "UsbFindDevicesRep/%d", devices);
+
+   Bench b;
+   bench_start(&b, SUITE, "encode", name, n);
+   size_t size = 0;
+   for(uint64_t i = 0; i < n; ++i) {
+      Packet pkt(UsbFindDevices);
+      topology_build(pkt, devices);
+      size = pkt.size();
+   }
+   bench_stop(&b, size + sizeof(uint16_t));
+}
+
+int main(int argc, char** argv)
+{
+   uint64_t n = bench_iterations(argc, argv, 1000000);
+   int devices = TOPOLOGY_DEVICES;
+   if(argc > 2)
+      devices = atoi(argv[2]);
+
+   // Calls
+#define BENCH_RUN(op, handler, flags) \
+   bench_encode<op##Req>(#op "Req", op, n); \
+   bench_encode<op##Rep>(#op "Rep", op, n); \
+   bench_decode<op##Req>(#op "Req", op, n); \
+   bench_decode<op##Rep>(#op "Rep", op, n);
+   SCHEMA_CALLS(BENCH_RUN)
+#undef BENCH_RUN
+
+   // Primitives
+   bench_addnumeric(n);
+   bench_finalize(n);
+   bench_iter_next(n);
+   bench_topology(n / 1000 + 1, devices);
+   return 0;
+}
+
+/** @} */
@@ -0,0 +1,632 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file sessionmux.cpp
+    \brief Local session multiplexer.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup client
+    @{
+  */
+#include "sessionmux.hpp"
+#include "common.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/** Maximum events per wait. */
+enum { MaxEvents = 64 };
+
+/** Maximum queued replies per client (bytes), client is dropped
+  * if it stops reading. */
+enum { MaxQueued = 16 << 20 };
+
+/** Return monotonic time (ms). */
+static uint64_t now_ms()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Return call flags, see usbschema.h. */
+static int call_flags(uint8_t op)
+{
+   switch(op) {
+#define CALL_FLAGS(op, handler, f) case op: return (f);
+      SCHEMA_CALLS(CALL_FLAGS)
+#undef CALL_FLAGS
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+/** Send received packet with given request id, payload is not copied. */
+static bool relay(int fd, uint16_t id, Packet& pkt)
+{
+   uint16_t nid = htons(id);
+   struct iovec iov[2];
+   iov[0].iov_base = &nid;
+   iov[0].iov_len = sizeof(uint16_t);
+   iov[1].iov_base = (void*) pkt.data();
+   iov[1].iov_len = pkt.size();
+   return send_full(fd, iov, 2) > 0;
+}
+
+SessionMux::SessionMux(int remote)
+   : mRemote(remote), mListen(-1), mEpoll(-1), mStop(0), mCacheTime(0),
+     mLastSerial(0), mLastId(0)
+{
+   rbuf_init(&mRemoteRb, RECVBUF_SIZE);
+   codec_init(&mCodec, CodecNone);
+   pthread_mutex_init(&mSendLock, NULL);
+   pthread_mutex_init(&mLock, NULL);
+   mTopology.res = 0;
+   mTopology.generation = 0;
+   mTopology.time = 0;
+}
+
+SessionMux::~SessionMux()
+{
+   // Close clients
+   std::map<uint32_t, Client*>::iterator i;
+   for(i = mClients.begin(); i != mClients.end(); ++i) {
+      ::close(i->second->fd);
+      rbuf_free(&i->second->rb);
+      delete i->second;
+   }
+   mClients.clear();
+
+   // Remove socket
+   if(mListen != -1) {
+      ::close(mListen);
+      unlink(mPath.c_str());
+   }
+
+   rbuf_free(&mRemoteRb);
+   codec_free(&mCodec);
+   pthread_mutex_destroy(&mSendLock);
+   pthread_mutex_destroy(&mLock);
+}
+
+bool SessionMux::listen(const std::string& path)
+{
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if(path.size() >= sizeof(addr.sun_path)) {
+      error_msg("Daemon: socket path %s is too long", path.c_str());
+      return false;
+   }
+   strcpy(addr.sun_path, path.c_str());
+
+   // Refuse path of running multiplexer, remove stale socket
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(fd < 0)
+      return false;
+   if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+      error_msg("Daemon: %s is in use", path.c_str());
+      ::close(fd);
+      return false;
+   }
+   ::close(fd);
+   unlink(path.c_str());
+
+   // Listen, accessible to owner only
+   mode_t mask = umask(0077);
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   bool ok = fd >= 0 && bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 &&
+             ::listen(fd, 128) == 0;
+   umask(mask);
+   if(!ok) {
+      error_msg("Daemon: failed to listen at %s: %s", path.c_str(), strerror(errno));
+      if(fd >= 0)
+         ::close(fd);
+      return false;
+   }
+
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+   mListen = fd;
+   mPath = path;
+   return true;
+}
+
+void SessionMux::setCompression(int codecs)
+{
+   codecs &= codec_supported();
+   if(codecs == CodecNone)
+      return;
+
+   // Called before relaying, server replies raw
+   UsbHelloReq req = { (uint32_t) codecs, NULL, 0 };
+   Packet pkt(UsbHello, ++mLastId);
+   pkt.addMessage(req);
+   UsbHelloRep rep;
+   if(pkt.send(mRemote) > 0 && pkt.recv(mRemote, &mRemoteRb) >= 0 &&
+      pkt.op() == UsbHello && pkt.getMessage(rep))
+      codec_init(&mCodec, rep.codec);
+
+   debug_msg("codecs 0x%x = 0x%x", codecs, mCodec.codec);
+}
+
+void SessionMux::run()
+{
+   // Create reactor
+   if((mEpoll = epoll_create(MaxEvents)) < 0) {
+      error_msg("Daemon: failed to create epoll instance");
+      return;
+   }
+
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.fd = mListen;
+   epoll_ctl(mEpoll, EPOLL_CTL_ADD, mListen, &ev);
+
+   // Start receiving from server
+   pthread_t thread;
+   if(pthread_create(&thread, NULL, &remote_run, this) != 0) {
+      error_msg("Daemon: failed to start receiving thread");
+      ::close(mEpoll);
+      return;
+   }
+
+   log_msg("Daemon: listening at %s", mPath.c_str());
+
+   // Process event loop
+   struct epoll_event events[MaxEvents];
+   while(!mStop) {
+      int count = epoll_wait(mEpoll, events, MaxEvents, -1);
+      for(int i = 0; i < count && !mStop; ++i) {
+         int fd = events[i].data.fd;
+         if(fd == mListen) {
+            accept_all();
+            continue;
+         }
+
+         // Client data or hangup
+         std::map<int, Client*>::iterator c = mSockets.find(fd);
+         if(c == mSockets.end())
+            continue;
+         bool hup = (events[i].events & (EPOLLHUP|EPOLLERR));
+         if(!hup && (events[i].events & EPOLLIN))
+            hup = !read(c->second);
+         if(!hup && (events[i].events & EPOLLOUT))
+            hup = !flush(c->second);
+         if(hup || (events[i].events & EPOLLRDHUP))
+            drop(c->second);
+      }
+   }
+
+   // Stop receiving thread
+   shutdown(mRemote, SHUT_RDWR);
+   pthread_join(thread, NULL);
+   ::close(mEpoll);
+   mEpoll = -1;
+   log_msg("Daemon: stopped");
+}
+
+void SessionMux::stop()
+{
+   mStop = 1;
+   if(mListen != -1)
+      shutdown(mListen, SHUT_RDWR);
+}
+
+void SessionMux::accept_all()
+{
+   int fd = -1;
+   while((fd = accept(mListen, NULL, NULL)) >= 0) {
+      Client* c = new Client;
+      c->fd = fd;
+      c->writing = false;
+      c->woff = 0;
+      rbuf_init(&c->rb, RECVBUF_SIZE);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+      pthread_mutex_lock(&mLock);
+      c->serial = ++mLastSerial;
+      mClients[c->serial] = c;
+      pthread_mutex_unlock(&mLock);
+      mSockets[fd] = c;
+
+      struct epoll_event ev;
+      ev.events = EPOLLIN|EPOLLRDHUP;
+      ev.data.fd = fd;
+      epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev);
+      debug_msg("client %u connected (fd %d)", c->serial, fd);
+   }
+
+   // Listening socket shut down
+   if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      mStop = 1;
+}
+
+bool SessionMux::read(Client* c)
+{
+   // Receive available data, level-triggered
+   int res = rbuf_fill(c->fd, &c->rb, MSG_DONTWAIT);
+   if(res <= 0)
+      return res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+   // Handle complete packets
+   while(rbuf_packet(&c->rb) > 0) {
+      Packet pkt;
+      if(pkt.recv(c->fd, &c->rb) < 0)
+         return false;
+
+      request(c, pkt);
+   }
+
+   // Write local answers
+   return flush(c);
+}
+
+bool SessionMux::flush(Client* c)
+{
+   // Take queued replies
+   pthread_mutex_lock(&mLock);
+   if(c->woff == c->wbuf.size()) {
+      c->wbuf.clear();
+      c->woff = 0;
+      c->wbuf.swap(c->out);
+   }
+   else {
+      c->wbuf.append(c->out.data(), c->out.size());
+      c->out.clear();
+   }
+   pthread_mutex_unlock(&mLock);
+
+   // Write until socket is full
+   while(c->woff < c->wbuf.size()) {
+      ssize_t n = ::send(c->fd, c->wbuf.data() + c->woff, c->wbuf.size() - c->woff,
+                         MSG_NOSIGNAL|MSG_DONTWAIT);
+      if(n < 0) {
+         if(errno == EINTR)
+            continue;
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      c->woff += n;
+   }
+
+   // Stop waiting for writable socket if nothing was queued meanwhile
+   pthread_mutex_lock(&mLock);
+   if(c->writing && c->out.size() == 0) {
+      struct epoll_event ev;
+      ev.events = EPOLLIN|EPOLLRDHUP;
+      ev.data.fd = c->fd;
+      epoll_ctl(mEpoll, EPOLL_CTL_MOD, c->fd, &ev);
+      c->writing = false;
+   }
+   pthread_mutex_unlock(&mLock);
+   return true;
+}
+
+void SessionMux::request(Client* c, Packet& pkt)
+{
+   Packet out;
+   Packet* fwd = NULL;
+   bool built = false;
+
+   pthread_mutex_lock(&mLock);
+   Pending p = { c->serial, pkt.id(), pkt.op(), 0, 0 };
+   switch(pkt.op()) {
+
+   // Session options are local, compression and shared memory are not used
+   case UsbHello: {
+      UsbHelloRep rep = { CodecNone, NULL, 0 };
+      out.reset(UsbHello);
+      out.addMessage(rep);
+      queue(c, pkt.id(), out);
+   }  break;
+   case UsbShmLink: {
+      UsbShmLinkRep rep = { -1, NULL, 0 };
+      out.reset(UsbShmLink);
+      out.addMessage(rep);
+      queue(c, pkt.id(), out);
+   }  break;
+
+   // Enumeration is answered from cache if recent, server is asked
+   // with generation of cache otherwise
+   case UsbFindDevices: {
+      UsbFindDevicesReq req;
+      if(!pkt.getMessage(req))
+         break;
+      p.generation = req.generation;
+      if(mTopology.generation != 0 && mCacheTime > 0 &&
+         now_ms() - mTopology.time < (uint64_t) mCacheTime) {
+         answerTopology(c->serial, pkt.id(), req.generation);
+         break;
+      }
+
+      p.sent = mTopology.generation;
+      UsbFindDevicesReq up = { p.sent, NULL, 0 };
+      out.reset(UsbFindDevices);
+      out.addMessage(up);
+      forward(p, out);
+      fwd = &out;
+      built = true;
+   }  break;
+
+   // Cancelled request is known by forwarded id, finished one is skipped
+   case UsbCancel: {
+      UsbCancelReq req;
+      if(!pkt.getMessage(req))
+         break;
+      std::map<uint16_t, Pending>::iterator i;
+      for(i = mPending.begin(); i != mPending.end(); ++i) {
+         if(i->second.client == c->serial && i->second.id == req.id)
+            break;
+      }
+      if(i == mPending.end())
+         break;
+
+      UsbCancelReq up = { req.devfd, i->first, NULL, 0 };
+      out.reset(UsbCancel);
+      out.addMessage(up);
+      forward(p, out);
+      fwd = &out;
+      built = true;
+   }  break;
+
+   default: {
+
+      // Closed device is no longer owned
+      if(pkt.op() == UsbClose && pkt.payloadSize() >= SCHEMA_SIZE_i32) {
+         int devfd = schema_get_i32(pkt.payload());
+         c->devices.erase(devfd);
+         mOwners.erase(devfd);
+      }
+
+      forward(p, pkt);
+      fwd = &pkt;
+   }  break;
+   }
+   pthread_mutex_unlock(&mLock);
+
+   // Send outside lock, server may be slow to read
+   if(fwd != NULL)
+      sendRemote(*fwd, built);
+}
+
+void SessionMux::forward(const Pending& p, Packet& pkt)
+{
+   // Calls without reply keep id 0
+   uint16_t id = 0;
+   if(p.id != 0 && !(call_flags(p.op) & SchemaNoReply)) {
+      do {
+         if(++mLastId == 0)
+            ++mLastId;
+      } while(mPending.find(mLastId) != mPending.end());
+      id = mLastId;
+      mPending[id] = p;
+   }
+
+   pkt.setId(id);
+}
+
+bool SessionMux::sendRemote(Packet& pkt, bool built)
+{
+   pthread_mutex_lock(&mSendLock);
+   bool res = false;
+   Compressor* z = (mCodec.codec != CodecNone) ? &mCodec : NULL;
+   if(built)
+      res = pkt.send(mRemote, z) > 0;
+   else if(z != NULL) {
+      Packet out(pkt.op(), pkt.id());
+      out.append(pkt.payload(), pkt.payloadSize());
+      res = out.send(mRemote, z) > 0;
+   }
+   else
+      res = relay(mRemote, pkt.id(), pkt);
+   pthread_mutex_unlock(&mSendLock);
+
+   // Forget request
+   if(!res) {
+      error_msg("Daemon: failed to send to server");
+      pthread_mutex_lock(&mLock);
+      if(pkt.id() != 0)
+         mPending.erase(pkt.id());
+      pthread_mutex_unlock(&mLock);
+   }
+   return res;
+}
+
+void SessionMux::queue(Client* c, uint16_t id, Packet& pkt)
+{
+   // Drop client that stopped reading
+   if(c->out.size() > MaxQueued) {
+      shutdown(c->fd, SHUT_RDWR);
+      return;
+   }
+
+   // Append request id and packet, length slot is written if built
+   uint16_t nid = htons(id);
+   pkt.finalize();
+   c->out.append((const char*) &nid, sizeof(uint16_t));
+   c->out.append(pkt.data(), pkt.size());
+
+   // Wake main thread when socket is writable
+   if(!c->writing) {
+      struct epoll_event ev;
+      ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP;
+      ev.data.fd = c->fd;
+      epoll_ctl(mEpoll, EPOLL_CTL_MOD, c->fd, &ev);
+      c->writing = true;
+   }
+}
+
+void SessionMux::sendClient(uint32_t serial, uint16_t id, Packet& pkt)
+{
+   std::map<uint32_t, Client*>::iterator i = mClients.find(serial);
+   if(i != mClients.end())
+      queue(i->second, id, pkt);
+}
+
+void SessionMux::answerTopology(uint32_t serial, uint16_t id, uint32_t generation)
+{
+   std::map<uint32_t, Client*>::iterator i = mClients.find(serial);
+   if(i == mClients.end())
+      return;
+
+   // Not modified or all busses
+   UsbFindDevicesRep rep = { mTopology.res, mTopology.generation, NULL, 0 };
+   Packet pkt(UsbFindDevices, id);
+   pkt.addMessage(rep);
+   if(generation != mTopology.generation)
+      pkt.append(mTopology.data.data(), mTopology.data.size());
+   queue(i->second, id, pkt);
+}
+
+void SessionMux::response(Packet& pkt)
+{
+   Packet out;
+   bool resend = false;
+
+   pthread_mutex_lock(&mLock);
+
+   // Pushed packet, route to device owner
+   if(pkt.id() == 0) {
+      if(pkt.payloadSize() >= SCHEMA_SIZE_i32) {
+         std::map<int, uint32_t>::iterator o = mOwners.find(schema_get_i32(pkt.payload()));
+         if(o != mOwners.end())
+            sendClient(o->second, 0, pkt);
+      }
+      pthread_mutex_unlock(&mLock);
+      return;
+   }
+
+   // Find request
+   std::map<uint16_t, Pending>::iterator i = mPending.find(pkt.id());
+   if(i == mPending.end()) {
+      pthread_mutex_unlock(&mLock);
+      return;
+   }
+   Pending p = i->second;
+   mPending.erase(i);
+
+   switch(p.op) {
+
+   // Opened device is owned by client
+   case UsbOpen: {
+      UsbOpenRep rep;
+      std::map<uint32_t, Client*>::iterator c = mClients.find(p.client);
+      if(pkt.getMessage(rep) && rep.res >= 0 && c != mClients.end()) {
+         c->second->devices.insert(rep.devfd);
+         mOwners[rep.devfd] = p.client;
+      }
+      sendClient(p.client, p.id, pkt);
+   }  break;
+
+   // Update shared topology
+   case UsbFindDevices: {
+      UsbFindDevicesRep rep;
+      if(!pkt.getMessage(rep)) {
+         sendClient(p.client, p.id, pkt);
+         break;
+      }
+
+      // Changed busses only, ask for all
+      bool unchanged = (p.sent != 0 && rep.generation == p.sent);
+      if(!unchanged && p.sent != 0 && rep.len > 0) {
+         p.sent = 0;
+         UsbFindDevicesReq up = { 0, NULL, 0 };
+         out.reset(UsbFindDevices);
+         out.addMessage(up);
+         forward(p, out);
+         resend = true;
+         break;
+      }
+
+      if(!unchanged) {
+         mTopology.generation = rep.generation;
+         mTopology.data.assign(rep.data, rep.len);
+      }
+      mTopology.res = rep.res;
+      mTopology.time = now_ms();
+      answerTopology(p.client, p.id, p.generation);
+   }  break;
+
+   default:
+      if(p.client != 0)
+         sendClient(p.client, p.id, pkt);
+      break;
+   }
+
+   pthread_mutex_unlock(&mLock);
+   if(resend)
+      sendRemote(out, true);
+}
+
+void SessionMux::drop(Client* c)
+{
+   debug_msg("client %u disconnected (fd %d)", c->serial, c->fd);
+   epoll_ctl(mEpoll, EPOLL_CTL_DEL, c->fd, NULL);
+   mSockets.erase(c->fd);
+
+   pthread_mutex_lock(&mLock);
+   mClients.erase(c->serial);
+   pthread_mutex_unlock(&mLock);
+
+   // Close devices left open, replies are dropped
+   std::set<int>::iterator i;
+   for(i = c->devices.begin(); i != c->devices.end(); ++i) {
+      UsbCloseReq req = { *i, NULL, 0 };
+      Packet out(UsbClose);
+      out.addMessage(req);
+      Pending p = { 0, 1, UsbClose, 0, 0 };
+      pthread_mutex_lock(&mLock);
+      mOwners.erase(*i);
+      forward(p, out);
+      pthread_mutex_unlock(&mLock);
+      sendRemote(out, true);
+      debug_msg("closing device %d of client %u", *i, c->serial);
+   }
+
+   ::close(c->fd);
+   rbuf_free(&c->rb);
+   delete c;
+}
+
+void* SessionMux::remote_run(void* arg)
+{
+   SessionMux* self = (SessionMux*) arg;
+   for(;;) {
+      Packet pkt;
+      if(pkt.recv(self->mRemote, &self->mRemoteRb) < 0)
+         break;
+
+      self->response(pkt);
+   }
+
+   // Server connection failed
+   if(!self->mStop) {
+      error_msg("Daemon: server connection closed");
+      self->stop();
+   }
+
+   return NULL;
+}
+
+/** @} */
@@ -0,0 +1,190 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file sessionmux.hpp
+    \brief Local session multiplexer.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup client
+    @{
+  */
+#pragma once
+#ifndef __sessionmux_hpp__
+#define __sessionmux_hpp__
+#include "protocol.hpp"
+#include "usbnet.h"
+#include <map>
+#include <set>
+#include <string>
+#include <pthread.h>
+#include <signal.h>
+using namespace Proto;
+
+/** Session multiplexer.
+  * Owns a single connection to the server and relays calls of local
+  * processes connected to a Unix socket. Request ids are remapped,
+  * so each process keeps its own id space, pushed packets are routed
+  * to the process that opened the device.
+  * Enumeration result is cached and shared by all processes,
+  * devices left open by a disconnected process are closed.
+  *
+  * Main thread accepts processes and forwards their requests,
+  * receiving thread forwards replies. Routing is done with mLock held,
+  * socket writes without it: replies are queued per process and written
+  * by main thread to non-blocking sockets, so a slow process can't stall
+  * the others.
+  */
+class SessionMux
+{
+   public:
+
+   /** Create multiplexer on connected server socket.
+     */
+   SessionMux(int remote);
+   ~SessionMux();
+
+   /** Listen for local processes on Unix socket.
+     * Fails if another multiplexer is listening on the path.
+     * \return true on success
+     */
+   bool listen(const std::string& path);
+
+   /** Negotiate payload compression with server, see codec_parse().
+     */
+   void setCompression(int codecs);
+
+   /** Answer enumeration from cache without asking server
+     * if it is younger than given time (ms), 0 disables.
+     */
+   void setCacheTime(int ms) { mCacheTime = ms; }
+
+   /** Relay calls until stopped or server connection fails.
+     */
+   void run();
+
+   /** Stop relaying, safe to call from signal handler.
+     */
+   void stop();
+
+   private:
+
+   /** Connected process. */
+   struct Client {
+      int fd;
+      uint32_t serial;         // Never reused, unlike fd
+      RecvBuf rb;              // Received data, main thread only
+      std::set<int> devices;   // Open devices
+      ByteBuffer out;          // Queued replies, mLock held
+      bool writing;            // Waiting for writable socket, mLock held
+      ByteBuffer wbuf;         // Replies being written, main thread only
+      size_t woff;             // Written part of wbuf
+   };
+
+   /** Request forwarded to server. */
+   struct Pending {
+      uint32_t client;         // Client serial, 0 for own requests
+      uint16_t id;             // Client request id
+      uint8_t op;
+      uint32_t generation;     // UsbFindDevices: client topology generation
+      uint32_t sent;           // UsbFindDevices: requested generation
+   };
+
+   /** Shared enumeration result. */
+   struct Topology {
+      int res;
+      uint32_t generation;     // 0 if not known
+      std::string data;        // All busses
+      uint64_t time;           // Last update (ms)
+   };
+
+   /** Accept pending processes. */
+   void accept_all();
+
+   /** Read and handle requests of client.
+     * \return false on closed connection
+     */
+   bool read(Client* c);
+
+   /** Write queued replies of client, main thread.
+     * \return false on closed connection
+     */
+   bool flush(Client* c);
+
+   /** Handle request of client, main thread. */
+   void request(Client* c, Packet& pkt);
+
+   /** Handle packet from server, receiving thread. */
+   void response(Packet& pkt);
+
+   /** Drop client, close its devices. */
+   void drop(Client* c);
+
+   /** Register request forwarded to server and assign new id,
+     * packet is sent with sendRemote() after releasing mLock.
+     * \warning Call with mLock held.
+     */
+   void forward(const Pending& p, Packet& pkt);
+
+   /** Send forwarded packet to server, request is dropped on failure.
+     * \param built packet is created locally, not received
+     * \warning Call without mLock.
+     */
+   bool sendRemote(Packet& pkt, bool built);
+
+   /** Queue packet for client with given id.
+     * \warning Call with mLock held.
+     */
+   void queue(Client* c, uint16_t id, Packet& pkt);
+
+   /** Queue packet for client with given serial, see queue().
+     * \warning Call with mLock held.
+     */
+   void sendClient(uint32_t serial, uint16_t id, Packet& pkt);
+
+   /** Answer enumeration from cached topology.
+     * \warning Call with mLock held.
+     */
+   void answerTopology(uint32_t serial, uint16_t id, uint32_t generation);
+
+   /** Receiving thread main loop. */
+   static void* remote_run(void* arg);
+
+   int mRemote;                 // Server socket
+   RecvBuf mRemoteRb;           // Receiving thread only
+   Compressor mCodec;           // Request compressor, mSendLock held
+   pthread_mutex_t mSendLock;   // Serializes sends to server
+   int mListen;                 // Unix socket
+   std::string mPath;
+   int mEpoll;
+   volatile sig_atomic_t mStop;
+   int mCacheTime;
+
+   /* Guarded by mLock */
+   pthread_mutex_t mLock;
+   std::map<uint32_t, Client*> mClients; // By serial
+   std::map<uint16_t, Pending> mPending; // By forwarded id
+   std::map<int, uint32_t> mOwners;      // Client serial by device
+   Topology mTopology;
+   uint32_t mLastSerial;
+   uint16_t mLastId;
+
+   /* Main thread only */
+   std::map<int, Client*> mSockets;      // Clients by fd
+};
+
+#endif // __sessionmux_hpp__
+/** @} */
@@ -35,7 +35,7 @@ int main(int argc, char* argv[])
 {
    // Create remote connection
    ClientSocket remote;
-   std::string host("localhost"), auth, lib("libusbnet.so"), exec;
+   std::string host("localhost"), auth, lib("libusbnet.so"), exec, daemon;
    int port = 22222, pos = 0, timeout = 1000;
 
    // Parse command line arguments
@@ -43,7 +43,14 @@ int main(int argc, char* argv[])
    cmd.add('h', "host",     "Target server host:[port]", "localhost:22222")
       .add('a', "auth",     "Authentication token user@host[:port]")
       .add('l', "library",  "Preloaded library", "libusbnet.so")
+      .add('d', "daemon",   "Use multiplexer at given socket path instead of connecting, see usbnetd")
       .add('t', "timeout",  "Connection timeout (ms).", "1000")
+      .add('r', "readahead", "Bulk read-ahead depth (0 = off).", "0")
+      .add('w', "writebehind", "Bulk/interrupt write-behind window (0 = off).", "0")
+      .add('b', "batch",    "Auto-batch up to given number of calls (0 = off).", "0")
+      .add('z', "compress", "Payload compression (lz4, zstd, zlib, 1 = any, 0 = off).", "0")
+      .add('s', "shm",      "Shared memory link with local server (0 = off).", "1")
+      .add('R', "record",   "Record exchanged packets to trace file, see usbreplay.")
       .add('q', "quiet",    "Quiet output", "", false)
       .add('?', "help",     "Print help",   "", false);
 
@@ -65,7 +72,14 @@ int main(int argc, char* argv[])
          break;
       case 'a': auth    = m.second; break;
       case 'l': lib     = m.second; break;
+      case 'd': daemon  = m.second; break;
       case 't': timeout = atoi(m.second.c_str()); break;
+      case 'r': setenv("USBNET_READAHEAD", m.second.c_str(), 1); break;
+      case 'w': setenv("USBNET_WRITEBEHIND", m.second.c_str(), 1); break;
+      case 'b': setenv("USBNET_BATCH", m.second.c_str(), 1); break;
+      case 'z': setenv("USBNET_COMPRESS", m.second.c_str(), 1); break;
+      case 's': setenv("USBNET_SHM", m.second.c_str(), 1); break;
+      case 'R': setenv("USBNET_RECORD", m.second.c_str(), 1); break;
       case 'q': log_setlevel(MsgError); break;
       case '?':
          cmd.printHelp();
@@ -88,39 +102,48 @@ int main(int argc, char* argv[])
       return EXIT_FAILURE;
    }
 
-   // Authenticate
-   if(!auth.empty()) {
-      remote.setMethod(ClientSocket::SSH);
-      remote.setTimeout(timeout);
-      if(!remote.setCredentials(auth)) {
-         error_msg("Client: invalid authentication method '%s'", auth.c_str());
-         cmd.printHelp();
-         return EXIT_FAILURE;
-      }
-
+   // Processes connect to multiplexer themselves
+   IpcSession* ipc = NULL;
+   if(!daemon.empty()) {
+      char level[16];
+      snprintf(level, sizeof(level), "%d", log_level());
+      setenv(IPC_DAEMON_ENV, daemon.c_str(), 1);
+      setenv(IPC_LOGLEVEL_ENV, level, 1);
+      log_msg("Client: using multiplexer at %s", daemon.c_str());
    }
+   else {
+
+      // Authenticate
+      if(!auth.empty()) {
+         remote.setMethod(ClientSocket::SSH);
+         remote.setTimeout(timeout);
+         if(!remote.setCredentials(auth)) {
+            error_msg("Client: invalid authentication method '%s'", auth.c_str());
+            cmd.printHelp();
+            return EXIT_FAILURE;
+         }
+      }
 
-   // Connect
-   log_msg("Client: connecting to %s:%d ...", host.c_str(), port);
-   if(remote.connect(host.c_str(), port) != Socket::Ok) {
-      error_msg("Client: connection failed.");
-      remote.close();
-      return EXIT_FAILURE;
-   }
+      // Connect
+      log_msg("Client: connecting to %s:%d ...", host.c_str(), port);
+      if(remote.connect(host.c_str(), port) != Socket::Ok) {
+         error_msg("Client: connection failed.");
+         remote.close();
+         return EXIT_FAILURE;
+      }
 
-   // Disable TCP buffering
-   int flag = 1;
-   setsockopt(remote.sock(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+      // Disable TCP buffering
+      int flag = 1;
+      setsockopt(remote.sock(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
 
-   // Create SHM segment
-   int shm_id = ipc_init();
-   if(shm_id == -1) {
-      return EXIT_FAILURE;
+      // Pass socket to executed processes
+      ipc = ipc_init(remote.sock());
+      if(ipc == NULL) {
+         remote.close();
+         return EXIT_FAILURE;
+      }
    }
 
-   // Attach segment and save fd
-   ipc_set_remote(remote.sock());
-
    // Run executable with preloaded library
    std::string execs("LD_PRELOAD=\"");
    execs.append(lib);
@@ -136,10 +159,10 @@ int main(int argc, char* argv[])
    log_msg("IPC: executable returned %d", ret);
 
    // Close IPC
-   ipc_teardown(shm_id);
+   ipc_teardown(ipc);
 
    // Close socket
-   if(remote.close() != Socket::Ok) {
+   if(remote.isOpen() && remote.close() != Socket::Ok) {
       return EXIT_FAILURE;
    }
 
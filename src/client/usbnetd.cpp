@@ -0,0 +1,158 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbnetd.cpp
+    \brief Local session multiplexer daemon.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup client
+    @{
+  */
+#include "clientsocket.hpp"
+#include "sessionmux.hpp"
+#include "common.h"
+#include "cmdflags.hpp"
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+
+// Global multiplexer ptr
+SessionMux* sMux = NULL;
+
+// SIGINT/SIGTERM signal handler
+void interrupt_handle(int s)
+{
+   if(sMux != NULL)
+      sMux->stop();
+}
+
+int main(int argc, char* argv[])
+{
+   // Create remote connection
+   ClientSocket remote;
+   std::string host("localhost"), auth, path;
+   int port = 22222, pos = 0, timeout = 1000, cache = 0, codecs = CodecNone;
+
+   // Default socket path
+   char buf[64];
+   snprintf(buf, sizeof(buf), "/tmp/usbnetd-%u", (unsigned) getuid());
+   path = buf;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('h', "host",     "Target server host:[port]", "localhost:22222")
+      .add('a', "auth",     "Authentication token user@host[:port]")
+      .add('t', "timeout",  "Connection timeout (ms).", "1000")
+      .add('s', "socket",   "Local socket path", buf)
+      .add('c', "cache",    "Answer enumeration from cache younger than given time (ms).", "0")
+      .add('z', "compress", "Payload compression (lz4, zstd, zlib, 1 = any, 0 = off).", "0")
+      .add('q', "quiet",    "Quiet output", "", false)
+      .add('?', "help",     "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbnetd [options]");
+
+   // Parse command line arguments
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+
+      // Evaluate
+      switch(m.first) {
+      case 'h':
+         host = m.second;
+         pos = host.find(':');
+         if(pos != std::string::npos) {
+            port = atoi(host.substr(pos + 1).c_str());
+            host.erase(pos);
+         }
+         break;
+      case 'a': auth    = m.second; break;
+      case 't': timeout = atoi(m.second.c_str()); break;
+      case 's': path    = m.second; break;
+      case 'c': cache   = atoi(m.second.c_str()); break;
+      case 'z': codecs  = codec_parse(m.second.c_str()); break;
+      case 'q': log_setlevel(MsgError); break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      default:
+         break;
+      }
+
+      // Next option
+      m = cmd.getopt();
+   }
+
+   // Authenticate
+   if(!auth.empty()) {
+      remote.setMethod(ClientSocket::SSH);
+      remote.setTimeout(timeout);
+      if(!remote.setCredentials(auth)) {
+         error_msg("Daemon: invalid authentication method '%s'", auth.c_str());
+         cmd.printHelp();
+         return EXIT_FAILURE;
+      }
+   }
+
+   // Connect
+   log_msg("Daemon: connecting to %s:%d ...", host.c_str(), port);
+   if(remote.connect(host.c_str(), port) != Socket::Ok) {
+      error_msg("Daemon: connection failed.");
+      remote.close();
+      return EXIT_FAILURE;
+   }
+
+   // Disable TCP buffering
+   int flag = 1;
+   setsockopt(remote.sock(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+   // Listen for local processes
+   SessionMux mux(remote.sock());
+   if(!mux.listen(path)) {
+      remote.close();
+      return EXIT_FAILURE;
+   }
+   mux.setCacheTime(cache);
+   mux.setCompression(codecs);
+
+   // Register signal handlers
+   sMux = &mux;
+   struct sigaction sa;
+   sa.sa_handler = interrupt_handle;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = 0;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   // Processes may disconnect before reply
+   signal(SIGPIPE, SIG_IGN);
+
+   // Relay calls
+   log_msg("Daemon: run processes with %s=%s", IPC_DAEMON_ENV, path.c_str());
+   mux.run();
+   sMux = NULL;
+
+   // Close socket
+   if(remote.close() != Socket::Ok)
+      return EXIT_FAILURE;
+
+   return EXIT_SUCCESS;
+}
+/** @} */
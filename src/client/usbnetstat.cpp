@@ -0,0 +1,255 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbnetstat.cpp
+    \brief Server statistics query tool.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup client
+    @{
+  */
+#include "clientsocket.hpp"
+#include "common.h"
+#include "cmdflags.hpp"
+#include "protocol.hpp"
+#include "usbnet.h"
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+using namespace Proto;
+
+/** Decoded call entry. */
+struct CallEntry {
+   UsbStatsCallMsg msg;
+   std::vector<UsbStatsBucketMsg> usb, total;
+};
+
+/** Order by total time, descending. */
+template <class T> bool by_time(const T& a, const T& b)
+{
+   return a.totaltime > b.totaltime;
+}
+
+static bool call_by_time(const CallEntry& a, const CallEntry& b)
+{
+   return by_time(a.msg, b.msg);
+}
+
+/** Return call name. */
+static const char* call_name(uint8_t op)
+{
+   switch(op) {
+#define CALL_NAME(op, handler, flags) case op: return #op;
+      SCHEMA_CALLS(CALL_NAME)
+#undef CALL_NAME
+      default: break;
+   }
+
+   return "Unknown";
+}
+
+/** Return histogram percentile (us), lower bound of bucket. */
+static double percentile(const std::vector<UsbStatsBucketMsg>& hist, double pct)
+{
+   uint64_t count = 0;
+   for(size_t i = 0; i < hist.size(); ++i)
+      count += hist[i].count;
+
+   uint64_t rank = (uint64_t) (count * pct);
+   for(size_t i = 0; i < hist.size(); ++i) {
+      if(rank < hist[i].count)
+         return stats_bucket_value(hist[i].index) / 1000.0;
+      rank -= hist[i].count;
+   }
+
+   return 0.0;
+}
+
+/** Decode histogram buckets. */
+static const char* read_buckets(const char* p, const char* end, int count,
+                                std::vector<UsbStatsBucketMsg>& dst)
+{
+   for(int i = 0; p != NULL && i < count; ++i) {
+      UsbStatsBucketMsg b;
+      if(!UsbStatsBucketMsg_unpack(p, end - p, &b))
+         return NULL;
+      p += UsbStatsBucketMsgSize;
+      dst.push_back(b);
+   }
+
+   return p;
+}
+
+int main(int argc, char* argv[])
+{
+   ClientSocket remote;
+   std::string host("localhost"), auth;
+   int port = 22222, pos = 0, timeout = 1000;
+   uint32_t flags = 0;
+   bool json = false;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('h', "host",     "Target server host:[port]", "localhost:22222")
+      .add('a', "auth",     "Authentication token user@host[:port]")
+      .add('t', "timeout",  "Connection timeout (ms).", "1000")
+      .add('r', "reset",    "Reset counters after query", "", false)
+      .add('j', "json",     "Print JSON lines", "", false)
+      .add('?', "help",     "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbnetstat [options]");
+
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+      switch(m.first) {
+      case 'h':
+         host = m.second;
+         pos = host.find(':');
+         if(pos != std::string::npos) {
+            port = atoi(host.substr(pos + 1).c_str());
+            host.erase(pos);
+         }
+         break;
+      case 'a': auth    = m.second; break;
+      case 't': timeout = atoi(m.second.c_str()); break;
+      case 'r': flags  |= StatsReset; break;
+      case 'j': json    = true; break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      default:
+         break;
+      }
+
+      m = cmd.getopt();
+   }
+
+   // Authenticate
+   if(!auth.empty()) {
+      remote.setMethod(ClientSocket::SSH);
+      remote.setTimeout(timeout);
+      if(!remote.setCredentials(auth)) {
+         error_msg("Client: invalid authentication method '%s'", auth.c_str());
+         cmd.printHelp();
+         return EXIT_FAILURE;
+      }
+   }
+
+   // Connect
+   if(remote.connect(host.c_str(), port) != Socket::Ok) {
+      error_msg("Client: connection to %s:%d failed.", host.c_str(), port);
+      remote.close();
+      return EXIT_FAILURE;
+   }
+
+   // Query
+   int nodelay = 1;
+   setsockopt(remote.sock(), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+   UsbStatsReq req = { flags, NULL, 0 };
+   Packet pkt(UsbStats, 1);
+   pkt.addMessage(req);
+   UsbStatsRep rep;
+   if(pkt.send(remote.sock()) <= 0 || pkt.recv(remote.sock()) < 0 ||
+      pkt.op() != UsbStats || !pkt.getMessage(rep)) {
+      error_msg("Client: statistics query failed.");
+      remote.close();
+      return EXIT_FAILURE;
+   }
+   remote.close();
+
+   // Decode calls
+   const char* p = rep.data;
+   const char* end = rep.data + rep.len;
+   std::vector<CallEntry> calls;
+   for(uint32_t i = 0; p != NULL && i < rep.calls; ++i) {
+      CallEntry e;
+      if(!UsbStatsCallMsg_unpack(p, end - p, &e.msg)) {
+         p = NULL;
+         break;
+      }
+      p = read_buckets(p + UsbStatsCallMsgSize, end, e.msg.usbbuckets, e.usb);
+      p = read_buckets(p, end, e.msg.totalbuckets, e.total);
+      calls.push_back(e);
+   }
+
+   // Decode devices
+   std::vector<UsbStatsDeviceMsg> devices;
+   for(uint32_t i = 0; p != NULL && i < rep.devices; ++i) {
+      UsbStatsDeviceMsg d;
+      if(!UsbStatsDeviceMsg_unpack(p, end - p, &d)) {
+         p = NULL;
+         break;
+      }
+      p += UsbStatsDeviceMsgSize;
+      devices.push_back(d);
+   }
+
+   if(p == NULL) {
+      error_msg("Client: malformed statistics reply.");
+      return EXIT_FAILURE;
+   }
+
+   // Busiest first
+   std::sort(calls.begin(), calls.end(), call_by_time);
+   std::sort(devices.begin(), devices.end(), by_time<UsbStatsDeviceMsg>);
+
+   // Print
+   if(!json) {
+      printf("Server uptime %u s\n\n", rep.uptime);
+      printf("%-22s %10s %8s %12s %12s %10s %10s %9s %9s %9s %9s\n",
+             "Call", "Calls", "Errors", "Bytes in", "Bytes out", "USB ms", "Total ms",
+             "USB p50", "USB p99", "p50 us", "p99 us");
+   }
+   for(size_t i = 0; i < calls.size(); ++i) {
+      const UsbStatsCallMsg& c = calls[i].msg;
+      const char* fmt = json ?
+         "{\"call\": \"%s\", \"calls\": %llu, \"errors\": %llu, \"bytes_in\": %llu, "
+         "\"bytes_out\": %llu, \"usb_ms\": %.3f, \"total_ms\": %.3f, \"usb_p50_us\": %.1f, "
+         "\"usb_p99_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}\n" :
+         "%-22s %10llu %8llu %12llu %12llu %10.1f %10.1f %9.1f %9.1f %9.1f %9.1f\n";
+      printf(fmt, call_name(c.op), (unsigned long long) c.calls,
+             (unsigned long long) c.errors, (unsigned long long) c.bytesin,
+             (unsigned long long) c.bytesout, c.usbtime / 1e6, c.totaltime / 1e6,
+             percentile(calls[i].usb, 0.5), percentile(calls[i].usb, 0.99),
+             percentile(calls[i].total, 0.5), percentile(calls[i].total, 0.99));
+   }
+
+   if(!json) {
+      printf("\n%-22s %10s %8s %12s %12s %10s %10s\n",
+             "Device", "Calls", "Errors", "Bytes in", "Bytes out", "USB ms", "Total ms");
+   }
+   for(size_t i = 0; i < devices.size(); ++i) {
+      const UsbStatsDeviceMsg& d = devices[i];
+      char name[32];
+      snprintf(name, sizeof(name), "%03u/%03u %04x:%04x",
+               d.location, d.devnum, d.vendor, d.product);
+      const char* fmt = json ?
+         "{\"device\": \"%s\", \"calls\": %llu, \"errors\": %llu, \"bytes_in\": %llu, "
+         "\"bytes_out\": %llu, \"usb_ms\": %.3f, \"total_ms\": %.3f}\n" :
+         "%-22s %10llu %8llu %12llu %12llu %10.1f %10.1f\n";
+      printf(fmt, name, (unsigned long long) d.calls, (unsigned long long) d.errors,
+             (unsigned long long) d.bytesin, (unsigned long long) d.bytesout,
+             d.usbtime / 1e6, d.totaltime / 1e6);
+   }
+
+   return EXIT_SUCCESS;
+}
+/** @} */
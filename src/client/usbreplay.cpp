@@ -0,0 +1,567 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbreplay.cpp
+    \brief Packet trace replay.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup client
+    @{
+  */
+#include "clientsocket.hpp"
+#include "protocol.hpp"
+#include "trace.h"
+#include "common.h"
+#include "cmdflags.hpp"
+#include "usbnet.h"
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+using namespace Proto;
+
+/** \page replay_page
+    <h2>Trace replay</h2>
+    Trace is recorded by "usbexportd -r file" or "usbnet -R file", see trace.h.
+    Replay drives a server with recorded requests of one session (-S),
+    requests are sent in recorded order and each recorded reply is awaited
+    before sending the requests that followed it, so the recorded concurrency
+    is kept. With -L, replay stands in for a server and answers requests
+    of a connected client with recorded replies, matched by opcode in recorded order.
+    Speed 1 keeps recorded delays, 0 replays at maximum speed.
+    Shared memory link requests are not replayed, client falls back to socket.
+  */
+
+/** Replay results per call. */
+struct CallResult {
+   uint64_t calls;            // Replayed calls
+   uint64_t mismatched;       // Replies (or requests with -L) different from trace
+   uint64_t time;             // Total reply latency (ns)
+   uint64_t hist[StatsBuckets];
+};
+
+/** Replay state. */
+struct Replay {
+   std::vector<const TraceRecord*> records; // Selected session
+   std::map<uint8_t, CallResult> results;
+   uint64_t start;                          // Replay start (ns)
+   double speed;                            // 0 = maximum
+   int timeout;                             // Reply timeout (ms)
+   uint64_t lost;                           // Missing replies or requests
+};
+
+/** Return monotonic time (ns). */
+static uint64_t now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Sleep until given time since base, scaled by speed. */
+static void pace(double speed, uint64_t base, uint64_t delay)
+{
+   if(speed <= 0.0)
+      return;
+
+   uint64_t target = base + (uint64_t) (delay / speed);
+   uint64_t cur = now();
+   if(target > cur) {
+      struct timespec ts;
+      ts.tv_sec = (target - cur) / 1000000000ULL;
+      ts.tv_nsec = (target - cur) % 1000000000ULL;
+      nanosleep(&ts, NULL);
+   }
+}
+
+/** Return call name. */
+static const char* call_name(uint8_t op)
+{
+   switch(op) {
+#define CALL_NAME(op, handler, flags) case op: return #op;
+      SCHEMA_CALLS(CALL_NAME)
+#undef CALL_NAME
+      case UsbBulkStreamData: return "UsbBulkStreamData";
+      default: break;
+   }
+
+   return "Unknown";
+}
+
+/** Return call schema flags. */
+static int call_flags(uint8_t op)
+{
+   switch(op) {
+#define CALL_FLAGS(op, handler, f) case op: return (f);
+      SCHEMA_CALLS(CALL_FLAGS)
+#undef CALL_FLAGS
+      default: break;
+   }
+
+   return 0;
+}
+
+/** Return payload of trace record. */
+static const char* payload(const TraceRecord* rec)
+{
+   return (const char*) (rec + 1);
+}
+
+/** Device ids, recorded to live. */
+typedef std::map<int32_t, int32_t> DeviceMap;
+
+/** Send recorded packet with given id.
+  * \param devices device ids to replace in calls on device, or NULL
+  */
+static bool send_record(int fd, const TraceRecord* rec, uint16_t id, const DeviceMap* devices = NULL)
+{
+   Packet pkt(rec->op, id);
+   if(rec->len > 0) {
+      char* dst = pkt.alloc(rec->len);
+      memcpy(dst, payload(rec), rec->len);
+
+      // Device id is the first parameter
+      if(devices != NULL && (call_flags(rec->op) & SchemaDevice) && rec->len >= SCHEMA_SIZE_i32) {
+         DeviceMap::const_iterator d = devices->find(schema_get_i32(dst));
+         if(d != devices->end())
+            schema_put_i32(dst, d->second);
+      }
+   }
+
+   return pkt.send(fd) > 0;
+}
+
+/** Account replayed call. */
+static void account(Replay& r, uint8_t op, uint64_t latency, bool mismatch)
+{
+   CallResult& c = r.results[op];
+   ++c.calls;
+   c.time += latency;
+   ++c.hist[stats_bucket(latency)];
+   if(mismatch)
+      ++c.mismatched;
+}
+
+/** Return lower bound of histogram percentile. */
+static uint64_t percentile(const CallResult& c, double pct)
+{
+   uint64_t rank = (uint64_t) (c.calls * pct);
+   for(int i = 0; i < StatsBuckets; ++i) {
+      if(rank < c.hist[i])
+         return stats_bucket_value(i);
+      rank -= c.hist[i];
+   }
+
+   return 0;
+}
+
+/** Select records of n-th session, sessions end with TraceClose.
+  * \param list print sessions instead
+  * \return number of sessions
+  */
+static int select_session(TraceReader& trace, int n, std::vector<const TraceRecord*>& dst, bool list)
+{
+   // Session ordinal by identifier, reused identifiers start new session
+   std::map<uint32_t, int> open;
+   std::vector<uint64_t> first, last, count;
+   const TraceRecord* rec = NULL;
+   trace_rewind(&trace);
+   while((rec = trace_next(&trace)) != NULL) {
+      std::map<uint32_t, int>::iterator i = open.find(rec->session);
+      if(i == open.end()) {
+         i = open.insert(std::make_pair(rec->session, (int) first.size())).first;
+         first.push_back(rec->time);
+         last.push_back(rec->time);
+         count.push_back(0);
+      }
+
+      int ordinal = i->second;
+      last[ordinal] = rec->time;
+      if(rec->dir == TraceClose)
+         open.erase(i);
+      else {
+         ++count[ordinal];
+         if(ordinal == n)
+            dst.push_back(rec);
+      }
+   }
+
+   if(list) {
+      for(size_t i = 0; i < first.size(); ++i)
+         printf("session %u: %llu packets, %.3f ms\n", (unsigned) i,
+                (unsigned long long) count[i], (last[i] - first[i]) / 1e6);
+   }
+
+   return first.size();
+}
+
+/** Drive server with recorded requests.
+  * Device ids assigned by server are mapped to recorded ids, so the trace
+  * may be replayed to a server with other devices open.
+  * \return false on connection error
+  */
+static bool drive(Replay& r, int fd)
+{
+   // Pending request
+   struct Pending {
+      uint8_t op;
+      uint64_t sent;
+      bool done;
+      std::string reply;
+   };
+
+   std::map<uint16_t, Pending> pending;
+   std::set<uint16_t> skipped;
+   DeviceMap devices;
+   RecvBuf rb;
+   rbuf_init(&rb, RECVBUF_SIZE);
+   bool ok = true;
+   uint64_t base = r.records.empty() ? 0 : r.records[0]->time;
+   for(size_t k = 0; ok && k < r.records.size(); ++k) {
+      const TraceRecord* rec = r.records[k];
+
+      // Send request, link to shared memory can't be replayed
+      if(rec->dir == TraceRequest) {
+         if(rec->op == UsbShmLink) {
+            skipped.insert(rec->id);
+            continue;
+         }
+
+         pace(r.speed, r.start, rec->time - base);
+         if(!send_record(fd, rec, rec->id, &devices)) {
+            ok = false;
+            break;
+         }
+
+         if(call_flags(rec->op) & SchemaNoReply)
+            account(r, rec->op, 0, false);
+         else {
+            Pending& p = pending[rec->id];
+            p.op = rec->op;
+            p.sent = now();
+            p.done = false;
+         }
+         continue;
+      }
+
+      // Pushed read-ahead data is not awaited
+      if(rec->id == 0 || skipped.erase(rec->id) > 0)
+         continue;
+
+      std::map<uint16_t, Pending>::iterator i = pending.find(rec->id);
+      if(i == pending.end())
+         continue;
+
+      // Receive until recorded reply arrives
+      while(!i->second.done) {
+         Packet pkt;
+         if(pkt.recv(fd, &rb) < 0) {
+            error_msg("Replay: no reply to %s (id %u)", call_name(i->second.op), rec->id);
+            ok = false;
+            break;
+         }
+
+         std::map<uint16_t, Pending>::iterator p = pending.find(pkt.id());
+         if(pkt.id() != 0 && p != pending.end() && !p->second.done) {
+            p->second.done = true;
+            p->second.reply.assign(pkt.payload(), pkt.payloadSize());
+            account(r, p->second.op, now() - p->second.sent, false);
+         }
+      }
+
+      // Compare with recorded reply, opened device ids differ
+      if(i->second.done) {
+         const std::string& reply = i->second.reply;
+         UsbOpenRep live, recorded;
+         bool mismatch = reply.size() != rec->len || memcmp(reply.data(), payload(rec), rec->len) != 0;
+         if(i->second.op == UsbOpen && schema_unpack(reply.data(), reply.size(), live) &&
+            schema_unpack(payload(rec), rec->len, recorded)) {
+            devices[recorded.devfd] = live.devfd;
+            mismatch = live.res != recorded.res;
+         }
+         if(mismatch)
+            ++r.results[i->second.op].mismatched;
+      }
+      pending.erase(i);
+   }
+
+   // Requests without recorded reply are not awaited
+   for(std::map<uint16_t, Pending>::iterator i = pending.begin(); i != pending.end(); ++i) {
+      if(!i->second.done)
+         ++r.lost;
+   }
+
+   rbuf_free(&rb);
+   return ok;
+}
+
+/** Stand in for server, answer client with recorded replies.
+  * \return false on connection error
+  */
+static bool serve(Replay& r, int fd)
+{
+   std::map<uint16_t, uint16_t> ids;            // Recorded to live request id
+   std::list<const TraceRecord*> deferred;      // Replies to requests not received yet
+   RecvBuf rb;
+   rbuf_init(&rb, RECVBUF_SIZE);
+   size_t cursor = 0;
+   bool ok = true;
+   for(;;) {
+      Packet req;
+      if(req.recv(fd, &rb) < 0)
+         break;
+
+      // Refuse shared memory link, client keeps socket
+      uint64_t received = now();
+      if(req.op() == UsbShmLink) {
+         UsbShmLinkRep rep = { -1, NULL, 0 };
+         Packet pkt(UsbShmLink, req.id());
+         pkt.addMessage(rep);
+         pkt.send(fd);
+         continue;
+      }
+
+      // Find next recorded request with the same opcode
+      size_t k = cursor;
+      while(k < r.records.size() &&
+            (r.records[k]->dir != TraceRequest || r.records[k]->op != req.op()))
+         ++k;
+      if(k == r.records.size()) {
+         error_msg("Replay: unexpected %s (id %u)", call_name(req.op()), req.id());
+         ++r.lost;
+         continue;
+      }
+
+      // Skipped replies wait for their requests
+      for(; cursor < k; ++cursor) {
+         if(r.records[cursor]->dir == TraceReply)
+            deferred.push_back(r.records[cursor]);
+      }
+
+      const TraceRecord* rec = r.records[k];
+      bool mismatch = rec->len != req.payloadSize() ||
+                      memcmp(payload(rec), req.payload(), rec->len) != 0;
+      ids[rec->id] = req.id();
+      cursor = k + 1;
+
+      // Replies recorded until next request
+      std::list<const TraceRecord*> replies;
+      for(std::list<const TraceRecord*>::iterator i = deferred.begin(); i != deferred.end(); ) {
+         if((*i)->id == rec->id) {
+            replies.push_back(*i);
+            i = deferred.erase(i);
+         }
+         else
+            ++i;
+      }
+      for(; cursor < r.records.size() && r.records[cursor]->dir == TraceReply; ++cursor)
+         replies.push_back(r.records[cursor]);
+
+      // Send with recorded delay
+      for(std::list<const TraceRecord*>::iterator i = replies.begin(); ok && i != replies.end(); ++i) {
+         const TraceRecord* rep = *i;
+         std::map<uint16_t, uint16_t>::iterator id = ids.find(rep->id);
+         if(rep->id != 0 && id == ids.end()) {
+            deferred.push_back(rep);
+            continue;
+         }
+
+         if(rep->time > rec->time)
+            pace(r.speed, received, rep->time - rec->time);
+         ok = send_record(fd, rep, rep->id == 0 ? 0 : id->second);
+      }
+
+      account(r, req.op(), now() - received, mismatch);
+      if(!ok)
+         break;
+   }
+
+   rbuf_free(&rb);
+   return ok;
+}
+
+/** Print results as JSON lines. */
+static void report(Replay& r, const char* mode, uint64_t elapsed)
+{
+   uint64_t calls = 0, mismatched = 0;
+   std::map<uint8_t, CallResult>::iterator i;
+   for(i = r.results.begin(); i != r.results.end(); ++i) {
+      const CallResult& c = i->second;
+      printf("{\"suite\": \"replay\", \"mode\": \"%s\", \"call\": \"%s\", \"calls\": %llu, "
+             "\"mismatched\": %llu, \"total_ms\": %.3f, \"p50_ns\": %llu, \"p99_ns\": %llu}\n",
+             mode, call_name(i->first), (unsigned long long) c.calls,
+             (unsigned long long) c.mismatched, c.time / 1e6,
+             (unsigned long long) percentile(c, 0.5), (unsigned long long) percentile(c, 0.99));
+      calls += c.calls;
+      mismatched += c.mismatched;
+   }
+
+   printf("{\"suite\": \"replay\", \"mode\": \"%s\", \"calls\": %llu, \"mismatched\": %llu, "
+          "\"lost\": %llu, \"elapsed_ms\": %.3f, \"calls_per_s\": %.1f}\n",
+          mode, (unsigned long long) calls, (unsigned long long) mismatched,
+          (unsigned long long) r.lost, elapsed / 1e6,
+          elapsed > 0 ? calls * 1e9 / elapsed : 0.0);
+}
+
+int main(int argc, char* argv[])
+{
+   ClientSocket remote;
+   std::string host("localhost"), auth, path;
+   int port = 22222, pos = 0, listen = 0, session = 0, timeout = 5000;
+   bool info = false, check = false;
+   Replay r;
+   r.speed = 0.0;
+   r.lost = 0;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('h', "host",     "Target server host:[port]", "localhost:22222")
+      .add('a', "auth",     "Authentication token user@host[:port]")
+      .add('L', "listen",   "Stand in for server on given port")
+      .add('S', "session",  "Replayed session", "0")
+      .add('x', "speed",    "Replay speed (1 = recorded, 0 = maximum)", "0")
+      .add('t', "timeout",  "Connection and reply timeout (ms).", "5000")
+      .add('i', "info",     "List trace sessions", "", false)
+      .add('c', "check",    "Fail on replies different from trace", "", false)
+      .add('q', "quiet",    "Quiet output", "", false)
+      .add('?', "help",     "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbreplay [options] <trace>");
+
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+      switch(m.first) {
+      case 'h':
+         host = m.second;
+         pos = host.find(':');
+         if(pos != std::string::npos) {
+            port = atoi(host.substr(pos + 1).c_str());
+            host.erase(pos);
+         }
+         break;
+      case 'a': auth    = m.second; break;
+      case 'L': listen  = atoi(m.second.c_str()); break;
+      case 'S': session = atoi(m.second.c_str()); break;
+      case 'x': r.speed = atof(m.second.c_str()); break;
+      case 't': timeout = atoi(m.second.c_str()); break;
+      case 'i': info    = true; break;
+      case 'c': check   = true; break;
+      case 'q': log_setlevel(MsgError); break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      case  0 :
+         path = m.second;
+         break;
+      default:
+         break;
+      }
+
+      m = cmd.getopt();
+   }
+
+   // Map trace
+   if(path.empty()) {
+      cmd.printHelp();
+      return EXIT_FAILURE;
+   }
+
+   TraceReader trace;
+   if(!trace_map(&trace, path.c_str()))
+      return EXIT_FAILURE;
+
+   int sessions = select_session(trace, session, r.records, info);
+   if(info) {
+      trace_unmap(&trace);
+      return EXIT_SUCCESS;
+   }
+   if(session >= sessions) {
+      error_msg("Replay: trace has %d sessions", sessions);
+      trace_unmap(&trace);
+      return EXIT_FAILURE;
+   }
+
+   // Connect to server or wait for client
+   Socket server;
+   int fd = -1;
+   if(listen > 0) {
+      if(server.listen(listen, Socket::All, 1) != Socket::Ok) {
+         error_msg("Replay: unable to listen on port %d", listen);
+         trace_unmap(&trace);
+         return EXIT_FAILURE;
+      }
+      fd = server.accept();
+   }
+   else {
+      if(!auth.empty()) {
+         remote.setMethod(ClientSocket::SSH);
+         remote.setTimeout(timeout);
+         if(!remote.setCredentials(auth)) {
+            error_msg("Replay: invalid authentication method '%s'", auth.c_str());
+            trace_unmap(&trace);
+            return EXIT_FAILURE;
+         }
+      }
+      if(remote.connect(host.c_str(), port) == Socket::Ok)
+         fd = remote.sock();
+   }
+
+   if(fd < 0) {
+      error_msg("Replay: connection failed");
+      trace_unmap(&trace);
+      return EXIT_FAILURE;
+   }
+
+   // Disable buffering, replies time out
+   int flag = 1;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+   struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+   if(listen == 0)
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+   // Replay
+   r.start = now();
+   bool ok = (listen > 0) ? serve(r, fd) : drive(r, fd);
+   report(r, (listen > 0) ? "client" : "server", now() - r.start);
+
+   if(listen > 0) {
+      ::close(fd);
+      server.close();
+   }
+   else
+      remote.close();
+   trace_unmap(&trace);
+
+   // Check results
+   uint64_t mismatched = 0;
+   std::map<uint8_t, CallResult>::iterator i;
+   for(i = r.results.begin(); i != r.results.end(); ++i)
+      mismatched += i->second.mismatched;
+   if(!ok || r.lost > 0 || (check && mismatched > 0))
+      return EXIT_FAILURE;
+
+   return EXIT_SUCCESS;
+}
+/** @} */
@@ -0,0 +1,244 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file codec.c
+    \brief Payload compression.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup proto
+    @{
+  */
+#include "codec.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/** Maximum skipped packets after incompressible payload. */
+#define CODEC_MAXSKIP 64
+
+int codec_supported()
+{
+   int mask = CodecNone;
+#ifdef HAVE_LZ4
+   mask |= CodecLZ4;
+#endif
+#ifdef HAVE_ZSTD
+   mask |= CodecZstd;
+#endif
+#ifdef HAVE_ZLIB
+   mask |= CodecZlib;
+#endif
+   return mask;
+}
+
+int codec_pick(int mask)
+{
+   // Prefer fastest
+   mask &= codec_supported();
+   if(mask & CodecLZ4)
+      return CodecLZ4;
+   if(mask & CodecZstd)
+      return CodecZstd;
+   if(mask & CodecZlib)
+      return CodecZlib;
+
+   return CodecNone;
+}
+
+int codec_parse(const char* name)
+{
+   if(strcmp(name, "lz4") == 0)
+      return CodecLZ4;
+   if(strcmp(name, "zstd") == 0)
+      return CodecZstd;
+   if(strcmp(name, "zlib") == 0)
+      return CodecZlib;
+   if(strcmp(name, "1") == 0)
+      return CodecLZ4|CodecZstd|CodecZlib;
+
+   return CodecNone;
+}
+
+void codec_init(Compressor* z, int codec)
+{
+   memset(z, 0, sizeof(Compressor));
+   z->codec = codec;
+   z->backoff = 1;
+}
+
+void codec_free(Compressor* z)
+{
+   free(z->buf);
+   z->buf = NULL;
+   z->size = z->len = 0;
+}
+
+/** Return maximum compressed size. */
+static uint32_t codec_bound(int codec, uint32_t len)
+{
+   switch(codec) {
+#ifdef HAVE_LZ4
+   case CodecLZ4:  return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZSTD
+   case CodecZstd: return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_ZLIB
+   case CodecZlib: return compressBound(len);
+#endif
+   default: break;
+   }
+
+   return 0;
+}
+
+int codec_compress(Compressor* z, const char* src, uint32_t len)
+{
+   // Small payload, payload over peer limit or skipping after incompressible one
+   if(z->codec == CodecNone || len < CODEC_MINSIZE || len > CODEC_MAXRAW)
+      return 0;
+   if(z->skip > 0) {
+      --z->skip;
+      return 0;
+   }
+
+   // Reserve buffer
+   uint32_t bound = codec_bound(z->codec, len) + CODEC_HEADER;
+   if(bound == CODEC_HEADER)
+      return 0;
+   if(z->size < bound) {
+      char* buf = realloc(z->buf, bound);
+      if(buf == NULL)
+         return 0;
+      z->buf = buf;
+      z->size = bound;
+   }
+
+   // Compress
+   char* dst = z->buf + CODEC_HEADER;
+   uint32_t cap = z->size - CODEC_HEADER;
+   uint32_t clen = 0;
+   switch(z->codec) {
+#ifdef HAVE_LZ4
+   case CodecLZ4: {
+      int res = LZ4_compress_default(src, dst, len, cap);
+      clen = (res > 0) ? res : 0;
+   }  break;
+#endif
+#ifdef HAVE_ZSTD
+   case CodecZstd: {
+      size_t res = ZSTD_compress(dst, cap, src, len, 1);
+      clen = ZSTD_isError(res) ? 0 : res;
+   }  break;
+#endif
+#ifdef HAVE_ZLIB
+   case CodecZlib: {
+      uLongf res = cap;
+      if(compress2((Bytef*) dst, &res, (const Bytef*) src, len, Z_BEST_SPEED) == Z_OK)
+         clen = res;
+   }  break;
+#endif
+   default: break;
+   }
+
+   // Incompressible, back off
+   if(clen == 0 || clen + CODEC_HEADER > len - len / 8) {
+      z->skip = z->backoff;
+      if(z->backoff < CODEC_MAXSKIP)
+         z->backoff *= 2;
+      return 0;
+   }
+
+   // Write header
+   z->backoff = 1;
+   z->buf[0] = z->codec;
+   uint32_t rawlen = htonl(len);
+   memcpy(z->buf + 1, &rawlen, sizeof(uint32_t));
+   z->len = clen + CODEC_HEADER;
+   return 1;
+}
+
+uint32_t codec_rawsize(const char* src, uint32_t len)
+{
+   if(len < CODEC_HEADER)
+      return 0;
+
+   // Refuse sizes over limit before anyone allocates them
+   uint32_t rawlen = 0;
+   memcpy(&rawlen, src + 1, sizeof(uint32_t));
+   rawlen = ntohl(rawlen);
+   if(rawlen > CODEC_MAXRAW)
+      return 0;
+
+   return rawlen;
+}
+
+uint32_t codec_decompress(const char* src, uint32_t len, char* dst, uint32_t cap)
+{
+   uint32_t rawlen = codec_rawsize(src, len);
+   if(rawlen == 0 || rawlen > cap)
+      return 0;
+
+   int codec = (uint8_t) src[0];
+   src += CODEC_HEADER;
+   len -= CODEC_HEADER;
+
+   // Decompress
+   uint32_t res = 0;
+   switch(codec) {
+#ifdef HAVE_LZ4
+   case CodecLZ4: {
+      int n = LZ4_decompress_safe(src, dst, len, rawlen);
+      res = (n > 0) ? n : 0;
+   }  break;
+#endif
+#ifdef HAVE_ZSTD
+   case CodecZstd: {
+      size_t n = ZSTD_decompress(dst, rawlen, src, len);
+      res = ZSTD_isError(n) ? 0 : n;
+   }  break;
+#endif
+#ifdef HAVE_ZLIB
+   case CodecZlib: {
+      uLongf n = rawlen;
+      if(uncompress((Bytef*) dst, &n, (const Bytef*) src, len) == Z_OK)
+         res = n;
+   }  break;
+#endif
+   default:
+      error_msg("%s: unsupported codec 0x%02x", __func__, codec);
+      break;
+   }
+
+   // Size must match
+   if(res != rawlen)
+      return 0;
+
+   return res;
+}
+
+/** @} */
@@ -0,0 +1,124 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file codec.h
+    \brief Payload compression.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup proto
+    @{
+  */
+#pragma once
+#ifndef __codec_h__
+#define __codec_h__
+#include <stdint.h>
+
+/** \page codec_page
+    <h2>Payload compression</h2>
+    Codec is negotiated per connection, peers compress packets with
+    the negotiated codec and decompress any codec compiled in.
+    Compressed packet has PACKET_COMPRESSED bit set in opcode and payload
+    \code
+       codec(1B) | raw size(4B, network byte-order) | compressed data
+    \endcode
+    Small payloads are sent raw. Incompressible payload is sent raw and
+    following packets are not compressed for an increasing number of packets.
+  */
+
+/** Opcode flag of compressed packet. */
+#define PACKET_COMPRESSED 0x80
+
+/** Compressed payload header size. */
+#define CODEC_HEADER (sizeof(uint8_t) + sizeof(uint32_t))
+
+/** Payloads smaller than this are not compressed. */
+#define CODEC_MINSIZE 256
+
+/** Largest accepted raw size of compressed payload (64MB).
+  * Raw size comes from the wire and is allocated before decompression.
+  */
+#define CODEC_MAXRAW (1 << 26)
+
+/** Payload codecs, bits in negotiation mask. */
+typedef enum {
+   CodecNone = 0,
+   CodecLZ4  = 1 << 0,
+   CodecZstd = 1 << 1,
+   CodecZlib = 1 << 2
+} Codec;
+
+/** Compressor state, one per connection and direction.
+  * Not thread-safe, use with connection send lock held.
+  */
+typedef struct {
+   int codec;        //! Codec, CodecNone disables compression
+   char* buf;        //! Compressed payload
+   uint32_t size;    //! Buffer capacity
+   uint32_t len;     //! Compressed payload length
+   uint16_t skip;    //! Packets to send raw
+   uint16_t backoff; //! Skip count after next incompressible payload
+} Compressor;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Return mask of compiled-in codecs.
+  */
+int codec_supported();
+
+/** Pick preferred codec from mask of both peers.
+  * \return codec or CodecNone
+  */
+int codec_pick(int mask);
+
+/** Return codec by name (lz4, zstd, zlib), mask of all for "1"
+  * or CodecNone.
+  */
+int codec_parse(const char* name);
+
+/** Initialize compressor.
+  */
+void codec_init(Compressor* z, int codec);
+
+/** Free compressor buffers.
+  */
+void codec_free(Compressor* z);
+
+/** Compress payload to compressor buffer, including header.
+  * \return 1 if compressed, 0 if payload should be sent raw
+  */
+int codec_compress(Compressor* z, const char* src, uint32_t len);
+
+/** Return decompressed size of compressed payload,
+  * 0 on error or if it exceeds CODEC_MAXRAW.
+  */
+uint32_t codec_rawsize(const char* src, uint32_t len);
+
+/** Decompress payload, including header.
+  * \param dst destination, at least codec_rawsize() long
+  * \return decompressed size, 0 on error
+  */
+uint32_t codec_decompress(const char* src, uint32_t len, char* dst, uint32_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __codec_h__
+/** @} */
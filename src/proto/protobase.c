@@ -23,11 +23,15 @@
     @{
   */
 #include "protobase.h"
+#include "shmlink.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/shm.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 uint32_t recv_full(int fd, char* buf, uint32_t pending)
@@ -49,24 +53,200 @@ uint32_t recv_full(int fd, char* buf, uint32_t pending)
    return read;
 }
 
+uint32_t send_full(int fd, struct iovec* iov, int count)
+{
+   // Local peer
+   ShmLink* link = shm_link_get(fd);
+   if(link != NULL)
+      return shm_link_write(link, iov, count);
+
+   return send_socket(fd, iov, count);
+}
+
+uint32_t send_socket(int fd, struct iovec* iov, int count)
+{
+   // Prepare message
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = iov;
+   msg.msg_iovlen = count;
+
+   uint32_t sent = 0;
+   while(msg.msg_iovlen > 0) {
+
+      // Send remaining buffers
+      ssize_t res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if(res < 0) {
+         if(errno == EINTR)
+            continue;
+         return 0;
+      }
+
+      sent += res;
+
+      // Skip sent buffers, shift partially sent
+      while(msg.msg_iovlen > 0 && (size_t) res >= msg.msg_iov->iov_len) {
+         res -= msg.msg_iov->iov_len;
+         ++msg.msg_iov;
+         --msg.msg_iovlen;
+      }
+      if(msg.msg_iovlen > 0) {
+         msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + res;
+         msg.msg_iov->iov_len -= res;
+      }
+   }
+
+   return sent;
+}
+
 uint32_t pkt_recv_header(int fd, char *buf)
 {
    // Read packet header
    uint32_t rcvd = 0;
-   if((rcvd = recv_full(fd, buf, 2)) == 0)
+   if((rcvd = recv_full(fd, buf, 4)) == 0)
       return 0;
 
    // Multi-byte
-   unsigned c = (unsigned char) buf[1];
+   unsigned c = (unsigned char) buf[3];
    if(c > 0x80) {
-      if((rcvd = recv_full(fd, buf + 2, c - 0x80)) == 0)
+      if((rcvd = recv_full(fd, buf + 4, c - 0x80)) == 0)
          return 0;
-      rcvd += 2;
+      rcvd += 4;
+   }
+
+   return rcvd;
+}
+
+/** Return packet header size, 0 if not known yet. */
+static uint32_t header_size(const char* buf, uint32_t avail)
+{
+   if(avail < 4)
+      return 0;
+
+   // Multi-byte
+   unsigned c = (unsigned char) buf[3];
+   if(c > 0x80)
+      return 4 + c - 0x80;
+
+   return 4;
+}
+
+void rbuf_init(RecvBuf* rb, uint32_t size)
+{
+   rb->data = malloc(size);
+   rb->size = size;
+   rb->pos = rb->len = 0;
+   rb->link = NULL;
+}
+
+void rbuf_free(RecvBuf* rb)
+{
+   free(rb->data);
+   rb->data = NULL;
+   rb->size = rb->pos = rb->len = 0;
+}
+
+int rbuf_fill(int fd, RecvBuf* rb, int flags)
+{
+   // Rewind empty buffer, compact if short of space
+   if(rb->pos == rb->len)
+      rb->pos = rb->len = 0;
+   if(rb->pos > 0 && rb->size - rb->len < rb->size / 4) {
+      memmove(rb->data, rb->data + rb->pos, rb->len - rb->pos);
+      rb->len -= rb->pos;
+      rb->pos = 0;
    }
 
+   // Receive available data
+   int rcvd = 0;
+   do {
+      if(rb->link != NULL)
+         rcvd = shm_link_read(rb->link, rb->data + rb->len, rb->size - rb->len, flags);
+      else
+         rcvd = recv(fd, rb->data + rb->len, rb->size - rb->len, flags);
+   } while(rcvd < 0 && errno == EINTR);
+
+   if(rcvd > 0)
+      rb->len += rcvd;
+
    return rcvd;
 }
 
+uint32_t rbuf_packet(RecvBuf* rb)
+{
+   // Parse header
+   const char* buf = rb->data + rb->pos;
+   uint32_t avail = rb->len - rb->pos;
+   uint32_t hsize = header_size(buf, avail);
+   if(hsize == 0 || avail < hsize)
+      return 0;
+
+   uint32_t size = 0;
+   unpack_size(buf + 3, &size);
+   size += hsize;
+   if(avail >= size)
+      return size;
+
+   // Enlarge to fit whole packet
+   if(size > rb->size - rb->pos) {
+      memmove(rb->data, rb->data + rb->pos, avail);
+      rb->len = avail;
+      rb->pos = 0;
+      if(size > rb->size) {
+         rb->data = realloc(rb->data, size);
+         rb->size = size;
+      }
+   }
+
+   return 0;
+}
+
+uint32_t rbuf_recv_header(int fd, RecvBuf* rb, char* buf)
+{
+   if(rb == NULL)
+      return pkt_recv_header(fd, buf);
+
+   // Receive until complete
+   uint32_t hsize = 0;
+   while((hsize = header_size(rb->data + rb->pos, rb->len - rb->pos)) == 0 ||
+         rb->len - rb->pos < hsize) {
+      if(rbuf_fill(fd, rb, 0) <= 0)
+         return 0;
+   }
+
+   // Consume header
+   memcpy(buf, rb->data + rb->pos, hsize);
+   rb->pos += hsize;
+   return hsize;
+}
+
+uint32_t rbuf_recv(int fd, RecvBuf* rb, char* dst, uint32_t len)
+{
+   if(rb == NULL)
+      return recv_full(fd, dst, len);
+
+   // Copy buffered data
+   uint32_t avail = rb->len - rb->pos;
+   if(avail > len)
+      avail = len;
+   memcpy(dst, rb->data + rb->pos, avail);
+   rb->pos += avail;
+
+   // Receive rest directly
+   if(rb->link != NULL) {
+      while(avail < len) {
+         int rcvd = shm_link_read(rb->link, dst + avail, len - avail, 0);
+         if(rcvd <= 0)
+            return 0;
+         avail += rcvd;
+      }
+   }
+   else if(avail < len && recv_full(fd, dst + avail, len - avail) == 0)
+      return 0;
+
+   return len;
+}
+
 void pkt_dump(const char* buf, uint32_t size)
 {
    printf("Packet (%dB):", size);
@@ -162,89 +342,187 @@ const char* as_string(void* data, uint32_t bytes)
    return (const char*) data;
 }
 
-int ipc_init()
+/** Socket handoff session, see ipc_init(). */
+struct IpcSession {
+   int fd;               //! Handed over socket
+   int lfd;              //! Listening Unix socket
+   pthread_t thread;     //! Accepting thread
+   char dir[64];         //! Private directory
+   char path[108];       //! Socket path, see sockaddr_un
+};
+
+/** Send socket descriptor with loglevel over Unix socket. */
+static int ipc_send_fd(int sock, int fd)
 {
-   int shm_id = 0;
-   log_msg("IPC: creating segment at key 0x%x (%d bytes)", SHM_KEY, SHM_SIZE);
-   if((shm_id = shmget(SHM_KEY, SHM_SIZE, IPC_CREAT|0666)) == -1) {
-      perror("shmget");
-   }
-
-   return shm_id;
+   int level = log_level();
+   struct iovec iov = { &level, sizeof(int) };
+   char cbuf[CMSG_SPACE(sizeof(int))];
+   memset(cbuf, 0, sizeof(cbuf));
+
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+   struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+   return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(int);
 }
 
-int ipc_teardown(int shm_id)
+/** Hand socket over to each connecting process. */
+static void* ipc_run(void* arg)
 {
-   log_msg("IPC: removing segment %d", shm_id);
-   return shmctl(shm_id, IPC_RMID, NULL);
-}
-
-static void* ipc_get_addr() {
-
-   // Get segment
-   int shm_id = 0;
-   if((shm_id = shmget(SHM_KEY, SHM_SIZE, 0666)) != -1) {
-
-      // Attach segment and read fd
-      void* shm_addr = NULL;
-      if ((shm_addr = shmat(shm_id, NULL, 0)) != (void *) -1)
-         return shm_addr;
+   IpcSession* s = (IpcSession*) arg;
+   for(;;) {
+      int sock = accept(s->lfd, NULL, NULL);
+      if(sock < 0) {
+         if(errno == EINTR || errno == ECONNABORTED)
+            continue;
+         break;
+      }
 
+      if(!ipc_send_fd(sock, s->fd))
+         error_msg("IPC: failed to pass socket: %s", strerror(errno));
+      close(sock);
    }
 
    return NULL;
 }
 
-int ipc_get_remote()
+IpcSession* ipc_init(int fd)
 {
-   // Get fd from SHM
-   int fd = 0;
+   IpcSession* s = malloc(sizeof(IpcSession));
+   memset(s, 0, sizeof(IpcSession));
+   s->fd = fd;
+   s->lfd = -1;
+
+   // Create private directory
+   const char* tmp = getenv("TMPDIR");
+   if(tmp == NULL || strlen(tmp) + 32 > sizeof(s->dir))
+      tmp = "/tmp";
+   snprintf(s->dir, sizeof(s->dir), "%s/usbnet-XXXXXX", tmp);
+   if(mkdtemp(s->dir) == NULL) {
+      error_msg("IPC: failed to create %s: %s", s->dir, strerror(errno));
+      free(s);
+      return NULL;
+   }
 
-   // Get SHM address
-   void* shm_addr = ipc_get_addr();
-   if(shm_addr != NULL) {
+   // Listen on session socket
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   snprintf(s->path, sizeof(s->path), "%s/session", s->dir);
+   strncpy(addr.sun_path, s->path, sizeof(addr.sun_path) - 1);
+   s->lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(s->lfd < 0 || bind(s->lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      listen(s->lfd, 16) < 0 || pthread_create(&s->thread, NULL, &ipc_run, s) != 0) {
+      error_msg("IPC: failed to listen at %s: %s", s->path, strerror(errno));
+      if(s->lfd >= 0)
+         close(s->lfd);
+      unlink(s->path);
+      rmdir(s->dir);
+      free(s);
+      return NULL;
+   }
 
-      // Read fd
-      fd = *((int*) shm_addr);
+   // Export path to executed processes
+   setenv(IPC_ENV, s->path, 1);
+   log_msg("IPC: passing socket descriptor %d at %s", fd, s->path);
+   return s;
+}
 
-      // Read loglevel
-      log_setlevel(*((int*) shm_addr + 1));
+void ipc_teardown(IpcSession* s)
+{
+   if(s == NULL)
+      return;
+
+   // Stop accepting
+   log_msg("IPC: closing %s", s->path);
+   shutdown(s->lfd, SHUT_RDWR);
+   pthread_join(s->thread, NULL);
+   close(s->lfd);
+   unlink(s->path);
+   rmdir(s->dir);
+   unsetenv(IPC_ENV);
+   free(s);
+}
 
-      // Detach
-      shmdt(shm_addr);
+/** Connect to Unix socket.
+  * \return socket or -1 on error
+  */
+static int ipc_connect(const char* path)
+{
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if(strlen(path) >= sizeof(addr.sun_path))
+      return -1;
+   strcpy(addr.sun_path, path);
+
+   int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+   if(sock < 0)
+      return -1;
+   if(connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+      error_msg("IPC: failed to connect to %s: %s", path, strerror(errno));
+      close(sock);
+      return -1;
    }
 
-   // Check resulting fd
-   log_msg("IPC: remote fd is %d\n", fd);
-
-   // Check peer name - keep-alive
-   struct sockaddr_in addr;
-   int len = sizeof(addr);
-   if(getpeername(fd, (struct sockaddr*)& addr, &len) < 0)
-      fd = -1;
-
-   return fd;
+   return sock;
 }
 
-int ipc_set_remote(int fd)
+int ipc_get_remote()
 {
-   // Save fd to SHM
-   void* shm_addr = ipc_get_addr();
-   if(shm_addr != NULL) {
-
-      // Store remote fd
-      *((int*) shm_addr) = fd;
-      log_msg("IPC: stored remote socket descriptor %d", fd);
+   // Multiplexer connection is used directly
+   const char* path = getenv(IPC_DAEMON_ENV);
+   if(path != NULL) {
+      const char* level = getenv(IPC_LOGLEVEL_ENV);
+      if(level != NULL)
+         log_setlevel(atoi(level));
+      int fd = ipc_connect(path);
+      log_msg("IPC: multiplexer fd is %d", fd);
+      return fd;
+   }
 
-      // Store loglevel
-      *((int*) shm_addr + 1) = log_level();
+   path = getenv(IPC_ENV);
+   if(path == NULL) {
+      error_msg("IPC: %s is not set", IPC_ENV);
+      return -1;
+   }
 
-      // Detach
-      shmdt(shm_addr);
-      return 1;
+   // Connect to session
+   int sock = ipc_connect(path);
+   if(sock < 0)
+      return -1;
+
+   // Receive socket descriptor and loglevel
+   int level = 0;
+   struct iovec iov = { &level, sizeof(int) };
+   char cbuf[CMSG_SPACE(sizeof(int))];
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+   int fd = -1;
+   if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == sizeof(int)) {
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+         memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
    }
+   close(sock);
 
-   return -1;
+   // Check resulting fd
+   if(fd != -1)
+      log_setlevel(level);
+   log_msg("IPC: remote fd is %d", fd);
+   return fd;
 }
 
 /** @} */
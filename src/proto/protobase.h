@@ -27,6 +27,7 @@
 #define __protobase_h__
 #include <stdint.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include "common.h"
 
 /** ASN.1 semantic types.
@@ -49,8 +50,29 @@ typedef enum {
 
 } Type;
 
-/** 1B op + 1B prefix + 4B length. */
-#define PACKET_MINSIZE (sizeof(uint8_t)+sizeof(uint8_t)+sizeof(uint32_t))
+/** 2B request id + 1B op + 1B prefix + 4B length. */
+#define PACKET_MINSIZE (sizeof(uint16_t)+sizeof(uint8_t)+sizeof(uint8_t)+sizeof(uint32_t))
+
+/** Default receive buffer size. */
+#define RECVBUF_SIZE 65536
+
+struct ShmLink;
+
+/** Socket handoff session. */
+typedef struct IpcSession IpcSession;
+
+/** Receive buffer.
+  * Data are received in bulk and parsed packet by packet,
+  * so back-to-back packets cost a single recv() call.
+  * Data are read from shared memory link instead of socket if set.
+  */
+typedef struct {
+   char* data;
+   uint32_t size; //! Buffer capacity
+   uint32_t pos;  //! First unparsed byte
+   uint32_t len;  //! End of received data
+   struct ShmLink* link; //! Shared memory source or NULL
+} RecvBuf;
 
 #ifdef __cplusplus
 extern "C"
@@ -58,6 +80,7 @@ extern "C"
 #endif
 
 /** Receive packet header.
+  * Header consists of request id (network byte-order), opcode and packed size.
   * Ensure buf is at least PACKET_MINSIZE.
   * \return header size on success, 0 on error
   */
@@ -67,6 +90,49 @@ uint32_t pkt_recv_header(int fd, char* buf);
   */
 uint32_t recv_full(int fd, char* buf, uint32_t pending);
 
+/** Initialize receive buffer.
+  */
+void rbuf_init(RecvBuf* rb, uint32_t size);
+
+/** Free receive buffer data.
+  */
+void rbuf_free(RecvBuf* rb);
+
+/** Receive available data to buffer.
+  * \param flags recv() flags, MSG_DONTWAIT for non-blocking read
+  * \return received bytes, 0 on closed connection, -1 on error
+  */
+int rbuf_fill(int fd, RecvBuf* rb, int flags);
+
+/** Return size of next buffered packet if it's complete.
+  * Buffer is enlarged if the packet doesn't fit.
+  * \return packet size or 0 if incomplete
+  */
+uint32_t rbuf_packet(RecvBuf* rb);
+
+/** Receive packet header through buffer, see pkt_recv_header().
+  * Unbuffered if rb is NULL.
+  * \return header size on success, 0 on error
+  */
+uint32_t rbuf_recv_header(int fd, RecvBuf* rb, char* buf);
+
+/** Receive data through buffer, see recv_full().
+  * Unbuffered if rb is NULL.
+  * \return received bytes on success, 0 on error
+  */
+uint32_t rbuf_recv(int fd, RecvBuf* rb, char* dst, uint32_t len);
+
+/** Block until all buffers are sent, as a single write if possible.
+  * Partially sent buffers are resumed, iovec array is modified.
+  * Buffers are written to shared memory link if attached to socket.
+  * \return sent bytes on success, 0 on error
+  */
+uint32_t send_full(int fd, struct iovec* iov, int count);
+
+/** Send buffers as send_full(), but always to the socket.
+  */
+uint32_t send_socket(int fd, struct iovec* iov, int count);
+
 /** Pack size to byte array.
   * \warning Array has to be at least 5B long for uint32.
   * \return packed size length (1 - 4B), -1 on error
@@ -95,24 +161,25 @@ int as_int(void* data, uint32_t bytes);
   */
 const char* as_string(void* data, uint32_t bytes);
 
-/** Create SHM segment.
+/** Start passing socket descriptor to local processes.
+  * Descriptor is passed with SCM_RIGHTS over a Unix socket in a private
+  * directory, path is exported in IPC_ENV for executed processes,
+  * so each session is independent.
+  * \return session or NULL on error
   */
-int ipc_init();
+IpcSession* ipc_init(int fd);
 
-/** Close SHM segment.
+/** Stop passing socket descriptor and remove session socket.
   */
-int ipc_teardown(int);
+void ipc_teardown(IpcSession* s);
 
 /** Return host socket descriptor.
-  * Retrieve socket descriptor from SHM.
-  */
-int ipc_get_remote();
-
-/** Save host socket descriptor.
-  * Save socket descriptor to SHM.
+  * Connect to multiplexer at IPC_DAEMON_ENV path if set,
+  * receive socket descriptor from session at IPC_ENV path otherwise.
   * Store host loglevel.
+  * \return socket descriptor or -1 on error
   */
-int ipc_set_remote(int fd);
+int ipc_get_remote();
 
 
 #ifdef __cplusplus
@@ -28,11 +28,17 @@
 #include <stdlib.h>
 #include <pthread.h>
 
-/* Shared packet lock. */
-static pthread_mutex_t __mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Thread packet key. */
+static pthread_key_t __pkt_key;
+static pthread_once_t __pkt_once = PTHREAD_ONCE_INIT;
 
-/* Shared packet ptr. */
-static Packet* sPacket = NULL;
+static void pkt_key_free(void* pkt) {
+   pkt_free((Packet*) pkt);
+}
+
+static void pkt_key_init() {
+   pthread_key_create(&__pkt_key, &pkt_key_free);
+}
 
 Packet* pkt_new(uint32_t size, uint8_t op) {
 
@@ -61,6 +67,7 @@ void pkt_init(Packet* pkt, uint8_t op)
 {
    // Set opcode and resize
    pkt->op = op;
+   pkt->id = 0;
    pkt->size = 0;
 }
 
@@ -78,29 +85,33 @@ int pkt_reserve(Packet* pkt, uint32_t size)
 }
 
 Packet* pkt_shared() {
-   return sPacket;
+   pthread_once(&__pkt_once, &pkt_key_init);
+   return pthread_getspecific(__pkt_key);
 }
 
 Packet* pkt_claim() {
 
-   // Lock global lock
-   pthread_mutex_lock(&__mutex);
-
-   // Alloc if needed
-   if(sPacket == NULL) {
-      sPacket = pkt_new(BUF_FRAGLEN, 0x00);
+   // Alloc if needed, freed on thread exit
+   Packet* pkt = pkt_shared();
+   if(pkt == NULL) {
+      pkt = pkt_new(BUF_FRAGLEN, 0x00);
+      pthread_setspecific(__pkt_key, pkt);
    }
 
-   return pkt_shared();
+   return pkt;
 }
 
 void pkt_release() {
 
-   // Unlock global lock
-   pthread_mutex_unlock(&__mutex);
+   // Thread packet stays allocated for reuse
 }
 
 uint32_t pkt_recv(int fd, Packet* dst)
+{
+   return pkt_recvbuf(fd, NULL, dst);
+}
+
+uint32_t pkt_recvbuf(int fd, RecvBuf* rb, Packet* dst)
 {
    // Prepare packet
    uint32_t size = 0;
@@ -110,15 +121,16 @@ uint32_t pkt_recv(int fd, Packet* dst)
    if(!pkt_reserve(dst, PACKET_MINSIZE))
       return 0;
 
-   if((size = pkt_recv_header(fd, dst->buf)) == 0) {
+   if((size = rbuf_recv_header(fd, rb, dst->buf)) == 0) {
       error_msg("%s: failed to receive packet header", __func__);
       return 0;
    }
 
    // Parse packet header
    dst->size = 0;
-   dst->op = dst->buf[0];
-   unpack_size(dst->buf + 1, &dst->size);
+   dst->id = ntohs(*((uint16_t*) dst->buf));
+   dst->op = dst->buf[2];
+   unpack_size(dst->buf + 3, &dst->size);
 
    // Receive payload
    if(dst->size > 0) {
@@ -127,12 +139,30 @@ uint32_t pkt_recv(int fd, Packet* dst)
       if(!pkt_reserve(dst, dst->size))
          return 0;
 
-      if((dst->size = recv_full(fd, dst->buf, dst->size)) == 0) {
+      if((dst->size = rbuf_recv(fd, rb, dst->buf, dst->size)) == 0) {
          error_msg("%s: failed to receive packet payload", __func__);
          return 0;
       }
    }
 
+   // Decompress payload
+   if(dst->op & PACKET_COMPRESSED) {
+      dst->op &= ~PACKET_COMPRESSED;
+      uint32_t rawlen = codec_rawsize(dst->buf, dst->size);
+      char* raw = (rawlen > 0) ? malloc(rawlen + BUF_FRAGLEN) : NULL;
+      if(raw == NULL || codec_decompress(dst->buf, dst->size, raw, rawlen) != rawlen) {
+         error_msg("%s: failed to decompress packet payload", __func__);
+         free(raw);
+         dst->size = 0;
+         return 0;
+      }
+
+      free(dst->buf);
+      dst->buf = raw;
+      dst->bufsize = rawlen + BUF_FRAGLEN;
+      dst->size = rawlen;
+   }
+
    #ifdef DEBUG
    //pkt_dump(dst->buf, dst->size);
    #endif
@@ -142,24 +172,40 @@ uint32_t pkt_recv(int fd, Packet* dst)
 }
 
 int pkt_send(Packet* pkt, int fd)
+{
+   return pkt_sendz(pkt, fd, NULL);
+}
+
+int pkt_sendz(Packet* pkt, int fd, Compressor* z)
 {
    #ifdef DEBUG
    //pkt_dump(pkt->buf, pkt->size);
    #endif
 
-   // Send opcode
-   char buf[PACKET_MINSIZE] = { pkt->op };
-   send(fd, buf, 1, 0);
-
-   // Send size
-   int len = pack_size(pkt->size, buf);
-   send(fd, buf, len, 0);
-
-   // Send payload
-   if(pkt->size > 0)
-      return send(fd, pkt->buf, pkt->size, 0);
+   // Compress payload
+   uint8_t op = pkt->op;
+   const char* payload = pkt->buf;
+   uint32_t size = pkt->size;
+   if(z != NULL && codec_compress(z, pkt->buf, pkt->size)) {
+      op |= PACKET_COMPRESSED;
+      payload = z->buf;
+      size = z->len;
+   }
 
-   return 0;
+   // Write request id, opcode and size
+   char buf[PACKET_MINSIZE];
+   uint16_t id = htons(pkt->id);
+   memcpy(buf, &id, sizeof(uint16_t));
+   buf[2] = op;
+   int len = pack_size(size, buf + 3) + 3;
+
+   // Send header and payload at once
+   struct iovec iov[2];
+   iov[0].iov_base = buf;
+   iov[0].iov_len = len;
+   iov[1].iov_base = (void*) payload;
+   iov[1].iov_len = size;
+   return send_full(fd, iov, (size > 0) ? 2 : 1);
 }
 
 int pkt_append(Packet* pkt, uint8_t type, uint16_t len, const void* val)
@@ -185,6 +231,16 @@ int pkt_append(Packet* pkt, uint8_t type, uint16_t len, const void* val)
    return isize;
 }
 
+char* pkt_alloc(Packet* pkt, uint32_t len)
+{
+   if(!pkt_reserve(pkt, pkt->size + len))
+      return NULL;
+
+   char* dst = pkt->buf + pkt->size;
+   pkt->size += len;
+   return dst;
+}
+
 int pkt_addnumeric(Packet* pkt, uint8_t type, uint16_t len, int32_t val)
 {
    // Cast to ensure correct data
@@ -207,15 +263,20 @@ int pkt_addnumeric(Packet* pkt, uint8_t type, uint16_t len, int32_t val)
 }
 
 void* pkt_begin(Packet* pkt, Iterator* it)
+{
+   return iter_begin(it, pkt->buf, pkt->size);
+}
+
+void* iter_begin(Iterator* it, const void* data, uint32_t len)
 {
    // Invalidate ptrs
    it->type = InvalidType;
    it->len = 0;
    it->cur = it->next = it->end = NULL;
 
-   // Check packet size
-   it->next = pkt->buf;
-   it->end = it->next + pkt->size;
+   // Set boundaries
+   it->next = (void*) data;
+   it->end = it->next + len;
    iter_next(it);
 
    return it->cur;
@@ -31,8 +31,21 @@
 #include <iomanip>
 using namespace Proto;
 
+/** Length slot size, 1B prefix + 4B length. */
+static const int SlotSize = sizeof(uint8_t) + sizeof(uint32_t);
+
+void ByteBuffer::grow(size_t size)
+{
+   char* data = (char*) realloc(mData, size);
+   if(data == NULL)
+      throw std::bad_alloc();
+
+   mData = data;
+   mCapacity = size;
+}
+
 Struct::Struct(ByteBuffer& sharedbuf, int pos)
-   : mBuf(sharedbuf), mPos(pos), mCursor(0), mSize(0)
+   : mBuf(sharedbuf), mPos(pos), mCursor(0), mSize(0), mSlot(-1)
 {
    // Seek end pos
    if(mPos < 0)
@@ -56,13 +69,23 @@ Struct& Struct::append(const char* str, size_t size) {
       if(size == 0)
          size = strlen(str);
 
-      mBuf.insert(mCursor, str, size);
+      mBuf.append(str, size);
       mSize += size;
       mCursor += size;
    }
    return *this;
 }
 
+Struct& Struct::reserveSlot()
+{
+   // Append placeholder, always 32bit length
+   mSlot = mBuf.size();
+   mBuf.push_back(0x80 + sizeof(uint32_t));
+   mBuf.append(SlotSize - 1, '\0');
+   mCursor += SlotSize;
+   return *this;
+}
+
 Struct& Struct::addNumeric(uint8_t type, uint8_t len, uint32_t val)
 {
    // Check
@@ -95,6 +118,26 @@ Struct& Struct::addData(const char* data, size_t size, uint8_t type)
 }
 
 
+char* Struct::alloc(size_t size)
+{
+   // Value is written by caller
+   int pos = mBuf.size();
+   mBuf.resize(pos + size);
+   mSize += size;
+   mCursor += size;
+   return &mBuf[pos];
+}
+
+Struct& Struct::truncate(int pos)
+{
+   // Drop tail
+   size_t len = mBuf.size() - pos;
+   mBuf.resize(pos);
+   mSize -= len;
+   mCursor -= len;
+   return *this;
+}
+
 Struct& Struct::addString(const char* str, uint8_t type)
 {
    if(str != 0) {
@@ -109,13 +152,18 @@ Struct& Struct::addString(const char* str, uint8_t type)
 
 Struct& Struct::finalize()
 {
+   if(mSlot < 0)
+      return *this;
+
    // Remaining bufsize
-   uint32_t block_size = mBuf.size() - startPos() - 1;
+   uint32_t block_size = mBuf.size() - mSlot - SlotSize;
 
-   // Pack number
-   char buf[6];
-   int len = pack_size(block_size, buf);
-   mBuf.insert(startPos() + 1, buf, len);
+   // Write fixed-size length to slot
+   char buf[SlotSize];
+   buf[0] = 0x80 + sizeof(uint32_t);
+   block_size = htonl(block_size);
+   memcpy(buf + 1, &block_size, sizeof(uint32_t));
+   memcpy(&mBuf[mSlot], buf, SlotSize);
 
    return *this;
 }
@@ -160,26 +208,48 @@ bool Iterator::enter()
    return next();
 }
 
-int Packet::recv(int fd)
+int Packet::recv(int fd, RecvBuf* rb)
 {
-   // Prepare buffer
-   uint32_t hsize = PACKET_MINSIZE;
-   mBuf.resize(hsize);
-   if((hsize = pkt_recv_header(fd, (char*) mBuf.data())) == 0)
+   // Receive header
+   char hbuf[PACKET_MINSIZE];
+   uint32_t hsize = 0;
+   if((hsize = rbuf_recv_header(fd, rb, hbuf)) == 0)
       return -1;
 
+   // Strip request id
+   mId = ntohs(*((uint16_t*) hbuf));
+   hsize -= sizeof(uint16_t);
+   mBuf.assign(hbuf + sizeof(uint16_t), hsize);
+
    // Unpack payload length
    uint32_t pending = 0;
-   int len = unpack_size(mBuf.data() + 1, &pending);
+   unpack_size(mBuf.data() + 1, &pending);
    mBuf.resize(hsize + pending);
 
-   char* ptr = (char*) mBuf.data() + 1 + len;
-   uint32_t total = hsize + pending;
+   char* ptr = (char*) mBuf.data() + hsize;
 
    // Receive payload
    if(pending > 0) {
-      if((hsize = recv_full(fd, ptr, pending)) == 0)
+      if((hsize = rbuf_recv(fd, rb, ptr, pending)) == 0)
+         return -1;
+   }
+
+   // Decompress payload
+   if(mBuf[0] & PACKET_COMPRESSED) {
+      uint32_t rawlen = codec_rawsize(ptr, pending);
+      ByteBuffer raw;
+      raw.resize(sizeof(uint8_t) + SlotSize + rawlen);
+      if(rawlen == 0 || codec_decompress(ptr, pending, &raw[sizeof(uint8_t) + SlotSize], rawlen) != rawlen) {
+         error_msg("%s: failed to decompress packet payload", __func__);
          return -1;
+      }
+
+      // Rewrite header, opcode and fixed-size length
+      raw[0] = mBuf[0] & ~PACKET_COMPRESSED;
+      raw[1] = 0x80 + sizeof(uint32_t);
+      uint32_t len = htonl(rawlen);
+      memcpy(&raw[2], &len, sizeof(uint32_t));
+      mBuf.swap(raw);
    }
 
    #ifdef DEBUG
@@ -193,8 +263,33 @@ void Packet::dump() {
    pkt_dump(mBuf.data(), size());
 }
 
-int Packet::send(int fd) {
+int Packet::send(int fd, Compressor* z, bool link) {
    finalize();
-   return ::send(fd, mBuf.data(), size(), 0);
+
+   // Compress payload
+   uint32_t hsize = sizeof(uint8_t) + SlotSize;
+   uint32_t len = size() - hsize;
+   uint8_t op = this->op();
+   const char* payload = mBuf.data() + hsize;
+   if(z != NULL && codec_compress(z, payload, len)) {
+      op |= PACKET_COMPRESSED;
+      payload = z->buf;
+      len = z->len;
+   }
+
+   // Write compact header, request id precedes opcode
+   char hdr[PACKET_MINSIZE];
+   uint16_t id = htons(mId);
+   memcpy(hdr, &id, sizeof(uint16_t));
+   hdr[2] = op;
+   int hlen = pack_size(len, hdr + 3) + 3;
+
+   // Send header and payload at once
+   struct iovec iov[2];
+   iov[0].iov_base = hdr;
+   iov[0].iov_len = hlen;
+   iov[1].iov_base = (void*) payload;
+   iov[1].iov_len = len;
+   return link ? send_full(fd, iov, 2) : send_socket(fd, iov, 2);
 }
 /** @} */
@@ -26,6 +26,7 @@
 #ifndef __protocol_h__
 #define __protocol_h__
 #include "protobase.h"
+#include "codec.h"
 
 /** \page proto_page
     <h2>Protocol C API</h2>
@@ -43,12 +44,13 @@
     \endcode
     <h3>How to write packet</h3>
     \code
-       Packet* pkt = pkt_claim(); // Claim shared buffer (or pkt_new())
+       Packet* pkt = pkt_claim(); // Claim thread buffer (or pkt_new())
        pkt_init(pkt, UsbInit);    // Write packet header and opcode
        pkt_addint8(pkt, 0x4F);    // Append 8bit integer
        pkt_adduint(pkt, someval); // Append variable-length unsigned
+       pkt->id = 1;               // Set request id, reply carries the same id
        pkt_send(pkt, fd);         // Send packet
-       pkt_release();             // Release shared buffer
+       pkt_release();             // Release thread buffer
     \endcode
   */
 
@@ -60,6 +62,7 @@
 typedef struct {
    uint32_t bufsize; //! Buffer size
    uint32_t size;    //! Payload size
+   uint16_t id;      //! Request id
    uint8_t  op;      //! Opcode
    char* buf;        //! Payload buffer
 } Packet;
@@ -98,22 +101,24 @@ void pkt_free(Packet* pkt);
 int pkt_reserve(Packet* pkt, uint32_t size);
 
 /** Initialize packet.
+  * Request id is reset to 0.
   * \param pkt initialized packet
   * \param op packet opcode
   */
 void pkt_init(Packet* pkt, uint8_t op);
 
-/** Return shared packet.
-  * \return ptr to shared packet
+/** Return calling thread packet.
+  * \return ptr to thread packet or NULL if not allocated
   */
 Packet* pkt_shared();
 
-/** Claim shared packet buffer.
-  * \return ptr to shared packet
+/** Claim calling thread packet buffer.
+  * Each thread owns its packet, so no locking is involved.
+  * \return ptr to thread packet
   */
 Packet* pkt_claim();
 
-/** Release shared packet buffer.
+/** Release calling thread packet buffer.
   */
 void pkt_release();
 
@@ -127,6 +132,13 @@ void pkt_release();
   */
 int pkt_append(Packet* pkt, uint8_t type, uint16_t len, const void* val);
 
+/** Append uninitialized data to be written in place.
+  * \param pkt packet
+  * \param len appended size
+  * \return ptr to appended data or NULL, valid until packet is resized
+  */
+char* pkt_alloc(Packet* pkt, uint32_t len);
+
 /** Append numeric value. */
 int pkt_addnumeric(Packet* pkt, uint8_t type, uint16_t len, int32_t val);
 
@@ -164,13 +176,32 @@ int pkt_addnumeric(Packet* pkt, uint8_t type, uint16_t len, int32_t val);
   */
 uint32_t pkt_recv(int fd, Packet* dst);
 
+/** Receive packet through receive buffer.
+  * Buffered data are used first, pending packets remain buffered.
+  * Compressed payload is decompressed.
+  * \param fd source fd
+  * \param rb receive buffer or NULL
+  * \param dst destination packet
+  * \return packet size on success, 0 on error
+  */
+uint32_t pkt_recvbuf(int fd, RecvBuf* rb, Packet* dst);
+
 /** Send packet.
+  * Header and payload are sent in a single write.
   * \param pkt given packet
   * \param fd destination socket descriptor
-  * \return socket send() value
+  * \return sent bytes on success, 0 on error
   */
 int pkt_send(Packet* pkt, int fd);
 
+/** Send packet, payload is compressed if worthwhile.
+  * \param pkt given packet
+  * \param fd destination socket descriptor
+  * \param z compressor or NULL
+  * \return sent bytes on success, 0 on error
+  */
+int pkt_sendz(Packet* pkt, int fd, Compressor* z);
+
 /** Set iterator to first packet payload.
   * \param pkt source packet
   * \param it iterator
@@ -178,6 +209,14 @@ int pkt_send(Packet* pkt, int fd);
   */
 void* pkt_begin(Packet* pkt, Iterator* it);
 
+/** Set iterator to first item in given data.
+  * \param it iterator
+  * \param data encoded items
+  * \param len data length
+  * \return current item ptr or NULL
+  */
+void* iter_begin(Iterator* it, const void* data, uint32_t len);
+
 
 /** Return true on iterator end.
   * \return true if iterator is at lastpos + 1
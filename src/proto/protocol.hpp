@@ -26,8 +26,13 @@
 #ifndef __protocol_hpp__
 #define __protocol_hpp__
 #include "protobase.h"
+#include "codec.h"
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
 /** \page protopp_page
     <h2>Protocol C++ API</h2>
@@ -45,7 +50,7 @@
     \endcode
     <h3>How to write packet</h3>
     \code
-      Packet pkt(UsbInit); // Create packet.
+      Packet pkt(UsbInit, in.id()); // Create reply to request.
       pkt.addInt32(someval); // Append 32bit integer.
       pkt.send(fd); // Send packet.
     \endcode
@@ -55,16 +60,103 @@
 namespace Proto
 {
 
-/* Types */
-typedef std::string ByteBuffer;
+/** Growable byte buffer.
+    Subset of std::string interface used by packets, but resize() and
+    alloc() leave new bytes uninitialized, so transfer buffers reused
+    from a pool are not zero-filled before data is read into them.
+  */
+class ByteBuffer
+{
+   public:
+   ByteBuffer() : mData(0), mSize(0), mCapacity(0) {}
+   ByteBuffer(const ByteBuffer& other) : mData(0), mSize(0), mCapacity(0) {
+      assign(other.mData, other.mSize);
+   }
+   ~ByteBuffer() {
+      free(mData);
+   }
+
+   ByteBuffer& operator=(const ByteBuffer& other) {
+      if(this != &other)
+         assign(other.mData, other.mSize);
+      return *this;
+   }
+
+   bool operator==(const ByteBuffer& other) const {
+      return mSize == other.mSize && (mSize == 0 || memcmp(mData, other.mData, mSize) == 0);
+   }
+
+   size_t size() const     { return mSize; }
+   size_t capacity() const { return mCapacity; }
+   const char* data() const { return mData; }
+   char& operator[](size_t pos) { return mData[pos]; }
+   char at(size_t pos) const { return mData[pos]; }
+
+   /** Drop contents, capacity is kept. */
+   void clear() {
+      mSize = 0;
+   }
+
+   /** Grow capacity to at least given size. */
+   void reserve(size_t size) {
+      if(size > mCapacity)
+         grow(size);
+   }
+
+   /** Set size, new bytes are uninitialized. */
+   void resize(size_t size) {
+      if(size > mCapacity)
+         grow((size < 2 * mCapacity) ? 2 * mCapacity : size);
+      mSize = size;
+   }
+
+   void assign(const char* data, size_t size) {
+      resize(size);
+      if(size > 0)
+         memcpy(mData, data, size);
+   }
+
+   void append(const char* data, size_t size) {
+      size_t pos = mSize;
+      resize(pos + size);
+      if(size > 0)
+         memcpy(mData + pos, data, size);
+   }
+
+   void append(size_t count, char ch) {
+      size_t pos = mSize;
+      resize(pos + count);
+      memset(mData + pos, ch, count);
+   }
+
+   void push_back(char ch) {
+      append(1, ch);
+   }
+
+   void swap(ByteBuffer& other) {
+      std::swap(mData, other.mData);
+      std::swap(mSize, other.mSize);
+      std::swap(mCapacity, other.mCapacity);
+   }
+
+   private:
+   void grow(size_t size);
+
+   char* mData;
+   size_t mSize, mCapacity;
+};
 
 /** Class contains data in given BER structure (block).
     Suitable for reading and writing blocks, TLV attributes, raw values.
+    Data are only appended to the shared buffer, block length is written
+    to a fixed-size slot reserved at block start and patched on finalize(),
+    so building nested blocks takes linear time.
   */
 class Struct
 {
    public:
    Struct(ByteBuffer& sharedbuf, int pos = -1);
+   virtual ~Struct() {}
 
    /** Return block size. */
    virtual size_t size() {
@@ -88,25 +180,28 @@ class Struct
 
    /** Push raw byte. */
    Struct& push(char ch) {
-      mBuf.insert(mCursor, 1, (char) ch);
+      mBuf.push_back(ch);
       ++mSize; ++mCursor;
       return *this;
    }
 
+   /** Reserve fixed-size length slot, see finalize(). */
+   Struct& reserveSlot();
+
    /** Write encoded length. */
    Struct& pushPacked(uint32_t val);
 
    /** Append raw data. */
    Struct& append(const char* str, size_t size = 0);
 
-   /** Finalize block, insert block size in header. */
+   /** Finalize block, write block size to reserved slot. */
    Struct& finalize();
 
    /** Begin new block. */
    Struct writeBlock(uint8_t type = InvalidType) {
       Struct block(mBuf, mBuf.size());
       if(type != InvalidType)
-         block.push(type);
+         block.push(type).reserveSlot();
       return block;
    }
 
@@ -126,6 +221,21 @@ class Struct
    /** Add raw data. */
    Struct& addData(const char* data, size_t size, uint8_t type = RawType);
 
+   /** Append uninitialized data to be written in place.
+     * \return ptr to data, valid until next append
+     */
+   char* alloc(size_t size);
+
+   /** Drop data from given position to the end.
+     * \param pos currentPos() before the dropped data was added
+     */
+   Struct& truncate(int pos);
+
+   /** Return ptr to data at given position, valid until next append. */
+   char* at(int pos) {
+      return &mBuf[pos];
+   }
+
    /** Append 8bit long unsigned integer. */
    Struct& addUInt8(uint8_t val) {
       return addNumeric(UnsignedType, 1, val);
@@ -161,9 +271,17 @@ class Struct
       mBuf = buf;
    }
 
+   /** Start block at given position, drops block state. */
+   void restart(int pos) {
+      mPos = mCursor = pos;
+      mSize = 0;
+      mSlot = -1;
+   }
+
    private:
       ByteBuffer& mBuf;
       int mPos, mCursor, mSize;
+      int mSlot; // Length slot position or -1
 };
 
 
@@ -274,11 +392,15 @@ class Packet : public Struct
 {
    public:
 
-   /** Create on new/existing buffer. */
-   Packet(uint8_t op = InvalidType)
-      : Struct(mBuf, 0) {
+   /** Create on new/existing buffer.
+     * \param op packet opcode
+     * \param id request id, replies carry id of the request
+     */
+   Packet(uint8_t op = InvalidType, uint16_t id = 0)
+      : Struct(mBuf, 0), mId(id) {
       if(op != InvalidType) {
-         push(op);
+         mBuf.reserve(InitialSize);
+         push(op).reserveSlot();
       }
    }
 
@@ -287,11 +409,43 @@ class Packet : public Struct
       return mBuf.at(0);
    }
 
+   /** Return request id. */
+   uint16_t id() {
+      return mId;
+   }
+
+   /** Set request id. */
+   void setId(uint16_t id) {
+      mId = id;
+   }
+
    /** Clear buffered data. */
    void clear() {
       mBuf.clear();
    }
 
+   /** Start new packet, buffer capacity is kept. */
+   Packet& reset(uint8_t op, uint16_t id = 0) {
+      mBuf.clear();
+      restart(0);
+      mId = id;
+      push(op).reserveSlot();
+      return *this;
+   }
+
+   /** Swap buffer storage with given buffer.
+     * Used to borrow preallocated storage and return it after use.
+     */
+   void swapBuffer(ByteBuffer& buf) {
+      mBuf.swap(buf);
+   }
+
+   /** Swap contents with other packet (no copy). */
+   void swap(Packet& other) {
+      mBuf.swap(other.mBuf);
+      std::swap(mId, other.mId);
+   }
+
    /** Returns total packet size. */
    size_t size() {
       return mBuf.size();
@@ -302,17 +456,61 @@ class Packet : public Struct
       return mBuf.data();
    }
 
+   /** Return payload, opcode and length are skipped. */
+   const char* payload() {
+      return mBuf.data() + headerSize();
+   }
+
+   /** Return payload size. */
+   uint32_t payloadSize() {
+      return mBuf.size() - headerSize();
+   }
+
+   /** Append fixed-layout message.
+     * Message type provides schema_size() and schema_pack(),
+     * see usbschema.h.
+     */
+   template <class M> Packet& addMessage(const M& msg) {
+      schema_pack(alloc(schema_size(msg)), msg);
+      return *this;
+   }
+
+   /** Read fixed-layout message from payload.
+     * \return true on success, false if payload is too short
+     */
+   template <class M> bool getMessage(M& msg) {
+      return schema_unpack(payload(), payloadSize(), msg);
+   }
+
    /** Hex-dump current data (debugging). */
    void dump();
 
-   /** Receive packet from socket. */
-   int recv(int fd);
-
-   /** Send packet to socket. */
-   int send(int fd);
+   /** Receive packet from socket.
+     * Compressed payload is decompressed.
+     * \param fd source socket
+     * \param rb receive buffer, unbuffered if NULL
+     */
+   int recv(int fd, RecvBuf* rb = NULL);
+
+   /** Send packet to socket in a single write.
+     * \warning Only for packets created with opcode, not received ones.
+     * \param fd destination socket
+     * \param z compressor, payload is sent raw if NULL
+     * \param link use shared memory link attached to socket
+     * \return sent bytes, 0 on error
+     */
+   int send(int fd, Compressor* z = NULL, bool link = true);
 
    private:
-   std::string mBuf;
+   /** Return opcode and length size. */
+   uint32_t headerSize() {
+      uint32_t len = 0;
+      return sizeof(uint8_t) + unpack_size(mBuf.data() + 1, &len);
+   }
+
+   enum { InitialSize = 64 };
+   ByteBuffer mBuf;
+   uint16_t mId;
 };
 
 }
@@ -0,0 +1,462 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file shmlink.c
+    \brief Shared memory transport for local peers.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup proto
+    @{
+  */
+#define _GNU_SOURCE
+#include "shmlink.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+
+/** Maximum attachable socket descriptor. */
+#define SHMLINK_MAXFD 1024
+
+/** Polls before sleeping on empty or full ring. */
+#define SHMLINK_SPIN 256
+
+/** Sleep interval between hangup checks (ms). */
+#define SHMLINK_TIMEOUT 100
+
+/** Links attached to socket descriptors. */
+static ShmLink* __links[SHMLINK_MAXFD];
+
+/** Return ring data. */
+static inline char* ring_data(ShmRing* r)
+{
+   return (char*) r + sizeof(ShmRing);
+}
+
+/** Return object length for ring data size. */
+static inline uint32_t link_len(uint32_t size)
+{
+   return 2 * (sizeof(ShmRing) + size);
+}
+
+/** Map object and set up rings.
+  * Client writes to the first ring, server to the second.
+  */
+static ShmLink* link_map(int shm, uint32_t size, int server, int fd)
+{
+   uint32_t len = link_len(size);
+   char* base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, shm, 0);
+   if(base == MAP_FAILED)
+      return NULL;
+
+   ShmLink* link = malloc(sizeof(ShmLink));
+   link->base = base;
+   link->len = len;
+   link->size = size;
+   link->fd = fd;
+   ShmRing* first = (ShmRing*) base;
+   ShmRing* second = (ShmRing*) (base + len / 2);
+   link->tx = server ? second : first;
+   link->rx = server ? first : second;
+   return link;
+}
+
+/** Sleep on ring position while it has given value.
+  * \return 0 if link is closed or peer hung up
+  */
+static int ring_sleep(ShmLink* link, volatile uint32_t* pos, uint32_t val)
+{
+   struct timespec ts = { 0, SHMLINK_TIMEOUT * 1000000 };
+   syscall(SYS_futex, pos, FUTEX_WAIT, val, &ts, NULL, 0);
+   if(link->rx->closed || link->tx->closed)
+      return 0;
+
+   // Check socket hangup
+   struct pollfd pfd = { link->fd, POLLRDHUP, 0 };
+   if(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP|POLLRDHUP|POLLERR|POLLNVAL)))
+      return 0;
+
+   return 1;
+}
+
+/** Wake up sleeper on ring position. */
+static inline void ring_wake(volatile uint32_t* pos)
+{
+   syscall(SYS_futex, pos, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int shm_link_local(int fd)
+{
+   struct sockaddr_storage local, peer;
+   socklen_t llen = sizeof(local), plen = sizeof(peer);
+   if(getsockname(fd, (struct sockaddr*) &local, &llen) < 0 ||
+      getpeername(fd, (struct sockaddr*) &peer, &plen) < 0)
+      return 0;
+   if(local.ss_family != peer.ss_family)
+      return 0;
+
+   // Loopback or own address
+   switch(peer.ss_family) {
+   case AF_UNIX:
+      return 1;
+   case AF_INET: {
+      struct in_addr* l = &((struct sockaddr_in*) &local)->sin_addr;
+      struct in_addr* p = &((struct sockaddr_in*) &peer)->sin_addr;
+      return (ntohl(p->s_addr) >> 24) == 127 || l->s_addr == p->s_addr;
+   }
+   case AF_INET6: {
+      struct in6_addr* l = &((struct sockaddr_in6*) &local)->sin6_addr;
+      struct in6_addr* p = &((struct sockaddr_in6*) &peer)->sin6_addr;
+      return IN6_IS_ADDR_LOOPBACK(p) || memcmp(l, p, sizeof(struct in6_addr)) == 0;
+   }
+   default:
+      break;
+   }
+
+   return 0;
+}
+
+/** Find owner of TCP socket in /proc/net/tcp or tcp6 by its addresses.
+  * Addresses are printed as 32bit words in host byte-order.
+  * \return 1 if found
+  */
+static int tcp_owner(const char* path, const uint32_t* addr, const uint32_t* peer,
+                     int words, unsigned port, unsigned peerport, uid_t* uid)
+{
+   FILE* fp = fopen(path, "r");
+   if(fp == NULL)
+      return 0;
+
+   int found = 0;
+   char line[512];
+   while(!found && fgets(line, sizeof(line), fp) != NULL) {
+      char la[33], ra[33];
+      unsigned lp = 0, rp = 0, owner = 0;
+      if(sscanf(line, " %*d: %32[0-9A-Fa-f]:%x %32[0-9A-Fa-f]:%x %*x %*x:%*x %*x:%*x %*x %u",
+                la, &lp, ra, &rp, &owner) != 5)
+         continue;
+      if((int) strlen(la) != words * 8 || (int) strlen(ra) != words * 8 ||
+         lp != port || rp != peerport)
+         continue;
+
+      // Compare words
+      found = 1;
+      for(int i = 0; i < words && found; ++i) {
+         char lw[9], rw[9];
+         memcpy(lw, la + i * 8, 8);
+         memcpy(rw, ra + i * 8, 8);
+         lw[8] = rw[8] = '\0';
+         found = (uint32_t) strtoul(lw, NULL, 16) == addr[i] &&
+                 (uint32_t) strtoul(rw, NULL, 16) == peer[i];
+      }
+      if(found)
+         *uid = owner;
+   }
+
+   fclose(fp);
+   return found;
+}
+
+int shm_link_peer_uid(int fd, uid_t* uid)
+{
+   struct sockaddr_storage local, peer;
+   socklen_t llen = sizeof(local), plen = sizeof(peer);
+   if(getsockname(fd, (struct sockaddr*) &local, &llen) < 0 ||
+      getpeername(fd, (struct sockaddr*) &peer, &plen) < 0)
+      return 0;
+
+   // Peer socket is local, so its addresses are ours swapped
+   switch(peer.ss_family) {
+   case AF_UNIX: {
+      struct ucred cred;
+      socklen_t len = sizeof(cred);
+      if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+         return 0;
+      *uid = cred.uid;
+      return 1;
+   }
+   case AF_INET: {
+      struct sockaddr_in* l = (struct sockaddr_in*) &local;
+      struct sockaddr_in* p = (struct sockaddr_in*) &peer;
+      return tcp_owner("/proc/net/tcp", &p->sin_addr.s_addr, &l->sin_addr.s_addr, 1,
+                       ntohs(p->sin_port), ntohs(l->sin_port), uid);
+   }
+   case AF_INET6: {
+      struct sockaddr_in6* l = (struct sockaddr_in6*) &local;
+      struct sockaddr_in6* p = (struct sockaddr_in6*) &peer;
+      return tcp_owner("/proc/net/tcp6", p->sin6_addr.s6_addr32, l->sin6_addr.s6_addr32, 4,
+                       ntohs(p->sin6_port), ntohs(l->sin6_port), uid);
+   }
+   default:
+      break;
+   }
+
+   return 0;
+}
+
+ShmLink* shm_link_create(char* name, uint32_t size, int fd)
+{
+   // Size must be power of two
+   if(size == 0 || (size & (size - 1)) != 0)
+      return NULL;
+
+   // Create unique object
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   snprintf(name, SHMLINK_NAMELEN, SHMLINK_PREFIX "%d-%08lx", (int) getpid(),
+            (unsigned long) (ts.tv_nsec ^ ts.tv_sec ^ fd) & 0xffffffff);
+   int shm = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+   if(shm < 0) {
+      error_msg("%s: shm_open(%s) failed: %s", __func__, name, strerror(errno));
+      return NULL;
+   }
+
+   // Size and map object
+   ShmLink* link = NULL;
+   if(ftruncate(shm, link_len(size)) == 0)
+      link = link_map(shm, size, 0, fd);
+   close(shm);
+   if(link == NULL) {
+      shm_unlink(name);
+      return NULL;
+   }
+
+   // Initialize rings
+   memset(link->base, 0, sizeof(ShmRing));
+   memset(link->base + link->len / 2, 0, sizeof(ShmRing));
+   link->tx->size = link->rx->size = size;
+   debug_msg("created %s, %u bytes per ring", name, size);
+   return link;
+}
+
+ShmLink* shm_link_open(const char* name, int fd)
+{
+   // Accept only link objects
+   if(strncmp(name, SHMLINK_PREFIX, strlen(SHMLINK_PREFIX)) != 0 ||
+      strchr(name + 1, '/') != NULL || strlen(name) >= SHMLINK_NAMELEN)
+      return NULL;
+
+   // Peer must be local with known user
+   uid_t uid = 0;
+   if(!shm_link_local(fd) || !shm_link_peer_uid(fd, &uid)) {
+      debug_msg("refused %s, unknown local peer", name);
+      return NULL;
+   }
+
+   int shm = shm_open(name, O_RDWR, 0);
+   if(shm < 0) {
+      debug_msg("shm_open(%s) failed: %s", name, strerror(errno));
+      return NULL;
+   }
+
+   // Check object owner is the peer, size against ring header
+   struct stat st;
+   ShmLink* link = NULL;
+   ShmRing hdr;
+   if(fstat(shm, &st) == 0 && st.st_uid == uid && st.st_size >= (off_t) sizeof(ShmRing) &&
+      pread(shm, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+      uint32_t size = hdr.size;
+      if(size > 0 && (size & (size - 1)) == 0 && size <= (1 << 28) &&
+         st.st_size == (off_t) link_len(size))
+         link = link_map(shm, size, 1, fd);
+   }
+   close(shm);
+
+   // Header sizes may change later, link keeps its own
+   if(link != NULL)
+      debug_msg("opened %s, %u bytes per ring", name, link->size);
+
+   return link;
+}
+
+void shm_link_unlink(const char* name)
+{
+   shm_unlink(name);
+}
+
+void shm_link_close(ShmLink* link)
+{
+   link->tx->closed = link->rx->closed = 1;
+   __sync_synchronize();
+   ring_wake(&link->tx->tail);
+   ring_wake(&link->rx->head);
+   ring_wake(&link->tx->head);
+   ring_wake(&link->rx->tail);
+}
+
+void shm_link_free(ShmLink* link)
+{
+   if(link == NULL)
+      return;
+
+   shm_link_close(link);
+   munmap(link->base, link->len);
+   free(link);
+}
+
+int shm_link_attach(int fd, ShmLink* link)
+{
+   if(fd < 0 || fd >= SHMLINK_MAXFD)
+      return 0;
+
+   __links[fd] = link;
+   __sync_synchronize();
+   return 1;
+}
+
+ShmLink* shm_link_get(int fd)
+{
+   if(fd < 0 || fd >= SHMLINK_MAXFD)
+      return NULL;
+
+   return __links[fd];
+}
+
+uint32_t shm_link_write(ShmLink* link, const struct iovec* iov, int count)
+{
+   ShmRing* r = link->tx;
+   char* data = ring_data(r);
+   uint32_t size = link->size;
+   uint32_t mask = size - 1;
+   uint32_t head = r->head;
+   uint32_t sent = 0;
+   const char* src = count > 0 ? iov->iov_base : NULL;
+   size_t left = count > 0 ? iov->iov_len : 0;
+
+   while(count > 0) {
+
+      // Wait for space
+      uint32_t tail = r->tail;
+      uint32_t space = size - (head - tail);
+      int spin = 0;
+      while(space == 0) {
+         if(r->closed)
+            return 0;
+         if(++spin < SHMLINK_SPIN) {
+            __sync_synchronize();
+         }
+         else {
+            r->wwait = 1;
+            __sync_synchronize();
+            if(r->tail == tail && !ring_sleep(link, &r->tail, tail))
+               return 0;
+            r->wwait = 0;
+         }
+         tail = r->tail;
+         space = size - (head - tail);
+      }
+      if(space > size)
+         return 0;
+      __sync_synchronize();
+
+      // Copy as much as fits, across buffers
+      while(space > 0 && count > 0) {
+         uint32_t len = left < space ? left : space;
+         uint32_t off = head & mask;
+         uint32_t first = size - off < len ? size - off : len;
+         memcpy(data + off, src, first);
+         memcpy(data, src + first, len - first);
+         head += len;
+         sent += len;
+         space -= len;
+         src += len;
+         left -= len;
+         while(left == 0 && --count > 0) {
+            ++iov;
+            src = iov->iov_base;
+            left = iov->iov_len;
+         }
+      }
+
+      // Publish and wake consumer
+      __sync_synchronize();
+      r->head = head;
+      __sync_synchronize();
+      if(r->rwait)
+         ring_wake(&r->head);
+   }
+
+   return sent;
+}
+
+int shm_link_read(ShmLink* link, char* dst, uint32_t len, int flags)
+{
+   ShmRing* r = link->rx;
+   char* data = ring_data(r);
+   uint32_t size = link->size;
+   uint32_t mask = size - 1;
+   uint32_t tail = r->tail;
+
+   // Wait for data
+   uint32_t head = r->head;
+   int spin = 0;
+   while(head == tail) {
+      if(r->closed)
+         return 0;
+      if(flags & MSG_DONTWAIT) {
+         errno = EAGAIN;
+         return -1;
+      }
+      if(++spin < SHMLINK_SPIN) {
+         __sync_synchronize();
+      }
+      else {
+         r->rwait = 1;
+         __sync_synchronize();
+         if(r->head == head && !ring_sleep(link, &r->head, head))
+            return 0;
+         r->rwait = 0;
+      }
+      head = r->head;
+   }
+   __sync_synchronize();
+
+   // Corrupted positions
+   uint32_t avail = head - tail;
+   if(avail > size)
+      return 0;
+
+   // Copy available data
+   if(len > avail)
+      len = avail;
+   uint32_t off = tail & mask;
+   uint32_t first = size - off < len ? size - off : len;
+   memcpy(dst, data + off, first);
+   memcpy(dst + first, data, len - first);
+
+   // Release space and wake producer
+   __sync_synchronize();
+   r->tail = tail + len;
+   __sync_synchronize();
+   if(r->wwait)
+      ring_wake(&r->tail);
+
+   return len;
+}
+
+/** @} */
@@ -0,0 +1,150 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file shmlink.h
+    \brief Shared memory transport for local peers.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup proto
+    @{
+  */
+#pragma once
+#ifndef __shmlink_h__
+#define __shmlink_h__
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** \page shmlink_page
+    <h2>Shared memory link</h2>
+    Peers on the same host may replace the socket byte stream with
+    a pair of single-producer, single-consumer rings in a POSIX shared memory
+    object. Client creates the object and passes its name to the server
+    over the socket, both sides then attach the link to the socket descriptor
+    and send_full() / rbuf_fill() use the rings instead. Packet format doesn't change.
+    \code
+       ring (client -> server) | ring (server -> client)
+       ring = header(192B) | data(size)
+    \endcode
+    Positions are free-running byte counters, consumer sleeps on futex
+    when the ring is empty and producer when it's full.
+    The socket stays open and is only watched for hangup.
+  */
+
+/** Shared memory object name prefix. */
+#define SHMLINK_PREFIX "/usbnet-"
+
+/** Maximum object name length. */
+#define SHMLINK_NAMELEN 32
+
+/** Default ring data size. */
+#define SHMLINK_SIZE (1 << 20)
+
+/** Ring header in shared memory, data follows.
+  * Producer and consumer fields are on separate cache lines.
+  */
+typedef struct {
+   volatile uint32_t head;   //! Produced bytes
+   volatile uint32_t rwait;  //! Consumer is sleeping
+   char pad0[56];
+   volatile uint32_t tail;   //! Consumed bytes
+   volatile uint32_t wwait;  //! Producer is sleeping
+   char pad1[56];
+   uint32_t size;            //! Data size, power of two
+   volatile uint32_t closed; //! Link closed by peer
+   char pad2[56];
+} ShmRing;
+
+/** Shared memory link, local mapping of both rings.
+  */
+typedef struct ShmLink {
+   char* base;     //! Mapped object
+   uint32_t len;   //! Mapped length
+   uint32_t size;  //! Ring data size
+   ShmRing* rx;    //! Incoming ring
+   ShmRing* tx;    //! Outgoing ring
+   int fd;         //! Connection socket, watched for hangup
+} ShmLink;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Return 1 if socket peer is on the same host.
+  */
+int shm_link_local(int fd);
+
+/** Find user of local socket peer.
+  * Unix socket peer is read from SO_PEERCRED, TCP peer from /proc/net.
+  * \return 1 if found
+  */
+int shm_link_peer_uid(int fd, uid_t* uid);
+
+/** Create shared memory object and link (client side).
+  * \param name object name buffer, at least SHMLINK_NAMELEN
+  * \param size ring data size, power of two
+  * \return link or NULL on error
+  */
+ShmLink* shm_link_create(char* name, uint32_t size, int fd);
+
+/** Open shared memory object created by peer (server side).
+  * Name must start with SHMLINK_PREFIX, object size must match ring headers,
+  * peer must be local and own the object.
+  * \return link or NULL on error
+  */
+ShmLink* shm_link_open(const char* name, int fd);
+
+/** Remove shared memory object name, mappings stay valid.
+  */
+void shm_link_unlink(const char* name);
+
+/** Mark link closed and wake up sleeping peer and local threads.
+  */
+void shm_link_close(ShmLink* link);
+
+/** Close and unmap link.
+  */
+void shm_link_free(ShmLink* link);
+
+/** Attach link to socket descriptor, NULL detaches.
+  * Sends on attached descriptor are written to the link.
+  * \return 1 on success, 0 if descriptor is out of range
+  */
+int shm_link_attach(int fd, ShmLink* link);
+
+/** Return link attached to socket descriptor or NULL.
+  */
+ShmLink* shm_link_get(int fd);
+
+/** Write buffers to outgoing ring, block while it's full.
+  * \return written bytes, 0 on closed link
+  */
+uint32_t shm_link_write(ShmLink* link, const struct iovec* iov, int count);
+
+/** Read available data from incoming ring, block while it's empty.
+  * \param flags MSG_DONTWAIT for non-blocking read
+  * \return read bytes, 0 on closed link, -1 with errno EAGAIN if empty
+  */
+int shm_link_read(ShmLink* link, char* dst, uint32_t len, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __shmlink_h__
+/** @} */
@@ -0,0 +1,181 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file trace.c
+    \brief Packet trace recording and reading.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup proto
+    @{
+  */
+#include "trace.h"
+#include "common.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/** Return clock time (ns). */
+static uint64_t trace_clock(clockid_t clk)
+{
+   struct timespec ts;
+   clock_gettime(clk, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Return payload padding to 8B. */
+static uint32_t trace_pad(uint32_t len)
+{
+   return (8 - (len & 7)) & 7;
+}
+
+int trace_open(TraceWriter* t, const char* path)
+{
+   t->fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+   if(t->fd < 0) {
+      error_msg("%s: unable to open '%s'", __func__, path);
+      return 0;
+   }
+
+   // Write header to new trace
+   struct stat st;
+   if(fstat(t->fd, &st) == 0 && st.st_size == 0) {
+      TraceHeader hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+      hdr.version = TRACE_VERSION;
+      hdr.start = trace_clock(CLOCK_REALTIME);
+      if(write(t->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+         error_msg("%s: unable to write '%s'", __func__, path);
+         close(t->fd);
+         t->fd = -1;
+         return 0;
+      }
+   }
+
+   pthread_mutex_init(&t->lock, NULL);
+   return 1;
+}
+
+void trace_close(TraceWriter* t)
+{
+   if(t->fd < 0)
+      return;
+
+   pthread_mutex_lock(&t->lock);
+   close(t->fd);
+   t->fd = -1;
+   pthread_mutex_unlock(&t->lock);
+   pthread_mutex_destroy(&t->lock);
+}
+
+void trace_write(TraceWriter* t, uint32_t session, uint8_t dir, uint8_t op, uint16_t id,
+                 const char* payload, uint32_t len)
+{
+   TraceRecord rec;
+   memset(&rec, 0, sizeof(rec));
+   rec.session = session;
+   rec.len = len;
+   rec.id = id;
+   rec.op = op;
+   rec.dir = dir;
+
+   // Single append per record, timestamps ordered by lock
+   static const char pad[8] = { 0 };
+   struct iovec iov[3];
+   iov[0].iov_base = &rec;
+   iov[0].iov_len = sizeof(rec);
+   iov[1].iov_base = (void*) payload;
+   iov[1].iov_len = len;
+   iov[2].iov_base = (void*) pad;
+   iov[2].iov_len = trace_pad(len);
+   pthread_mutex_lock(&t->lock);
+   if(t->fd >= 0) {
+      rec.time = trace_clock(CLOCK_MONOTONIC);
+      if(writev(t->fd, iov, 3) < 0)
+         error_msg("%s: write failed", __func__);
+   }
+   pthread_mutex_unlock(&t->lock);
+}
+
+int trace_map(TraceReader* r, const char* path)
+{
+   memset(r, 0, sizeof(TraceReader));
+   int fd = open(path, O_RDONLY);
+   if(fd < 0) {
+      error_msg("%s: unable to open '%s'", __func__, path);
+      return 0;
+   }
+
+   // Map whole file
+   struct stat st;
+   void* base = MAP_FAILED;
+   if(fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(TraceHeader))
+      base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(base == MAP_FAILED) {
+      error_msg("%s: unable to map '%s'", __func__, path);
+      return 0;
+   }
+
+   // Check header
+   const TraceHeader* hdr = (const TraceHeader*) base;
+   if(memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != TRACE_VERSION) {
+      error_msg("%s: '%s' is not a version %u trace", __func__, path, TRACE_VERSION);
+      munmap(base, st.st_size);
+      return 0;
+   }
+
+   r->base = (const char*) base;
+   r->len = st.st_size;
+   r->pos = sizeof(TraceHeader);
+   return 1;
+}
+
+void trace_unmap(TraceReader* r)
+{
+   if(r->base != NULL)
+      munmap((void*) r->base, r->len);
+   r->base = NULL;
+   r->len = r->pos = 0;
+}
+
+const TraceRecord* trace_next(TraceReader* r)
+{
+   if(r->pos + sizeof(TraceRecord) > r->len)
+      return NULL;
+
+   // Check payload bounds
+   const TraceRecord* rec = (const TraceRecord*) (r->base + r->pos);
+   uint64_t next = r->pos + sizeof(TraceRecord) + rec->len + trace_pad(rec->len);
+   if(next > r->len)
+      return NULL;
+
+   r->pos = next;
+   return rec;
+}
+
+void trace_rewind(TraceReader* r)
+{
+   r->pos = sizeof(TraceHeader);
+}
+
+/** @} */
@@ -0,0 +1,137 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file trace.h
+    \brief Packet trace recording and reading.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup proto
+    @{
+  */
+#pragma once
+#ifndef __trace_h__
+#define __trace_h__
+#include <stdint.h>
+#include <pthread.h>
+
+/** \page trace_page
+    <h2>Packet traces</h2>
+    Trace is an append-only file of exchanged packets, written in host
+    byte-order so it can be memory-mapped and read in place.
+    \code
+       header(24B)  = magic(8B) | version(4B) | reserved(4B) | start(8B, realtime ns)
+       record(24B)  = time(8B) | session(4B) | len(4B) | id(2B) | op(1B) | dir(1B) | reserved(4B)
+       record       = record header | payload (len B) | padding to 8B
+    \endcode
+    Record time is system-wide monotonic time (ns), so records of sessions
+    appended later or by other processes on the same host share time base.
+    Session identifies connection (server records client socket, client
+    its process id), TraceClose record marks its end. Payloads are recorded
+    uncompressed.
+  */
+
+/** Trace file magic. */
+#define TRACE_MAGIC "USBNETTR"
+
+/** Trace format version. */
+#define TRACE_VERSION 3
+
+/** Record direction. */
+typedef enum {
+   TraceRequest = 0, //! Client to server
+   TraceReply   = 1, //! Server to client
+   TraceClose   = 2  //! Session closed, no payload
+} TraceDir;
+
+/** Trace file header. */
+typedef struct {
+   char magic[8];
+   uint32_t version;
+   uint32_t reserved;
+   uint64_t start;
+} TraceHeader;
+
+/** Trace record header, payload follows. */
+typedef struct {
+   uint64_t time;
+   uint32_t session;
+   uint32_t len;
+   uint16_t id;
+   uint8_t op;
+   uint8_t dir;
+   uint32_t reserved;
+} TraceRecord;
+
+/** Trace writer, thread-safe. */
+typedef struct {
+   int fd;                //! Trace file, -1 if closed
+   pthread_mutex_t lock;  //! Serializes records
+} TraceWriter;
+
+/** Memory-mapped trace. */
+typedef struct {
+   const char* base;      //! Mapped file
+   uint64_t len;          //! Mapped length
+   uint64_t pos;          //! Next record offset
+} TraceReader;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Open trace for appending, header is written to empty file.
+  * \return 1 on success, 0 on error
+  */
+int trace_open(TraceWriter* t, const char* path);
+
+/** Close trace.
+  */
+void trace_close(TraceWriter* t);
+
+/** Append record.
+  * \param session connection identifier
+  * \param dir TraceDir
+  * \param payload uncompressed payload
+  */
+void trace_write(TraceWriter* t, uint32_t session, uint8_t dir, uint8_t op, uint16_t id,
+                 const char* payload, uint32_t len);
+
+/** Map trace for reading.
+  * \return 1 on success, 0 on error
+  */
+int trace_map(TraceReader* r, const char* path);
+
+/** Unmap trace.
+  */
+void trace_unmap(TraceReader* r);
+
+/** Return next record or NULL at the end, payload follows the record.
+  * Truncated record at the end is ignored.
+  */
+const TraceRecord* trace_next(TraceReader* r);
+
+/** Restart reading from first record.
+  */
+void trace_rewind(TraceReader* r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __trace_h__
+/** @} */
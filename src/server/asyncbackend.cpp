@@ -0,0 +1,182 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file asyncbackend.cpp
+    \brief Asynchronous device access backend.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "asyncbackend.hpp"
+#include <sys/time.h>
+
+/** Maximum event wait of a thread waiting for its transfer (ms). */
+static const int WaitSlice = 100;
+
+/** Synchronous transfer state. */
+struct SyncTransfer {
+   pthread_mutex_t* lock;
+   pthread_cond_t* cond;
+   bool done;
+};
+
+AsyncBackend::AsyncBackend()
+   : mHandling(false), mDeferred(false), mReady(NULL), mReadyArg(NULL)
+{
+   pthread_mutex_init(&mLock, NULL);
+   pthread_cond_init(&mCond, NULL);
+}
+
+AsyncBackend::~AsyncBackend()
+{
+   pthread_mutex_destroy(&mLock);
+   pthread_cond_destroy(&mCond);
+}
+
+void AsyncBackend::setReady(void (*ready)(void*), void* arg)
+{
+   pthread_mutex_lock(&mLock);
+   mReady = ready;
+   mReadyArg = arg;
+   pthread_mutex_unlock(&mLock);
+}
+
+bool AsyncBackend::handleEvents(int timeout)
+{
+   pthread_mutex_lock(&mLock);
+
+   // Other thread is handling events, don't block,
+   // it calls ready function when it's done
+   if(mHandling && timeout <= 0) {
+      mDeferred = true;
+      pthread_mutex_unlock(&mLock);
+      return false;
+   }
+
+   // Other thread is handling events, wait until it's done,
+   // pending events would keep level-triggered event fd readable
+   if(mHandling) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      long usec = now.tv_usec + (timeout % 1000) * 1000;
+      struct timespec ts = { now.tv_sec + timeout / 1000 + usec / 1000000,
+                             (usec % 1000000) * 1000 };
+      while(mHandling) {
+         if(pthread_cond_timedwait(&mCond, &mLock, &ts) != 0)
+            break;
+      }
+      pthread_mutex_unlock(&mLock);
+      return true;
+   }
+
+   // Handle events
+   mHandling = true;
+   pthread_mutex_unlock(&mLock);
+   processEvents(timeout);
+   pthread_mutex_lock(&mLock);
+   finish();
+   pthread_mutex_unlock(&mLock);
+   return true;
+}
+
+void AsyncBackend::finish()
+{
+   mHandling = false;
+   pthread_cond_broadcast(&mCond);
+
+   // Deferred events may be handled again
+   if(mDeferred && mReady != NULL) {
+      mDeferred = false;
+      pthread_mutex_unlock(&mLock);
+      mReady(mReadyArg);
+      pthread_mutex_lock(&mLock);
+   }
+}
+
+void AsyncBackend::wake(UsbTransfer* t)
+{
+   SyncTransfer* sync = (SyncTransfer*) t->data;
+   pthread_mutex_lock(sync->lock);
+   sync->done = true;
+   pthread_cond_broadcast(sync->cond);
+   pthread_mutex_unlock(sync->lock);
+}
+
+int AsyncBackend::transfer(usb_dev_handle* h, int type, int ep, char* bytes, int size, int timeout)
+{
+   // Submit
+   SyncTransfer sync = { &mLock, &mCond, false };
+   UsbTransfer t = { h, type, ep, bytes, size, timeout, 0, &AsyncBackend::wake, &sync, NULL };
+   int res = submit(&t);
+   if(res < 0)
+      return res;
+
+   // Wait for completion, handle events if no other thread does
+   pthread_mutex_lock(&mLock);
+   mSync[h] = &t;
+   while(!sync.done) {
+      if(mHandling) {
+         pthread_cond_wait(&mCond, &mLock);
+         continue;
+      }
+
+      mHandling = true;
+      pthread_mutex_unlock(&mLock);
+      processEvents(WaitSlice);
+      pthread_mutex_lock(&mLock);
+      finish();
+   }
+   mSync.erase(h);
+   pthread_mutex_unlock(&mLock);
+
+   return t.res;
+}
+
+int AsyncBackend::abort(usb_dev_handle* h)
+{
+   // Transfer is valid until its caller leaves, cancel completes it later
+   int res = -ENOENT;
+   pthread_mutex_lock(&mLock);
+   std::map<usb_dev_handle*, UsbTransfer*>::iterator i = mSync.find(h);
+   if(i != mSync.end())
+      res = cancel(i->second);
+   pthread_mutex_unlock(&mLock);
+   return res;
+}
+
+int AsyncBackend::bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_BULK, ep | USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+int AsyncBackend::bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_BULK, ep & ~USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+int AsyncBackend::interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_INTERRUPT, ep | USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+int AsyncBackend::interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_INTERRUPT, ep & ~USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+/** @} */
@@ -0,0 +1,85 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file asyncbackend.hpp
+    \brief Asynchronous device access backend.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __asyncbackend_hpp__
+#define __asyncbackend_hpp__
+#include "usbbackend.hpp"
+#include <map>
+#include <pthread.h>
+
+/** Backend built on submitted transfers.
+  * Synchronous bulk and interrupt calls submit a transfer and wait
+  * for its completion. Events are handled by one thread at a time,
+  * a waiting thread handles events itself if no other thread does,
+  * so transfers complete with or without an event loop.
+  */
+class AsyncBackend : public UsbBackend
+{
+   public:
+   AsyncBackend();
+   virtual ~AsyncBackend();
+
+   int bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+
+   bool async() { return true; }
+   int abort(usb_dev_handle* h);
+   bool handleEvents(int timeout = 0);
+   void setReady(void (*ready)(void*), void* arg);
+
+   protected:
+
+   /** Wait for events up to timeout and complete finished transfers.
+     * Called by one thread at a time, callbacks are called from it.
+     * \param timeout maximum wait (ms), 0 doesn't block
+     */
+   virtual void processEvents(int timeout) = 0;
+
+   private:
+
+   /** Submit transfer and wait for completion. */
+   int transfer(usb_dev_handle* h, int type, int ep, char* bytes, int size, int timeout);
+
+   /** Completion of synchronous transfer. */
+   static void wake(UsbTransfer* t);
+
+   /** End event handling, call ready function if events were deferred.
+     * \warning Call with mLock held, it's released while calling ready function.
+     */
+   void finish();
+
+   pthread_mutex_t mLock;
+   pthread_cond_t mCond;  // Signalled on completion and handler change
+   bool mHandling;        // A thread is handling events
+   bool mDeferred;        // Events were left to handling thread
+   void (*mReady)(void*); // Called when deferred events may be handled
+   void* mReadyArg;
+   std::map<usb_dev_handle*, UsbTransfer*> mSync; // Synchronous calls in progress
+};
+
+#endif // __asyncbackend_hpp__
+/** @} */
@@ -0,0 +1,209 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file deviceprogram.cpp
+    \brief Sandboxed device program interpreter.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "deviceprogram.hpp"
+#include "common.h"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+/** Read/write little-endian values. */
+static inline uint32_t get_le(const char* p, int len)
+{
+   uint32_t v = 0;
+   for(int i = len - 1; i >= 0; --i)
+      v = (v << 8) | (uint8_t) p[i];
+   return v;
+}
+
+static inline void put_le(char* p, int len, uint32_t v)
+{
+   for(int i = 0; i < len; ++i, v >>= 8)
+      p[i] = (char) (v & 0xff);
+}
+
+DeviceProgram::DeviceProgram(UsbBackend* backend, usb_dev_handle* h, int timeout, uint32_t endpoints)
+   : mBackend(backend), mHandle(h), mTimeout(timeout), mEndpoints(endpoints), mCode(NULL), mCount(0),
+     mMem(NULL), mMemSize(0), mResult(0), mPc(0), mSteps(0)
+{
+   memset(mReg, 0, sizeof(mReg));
+}
+
+bool DeviceProgram::load(const char* code, uint32_t codesize, char* mem, uint32_t memsize)
+{
+   // Check sizes
+   if(codesize == 0 || codesize % ProgInsnSize != 0 || memsize > ProgMaxMem)
+      return false;
+
+   mCode = code;
+   mCount = codesize / ProgInsnSize;
+   mMem = mem;
+   mMemSize = memsize;
+   return true;
+}
+
+char* DeviceProgram::at(int32_t pos, int32_t len)
+{
+   if(pos < 0 || len < 0 || (uint32_t) pos > mMemSize || (uint32_t) len > mMemSize - pos)
+      return NULL;
+
+   return mMem + pos;
+}
+
+long DeviceProgram::elapsed()
+{
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - mStart.tv_sec) * 1000 + (now.tv_usec - mStart.tv_usec) / 1000;
+}
+
+int DeviceProgram::run(uint32_t steps)
+{
+   if(steps == 0 || steps > ProgMaxSteps)
+      steps = ProgMaxSteps;
+
+   gettimeofday(&mStart, NULL);
+   mPc = mSteps = 0;
+   mResult = 0;
+   while(mPc < mCount) {
+
+      // Check budget
+      if(mSteps++ >= steps)
+         return -ETIMEDOUT;
+
+      // Decode instruction
+      const char* insn = mCode + mPc * ProgInsnSize;
+      uint8_t op = schema_get_u8(insn);
+      uint8_t a = schema_get_u8(insn + 1);
+      uint16_t b = schema_get_u16(insn + 2);
+      int32_t imm = schema_get_i32(insn + 4);
+      if(a >= ProgRegs)
+         return -EINVAL;
+
+      int32_t& r = mReg[a];
+      uint32_t next = mPc + 1;
+      char* p = NULL;
+      switch(op) {
+
+      // Registers
+      case ProgEnd:
+         mResult = r;
+         return 0;
+      case ProgSet:
+         r = imm;
+         break;
+      case ProgAdd:
+         r += imm;
+         break;
+      case ProgAnd:
+         r &= imm;
+         break;
+
+      // Memory
+      case ProgLoad8:
+      case ProgLoad16:
+      case ProgLoad32: {
+         int len = 1 << (op - ProgLoad8);
+         if((p = at(imm, len)) == NULL)
+            return -EFAULT;
+         r = get_le(p, len);
+      }  break;
+      case ProgStore8:
+      case ProgStore16:
+      case ProgStore32: {
+         int len = 1 << (op - ProgStore8);
+         if((p = at(imm, len)) == NULL)
+            return -EFAULT;
+         put_le(p, len, r);
+      }  break;
+
+      // Control flow
+      case ProgJumpLess:
+         if(b >= ProgRegs)
+            return -EINVAL;
+         if(r < mReg[b])
+            next = imm;
+         break;
+      case ProgJump:
+         next = imm;
+         break;
+      case ProgJumpZero:
+         if(r == 0)
+            next = imm;
+         break;
+      case ProgJumpNonZero:
+         if(r != 0)
+            next = imm;
+         break;
+
+      // Transfers
+      case ProgControl: {
+         char* setup = at(b, 8);
+         if(setup == NULL)
+            return -EFAULT;
+         int size = get_le(setup + 6, 2);
+         if((p = at(imm, size)) == NULL)
+            return -EFAULT;
+         r = mBackend->controlMsg(mHandle, (uint8_t) setup[0], (uint8_t) setup[1],
+                                  get_le(setup + 2, 2), get_le(setup + 4, 2),
+                                  p, size, mTimeout);
+      }  break;
+      case ProgBulk:
+      case ProgInterrupt: {
+         if((p = at(imm, r)) == NULL)
+            return -EFAULT;
+         // Endpoint not active fails transfer, as call on device would
+         int ep = b & 0xff;
+         if(!(mEndpoints & (1U << usb_epindex(ep))))
+            r = -ENOENT;
+         else if(op == ProgBulk)
+            r = (ep & USB_ENDPOINT_IN) ? mBackend->bulkRead(mHandle, ep, p, r, mTimeout)
+                                       : mBackend->bulkWrite(mHandle, ep, p, r, mTimeout);
+         else
+            r = (ep & USB_ENDPOINT_IN) ? mBackend->interruptRead(mHandle, ep, p, r, mTimeout)
+                                       : mBackend->interruptWrite(mHandle, ep, p, r, mTimeout);
+      }  break;
+      case ProgSleep:
+         if(imm < 0 || imm > ProgMaxSleep)
+            return -EINVAL;
+         usleep(imm);
+         break;
+
+      default:
+         return -EINVAL;
+      }
+
+      // Check jump target and time
+      if(next >= mCount && op >= ProgJump && op <= ProgJumpLess)
+         return -EINVAL;
+      if(op >= ProgControl && elapsed() > ProgMaxTime)
+         return -ETIMEDOUT;
+
+      mPc = next;
+   }
+
+   // Ran past last instruction
+   return -EINVAL;
+}
+/** @} */
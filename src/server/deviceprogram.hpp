@@ -0,0 +1,97 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file deviceprogram.hpp
+    \brief Sandboxed device program interpreter.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __deviceprogram_hpp__
+#define __deviceprogram_hpp__
+#include "usbbackend.hpp"
+#include <sys/time.h>
+#include "usbprogram.h"
+
+/** Interpreter of client programs, see usbprogram.h.
+  * Program has access only to its memory and the open device,
+  * every memory access and jump is checked, run is bounded
+  * by instruction budget and total time.
+  */
+class DeviceProgram
+{
+   public:
+   /** Create interpreter on open device.
+     * \param endpoints mask of active endpoints, bit per usb_epindex()
+     */
+   DeviceProgram(UsbBackend* backend, usb_dev_handle* h, int timeout, uint32_t endpoints);
+
+   /** Load program.
+     * \param mem program memory, initialized by caller
+     * \return false if program is invalid
+     */
+   bool load(const char* code, uint32_t codesize, char* mem, uint32_t memsize);
+
+   /** Run loaded program.
+     * \param steps instruction budget, limited by ProgMaxSteps
+     * \return 0 when program ended, see result(), -EINVAL on invalid
+     *         instruction, -EFAULT on out of bounds access,
+     *         -ETIMEDOUT when out of budget
+     */
+   int run(uint32_t steps);
+
+   /** Return program result, register of End instruction. */
+   int32_t result() {
+      return mResult;
+   }
+
+   /** Return last executed instruction. */
+   uint32_t pc() {
+      return mPc;
+   }
+
+   /** Return executed instructions. */
+   uint32_t steps() {
+      return mSteps;
+   }
+
+   private:
+
+   /** Return ptr to memory range or NULL if out of bounds. */
+   char* at(int32_t pos, int32_t len);
+
+   /** Return milliseconds since run start. */
+   long elapsed();
+
+   UsbBackend* mBackend;
+   usb_dev_handle* mHandle;
+   int mTimeout;
+   uint32_t mEndpoints;
+   const char* mCode;
+   uint32_t mCount;  // Instructions
+   char* mMem;
+   uint32_t mMemSize;
+   int32_t mReg[ProgRegs];
+   int32_t mResult;
+   uint32_t mPc, mSteps;
+   struct timeval mStart;
+};
+
+#endif // __deviceprogram_hpp__
+/** @} */
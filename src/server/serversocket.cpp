@@ -24,110 +24,230 @@
   */
 #include "serversocket.hpp"
 #include "common.h"
-#include <sys/poll.h>
+#include <map>
+#include <set>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+/** Client connection.
+  * Socket is closed when the connection is hung up and the last
+  * reference is released, so fd can't be reused while referenced.
+  */
+struct Connection
+{
+   int fd;
+   int refs;
+   RecvBuf rb; // Received data, event loop only
+};
 
 class ServerSocket::Private
 {
    public:
-   std::vector<struct pollfd> clients;
+   enum { MaxEvents = 64 };
+
+   int epfd;
+   pthread_mutex_t lock; // Guards connections
+   std::map<int, Connection*> conns;
+   std::set<int> watched; // Additional fds, event loop only
 };
 
 ServerSocket::ServerSocket(int fd)
    : Socket(fd), d(new Private)
 {
+   d->epfd = -1;
+   pthread_mutex_init(&d->lock, NULL);
 }
 
 ServerSocket::~ServerSocket()
 {
+   // Close remaining connections
+   std::map<int, Connection*>::iterator i;
+   for(i = d->conns.begin(); i != d->conns.end(); ++i) {
+      ::close(i->first);
+      rbuf_free(&i->second->rb);
+      delete i->second;
+   }
+
+   pthread_mutex_destroy(&d->lock);
    delete d;
 }
 
+bool ServerSocket::retain(int fd)
+{
+   bool found = false;
+   pthread_mutex_lock(&d->lock);
+   std::map<int, Connection*>::iterator i = d->conns.find(fd);
+   if(i != d->conns.end()) {
+      ++i->second->refs;
+      found = true;
+   }
+   pthread_mutex_unlock(&d->lock);
+   return found;
+}
+
+void ServerSocket::release(int fd)
+{
+   pthread_mutex_lock(&d->lock);
+   std::map<int, Connection*>::iterator i = d->conns.find(fd);
+   if(i != d->conns.end() && --i->second->refs == 0) {
+
+      // Close with last reference
+      rbuf_free(&i->second->rb);
+      delete i->second;
+      d->conns.erase(i);
+      ::close(fd);
+      debug_msg("closed socket fd %d", fd);
+   }
+   pthread_mutex_unlock(&d->lock);
+}
+
+void ServerSocket::watch(int fd)
+{
+   d->watched.insert(fd);
+}
+
+void ServerSocket::rearm(int fd)
+{
+   struct epoll_event ev;
+   ev.events = EPOLLIN|EPOLLONESHOT;
+   ev.data.fd = fd;
+   if(d->epfd >= 0)
+      epoll_ctl(d->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
 void ServerSocket::run()
 {
    log_msg("Server: running at %s:%d", host().c_str(), port());
 
-   // Append self to clients vector
-   std::vector<pollfd>::iterator it;
-   std::vector<pollfd> incoming;
-   struct pollfd self;
-   self.events = POLLIN; // Only reading
-   self.fd = sock();     // Server fd
-   incoming.push_back(self);
+   // Create reactor
+   if((d->epfd = epoll_create(Private::MaxEvents)) < 0) {
+      error_msg("Server: failed to create epoll instance");
+      return;
+   }
+
+   // Watch server socket, accept until drained
+   struct epoll_event ev;
+   ev.events = EPOLLIN|EPOLLET;
+   ev.data.fd = sock();
+   fcntl(sock(), F_SETFL, fcntl(sock(), F_GETFL) | O_NONBLOCK);
+   epoll_ctl(d->epfd, EPOLL_CTL_ADD, sock(), &ev);
+   log_msg("Server: listening on fd %d", sock());
+
+   // Watch additional fds
+   std::set<int>::iterator w;
+   for(w = d->watched.begin(); w != d->watched.end(); ++w) {
+      ev.events = EPOLLIN|EPOLLONESHOT;
+      ev.data.fd = *w;
+      epoll_ctl(d->epfd, EPOLL_CTL_ADD, *w, &ev);
+   }
 
    // Process event loop
+   bool busy = false;
+   struct epoll_event events[Private::MaxEvents];
    while(isOpen()) {
 
-      // Evaluate incoming sockets
-      if(!incoming.empty()) {
-         for(it = incoming.begin(); it != incoming.end(); ++it) {
-            if(it->fd == sock()) {
-               log_msg("Server: listening on fd %d", it->fd);
-            }
-            else {
-               log_msg("Server: client connected (socket fd %d)", it->fd);
-            }
-            d->clients.push_back(*it);
+      // Wait for events, don't block with pending work
+      int count = epoll_wait(d->epfd, events, Private::MaxEvents, busy ? 0 : -1);
+      for(int i = 0; i < count; ++i) {
+         int fd = events[i].data.fd;
+
+         // Server socket
+         if(fd == sock()) {
+            accept_all();
+            continue;
          }
-         incoming.clear();
-      }
 
-      // Poll clients
-      // Contiguity for std::vector is mandated by the standard [See 23.2.4./1]
-      if(poll(&d->clients[0], d->clients.size(), 1000) > 0)
-      {
-         // Check server for read
-         for(it = d->clients.begin(); it != d->clients.end(); ++it) {
-
-            // Incoming
-            if(it->revents & POLLIN) {
-
-               // Server socket
-               if(it->fd == d->clients[0].fd) {
-
-                  struct pollfd client;
-                  client.events = POLLIN;
-                  client.fd = accept();
-                  client.revents = 0;
-
-                  // Accept client
-                  if(client.fd > 0) {
-                     incoming.push_back(client);
-                  }
-               }
-               else {
-                  if(!read(it->fd))
-                     it->revents |= POLLHUP;
-               }
-            }
-
-            // Disconnect
-            if(it->revents & POLLHUP) {
-               log_msg("Server: client disconnected (socket fd %d)", it->fd);
-               d->clients.erase(it);
-               it = d->clients.begin();
-               continue;
-            }
+         // Watched fd
+         if(d->watched.count(fd) > 0) {
+            event(fd);
+            continue;
          }
+
+         // Incoming data, read all pending packets
+         bool hup = (events[i].events & (EPOLLHUP|EPOLLERR));
+         if(!hup && (events[i].events & EPOLLIN))
+            hup = !read(fd);
+
+         // Disconnect
+         if(hup || (events[i].events & EPOLLRDHUP))
+            hangup(fd);
       }
+
+      // Process pending work
+      busy = idle();
    }
 
-   // Stop server
+   // Stop reactor
+   ::close(d->epfd);
+   d->epfd = -1;
    log_msg("Server: stopped");
 }
 
-bool ServerSocket::read(int fd)
+void ServerSocket::accept_all()
+{
+   int fd = -1;
+   while(isOpen() && (fd = accept()) >= 0) {
+
+      // Disable TCP buffering, pushed packets must not wait for ACK
+      int flag = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+      // Register connection
+      Connection* conn = new Connection;
+      conn->fd = fd;
+      conn->refs = 1;
+      rbuf_init(&conn->rb, RECVBUF_SIZE);
+      pthread_mutex_lock(&d->lock);
+      d->conns[fd] = conn;
+      pthread_mutex_unlock(&d->lock);
+
+      // Watch client
+      struct epoll_event ev;
+      ev.events = EPOLLIN|EPOLLRDHUP|EPOLLET;
+      ev.data.fd = fd;
+      epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev);
+      log_msg("Server: client connected (socket fd %d)", fd);
+   }
+}
+
+void ServerSocket::hangup(int fd)
 {
-   Packet pkt;
+   // Stop watching and drop reactor reference
+   epoll_ctl(d->epfd, EPOLL_CTL_DEL, fd, NULL);
+   log_msg("Server: client disconnected (socket fd %d)", fd);
+   disconnected(fd);
+   release(fd);
+}
 
-   // Read packet
-   if(pkt.recv(fd) < 0) {
+bool ServerSocket::read(int fd)
+{
+   // Find connection
+   pthread_mutex_lock(&d->lock);
+   std::map<int, Connection*>::iterator i = d->conns.find(fd);
+   Connection* conn = (i != d->conns.end()) ? i->second : NULL;
+   pthread_mutex_unlock(&d->lock);
+   if(conn == NULL)
       return false;
-   }
 
-   // Handle incoming packet
-   handle(fd, pkt);
+   // Receive until drained, partial packet remains buffered
+   int res = 0;
+   while((res = rbuf_fill(fd, &conn->rb, MSG_DONTWAIT)) > 0) {
+
+      // Handle complete packets
+      while(rbuf_packet(&conn->rb) > 0) {
+         Packet pkt;
+         if(pkt.recv(fd, &conn->rb) < 0)
+            return false;
+
+         handle(fd, pkt);
+      }
+   }
 
-   return true;
+   return (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
 }
 
 /** @} */
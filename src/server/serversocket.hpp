@@ -29,7 +29,10 @@
 #include "protocol.hpp"
 using namespace Proto;
 
-/** Server socket reimplementation. */
+/** Server socket reimplementation.
+  * Event loop is an edge-triggered epoll reactor, client sockets are
+  * reference counted and closed when hung up and no longer referenced.
+  */
 class ServerSocket : public Socket
 {
    public:
@@ -41,13 +44,38 @@ class ServerSocket : public Socket
      */
    void run();
 
+   /** Watch additional fd in event loop, event() is called when readable.
+     * Fd is level-triggered and one-shot, it's disabled until rearm(),
+     * must be registered before run().
+     * \param fd watched fd
+     */
+   void watch(int fd);
+
+   /** Enable watched fd again after event(), may be called from any thread.
+     * \param fd watched fd
+     */
+   void rearm(int fd);
+
    protected:
 
    /** Handle incoming data.
+     * Reads all available data and handles complete packets.
      * \param fd
+     * \return false on closed connection or error
      */
    bool read(int fd);
 
+   /** Reference client socket, keeps it open after hangup.
+     * \param fd client socket fd
+     * \return false if client is not connected
+     */
+   bool retain(int fd);
+
+   /** Release client socket reference, last one closes the socket.
+     * \param fd client socket fd
+     */
+   void release(int fd);
+
    /** Handle incoming packet.
      * \param fd source fd
      * \param pkt incoming packet
@@ -55,8 +83,29 @@ class ServerSocket : public Socket
      */
    virtual bool handle(int fd, Packet& pkt) = 0;
 
+   /** Process pending work when there are no incoming events.
+     * \return true if more work is pending (event loop won't block)
+     */
+   virtual bool idle() { return false; }
+
+   /** Watched fd is readable, it's disabled until rearm().
+     * \param fd watched fd
+     */
+   virtual void event(int fd) {}
+
+   /** Client disconnected.
+     * \param fd client socket fd
+     */
+   virtual void disconnected(int fd) {}
+
    private:
 
+   /** Accept all pending clients. */
+   void accept_all();
+
+   /** Unregister disconnected client. */
+   void hangup(int fd);
+
    /* Opaque pointer */
    class Private;
    Private* d;
@@ -0,0 +1,353 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file serverstats.cpp
+    \brief Server call statistics.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "serverstats.hpp"
+#include <cstring>
+
+/** Device counters. */
+struct ServerStats::DeviceStats {
+   volatile uint64_t key;  // Bus location and devnum, 0 if free
+   uint16_t vendor, product;
+   Counters c;
+};
+
+ServerStats::ServerStats()
+   : mStart(time(NULL))
+{
+   mCalls = new CallStats[Calls];
+   memset((void*) mCalls, 0, Calls * sizeof(CallStats));
+   mDevices = new DeviceStats[Devices];
+   memset((void*) mDevices, 0, Devices * sizeof(DeviceStats));
+   pthread_key_create(&mKey, NULL);
+}
+
+ServerStats::~ServerStats()
+{
+   pthread_key_delete(mKey);
+   delete [] mDevices;
+   delete [] mCalls;
+}
+
+uint64_t ServerStats::now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void ServerStats::begin(Call& c, uint8_t op, uint32_t bytesin)
+{
+   memset(&c, 0, sizeof(Call));
+   c.op = op;
+   c.bytesin = bytesin;
+   c.outer = (Call*) pthread_getspecific(mKey);
+   pthread_setspecific(mKey, &c);
+   c.start = now();
+}
+
+void ServerStats::add(Counters& dst, const Call& c, uint64_t elapsed)
+{
+   __sync_fetch_and_add(&dst.calls, 1);
+   if(c.errors > 0)
+      __sync_fetch_and_add(&dst.errors, c.errors);
+   __sync_fetch_and_add(&dst.bytesin, c.bytesin);
+   __sync_fetch_and_add(&dst.bytesout, c.bytesout);
+   __sync_fetch_and_add(&dst.usbtime, c.usbtime);
+   __sync_fetch_and_add(&dst.totaltime, elapsed);
+}
+
+void ServerStats::end(Call& c)
+{
+   uint64_t elapsed = now() - c.start;
+   pthread_setspecific(mKey, c.outer);
+
+   // Enclosing call includes nested device calls
+   if(c.outer != NULL) {
+      c.outer->usbtime += c.usbtime;
+      c.outer->errors += c.errors;
+      if(c.outer->dev == NULL)
+         c.outer->dev = c.dev;
+   }
+
+   // Record call
+   unsigned index = (uint8_t) (c.op - CallType);
+   if(index < Calls) {
+      CallStats& s = mCalls[index];
+      add(s.c, c, elapsed);
+      __sync_fetch_and_add(&s.usb[stats_bucket(c.usbtime)], 1);
+      __sync_fetch_and_add(&s.total[stats_bucket(elapsed)], 1);
+   }
+
+   // Record device, nested calls are recorded by enclosing call
+   if(c.dev != NULL && c.outer == NULL)
+      add(c.dev->c, c, elapsed);
+}
+
+void ServerStats::device(usb_dev_handle* h, uint64_t elapsed, bool failed)
+{
+   Call* c = (Call*) pthread_getspecific(mKey);
+   if(c == NULL)
+      return;
+
+   c->usbtime += elapsed;
+   if(failed)
+      ++c->errors;
+   if(h != NULL)
+      c->dev = lookup(h);
+}
+
+void ServerStats::sent(uint32_t bytes)
+{
+   Call* c = (Call*) pthread_getspecific(mKey);
+   if(c != NULL)
+      c->bytesout += bytes;
+}
+
+ServerStats::DeviceStats* ServerStats::lookup(usb_dev_handle* h)
+{
+   // Key by physical device, survives reopening
+   uint32_t location = (h->bus != NULL) ? h->bus->location : 0;
+   uint8_t devnum = (h->device != NULL) ? h->device->devnum : 0;
+   uint64_t key = (((uint64_t) location << 8) | devnum) + 1;
+
+   // Find or claim entry
+   unsigned i = (location * 131 + devnum) % Devices;
+   for(int n = 0; n < Devices; ++n, i = (i + 1) % Devices) {
+      DeviceStats* d = &mDevices[i];
+      if(d->key == key)
+         return d;
+      if(d->key == 0 && __sync_bool_compare_and_swap(&d->key, 0, key)) {
+         if(h->device != NULL) {
+            d->vendor = h->device->descriptor.idVendor;
+            d->product = h->device->descriptor.idProduct;
+         }
+         return d;
+      }
+      if(d->key == key)
+         return d;
+   }
+
+   // Table full
+   return NULL;
+}
+
+/** Return counter value, optionally subtract it from counter. */
+static uint64_t take(volatile uint64_t* val, bool reset)
+{
+   uint64_t res = *val;
+   if(reset && res > 0)
+      __sync_fetch_and_sub(val, res);
+   return res;
+}
+
+void ServerStats::snapshot(Packet& pkt, bool reset)
+{
+   // Reply header is written after entries
+   int pos = pkt.currentPos();
+   pkt.alloc(UsbStatsRepSize);
+   UsbStatsRep rep = { (uint32_t) (time(NULL) - mStart), 0, 0, NULL, 0 };
+
+   // Calls with histograms, only non-empty buckets are written
+   uint64_t usb[StatsBuckets], total[StatsBuckets];
+   for(int i = 0; i < Calls; ++i) {
+      CallStats& s = mCalls[i];
+      if(s.c.calls == 0)
+         continue;
+
+      UsbStatsCallMsg msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.op = CallType + i;
+      msg.calls = take(&s.c.calls, reset);
+      msg.errors = take(&s.c.errors, reset);
+      msg.bytesin = take(&s.c.bytesin, reset);
+      msg.bytesout = take(&s.c.bytesout, reset);
+      msg.usbtime = take(&s.c.usbtime, reset);
+      msg.totaltime = take(&s.c.totaltime, reset);
+      for(int b = 0; b < StatsBuckets; ++b) {
+         if((usb[b] = take(&s.usb[b], reset)) > 0)
+            ++msg.usbbuckets;
+         if((total[b] = take(&s.total[b], reset)) > 0)
+            ++msg.totalbuckets;
+      }
+      pkt.addMessage(msg);
+
+      UsbStatsBucketMsg bucket = { 0, 0, NULL, 0 };
+      for(int b = 0; b < StatsBuckets; ++b) {
+         if(usb[b] > 0) {
+            bucket.index = b;
+            bucket.count = usb[b];
+            pkt.addMessage(bucket);
+         }
+      }
+      for(int b = 0; b < StatsBuckets; ++b) {
+         if(total[b] > 0) {
+            bucket.index = b;
+            bucket.count = total[b];
+            pkt.addMessage(bucket);
+         }
+      }
+      ++rep.calls;
+   }
+
+   // Devices
+   for(int i = 0; i < Devices; ++i) {
+      DeviceStats& d = mDevices[i];
+      if(d.key == 0 || d.c.calls == 0)
+         continue;
+
+      UsbStatsDeviceMsg msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.location = (d.key - 1) >> 8;
+      msg.devnum = (d.key - 1) & 0xff;
+      msg.vendor = d.vendor;
+      msg.product = d.product;
+      msg.calls = take(&d.c.calls, reset);
+      msg.errors = take(&d.c.errors, reset);
+      msg.bytesin = take(&d.c.bytesin, reset);
+      msg.bytesout = take(&d.c.bytesout, reset);
+      msg.usbtime = take(&d.c.usbtime, reset);
+      msg.totaltime = take(&d.c.totaltime, reset);
+      pkt.addMessage(msg);
+      ++rep.devices;
+   }
+
+   UsbStatsRep_pack(pkt.at(pos), &rep);
+}
+
+/* Device calls are timed and attributed to the current call. */
+#define TIMED_CALL(h, call) \
+   uint64_t start = ServerStats::now(); \
+   int res = mBackend->call; \
+   mStats->device((h), ServerStats::now() - start, res < 0); \
+   return res;
+
+void StatsBackend::init()
+{
+   uint64_t start = ServerStats::now();
+   mBackend->init();
+   mStats->device(NULL, ServerStats::now() - start, false);
+}
+
+int StatsBackend::findBusses()
+{
+   TIMED_CALL(NULL, findBusses())
+}
+
+int StatsBackend::findDevices()
+{
+   TIMED_CALL(NULL, findDevices())
+}
+
+struct usb_bus* StatsBackend::busses()
+{
+   return mBackend->busses();
+}
+
+usb_dev_handle* StatsBackend::open(struct usb_device* dev)
+{
+   uint64_t start = ServerStats::now();
+   usb_dev_handle* h = mBackend->open(dev);
+   mStats->device(h, ServerStats::now() - start, h == NULL);
+   return h;
+}
+
+int StatsBackend::close(usb_dev_handle* h)
+{
+   // Handle is invalid after close
+   mStats->device(h, 0, false);
+   TIMED_CALL(NULL, close(h))
+}
+
+int StatsBackend::setConfiguration(usb_dev_handle* h, int configuration)
+{
+   TIMED_CALL(h, setConfiguration(h, configuration))
+}
+
+int StatsBackend::setAltInterface(usb_dev_handle* h, int interface, int alternate)
+{
+   TIMED_CALL(h, setAltInterface(h, interface, alternate))
+}
+
+int StatsBackend::resetEp(usb_dev_handle* h, unsigned ep)
+{
+   TIMED_CALL(h, resetEp(h, ep))
+}
+
+int StatsBackend::clearHalt(usb_dev_handle* h, unsigned ep)
+{
+   TIMED_CALL(h, clearHalt(h, ep))
+}
+
+int StatsBackend::reset(usb_dev_handle* h)
+{
+   TIMED_CALL(h, reset(h))
+}
+
+int StatsBackend::claimInterface(usb_dev_handle* h, int interface)
+{
+   TIMED_CALL(h, claimInterface(h, interface))
+}
+
+int StatsBackend::releaseInterface(usb_dev_handle* h, int interface)
+{
+   TIMED_CALL(h, releaseInterface(h, interface))
+}
+
+int StatsBackend::controlMsg(usb_dev_handle* h, int requesttype, int request,
+                             int value, int index, char* bytes, int size, int timeout)
+{
+   TIMED_CALL(h, controlMsg(h, requesttype, request, value, index, bytes, size, timeout))
+}
+
+int StatsBackend::bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   TIMED_CALL(h, bulkRead(h, ep, bytes, size, timeout))
+}
+
+int StatsBackend::bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   TIMED_CALL(h, bulkWrite(h, ep, bytes, size, timeout))
+}
+
+int StatsBackend::interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   TIMED_CALL(h, interruptRead(h, ep, bytes, size, timeout))
+}
+
+int StatsBackend::interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   TIMED_CALL(h, interruptWrite(h, ep, bytes, size, timeout))
+}
+
+int StatsBackend::getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen)
+{
+   TIMED_CALL(h, getDriver(h, interface, name, namelen))
+}
+
+int StatsBackend::detachKernelDriver(usb_dev_handle* h, int interface)
+{
+   TIMED_CALL(h, detachKernelDriver(h, interface))
+}
+
+/** @} */
@@ -0,0 +1,159 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file serverstats.hpp
+    \brief Server call statistics.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __serverstats_hpp__
+#define __serverstats_hpp__
+#include "usbbackend.hpp"
+#include "protocol.hpp"
+#include <ctime>
+#include <pthread.h>
+using namespace Proto;
+
+/** Per-call and per-device statistics, see usbstats.h.
+  * Counters are updated with atomic operations and never locked,
+  * snapshot is consistent per counter, not as a whole.
+  */
+class ServerStats
+{
+   public:
+
+   /** Device counters, opaque. */
+   struct DeviceStats;
+
+   /** Call in progress, owned by executing thread. */
+   struct Call {
+      uint8_t op;
+      uint64_t start;      // Start time (ns)
+      uint64_t usbtime;    // Time in device calls (ns)
+      uint64_t errors;     // Failed device calls
+      uint64_t bytesin, bytesout;
+      DeviceStats* dev;    // Device used by call
+      Call* outer;         // Enclosing call (batch)
+   };
+
+   ServerStats();
+   ~ServerStats();
+
+   /** Start call in current thread, calls may nest. */
+   void begin(Call& c, uint8_t op, uint32_t bytesin);
+
+   /** Finish call started by begin() and record it.
+     * Device time of nested call is added to enclosing call.
+     */
+   void end(Call& c);
+
+   /** Record device call of current thread call.
+     * \param h device, NULL keeps device of the call
+     */
+   void device(usb_dev_handle* h, uint64_t elapsed, bool failed);
+
+   /** Record bytes sent by current thread call. */
+   void sent(uint32_t bytes);
+
+   /** Append snapshot to packet, see UsbStats_REP.
+     * \param reset subtract reported values from counters
+     */
+   void snapshot(Packet& pkt, bool reset);
+
+   /** Return monotonic time (ns). */
+   static uint64_t now();
+
+   private:
+
+   /** Call or device counters. */
+   struct Counters {
+      volatile uint64_t calls, errors;
+      volatile uint64_t bytesin, bytesout;
+      volatile uint64_t usbtime, totaltime;
+   };
+
+   /** Call counters and latency histograms. */
+   struct CallStats {
+      Counters c;
+      volatile uint64_t usb[StatsBuckets];
+      volatile uint64_t total[StatsBuckets];
+   };
+
+   enum { Calls = 64, Devices = 256 };
+
+   /** Add call to counters. */
+   static void add(Counters& dst, const Call& c, uint64_t elapsed);
+
+   /** Return device entry, created on first use, or NULL if table is full. */
+   DeviceStats* lookup(usb_dev_handle* h);
+
+   CallStats* mCalls;              // By opcode - CallType
+   DeviceStats* mDevices;          // Open addressing by bus location and devnum
+   pthread_key_t mKey;             // Current call
+   time_t mStart;
+};
+
+/** Backend decorator recording device call times to statistics.
+  */
+class StatsBackend : public UsbBackend
+{
+   public:
+   StatsBackend(UsbBackend* backend, ServerStats* stats)
+      : mBackend(backend), mStats(stats)
+   {}
+
+   void init();
+   int findBusses();
+   int findDevices();
+   struct usb_bus* busses();
+   usb_dev_handle* open(struct usb_device* dev);
+   int close(usb_dev_handle* h);
+   int setConfiguration(usb_dev_handle* h, int configuration);
+   int setAltInterface(usb_dev_handle* h, int interface, int alternate);
+   int resetEp(usb_dev_handle* h, unsigned ep);
+   int clearHalt(usb_dev_handle* h, unsigned ep);
+   int reset(usb_dev_handle* h);
+   int claimInterface(usb_dev_handle* h, int interface);
+   int releaseInterface(usb_dev_handle* h, int interface);
+   int controlMsg(usb_dev_handle* h, int requesttype, int request,
+                  int value, int index, char* bytes, int size, int timeout);
+   int bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen);
+   int detachKernelDriver(usb_dev_handle* h, int interface);
+
+   /* Asynchronous transfers are not timed, completion is recorded by caller. */
+   bool async() { return mBackend->async(); }
+   int submit(UsbTransfer* t) { return mBackend->submit(t); }
+   int cancel(UsbTransfer* t) { return mBackend->cancel(t); }
+   int abort(usb_dev_handle* h) { return mBackend->abort(h); }
+   int eventFd() { return mBackend->eventFd(); }
+   bool handleEvents(int timeout = 0) { return mBackend->handleEvents(timeout); }
+   void setReady(void (*ready)(void*), void* arg) { mBackend->setReady(ready, arg); }
+
+   private:
+   UsbBackend* mBackend;
+   ServerStats* mStats;
+};
+
+#endif // __serverstats_hpp__
+/** @} */
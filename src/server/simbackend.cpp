@@ -0,0 +1,763 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file simbackend.cpp
+    \brief Simulated device backend.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "simbackend.hpp"
+#include "common.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+/** Maximum devices per bus. */
+static const int BusDevices = 127;
+
+SimBackend::SimBackend()
+   : mBussesFound(false), mDevicesFound(false)
+{
+}
+
+SimBackend::~SimBackend()
+{
+   for(unsigned i = 0; i < mDevices.size(); ++i) {
+      pthread_mutex_destroy(&mDevices[i]->lock);
+      pthread_cond_destroy(&mDevices[i]->cond);
+      delete mDevices[i];
+   }
+   for(unsigned i = 0; i < mBusses.size(); ++i)
+      delete mBusses[i];
+}
+
+/** Return transfer type by name or -1. */
+static int parse_type(const char* name)
+{
+   if(strcmp(name, "control") == 0)
+      return USB_ENDPOINT_TYPE_CONTROL;
+   if(strcmp(name, "bulk") == 0)
+      return USB_ENDPOINT_TYPE_BULK;
+   if(strcmp(name, "interrupt") == 0)
+      return USB_ENDPOINT_TYPE_INTERRUPT;
+
+   return -1;
+}
+
+bool SimBackend::load(const char* path)
+{
+   FILE* fp = fopen(path, "r");
+   if(fp == NULL) {
+      error_msg("SimBackend: can't open '%s': %s", path, strerror(errno));
+      return false;
+   }
+
+   // Parse directives
+   std::vector<Spec> specs;
+   char line[256];
+   int lineno = 0;
+   bool ok = true;
+   while(ok && fgets(line, sizeof(line), fp) != NULL) {
+      ++lineno;
+
+      // Strip comment
+      char* comment = strchr(line, '#');
+      if(comment != NULL)
+         *comment = '\0';
+
+      char key[32], arg[32], mode[32];
+      unsigned a = 0, b = 0;
+      int n = 0;
+      if(sscanf(line, "%31s", key) != 1)
+         continue;
+
+      // New device
+      if(strcmp(key, "device") == 0) {
+         Spec spec;
+         spec.count = 1;
+         memset(spec.latency, 0, sizeof(spec.latency));
+         spec.throughput = 0;
+         n = sscanf(line, "%*s %x:%x %d", &a, &b, &spec.count);
+         spec.vendor = a;
+         spec.product = b;
+         ok = (n >= 2 && spec.count > 0);
+         if(ok)
+            specs.push_back(spec);
+         continue;
+      }
+
+      // Device options
+      if(specs.empty()) {
+         ok = false;
+         break;
+      }
+      Spec& spec = specs.back();
+      if(strcmp(key, "latency") == 0) {
+         n = sscanf(line, "%*s %31s %u", arg, &a);
+         int type = (n == 2) ? parse_type(arg) : -1;
+         if((ok = (type >= 0)))
+            spec.latency[type] = a;
+      }
+      else if(strcmp(key, "throughput") == 0) {
+         ok = (sscanf(line, "%*s %u", &a) == 1);
+         spec.throughput = a;
+      }
+      else if(strcmp(key, "endpoint") == 0) {
+         Endpoint ep;
+         memset(&ep, 0, sizeof(Endpoint));
+         n = sscanf(line, "%*s %x %31s %u %31s", &a, arg, &b, mode);
+         ep.address = a & 0xff;
+         ep.type = (n == 4) ? parse_type(arg) : -1;
+         ep.maxpacket = b;
+         ep.mode = -1;
+         if(n == 4) {
+            const char* modes[] = { "source", "sink", "echo", "stall", "timeout" };
+            for(int i = 0; i < 5; ++i) {
+               if(strcmp(mode, modes[i]) == 0)
+                  ep.mode = EpSource + i;
+            }
+         }
+         ok = (ep.type == USB_ENDPOINT_TYPE_BULK || ep.type == USB_ENDPOINT_TYPE_INTERRUPT) &&
+              (ep.address & 0x0f) != 0 && ep.mode >= 0 && spec.ep.size() < 30;
+         if(ok)
+            spec.ep.push_back(ep);
+      }
+      else {
+         ok = false;
+      }
+   }
+
+   fclose(fp);
+   if(!ok) {
+      error_msg("SimBackend: %s:%d: invalid directive", path, lineno);
+      return false;
+   }
+
+   build(specs);
+   log_msg("SimBackend: %u simulated devices on %u busses",
+           (unsigned) mDevices.size(), (unsigned) mBusses.size());
+   return true;
+}
+
+void SimBackend::build(const std::vector<Spec>& specs)
+{
+   struct usb_bus* bus = NULL;
+   struct usb_device* last = NULL;
+   int devnum = BusDevices;
+   for(unsigned s = 0; s < specs.size(); ++s) {
+      for(int c = 0; c < specs[s].count; ++c) {
+
+         // Start new bus when full
+         if(devnum == BusDevices) {
+            struct usb_bus* next = new struct usb_bus;
+            memset(next, 0, sizeof(struct usb_bus));
+            next->location = mBusses.size() + 1;
+            snprintf(next->dirname, sizeof(next->dirname), "%03u", next->location);
+            if(bus != NULL) {
+               bus->next = next;
+               next->prev = bus;
+            }
+            mBusses.push_back(bus = next);
+            last = NULL;
+            devnum = 0;
+         }
+
+         // Create device
+         Device* d = new Device;
+         d->spec = specs[s];
+         d->changes = 0;
+         pthread_mutex_init(&d->lock, NULL);
+         pthread_cond_init(&d->cond, NULL);
+         mDevices.push_back(d);
+
+         // Endpoint descriptors
+         const std::vector<Endpoint>& ep = d->spec.ep;
+         d->epdesc.resize(ep.size());
+         for(unsigned i = 0; i < ep.size(); ++i) {
+            struct usb_endpoint_descriptor* e = &d->epdesc[i];
+            memset(e, 0, sizeof(struct usb_endpoint_descriptor));
+            e->bLength = 7;
+            e->bDescriptorType = 0x05;
+            e->bEndpointAddress = ep[i].address;
+            e->bmAttributes = ep[i].type;
+            e->wMaxPacketSize = ep[i].maxpacket;
+            e->bInterval = (ep[i].type == USB_ENDPOINT_TYPE_INTERRUPT) ? 1 : 0;
+         }
+
+         // Interface, vendor-specific class
+         struct usb_interface_descriptor* alt = &d->altsetting;
+         memset(alt, 0, sizeof(struct usb_interface_descriptor));
+         alt->bLength = 9;
+         alt->bDescriptorType = 0x04;
+         alt->bNumEndpoints = ep.size();
+         alt->bInterfaceClass = 0xff;
+         alt->endpoint = ep.empty() ? NULL : &d->epdesc[0];
+         d->iface.altsetting = alt;
+         d->iface.num_altsetting = 1;
+
+         // Configuration
+         struct usb_config_descriptor* cfg = &d->config;
+         memset(cfg, 0, sizeof(struct usb_config_descriptor));
+         cfg->bLength = 9;
+         cfg->bDescriptorType = 0x02;
+         cfg->wTotalLength = 9 + 9 + 7 * ep.size();
+         cfg->bNumInterfaces = 1;
+         cfg->bConfigurationValue = 1;
+         cfg->bmAttributes = 0x80;
+         cfg->MaxPower = 50;
+         cfg->interface = &d->iface;
+
+         // Device
+         struct usb_device* dev = &d->dev;
+         memset(dev, 0, sizeof(struct usb_device));
+         dev->devnum = ++devnum;
+         snprintf(dev->filename, sizeof(dev->filename), "%03d", dev->devnum);
+         dev->bus = bus;
+         dev->descriptor.bLength = 18;
+         dev->descriptor.bDescriptorType = 0x01;
+         dev->descriptor.bcdUSB = 0x0200;
+         dev->descriptor.bMaxPacketSize0 = 64;
+         dev->descriptor.idVendor = d->spec.vendor;
+         dev->descriptor.idProduct = d->spec.product;
+         dev->descriptor.bcdDevice = 0x0100;
+         dev->descriptor.bNumConfigurations = 1;
+         dev->config = cfg;
+         dev->dev = d;
+
+         // Append to bus
+         if(last != NULL) {
+            last->next = dev;
+            dev->prev = last;
+         }
+         else {
+            bus->devices = dev;
+         }
+         last = dev;
+      }
+   }
+}
+
+int SimBackend::findBusses()
+{
+   // Busses appear on first call
+   int res = mBussesFound ? 0 : mBusses.size();
+   mBussesFound = true;
+   return res;
+}
+
+int SimBackend::findDevices()
+{
+   // Devices appear on first call
+   int res = mDevicesFound ? 0 : mDevices.size();
+   mDevicesFound = true;
+   return res;
+}
+
+struct usb_bus* SimBackend::busses()
+{
+   return mBussesFound && !mBusses.empty() ? mBusses[0] : NULL;
+}
+
+usb_dev_handle* SimBackend::open(struct usb_device* dev)
+{
+   usb_dev_handle* h = new usb_dev_handle;
+   memset(h, 0, sizeof(usb_dev_handle));
+   h->fd = -1;
+   h->bus = dev->bus;
+   h->device = dev;
+   h->config = h->interface = h->altsetting = -1;
+   h->impl_info = dev->dev;
+   return h;
+}
+
+int SimBackend::close(usb_dev_handle* h)
+{
+   delete h;
+   return 0;
+}
+
+int SimBackend::setConfiguration(usb_dev_handle* h, int configuration)
+{
+   if(configuration != 1)
+      return -EINVAL;
+
+   h->config = configuration;
+   return 0;
+}
+
+int SimBackend::setAltInterface(usb_dev_handle* h, int interface, int alternate)
+{
+   if(interface != h->interface || interface < 0 || alternate != 0)
+      return -EINVAL;
+
+   h->altsetting = alternate;
+   return 0;
+}
+
+int SimBackend::resetEp(usb_dev_handle* /* h */, unsigned /* ep */)
+{
+   return 0;
+}
+
+int SimBackend::clearHalt(usb_dev_handle* /* h */, unsigned /* ep */)
+{
+   return 0;
+}
+
+int SimBackend::reset(usb_dev_handle* /* h */)
+{
+   return 0;
+}
+
+int SimBackend::claimInterface(usb_dev_handle* h, int interface)
+{
+   if(interface != 0)
+      return -EINVAL;
+
+   h->interface = interface;
+   return 0;
+}
+
+int SimBackend::releaseInterface(usb_dev_handle* h, int interface)
+{
+   if(interface != h->interface)
+      return -EINVAL;
+
+   h->interface = -1;
+   return 0;
+}
+
+int SimBackend::getDriver(usb_dev_handle* /* h */, int /* interface */,
+                          char* /* name */, unsigned /* namelen */)
+{
+   return -ENODATA;
+}
+
+int SimBackend::detachKernelDriver(usb_dev_handle* /* h */, int /* interface */)
+{
+   return -ENODATA;
+}
+
+/** Sleep for given time (us), usleep() may refuse a second or more. */
+static void sleep_us(int64_t us)
+{
+   struct timespec ts;
+   ts.tv_sec = us / 1000000;
+   ts.tv_nsec = (us % 1000000) * 1000;
+   while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+}
+
+/** Fail transfer after timeout (ms), 0 waits without timeout.
+  * \return -ETIMEDOUT
+  */
+static int expire(int timeout, int64_t* latency)
+{
+   *latency = (timeout > 0) ? (int64_t) timeout * 1000 : -1;
+   return -ETIMEDOUT;
+}
+
+void SimBackend::cost(Device* d, int type, int size, int64_t* latency, int64_t* busy)
+{
+   *latency = d->spec.latency[type];
+   *busy = 0;
+   if(type == USB_ENDPOINT_TYPE_BULK && d->spec.throughput > 0)
+      *busy = size / d->spec.throughput;
+}
+
+void SimBackend::delay(Device* d, int type, int size)
+{
+   int64_t latency = 0, busy = 0;
+   cost(d, type, size, &latency, &busy);
+   if(latency + busy > 0)
+      sleep_us(latency + busy);
+}
+
+SimBackend::Endpoint* SimBackend::endpoint(Device* d, int ep, int type)
+{
+   std::vector<Endpoint>& eps = d->spec.ep;
+   for(unsigned i = 0; i < eps.size(); ++i) {
+      if(eps[i].address == (ep & 0xff) && eps[i].type == type)
+         return &eps[i];
+   }
+
+   return NULL;
+}
+
+int SimBackend::controlMsg(usb_dev_handle* h, int requesttype, int request,
+                           int value, int /* index */, char* bytes, int size,
+                           int /* timeout */)
+{
+   Device* d = (Device*) h->impl_info;
+   if(size < 0 || (size > 0 && bytes == NULL))
+      return -EINVAL;
+
+   delay(d, USB_ENDPOINT_TYPE_CONTROL, size);
+
+   // Device to host
+   if(requesttype & USB_ENDPOINT_IN) {
+
+      // Device descriptor, little-endian
+      if(request == USB_REQ_GET_DESCRIPTOR && (value >> 8) == 0x01) {
+         const struct usb_device_descriptor& desc = d->dev.descriptor;
+         char raw[18] = {
+            (char) desc.bLength, (char) desc.bDescriptorType,
+            (char) (desc.bcdUSB & 0xff), (char) (desc.bcdUSB >> 8),
+            (char) desc.bDeviceClass, (char) desc.bDeviceSubClass,
+            (char) desc.bDeviceProtocol, (char) desc.bMaxPacketSize0,
+            (char) (desc.idVendor & 0xff), (char) (desc.idVendor >> 8),
+            (char) (desc.idProduct & 0xff), (char) (desc.idProduct >> 8),
+            (char) (desc.bcdDevice & 0xff), (char) (desc.bcdDevice >> 8),
+            (char) desc.iManufacturer, (char) desc.iProduct,
+            (char) desc.iSerialNumber, (char) desc.bNumConfigurations
+         };
+         if(size > (int) sizeof(raw))
+            size = sizeof(raw);
+         memcpy(bytes, raw, size);
+         return size;
+      }
+
+      for(int i = 0; i < size; ++i)
+         bytes[i] = (char) (request + i);
+   }
+
+   return size;
+}
+
+int SimBackend::execute(usb_dev_handle* h, int type, int ep, char* bytes, int size, int timeout,
+                        int64_t* latency, int64_t* busy)
+{
+   *latency = *busy = 0;
+   Device* d = (Device*) h->impl_info;
+   Endpoint* e = endpoint(d, ep, type);
+   if(e == NULL || size < 0)
+      return -EINVAL;
+
+   // Failing endpoints
+   int res = size;
+   bool input = (ep & USB_ENDPOINT_IN);
+   switch(e->mode) {
+   case EpStall:
+      cost(d, type, 0, latency, busy);
+      return -EPIPE;
+   case EpTimeout:
+      return expire(timeout, latency);
+   case EpSource:
+      if(!input)
+         return -EINVAL;
+      pthread_mutex_lock(&d->lock);
+      for(int i = 0; i < size; ++i)
+         bytes[i] = (char) e->counter++;
+      pthread_mutex_unlock(&d->lock);
+      break;
+   case EpSink:
+      if(input)
+         return -EINVAL;
+      break;
+   case EpEcho:
+      pthread_mutex_lock(&d->lock);
+      if(!input) {
+
+         // Buffer is limited, device accepts what fits
+         if((unsigned) res > MaxEcho - d->echo.size())
+            res = MaxEcho - d->echo.size();
+         d->echo.append(bytes, res);
+      }
+      else {
+         if((unsigned) res > d->echo.size())
+            res = d->echo.size();
+         memcpy(bytes, d->echo.data(), res);
+         d->echo.erase(0, res);
+      }
+      if(res > 0) {
+         ++d->changes;
+         pthread_cond_broadcast(&d->cond);
+      }
+      pthread_mutex_unlock(&d->lock);
+
+      // Nothing to return or no space left
+      if(res == 0 && size > 0)
+         return expire(timeout, latency);
+      break;
+   default:
+      return -EINVAL;
+   }
+
+   cost(d, type, res, latency, busy);
+   return res;
+}
+
+uint32_t SimBackend::changes(usb_dev_handle* h)
+{
+   Device* d = (Device*) h->impl_info;
+   pthread_mutex_lock(&d->lock);
+   uint32_t res = d->changes;
+   pthread_mutex_unlock(&d->lock);
+   return res;
+}
+
+int SimBackend::transfer(usb_dev_handle* h, int type, int ep, char* bytes, int size, int timeout)
+{
+   Device* d = (Device*) h->impl_info;
+   int64_t latency = 0, busy = 0;
+   uint32_t seen = changes(h);
+   int res = execute(h, type, ep, bytes, size, timeout, &latency, &busy);
+
+   // No timeout, wait for echo buffer change and try again
+   while(latency < 0) {
+      pthread_mutex_lock(&d->lock);
+      d->waiting.insert(h);
+      while(d->changes == seen && d->waiting.count(h))
+         pthread_cond_wait(&d->cond, &d->lock);
+
+      // Removed by abort()
+      bool aborted = (d->waiting.erase(h) == 0);
+      seen = d->changes;
+      pthread_mutex_unlock(&d->lock);
+      if(aborted)
+         return -ECANCELED;
+
+      res = execute(h, type, ep, bytes, size, timeout, &latency, &busy);
+   }
+
+   if(latency + busy > 0)
+      sleep_us(latency + busy);
+
+   return res;
+}
+
+int SimBackend::abort(usb_dev_handle* h)
+{
+   // Only transfers waiting without timeout are aborted
+   Device* d = (Device*) h->impl_info;
+   pthread_mutex_lock(&d->lock);
+   int res = d->waiting.erase(h) ? 0 : -ENOENT;
+   if(res == 0)
+      pthread_cond_broadcast(&d->cond);
+   pthread_mutex_unlock(&d->lock);
+   return res;
+}
+
+int SimBackend::bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_BULK, ep | USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+int SimBackend::bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_BULK, ep & ~USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+int SimBackend::interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_INTERRUPT, ep | USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+int SimBackend::interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return transfer(h, USB_ENDPOINT_TYPE_INTERRUPT, ep & ~USB_ENDPOINT_IN, bytes, size, timeout);
+}
+
+/** Return monotonic time (us). */
+static uint64_t monotonic()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+SimAsyncBackend::SimAsyncBackend(SimBackend* sim)
+   : mSim(sim)
+{
+   mTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+   if(mTimer < 0)
+      error_msg("SimAsyncBackend: can't create timer: %s", strerror(errno));
+   pthread_mutex_init(&mQueueLock, NULL);
+}
+
+SimAsyncBackend::~SimAsyncBackend()
+{
+   if(!mQueue.empty() || !mWaiting.empty())
+      error_msg("SimAsyncBackend: %d transfers still submitted", (int) (mQueue.size() + mWaiting.size()));
+   if(mTimer >= 0)
+      ::close(mTimer);
+   pthread_mutex_destroy(&mQueueLock);
+}
+
+int SimAsyncBackend::close(usb_dev_handle* h)
+{
+   // Forget endpoint state
+   pthread_mutex_lock(&mQueueLock);
+   std::map<EndpointKey, uint64_t>::iterator i = mBusy.begin();
+   while(i != mBusy.end()) {
+      if(i->first.first == h)
+         mBusy.erase(i++);
+      else
+         ++i;
+   }
+   pthread_mutex_unlock(&mQueueLock);
+
+   return mSim->close(h);
+}
+
+void SimAsyncBackend::arm()
+{
+   struct itimerspec its;
+   memset(&its, 0, sizeof(its));
+   if(!mQueue.empty()) {
+      uint64_t at = mQueue.begin()->first;
+      its.it_value.tv_sec = at / 1000000;
+      its.it_value.tv_nsec = (at % 1000000) * 1000;
+   }
+
+   timerfd_settime(mTimer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int SimAsyncBackend::submit(UsbTransfer* t)
+{
+   if(mTimer < 0)
+      return -ENOSYS;
+
+   // Execute now, complete when simulated time elapses
+   int64_t latency = 0, busy = 0;
+   int res = mSim->execute(t->h, t->type, t->ep, t->bytes, t->size, t->timeout, &latency, &busy);
+   if(res == -EINVAL)
+      return res;
+
+   pthread_mutex_lock(&mQueueLock);
+   enqueue(t, res, latency, busy);
+
+   // Moved data may complete waiting transfers
+   if(res > 0)
+      retry(t->h);
+   pthread_mutex_unlock(&mQueueLock);
+
+   return 0;
+}
+
+void SimAsyncBackend::enqueue(UsbTransfer* t, int res, int64_t latency, int64_t busy)
+{
+   // Wait without timeout until retried or cancelled
+   if(latency < 0) {
+      mWaiting.push_back(t);
+      return;
+   }
+
+   t->res = res;
+   uint64_t at = monotonic() + latency;
+
+   // Endpoint moves data of one transfer at a time
+   if(res >= 0) {
+      uint64_t& until = mBusy[EndpointKey(t->h, t->ep)];
+      if(at < until)
+         at = until;
+      at += busy;
+      until = at;
+   }
+
+   mQueue.insert(Queue::value_type(at, t));
+   if(mQueue.begin()->second == t)
+      arm();
+}
+
+void SimAsyncBackend::retry(usb_dev_handle* h)
+{
+   std::vector<UsbTransfer*> waiting;
+   waiting.swap(mWaiting);
+   for(unsigned i = 0; i < waiting.size(); ++i) {
+      UsbTransfer* t = waiting[i];
+      if(t->h->impl_info != h->impl_info) {
+         mWaiting.push_back(t);
+         continue;
+      }
+
+      int64_t latency = 0, busy = 0;
+      int res = mSim->execute(t->h, t->type, t->ep, t->bytes, t->size, t->timeout, &latency, &busy);
+      enqueue(t, res, latency, busy);
+   }
+}
+
+int SimAsyncBackend::cancel(UsbTransfer* t)
+{
+   // Find submitted transfer
+   int res = -ENOENT;
+   pthread_mutex_lock(&mQueueLock);
+   Queue::iterator i;
+   for(i = mQueue.begin(); i != mQueue.end(); ++i) {
+      if(i->second == t)
+         break;
+   }
+
+   bool found = (i != mQueue.end());
+   if(found)
+      mQueue.erase(i);
+
+   // Waiting without timeout
+   std::vector<UsbTransfer*>::iterator w = std::find(mWaiting.begin(), mWaiting.end(), t);
+   if(!found && w != mWaiting.end()) {
+      mWaiting.erase(w);
+      found = true;
+   }
+
+   // Complete immediately
+   if(found) {
+      t->res = -ECANCELED;
+      mQueue.insert(Queue::value_type(monotonic(), t));
+      arm();
+      res = 0;
+   }
+   pthread_mutex_unlock(&mQueueLock);
+
+   return res;
+}
+
+void SimAsyncBackend::processEvents(int timeout)
+{
+   // Wait for timer
+   struct pollfd pfd = { mTimer, POLLIN, 0 };
+   if(poll(&pfd, 1, timeout) <= 0)
+      return;
+
+   uint64_t expired = 0;
+   if(::read(mTimer, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+      return;
+
+   // Collect finished transfers
+   std::vector<UsbTransfer*> done;
+   pthread_mutex_lock(&mQueueLock);
+   uint64_t now = monotonic();
+   while(!mQueue.empty() && mQueue.begin()->first <= now) {
+      done.push_back(mQueue.begin()->second);
+      mQueue.erase(mQueue.begin());
+   }
+   arm();
+   pthread_mutex_unlock(&mQueueLock);
+
+   // Complete, callbacks may submit new transfers
+   for(unsigned i = 0; i < done.size(); ++i)
+      done[i]->callback(done[i]);
+}
+
+/** @} */
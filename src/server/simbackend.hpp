@@ -0,0 +1,246 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file simbackend.hpp
+    \brief Simulated device backend.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __simbackend_hpp__
+#define __simbackend_hpp__
+#include "asyncbackend.hpp"
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <pthread.h>
+
+/** \page simbackend_page
+    <h2>Simulated devices</h2>
+    Devices are described in a text file, one directive per line,
+    '#' starts a comment. Directives following "device" apply to it.
+    \code
+       device <vendor>:<product> [count]     # hex ids, count copies
+       latency <control|bulk|interrupt> <us> # per transfer
+       throughput <MB/s>                     # bulk data rate, 0 = unlimited
+       endpoint <address> <bulk|interrupt> <maxpacket> <behaviour>
+    \endcode
+    Endpoint behaviours
+    \code
+       source  - IN, returns requested size of counter bytes
+       sink    - OUT, accepts all data
+       echo    - OUT stores data up to 1MB, IN returns stored data or times out
+       stall   - transfers fail with -EPIPE
+       timeout - transfers fail with -ETIMEDOUT after timeout
+    \endcode
+    Transfer with timeout 0 doesn't time out, it waits for the echo buffer
+    to change or until it's cancelled.
+    Each device has configuration 1 with a single interface 0.
+    IN control transfers return the device descriptor for GET_DESCRIPTOR,
+    request + offset bytes otherwise.
+
+    SimAsyncBackend is a fake asynchronous transport over the same devices.
+    Submitted transfer completes after the device latency, an endpoint moves
+    data of one transfer at a time, so transfers queued on an endpoint
+    hide the latency and run at the device throughput.
+  */
+
+/** Backend with simulated devices.
+  */
+class SimBackend : public UsbBackend
+{
+   public:
+   SimBackend();
+   ~SimBackend();
+
+   /** Load device description.
+     * \return false on error
+     */
+   bool load(const char* path);
+
+   void init() {}
+   int findBusses();
+   int findDevices();
+   struct usb_bus* busses();
+   usb_dev_handle* open(struct usb_device* dev);
+   int close(usb_dev_handle* h);
+   int setConfiguration(usb_dev_handle* h, int configuration);
+   int setAltInterface(usb_dev_handle* h, int interface, int alternate);
+   int resetEp(usb_dev_handle* h, unsigned ep);
+   int clearHalt(usb_dev_handle* h, unsigned ep);
+   int reset(usb_dev_handle* h);
+   int claimInterface(usb_dev_handle* h, int interface);
+   int releaseInterface(usb_dev_handle* h, int interface);
+   int controlMsg(usb_dev_handle* h, int requesttype, int request,
+                  int value, int index, char* bytes, int size, int timeout);
+   int bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen);
+   int detachKernelDriver(usb_dev_handle* h, int interface);
+   int abort(usb_dev_handle* h);
+
+   /** Execute bulk or interrupt transfer without waiting.
+     * \param ep endpoint address including direction
+     * \param latency set to time before transfer completes (us),
+     *        -1 if it waits without timeout, see changes()
+     * \param busy set to time endpoint is busy moving data (us)
+     * \return transferred bytes or negative errno
+     */
+   int execute(usb_dev_handle* h, int type, int ep, char* bytes, int size, int timeout,
+               int64_t* latency, int64_t* busy);
+
+   /** Return number of echo buffer changes of device, waiting transfer
+     * may be executed again when it changes.
+     */
+   uint32_t changes(usb_dev_handle* h);
+
+   private:
+
+   /** Endpoint behaviour. */
+   enum { EpSource, EpSink, EpEcho, EpStall, EpTimeout };
+
+   /** Echo buffer size per device (bytes). */
+   enum { MaxEcho = 1 << 20 };
+
+   /** Simulated endpoint. */
+   struct Endpoint {
+      int address;
+      int type;          // Transfer type (USB_ENDPOINT_TYPE_*)
+      int maxpacket;
+      int mode;          // Behaviour
+      uint8_t counter;   // Next source byte
+   };
+
+   /** Device description. */
+   struct Spec {
+      uint16_t vendor, product;
+      int count;
+      int latency[4];    // Latency by transfer type (us)
+      int throughput;    // Bulk rate (bytes/us), 0 = unlimited
+      std::vector<Endpoint> ep;
+   };
+
+   /** Simulated device, descriptors point to its members. */
+   struct Device {
+      struct usb_device dev;
+      struct usb_config_descriptor config;
+      struct usb_interface iface;
+      struct usb_interface_descriptor altsetting;
+      std::vector<struct usb_endpoint_descriptor> epdesc;
+      Spec spec;
+      std::string echo;      // Data stored by echo endpoints
+      uint32_t changes;      // Echo buffer changes
+      pthread_mutex_t lock;  // Guards echo and counters
+      pthread_cond_t cond;   // Signalled on echo change or abort
+      std::set<usb_dev_handle*> waiting; // Transfers waiting without timeout
+   };
+
+   /** Create devices and busses from descriptions. */
+   void build(const std::vector<Spec>& specs);
+
+   /** Return simulated endpoint or NULL. */
+   Endpoint* endpoint(Device* d, int ep, int type);
+
+   /** Return transfer latency and data time (us). */
+   void cost(Device* d, int type, int size, int64_t* latency, int64_t* busy);
+
+   /** Simulate transfer time. */
+   void delay(Device* d, int type, int size);
+
+   /** Execute bulk or interrupt transfer. */
+   int transfer(usb_dev_handle* h, int type, int ep, char* bytes, int size, int timeout);
+
+   std::vector<Device*> mDevices;
+   std::vector<struct usb_bus*> mBusses;
+   bool mBussesFound, mDevicesFound;
+};
+
+/** Fake asynchronous transport over simulated devices.
+  * Transfers are executed on submit and completed when their simulated
+  * time elapses, completions are driven by a timerfd.
+  */
+class SimAsyncBackend : public AsyncBackend
+{
+   public:
+   /** Create transport on simulated devices, owned by caller. */
+   SimAsyncBackend(SimBackend* sim);
+   ~SimAsyncBackend();
+
+   void init() { mSim->init(); }
+   int findBusses() { return mSim->findBusses(); }
+   int findDevices() { return mSim->findDevices(); }
+   struct usb_bus* busses() { return mSim->busses(); }
+   usb_dev_handle* open(struct usb_device* dev) { return mSim->open(dev); }
+   int close(usb_dev_handle* h);
+   int setConfiguration(usb_dev_handle* h, int configuration) { return mSim->setConfiguration(h, configuration); }
+   int setAltInterface(usb_dev_handle* h, int interface, int alternate) { return mSim->setAltInterface(h, interface, alternate); }
+   int resetEp(usb_dev_handle* h, unsigned ep) { return mSim->resetEp(h, ep); }
+   int clearHalt(usb_dev_handle* h, unsigned ep) { return mSim->clearHalt(h, ep); }
+   int reset(usb_dev_handle* h) { return mSim->reset(h); }
+   int claimInterface(usb_dev_handle* h, int interface) { return mSim->claimInterface(h, interface); }
+   int releaseInterface(usb_dev_handle* h, int interface) { return mSim->releaseInterface(h, interface); }
+   int controlMsg(usb_dev_handle* h, int requesttype, int request,
+                  int value, int index, char* bytes, int size, int timeout) {
+      return mSim->controlMsg(h, requesttype, request, value, index, bytes, size, timeout);
+   }
+   int getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen) {
+      return mSim->getDriver(h, interface, name, namelen);
+   }
+   int detachKernelDriver(usb_dev_handle* h, int interface) { return mSim->detachKernelDriver(h, interface); }
+
+   int submit(UsbTransfer* t);
+   int cancel(UsbTransfer* t);
+   int eventFd() { return mTimer; }
+
+   protected:
+   void processEvents(int timeout);
+
+   private:
+
+   /** Arm timer for earliest completion.
+     * \warning Call with mQueueLock held.
+     */
+   void arm();
+
+   /** Queue transfer executed with given result and times.
+     * \warning Call with mQueueLock held.
+     */
+   void enqueue(UsbTransfer* t, int res, int64_t latency, int64_t busy);
+
+   /** Execute waiting transfers of device again.
+     * \warning Call with mQueueLock held.
+     */
+   void retry(usb_dev_handle* h);
+
+   typedef std::multimap<uint64_t, UsbTransfer*> Queue;
+   typedef std::pair<usb_dev_handle*, int> EndpointKey;
+
+   SimBackend* mSim;
+   int mTimer;                            // Completion timer
+   pthread_mutex_t mQueueLock;
+   Queue mQueue;                          // Submitted transfers by completion time (us)
+   std::vector<UsbTransfer*> mWaiting;    // Transfers without timeout
+   std::map<EndpointKey, uint64_t> mBusy; // Endpoint busy until (us)
+};
+
+#endif // __simbackend_hpp__
+/** @} */
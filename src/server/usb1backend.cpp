@@ -0,0 +1,583 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usb1backend.cpp
+    \brief Asynchronous libusb-1.0 device access backend.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#ifdef HAVE_LIBUSB1
+#include "usb1backend.hpp"
+#include "common.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+/** Guards UsbTransfer::priv of submitted transfers. */
+static pthread_mutex_t sTransferLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Return negative errno for libusb error. */
+static int usb1_error(int err)
+{
+   switch(err) {
+   case LIBUSB_SUCCESS:             return 0;
+   case LIBUSB_ERROR_INVALID_PARAM: return -EINVAL;
+   case LIBUSB_ERROR_ACCESS:        return -EACCES;
+   case LIBUSB_ERROR_NO_DEVICE:     return -ENODEV;
+   case LIBUSB_ERROR_NOT_FOUND:     return -ENOENT;
+   case LIBUSB_ERROR_BUSY:          return -EBUSY;
+   case LIBUSB_ERROR_TIMEOUT:       return -ETIMEDOUT;
+   case LIBUSB_ERROR_OVERFLOW:      return -EOVERFLOW;
+   case LIBUSB_ERROR_PIPE:          return -EPIPE;
+   case LIBUSB_ERROR_INTERRUPTED:   return -EINTR;
+   case LIBUSB_ERROR_NO_MEM:        return -ENOMEM;
+   case LIBUSB_ERROR_NOT_SUPPORTED: return -ENOSYS;
+   default: break;
+   }
+
+   return (err < 0) ? -EIO : err;
+}
+
+/** Return transferred bytes or negative errno for finished transfer. */
+static int usb1_status(const struct libusb_transfer* lt)
+{
+   switch(lt->status) {
+   case LIBUSB_TRANSFER_COMPLETED: return lt->actual_length;
+   case LIBUSB_TRANSFER_TIMED_OUT: return -ETIMEDOUT;
+   case LIBUSB_TRANSFER_CANCELLED: return -ECANCELED;
+   case LIBUSB_TRANSFER_STALL:     return -EPIPE;
+   case LIBUSB_TRANSFER_NO_DEVICE: return -ENODEV;
+   case LIBUSB_TRANSFER_OVERFLOW:  return -EOVERFLOW;
+   default: break;
+   }
+
+   return -EIO;
+}
+
+/** Copy descriptor extra bytes. */
+static unsigned char* usb1_extra(const unsigned char* extra, int len)
+{
+   if(extra == NULL || len <= 0)
+      return NULL;
+
+   unsigned char* copy = new unsigned char[len];
+   memcpy(copy, extra, len);
+   return copy;
+}
+
+/** Convert configuration descriptor to libusb-0.1 structures. */
+static void usb1_config(struct usb_config_descriptor* dst, const struct libusb_config_descriptor* src)
+{
+   memset(dst, 0, sizeof(struct usb_config_descriptor));
+   dst->bLength = src->bLength;
+   dst->bDescriptorType = src->bDescriptorType;
+   dst->wTotalLength = src->wTotalLength;
+   dst->bNumInterfaces = src->bNumInterfaces;
+   dst->bConfigurationValue = src->bConfigurationValue;
+   dst->iConfiguration = src->iConfiguration;
+   dst->bmAttributes = src->bmAttributes;
+   dst->MaxPower = src->MaxPower;
+   dst->extra = usb1_extra(src->extra, src->extra_length);
+   dst->extralen = dst->extra ? src->extra_length : 0;
+   dst->interface = new struct usb_interface[src->bNumInterfaces];
+
+   // Interfaces
+   for(int i = 0; i < src->bNumInterfaces; ++i) {
+      const struct libusb_interface* si = &src->interface[i];
+      struct usb_interface* di = &dst->interface[i];
+      di->num_altsetting = si->num_altsetting;
+      di->altsetting = new struct usb_interface_descriptor[si->num_altsetting];
+
+      // Alternate settings
+      for(int a = 0; a < si->num_altsetting; ++a) {
+         const struct libusb_interface_descriptor* sa = &si->altsetting[a];
+         struct usb_interface_descriptor* da = &di->altsetting[a];
+         memset(da, 0, sizeof(struct usb_interface_descriptor));
+         da->bLength = sa->bLength;
+         da->bDescriptorType = sa->bDescriptorType;
+         da->bInterfaceNumber = sa->bInterfaceNumber;
+         da->bAlternateSetting = sa->bAlternateSetting;
+         da->bNumEndpoints = sa->bNumEndpoints;
+         da->bInterfaceClass = sa->bInterfaceClass;
+         da->bInterfaceSubClass = sa->bInterfaceSubClass;
+         da->bInterfaceProtocol = sa->bInterfaceProtocol;
+         da->iInterface = sa->iInterface;
+         da->extra = usb1_extra(sa->extra, sa->extra_length);
+         da->extralen = da->extra ? sa->extra_length : 0;
+         da->endpoint = new struct usb_endpoint_descriptor[sa->bNumEndpoints];
+
+         // Endpoints
+         for(int e = 0; e < sa->bNumEndpoints; ++e) {
+            const struct libusb_endpoint_descriptor* se = &sa->endpoint[e];
+            struct usb_endpoint_descriptor* de = &da->endpoint[e];
+            memset(de, 0, sizeof(struct usb_endpoint_descriptor));
+            de->bLength = se->bLength;
+            de->bDescriptorType = se->bDescriptorType;
+            de->bEndpointAddress = se->bEndpointAddress;
+            de->bmAttributes = se->bmAttributes;
+            de->wMaxPacketSize = se->wMaxPacketSize;
+            de->bInterval = se->bInterval;
+            de->bRefresh = se->bRefresh;
+            de->bSynchAddress = se->bSynchAddress;
+            de->extra = usb1_extra(se->extra, se->extra_length);
+            de->extralen = de->extra ? se->extra_length : 0;
+         }
+      }
+   }
+}
+
+/** Free configuration converted by usb1_config(). */
+static void usb1_config_free(struct usb_config_descriptor* cfg)
+{
+   for(int i = 0; i < cfg->bNumInterfaces; ++i) {
+      struct usb_interface* iface = &cfg->interface[i];
+      for(int a = 0; a < iface->num_altsetting; ++a) {
+         struct usb_interface_descriptor* alt = &iface->altsetting[a];
+         for(int e = 0; e < alt->bNumEndpoints; ++e)
+            delete[] alt->endpoint[e].extra;
+         delete[] alt->endpoint;
+         delete[] alt->extra;
+      }
+      delete[] iface->altsetting;
+   }
+   delete[] cfg->interface;
+   delete[] cfg->extra;
+}
+
+Usb1Backend::Usb1Backend()
+   : mCtx(NULL), mEpoll(-1)
+{
+}
+
+bool Usb1Backend::start()
+{
+   // Initialize libusb
+   int res = libusb_init(&mCtx);
+   if(res < 0) {
+      error_msg("Usb1Backend: libusb_init failed: %s", libusb_error_name(res));
+      mCtx = NULL;
+      return false;
+   }
+
+   // Aggregate poll fds, transfer timeouts must be handled by a poll fd
+   if(!libusb_pollfds_handle_timeouts(mCtx))
+      error_msg("Usb1Backend: libusb doesn't handle timeouts in poll fds");
+   if((mEpoll = epoll_create(8)) < 0) {
+      error_msg("Usb1Backend: failed to create epoll instance");
+      return false;
+   }
+
+   const struct libusb_pollfd** fds = libusb_get_pollfds(mCtx);
+   for(int i = 0; fds != NULL && fds[i] != NULL; ++i)
+      added(fds[i]->fd, fds[i]->events, this);
+   libusb_free_pollfds(fds);
+   libusb_set_pollfd_notifiers(mCtx, &Usb1Backend::added, &Usb1Backend::removed, this);
+   return true;
+}
+
+Usb1Backend::~Usb1Backend()
+{
+   // Free devices
+   std::map<libusb_device*, struct usb_device*>::iterator i;
+   for(i = mDevices.begin(); i != mDevices.end(); ++i)
+      mGone.push_back(i->second);
+   for(unsigned k = 0; k < mGone.size(); ++k) {
+      struct usb_device* dev = mGone[k];
+      libusb_unref_device((libusb_device*) dev->dev);
+      for(int c = 0; dev->config && c < dev->descriptor.bNumConfigurations; ++c)
+         usb1_config_free(&dev->config[c]);
+      delete[] dev->config;
+      delete dev;
+   }
+   for(unsigned k = 0; k < mBusses.size(); ++k)
+      delete mBusses[k];
+
+   // Stop libusb
+   if(mCtx != NULL) {
+      libusb_set_pollfd_notifiers(mCtx, NULL, NULL, NULL);
+      libusb_exit(mCtx);
+   }
+   if(mEpoll >= 0)
+      ::close(mEpoll);
+}
+
+void Usb1Backend::added(int fd, short events, void* data)
+{
+   Usb1Backend* self = (Usb1Backend*) data;
+   struct epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+   ev.data.fd = fd;
+   epoll_ctl(self->mEpoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void Usb1Backend::removed(int fd, void* data)
+{
+   Usb1Backend* self = (Usb1Backend*) data;
+   epoll_ctl(self->mEpoll, EPOLL_CTL_DEL, fd, NULL);
+}
+
+struct usb_bus* Usb1Backend::bus(uint8_t busnum, int* created)
+{
+   // Find existing
+   for(unsigned i = 0; i < mBusses.size(); ++i) {
+      if(mBusses[i]->location == busnum)
+         return mBusses[i];
+   }
+
+   // Append new bus
+   struct usb_bus* b = new struct usb_bus;
+   memset(b, 0, sizeof(struct usb_bus));
+   b->location = busnum;
+   snprintf(b->dirname, sizeof(b->dirname), "%03u", busnum);
+   if(!mBusses.empty()) {
+      mBusses.back()->next = b;
+      b->prev = mBusses.back();
+   }
+   mBusses.push_back(b);
+   ++*created;
+   return b;
+}
+
+struct usb_device* Usb1Backend::create(libusb_device* ldev, struct usb_bus* b)
+{
+   struct usb_device* dev = new struct usb_device;
+   memset(dev, 0, sizeof(struct usb_device));
+   dev->bus = b;
+   dev->devnum = libusb_get_device_address(ldev);
+   snprintf(dev->filename, sizeof(dev->filename), "%03d", dev->devnum);
+   dev->dev = ldev;
+
+   // Device descriptor
+   struct libusb_device_descriptor desc;
+   if(libusb_get_device_descriptor(ldev, &desc) == 0) {
+      dev->descriptor.bLength = desc.bLength;
+      dev->descriptor.bDescriptorType = desc.bDescriptorType;
+      dev->descriptor.bcdUSB = desc.bcdUSB;
+      dev->descriptor.bDeviceClass = desc.bDeviceClass;
+      dev->descriptor.bDeviceSubClass = desc.bDeviceSubClass;
+      dev->descriptor.bDeviceProtocol = desc.bDeviceProtocol;
+      dev->descriptor.bMaxPacketSize0 = desc.bMaxPacketSize0;
+      dev->descriptor.idVendor = desc.idVendor;
+      dev->descriptor.idProduct = desc.idProduct;
+      dev->descriptor.bcdDevice = desc.bcdDevice;
+      dev->descriptor.iManufacturer = desc.iManufacturer;
+      dev->descriptor.iProduct = desc.iProduct;
+      dev->descriptor.iSerialNumber = desc.iSerialNumber;
+      dev->descriptor.bNumConfigurations = desc.bNumConfigurations;
+   }
+
+   // Configurations, unreadable ones are left empty
+   int count = dev->descriptor.bNumConfigurations;
+   if(count > 0) {
+      dev->config = new struct usb_config_descriptor[count];
+      for(int c = 0; c < count; ++c) {
+         struct libusb_config_descriptor* cfg = NULL;
+         if(libusb_get_config_descriptor(ldev, c, &cfg) == 0) {
+            usb1_config(&dev->config[c], cfg);
+            libusb_free_config_descriptor(cfg);
+         }
+         else {
+            memset(&dev->config[c], 0, sizeof(struct usb_config_descriptor));
+         }
+      }
+   }
+
+   return dev;
+}
+
+int Usb1Backend::scan(int* busses)
+{
+   *busses = 0;
+   if(mCtx == NULL)
+      return 0;
+
+   libusb_device** list = NULL;
+   ssize_t count = libusb_get_device_list(mCtx, &list);
+   if(count < 0)
+      return usb1_error(count);
+
+   // Add new devices
+   int changes = 0;
+   std::map<libusb_device*, struct usb_device*> present;
+   for(ssize_t i = 0; i < count; ++i) {
+      libusb_device* ldev = list[i];
+      std::map<libusb_device*, struct usb_device*>::iterator d = mDevices.find(ldev);
+      if(d != mDevices.end()) {
+         present.insert(*d);
+         mDevices.erase(d);
+         continue;
+      }
+
+      // Append to bus
+      struct usb_bus* b = bus(libusb_get_bus_number(ldev), busses);
+      struct usb_device* dev = create(libusb_ref_device(ldev), b);
+      struct usb_device* last = b->devices;
+      while(last != NULL && last->next != NULL)
+         last = last->next;
+      if(last != NULL) {
+         last->next = dev;
+         dev->prev = last;
+      }
+      else {
+         b->devices = dev;
+      }
+      present[ldev] = dev;
+      ++changes;
+   }
+   libusb_free_device_list(list, 0);
+
+   // Unlink removed devices
+   std::map<libusb_device*, struct usb_device*>::iterator i;
+   for(i = mDevices.begin(); i != mDevices.end(); ++i) {
+      struct usb_device* dev = i->second;
+      if(dev->prev != NULL)
+         dev->prev->next = dev->next;
+      else
+         dev->bus->devices = dev->next;
+      if(dev->next != NULL)
+         dev->next->prev = dev->prev;
+      dev->next = dev->prev = NULL;
+      mGone.push_back(dev);
+      ++changes;
+   }
+
+   mDevices.swap(present);
+   return changes;
+}
+
+int Usb1Backend::findBusses()
+{
+   int busses = 0;
+   scan(&busses);
+   return busses;
+}
+
+int Usb1Backend::findDevices()
+{
+   int busses = 0;
+   return scan(&busses);
+}
+
+struct usb_bus* Usb1Backend::busses()
+{
+   return mBusses.empty() ? NULL : mBusses[0];
+}
+
+usb_dev_handle* Usb1Backend::open(struct usb_device* dev)
+{
+   libusb_device_handle* lh = NULL;
+   int res = libusb_open((libusb_device*) dev->dev, &lh);
+   if(res < 0) {
+      debug_msg("libusb_open failed: %s", libusb_error_name(res));
+      return NULL;
+   }
+
+   usb_dev_handle* h = new usb_dev_handle;
+   memset(h, 0, sizeof(usb_dev_handle));
+   h->fd = -1;
+   h->bus = dev->bus;
+   h->device = dev;
+   h->config = h->interface = h->altsetting = -1;
+   h->impl_info = lh;
+   return h;
+}
+
+int Usb1Backend::close(usb_dev_handle* h)
+{
+   libusb_close((libusb_device_handle*) h->impl_info);
+   delete h;
+   return 0;
+}
+
+int Usb1Backend::setConfiguration(usb_dev_handle* h, int configuration)
+{
+   int res = usb1_error(libusb_set_configuration((libusb_device_handle*) h->impl_info, configuration));
+   if(res == 0)
+      h->config = configuration;
+   return res;
+}
+
+int Usb1Backend::setAltInterface(usb_dev_handle* h, int interface, int alternate)
+{
+   // Interface must be claimed
+   if(interface < 0)
+      return -EINVAL;
+
+   int res = usb1_error(libusb_set_interface_alt_setting((libusb_device_handle*) h->impl_info,
+                                                         interface, alternate));
+   if(res == 0 && interface == h->interface)
+      h->altsetting = alternate;
+   return res;
+}
+
+int Usb1Backend::resetEp(usb_dev_handle* h, unsigned ep)
+{
+   // Deprecated in libusb-0.1, resets data toggle like clear halt
+   return clearHalt(h, ep);
+}
+
+int Usb1Backend::clearHalt(usb_dev_handle* h, unsigned ep)
+{
+   return usb1_error(libusb_clear_halt((libusb_device_handle*) h->impl_info, ep));
+}
+
+int Usb1Backend::reset(usb_dev_handle* h)
+{
+   return usb1_error(libusb_reset_device((libusb_device_handle*) h->impl_info));
+}
+
+int Usb1Backend::claimInterface(usb_dev_handle* h, int interface)
+{
+   int res = usb1_error(libusb_claim_interface((libusb_device_handle*) h->impl_info, interface));
+   if(res == 0) {
+      h->interface = interface;
+      h->altsetting = 0;
+   }
+   return res;
+}
+
+int Usb1Backend::releaseInterface(usb_dev_handle* h, int interface)
+{
+   int res = usb1_error(libusb_release_interface((libusb_device_handle*) h->impl_info, interface));
+   if(res == 0) {
+      h->interface = -1;
+      h->altsetting = -1;
+   }
+   return res;
+}
+
+int Usb1Backend::controlMsg(usb_dev_handle* h, int requesttype, int request,
+                            int value, int index, char* bytes, int size, int timeout)
+{
+   return usb1_error(libusb_control_transfer((libusb_device_handle*) h->impl_info,
+                                             requesttype, request, value, index,
+                                             (unsigned char*) bytes, size, timeout));
+}
+
+int Usb1Backend::getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen)
+{
+   libusb_device_handle* lh = (libusb_device_handle*) h->impl_info;
+   int res = libusb_kernel_driver_active(lh, interface);
+   if(res <= 0)
+      return (res == 0) ? -ENODATA : usb1_error(res);
+
+   // Driver name from sysfs, <bus>-<port.port...>:<config>.<interface>
+   libusb_device* ldev = libusb_get_device(lh);
+   uint8_t ports[8];
+   int depth = libusb_get_port_numbers(ldev, ports, sizeof(ports));
+   int config = 0;
+   if(depth <= 0 || libusb_get_configuration(lh, &config) < 0)
+      return -ENODATA;
+
+   char path[PATH_MAX];
+   int len = snprintf(path, sizeof(path), "/sys/bus/usb/devices/%d-%d",
+                      libusb_get_bus_number(ldev), ports[0]);
+   for(int i = 1; i < depth; ++i)
+      len += snprintf(path + len, sizeof(path) - len, ".%d", ports[i]);
+   snprintf(path + len, sizeof(path) - len, ":%d.%d/driver", config, interface);
+
+   char link[PATH_MAX];
+   ssize_t n = readlink(path, link, sizeof(link) - 1);
+   if(n <= 0)
+      return -ENODATA;
+   link[n] = '\0';
+
+   const char* driver = strrchr(link, '/');
+   snprintf(name, namelen, "%s", driver ? driver + 1 : link);
+   return 0;
+}
+
+int Usb1Backend::detachKernelDriver(usb_dev_handle* h, int interface)
+{
+   return usb1_error(libusb_detach_kernel_driver((libusb_device_handle*) h->impl_info, interface));
+}
+
+int Usb1Backend::submit(UsbTransfer* t)
+{
+   struct libusb_transfer* lt = libusb_alloc_transfer(0);
+   if(lt == NULL)
+      return -ENOMEM;
+
+   // Fill transfer
+   libusb_device_handle* lh = (libusb_device_handle*) t->h->impl_info;
+   if(t->type == USB_ENDPOINT_TYPE_INTERRUPT)
+      libusb_fill_interrupt_transfer(lt, lh, t->ep, (unsigned char*) t->bytes, t->size,
+                                     &Usb1Backend::done, t, t->timeout);
+   else
+      libusb_fill_bulk_transfer(lt, lh, t->ep, (unsigned char*) t->bytes, t->size,
+                                &Usb1Backend::done, t, t->timeout);
+
+   // Submit, backend data is cleared on completion
+   pthread_mutex_lock(&sTransferLock);
+   t->priv = lt;
+   int res = libusb_submit_transfer(lt);
+   if(res < 0)
+      t->priv = NULL;
+   pthread_mutex_unlock(&sTransferLock);
+   if(res < 0) {
+      libusb_free_transfer(lt);
+      return usb1_error(res);
+   }
+
+   return 0;
+}
+
+int Usb1Backend::cancel(UsbTransfer* t)
+{
+   int res = -ENOENT;
+   pthread_mutex_lock(&sTransferLock);
+   if(t->priv != NULL)
+      res = usb1_error(libusb_cancel_transfer((struct libusb_transfer*) t->priv));
+   pthread_mutex_unlock(&sTransferLock);
+   return res;
+}
+
+void Usb1Backend::done(struct libusb_transfer* lt)
+{
+   UsbTransfer* t = (UsbTransfer*) lt->user_data;
+   t->res = usb1_status(lt);
+   pthread_mutex_lock(&sTransferLock);
+   t->priv = NULL;
+   pthread_mutex_unlock(&sTransferLock);
+   libusb_free_transfer(lt);
+   t->callback(t);
+}
+
+void Usb1Backend::processEvents(int timeout)
+{
+   if(mCtx == NULL)
+      return;
+
+   // Wait for pending events
+   struct epoll_event ev;
+   if(epoll_wait(mEpoll, &ev, 1, timeout) <= 0)
+      return;
+
+   // Complete transfers
+   struct timeval tv = { 0, 0 };
+   libusb_handle_events_timeout_completed(mCtx, &tv, NULL);
+}
+
+#endif // HAVE_LIBUSB1
+/** @} */
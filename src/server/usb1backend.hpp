@@ -0,0 +1,110 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usb1backend.hpp
+    \brief Asynchronous libusb-1.0 device access backend.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __usb1backend_hpp__
+#define __usb1backend_hpp__
+#ifdef HAVE_LIBUSB1
+#include "asyncbackend.hpp"
+#include <libusb.h>
+#include <map>
+#include <vector>
+
+/** Backend with devices attached to host, calls libusb-1.0.
+  * Devices are presented as libusb-0.1 structures, bulk and interrupt
+  * transfers are submitted with libusb_submit_transfer() and completed
+  * by libusb event handling. Event fd aggregates libusb poll fds,
+  * transfer timeouts are handled by libusb timerfd.
+  */
+class Usb1Backend : public AsyncBackend
+{
+   public:
+   Usb1Backend();
+   ~Usb1Backend();
+
+   /** Initialize libusb, call before use.
+     * \return false on error
+     */
+   bool start();
+
+   void init() {}
+   int findBusses();
+   int findDevices();
+   struct usb_bus* busses();
+   usb_dev_handle* open(struct usb_device* dev);
+   int close(usb_dev_handle* h);
+   int setConfiguration(usb_dev_handle* h, int configuration);
+   int setAltInterface(usb_dev_handle* h, int interface, int alternate);
+   int resetEp(usb_dev_handle* h, unsigned ep);
+   int clearHalt(usb_dev_handle* h, unsigned ep);
+   int reset(usb_dev_handle* h);
+   int claimInterface(usb_dev_handle* h, int interface);
+   int releaseInterface(usb_dev_handle* h, int interface);
+   int controlMsg(usb_dev_handle* h, int requesttype, int request,
+                  int value, int index, char* bytes, int size, int timeout);
+   int getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen);
+   int detachKernelDriver(usb_dev_handle* h, int interface);
+
+   int submit(UsbTransfer* t);
+   int cancel(UsbTransfer* t);
+   int eventFd() { return mEpoll; }
+
+   protected:
+   void processEvents(int timeout);
+
+   private:
+
+   /** Rescan devices.
+     * Removed devices are unlinked and kept until destroyed,
+     * open handles may still refer to them.
+     * \param busses set to number of new busses
+     * \return number of added and removed devices
+     */
+   int scan(int* busses);
+
+   /** Create device from libusb device. */
+   struct usb_device* create(libusb_device* dev, struct usb_bus* bus);
+
+   /** Return bus by number, created on first use.
+     * \param created incremented if bus is created
+     */
+   struct usb_bus* bus(uint8_t busnum, int* created);
+
+   /** Transfer completion, called from libusb event handling. */
+   static void LIBUSB_CALL done(struct libusb_transfer* lt);
+
+   /* Poll fd notifiers, keep event fd in sync. */
+   static void LIBUSB_CALL added(int fd, short events, void* data);
+   static void LIBUSB_CALL removed(int fd, void* data);
+
+   libusb_context* mCtx;
+   int mEpoll;                                      // Aggregated libusb poll fds
+   std::map<libusb_device*, struct usb_device*> mDevices; // Present devices, referenced
+   std::vector<struct usb_device*> mGone;           // Removed devices, referenced
+   std::vector<struct usb_bus*> mBusses;            // Linked in order of creation
+};
+
+#endif // HAVE_LIBUSB1
+#endif // __usb1backend_hpp__
+/** @} */
@@ -0,0 +1,143 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbbackend.cpp
+    \brief Device access backends.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "usbbackend.hpp"
+
+void LibusbBackend::init()
+{
+   ::usb_init();
+}
+
+int LibusbBackend::findBusses()
+{
+   return ::usb_find_busses();
+}
+
+int LibusbBackend::findDevices()
+{
+   return ::usb_find_devices();
+}
+
+struct usb_bus* LibusbBackend::busses()
+{
+   return ::usb_get_busses();
+}
+
+usb_dev_handle* LibusbBackend::open(struct usb_device* dev)
+{
+   return ::usb_open(dev);
+}
+
+int LibusbBackend::close(usb_dev_handle* h)
+{
+   return ::usb_close(h);
+}
+
+int LibusbBackend::setConfiguration(usb_dev_handle* h, int configuration)
+{
+   return ::usb_set_configuration(h, configuration);
+}
+
+int LibusbBackend::setAltInterface(usb_dev_handle* h, int interface, int alternate)
+{
+   // libusb-0.1 selects alternate setting of last claimed interface
+   int claimed = h->interface, altsetting = h->altsetting;
+   h->interface = interface;
+   int res = ::usb_set_altinterface(h, alternate);
+   h->interface = claimed;
+   if(interface != claimed)
+      h->altsetting = altsetting;
+   return res;
+}
+
+int LibusbBackend::resetEp(usb_dev_handle* h, unsigned ep)
+{
+   return ::usb_resetep(h, ep);
+}
+
+int LibusbBackend::clearHalt(usb_dev_handle* h, unsigned ep)
+{
+   return ::usb_clear_halt(h, ep);
+}
+
+int LibusbBackend::reset(usb_dev_handle* h)
+{
+   return ::usb_reset(h);
+}
+
+int LibusbBackend::claimInterface(usb_dev_handle* h, int interface)
+{
+   return ::usb_claim_interface(h, interface);
+}
+
+int LibusbBackend::releaseInterface(usb_dev_handle* h, int interface)
+{
+   return ::usb_release_interface(h, interface);
+}
+
+int LibusbBackend::controlMsg(usb_dev_handle* h, int requesttype, int request,
+                              int value, int index, char* bytes, int size, int timeout)
+{
+   return ::usb_control_msg(h, requesttype, request, value, index, bytes, size, timeout);
+}
+
+int LibusbBackend::bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return ::usb_bulk_read(h, ep, bytes, size, timeout);
+}
+
+int LibusbBackend::bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return ::usb_bulk_write(h, ep, bytes, size, timeout);
+}
+
+int LibusbBackend::interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return ::usb_interrupt_read(h, ep, bytes, size, timeout);
+}
+
+int LibusbBackend::interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout)
+{
+   return ::usb_interrupt_write(h, ep, bytes, size, timeout);
+}
+
+int LibusbBackend::getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen)
+{
+#if LIBUSB_HAS_GET_DRIVER_NP
+   return ::usb_get_driver_np(h, interface, name, namelen);
+#else
+   return -1;
+#endif
+}
+
+int LibusbBackend::detachKernelDriver(usb_dev_handle* h, int interface)
+{
+#if LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
+   return ::usb_detach_kernel_driver_np(h, interface);
+#else
+   return 0;
+#endif
+}
+
+/** @} */
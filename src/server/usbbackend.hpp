@@ -0,0 +1,168 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbbackend.hpp
+    \brief Device access backends.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __usbbackend_hpp__
+#define __usbbackend_hpp__
+#include "usbnet.h"
+#include <cerrno>
+
+struct UsbTransfer;
+
+/** Transfer completion callback. */
+typedef void (*UsbTransferCallback)(struct UsbTransfer* t);
+
+/** Asynchronous bulk or interrupt transfer.
+  * Caller owns transfer and buffer until the callback is called.
+  */
+struct UsbTransfer
+{
+   usb_dev_handle* h;
+   int type;                     //! Transfer type (USB_ENDPOINT_TYPE_*)
+   int ep;                       //! Endpoint address including direction
+   char* bytes;
+   int size;
+   int timeout;                  //! Timeout (ms)
+   int res;                      //! Transferred bytes or negative errno
+   UsbTransferCallback callback; //! Called once on completion
+   void* data;                   //! Caller data
+   void* priv;                   //! Backend data
+};
+
+/** Return endpoint index 0-31, IN endpoints follow OUT. */
+static inline int usb_epindex(int ep) {
+   return (ep & 0x0f) | ((ep & USB_ENDPOINT_IN) >> 3);
+}
+
+/** Device access used by server, mirrors libusb-0.1 calls.
+  * Calls on open devices may be called from multiple threads,
+  * each device is used by one thread at a time.
+  */
+class UsbBackend
+{
+   public:
+   virtual ~UsbBackend() {}
+
+   /* (1) Core functions. */
+   virtual void init() = 0;
+   virtual int findBusses() = 0;
+   virtual int findDevices() = 0;
+   virtual struct usb_bus* busses() = 0;
+
+   /* (2) Device controls. */
+   virtual usb_dev_handle* open(struct usb_device* dev) = 0;
+   virtual int close(usb_dev_handle* h) = 0;
+   virtual int setConfiguration(usb_dev_handle* h, int configuration) = 0;
+   virtual int setAltInterface(usb_dev_handle* h, int interface, int alternate) = 0;
+   virtual int resetEp(usb_dev_handle* h, unsigned ep) = 0;
+   virtual int clearHalt(usb_dev_handle* h, unsigned ep) = 0;
+   virtual int reset(usb_dev_handle* h) = 0;
+   virtual int claimInterface(usb_dev_handle* h, int interface) = 0;
+   virtual int releaseInterface(usb_dev_handle* h, int interface) = 0;
+
+   /* (3) Transfers. */
+   virtual int controlMsg(usb_dev_handle* h, int requesttype, int request,
+                          int value, int index, char* bytes, int size, int timeout) = 0;
+   virtual int bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout) = 0;
+   virtual int bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout) = 0;
+   virtual int interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout) = 0;
+   virtual int interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout) = 0;
+
+   /* (4) Non-portable. */
+   virtual int getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen) = 0;
+   virtual int detachKernelDriver(usb_dev_handle* h, int interface) = 0;
+
+   /* (5) Asynchronous transfers, optional. */
+
+   /** Return true if backend supports submit(). */
+   virtual bool async() { return false; }
+
+   /** Submit bulk or interrupt transfer, returns immediately.
+     * Callback is called from a thread handling events,
+     * cancelled transfer completes with -ECANCELED.
+     * \return 0 or negative errno if not submitted
+     */
+   virtual int submit(UsbTransfer* /* t */) { return -ENOSYS; }
+
+   /** Cancel submitted transfer, completes asynchronously.
+     * \return 0 or negative errno
+     */
+   virtual int cancel(UsbTransfer* /* t */) { return -ENOSYS; }
+
+   /** Abort synchronous bulk or interrupt call in progress on device,
+     * it returns -ECANCELED or its result if it's finishing already.
+     * \return 0 or negative errno if no call is aborted
+     */
+   virtual int abort(usb_dev_handle* /* h */) { return -ENOSYS; }
+
+   /** Return fd readable when events are pending or -1.
+     */
+   virtual int eventFd() { return -1; }
+
+   /** Handle pending events and complete transfers.
+     * One thread handles events at a time, others wait until it's done
+     * or timeout elapses.
+     * \param timeout maximum wait (ms), 0 doesn't block
+     * \return false if events are left to other handler and timeout is 0,
+     *         ready function is called when it's done, see setReady()
+     */
+   virtual bool handleEvents(int /* timeout */ = 0) { return true; }
+
+   /** Set function called when events left to other handler may be handled again.
+     * \param ready called from thread that handled events
+     * \param arg ready function argument
+     */
+   virtual void setReady(void (* /* ready */)(void*), void* /* arg */) {}
+};
+
+/** Backend with devices attached to host, calls libusb.
+  */
+class LibusbBackend : public UsbBackend
+{
+   public:
+   void init();
+   int findBusses();
+   int findDevices();
+   struct usb_bus* busses();
+   usb_dev_handle* open(struct usb_device* dev);
+   int close(usb_dev_handle* h);
+   int setConfiguration(usb_dev_handle* h, int configuration);
+   int setAltInterface(usb_dev_handle* h, int interface, int alternate);
+   int resetEp(usb_dev_handle* h, unsigned ep);
+   int clearHalt(usb_dev_handle* h, unsigned ep);
+   int reset(usb_dev_handle* h);
+   int claimInterface(usb_dev_handle* h, int interface);
+   int releaseInterface(usb_dev_handle* h, int interface);
+   int controlMsg(usb_dev_handle* h, int requesttype, int request,
+                  int value, int index, char* bytes, int size, int timeout);
+   int bulkRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int bulkWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptRead(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int interruptWrite(usb_dev_handle* h, int ep, char* bytes, int size, int timeout);
+   int getDriver(usb_dev_handle* h, int interface, char* name, unsigned namelen);
+   int detachKernelDriver(usb_dev_handle* h, int interface);
+};
+
+#endif // __usbbackend_hpp__
+/** @} */
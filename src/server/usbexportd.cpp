@@ -23,6 +23,8 @@
     @{
   */
 #include "usbservice.hpp"
+#include "simbackend.hpp"
+#include "usb1backend.hpp"
 #include "cmdflags.hpp"
 #include "common.h"
 #include <csignal>
@@ -44,10 +46,17 @@ int main(int argc, char* argv[])
 {
    // Command line options
    int host = ServerSocket::All;
+   int backlog = 128;
+   std::string simulate, trace;
+   bool async = false;
 
    // Parse command line arguments
    CmdFlags cmd(argc, argv);
    cmd.add('l', "local", "Bind to localhost only.")
+      .add('b', "backlog", "Pending connections limit.", "128")
+      .add('s', "simulate", "Serve simulated devices from description file.")
+      .add('r', "record",   "Record exchanged packets to trace file, see usbreplay.")
+      .add('A', "async",    "Asynchronous transfers (libusb-1.0 or simulated devices).", "", false)
       .add('q', "quiet", "Quiet output", "", false)
       .add('?', "help",  "Print help",   "", false);
 
@@ -65,6 +74,18 @@ int main(int argc, char* argv[])
       case 'l':
          host = ServerSocket::Local;
          break;
+      case 'b':
+         backlog = atoi(m.second.c_str());
+         break;
+      case 's':
+         simulate = m.second;
+         break;
+      case 'r':
+         trace = m.second;
+         break;
+      case 'A':
+         async = true;
+         break;
       case '?':
          cmd.printHelp();
          return EXIT_SUCCESS;
@@ -82,9 +103,43 @@ int main(int argc, char* argv[])
    if(host == ServerSocket::Local)
       log_msg("Server: binding to localhost only");
 
+   // Device backend
+   LibusbBackend libusb;
+   SimBackend sim;
+   UsbBackend* backend = &libusb;
+   if(!simulate.empty()) {
+      if(!sim.load(simulate.c_str()))
+         return EXIT_FAILURE;
+      backend = &sim;
+   }
+
+   // Asynchronous transfers, fake transport for simulated devices
+   SimAsyncBackend simasync(&sim);
+#ifdef HAVE_LIBUSB1
+   Usb1Backend usb1;
+#endif
+   if(async) {
+      if(!simulate.empty()) {
+         backend = &simasync;
+      }
+      else {
+#ifdef HAVE_LIBUSB1
+         if(!usb1.start())
+            return EXIT_FAILURE;
+         backend = &usb1;
+#else
+         error_msg("Server: asynchronous transfers need libusb-1.0, not compiled in");
+         return EXIT_FAILURE;
+#endif
+      }
+      log_msg("Server: using asynchronous transfers");
+   }
+
    // Create server socket
-   UsbService service;
-   if(service.listen(22222, host) != Socket::Ok) {
+   UsbService service(backend);
+   if(!trace.empty() && !service.record(trace.c_str()))
+      return EXIT_FAILURE;
+   if(service.listen(22222, host, backlog) != Socket::Ok) {
       return EXIT_FAILURE;
    }
 
@@ -96,6 +151,9 @@ int main(int argc, char* argv[])
    sa.sa_flags = 0;
    sigaction(SIGINT, &sa, NULL);
 
+   // Workers may reply to disconnected clients
+   signal(SIGPIPE, SIG_IGN);
+
    // Process client requests
    service.run();
 
@@ -23,26 +23,107 @@
     @{
   */
 #include "usbservice.hpp"
+#include "deviceprogram.hpp"
 #include "protocol.hpp"
+#include "shmlink.h"
 #include <netinet/tcp.h>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
 
-UsbService::UsbService(int fd)
-   : ServerSocket(fd)
+UsbService::UsbService(UsbBackend* backend, int fd)
+   : ServerSocket(fd), mTimed(backend, &mStats), mBackend(&mTimed), mGeneration(time(NULL))
 {
    // Disable TCP buffering
    int flag = 1;
    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+   // Initialize locks
+   pthread_mutex_init(&mOpenLock, NULL);
+   pthread_mutex_init(&mWorkerLock, NULL);
+   pthread_mutex_init(&mCodecLock, NULL);
+   pthread_mutex_init(&mLocalLock, NULL);
+   for(int i = 0; i < SendLocks; ++i)
+      pthread_mutex_init(&mSendLock[i], NULL);
+   pthread_key_create(&mBatchKey, NULL);
+   pthread_key_create(&mLinkKey, NULL);
+   mTrace.fd = -1;
+
+   // Handle backend events in event loop
+   int efd = mBackend->eventFd();
+   if(efd >= 0) {
+      watch(efd);
+      mBackend->setReady(&UsbService::events_ready, this);
+   }
 }
 
 UsbService::~UsbService()
 {
+   // Stop workers
+   std::map<int, Worker*> workers;
+   pthread_mutex_lock(&mWorkerLock);
+   workers.swap(mWorkers);
+   pthread_mutex_unlock(&mWorkerLock);
+   std::map<int, Worker*>::iterator w;
+   for(w = workers.begin(); w != workers.end(); ++w) {
+      pthread_t thread = w->second->thread;
+      pthread_mutex_lock(&w->second->lock);
+      w->second->stop = true;
+      pthread_cond_signal(&w->second->cond);
+      pthread_mutex_unlock(&w->second->lock);
+      pthread_join(thread, NULL);
+   }
+
    // Close open devices
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      log_msg("UsbService: closing open device %p", *i);
-      ::usb_close(*i);
+   std::vector<Handle>::iterator i;
+   for(i = mHandles.begin(); i != mHandles.end(); ++i) {
+      if(i->h != NULL) {
+         log_msg("UsbService: closing open device %p", i->h);
+         mBackend->close(i->h);
+      }
+   }
+   mHandles.clear();
+   mFreeSlots.clear();
+
+   // Free compressors
+   std::map<int, Compressor*>::iterator z;
+   for(z = mCodecs.begin(); z != mCodecs.end(); ++z) {
+      codec_free(z->second);
+      delete z->second;
    }
-   mOpenList.clear();
+   mCodecs.clear();
+
+   // Free locks
+   pthread_mutex_destroy(&mOpenLock);
+   pthread_mutex_destroy(&mWorkerLock);
+   pthread_mutex_destroy(&mCodecLock);
+   pthread_mutex_destroy(&mLocalLock);
+   for(int i = 0; i < SendLocks; ++i)
+      pthread_mutex_destroy(&mSendLock[i]);
+   pthread_key_delete(mBatchKey);
+   pthread_key_delete(mLinkKey);
+   trace_close(&mTrace);
+}
+
+bool UsbService::record(const char* path)
+{
+   trace_close(&mTrace);
+   return trace_open(&mTrace, path);
+}
+
+/** Return call flags, see usbschema.h. */
+static int call_flags(uint8_t op)
+{
+   switch(op)
+   {
+#define CALL_FLAGS(op, handler, f) case op: return (f);
+      SCHEMA_CALLS(CALL_FLAGS)
+#undef CALL_FLAGS
+      default:
+         break;
+   }
+
+   return 0;
 }
 
 bool UsbService::handle(int fd, Packet& pkt)
@@ -51,157 +132,906 @@ bool UsbService::handle(int fd, Packet& pkt)
    if(pkt.size() <= 0)
       return false;
 
-   // Packet handling
+   // Record request
+   if(mTrace.fd >= 0)
+      trace_write(&mTrace, fd, TraceRequest, pkt.op(), pkt.id(), pkt.payload(), pkt.payloadSize());
+
+   // Cancel isn't queued behind the call it cancels
+   if(pkt.op() == UsbCancel)
+      return dispatch(fd, pkt);
+
+   // Calls on device, first parameter is device fd
+   if(!(call_flags(pkt.op()) & SchemaDevice) || pkt.payloadSize() < SCHEMA_SIZE_i32)
+      return dispatchLocal(fd, pkt);
+
+   // Unknown device is handled in place, checked under worker lock
+   // so a racing close can't leave a worker behind for a closed device
+   int devfd = schema_get_i32(pkt.payload());
+   pthread_mutex_lock(&mWorkerLock);
+   Worker* w = NULL;
+   if(device(devfd) != NULL)
+      w = worker(devfd, true);
+   if(w == NULL) {
+      pthread_mutex_unlock(&mWorkerLock);
+      return dispatchLocal(fd, pkt);
+   }
+
+   Job job;
+   job.fd = fd;
+   job.pkt = new Packet();
+   job.pkt->swap(pkt);
+   job.link = (pthread_getspecific(mLinkKey) != NULL);
+   retain(fd);
+   pthread_mutex_lock(&w->lock);
+   w->queue.push_back(job);
+   pthread_cond_signal(&w->cond);
+   pthread_mutex_unlock(&w->lock);
+   pthread_mutex_unlock(&mWorkerLock);
+   return true;
+}
+
+bool UsbService::dispatchLocal(int fd, Packet& pkt)
+{
+   pthread_mutex_lock(&mLocalLock);
+   bool res = dispatch(fd, pkt);
+   pthread_mutex_unlock(&mLocalLock);
+   return res;
+}
+
+bool UsbService::dispatch(int fd, Packet& pkt)
+{
+   // Decode request and call handler
    switch(pkt.op())
    {
-      case UsbInit:        usb_init(fd, pkt);         break;
-      case UsbFindBusses:  usb_find_busses(fd, pkt);  break;
-      case UsbFindDevices: usb_find_devices(fd, pkt); break;
-      case UsbOpen:        usb_open(fd, pkt);         break;
-      case UsbClose:       usb_close(fd, pkt);        break;
-      case UsbControlMsg:  usb_control_msg(fd, pkt);  break;
-      case UsbClaimInterface: usb_claim_interface(fd, pkt); break;
-      case UsbReleaseInterface: usb_release_interface(fd, pkt); break;
-      case UsbGetKernelDriver: usb_get_kernel_driver(fd, pkt); break;
-      case UsbDetachKernelDriver: usb_detach_kernel_driver(fd, pkt); break;
-      case UsbBulkRead:    usb_bulk_read(fd, pkt);    break;
-      case UsbBulkWrite:   usb_bulk_write(fd, pkt);   break;
-      case UsbSetConfiguration: usb_set_configuration(fd, pkt); break;
-      case UsbSetAltInterface: usb_set_altinterface(fd, pkt); break;
-      case UsbResetEp:     usb_resetep(fd, pkt); break;
-      case UsbClearHalt:   usb_clear_halt(fd, pkt); break;
-      case UsbReset:       usb_reset(fd, pkt); break;
-      case UsbInterruptWrite: usb_interrupt_write(fd, pkt); break;
-      case UsbInterruptRead: usb_interrupt_read(fd, pkt); break;
+#define CALL_DISPATCH(op, handler, flags) \
+      case op: { \
+         op##Req req; \
+         if(!pkt.getMessage(req)) \
+            break; \
+         ServerStats::Call call; \
+         mStats.begin(call, op, pkt.payloadSize()); \
+         handler(fd, pkt, req); \
+         mStats.end(call); \
+         return true; \
+      }
+      SCHEMA_CALLS(CALL_DISPATCH)
+#undef CALL_DISPATCH
       default:
          log_msg("%s: unhandled call type: 0x%02x (socket fd %d)", __func__, pkt.op(), fd);
          return false;
          break;
    }
 
-   return true;
+   log_msg("%s: malformed call 0x%02x (socket fd %d)", __func__, pkt.op(), fd);
+   return false;
+}
+
+UsbService::Handle* UsbService::slot(int devfd)
+{
+   // Check slot index and generation
+   unsigned index = devfd & ((1 << SlotBits) - 1);
+   if(devfd < 0 || index >= mHandles.size())
+      return NULL;
+
+   Handle* s = &mHandles[index];
+   if(s->h == NULL || s->gen != (devfd >> SlotBits))
+      return NULL;
+
+   return s;
+}
+
+int UsbService::attach(usb_dev_handle* h)
+{
+   pthread_mutex_lock(&mOpenLock);
+
+   // Reuse free slot or append new
+   unsigned index = mHandles.size();
+   if(!mFreeSlots.empty()) {
+      index = mFreeSlots.back();
+      mFreeSlots.pop_back();
+   }
+   else if(index < (1 << SlotBits)) {
+      Handle empty;
+      memset(&empty, 0, sizeof(Handle));
+      mHandles.push_back(empty);
+   }
+   else {
+      pthread_mutex_unlock(&mOpenLock);
+      return -1;
+   }
+
+   // Generation is never 0, so device id is never 0
+   Handle* s = &mHandles[index];
+   if(++s->gen > MaxGen)
+      s->gen = 1;
+   s->h = h;
+   s->config = -1;
+   memset(s->ep, 0, sizeof(s->ep));
+   int devfd = (s->gen << SlotBits) | index;
+   pthread_mutex_unlock(&mOpenLock);
+   return devfd;
+}
+
+usb_dev_handle* UsbService::detach(int devfd)
+{
+   pthread_mutex_lock(&mOpenLock);
+   usb_dev_handle* h = NULL;
+   Handle* s = slot(devfd);
+   if(s != NULL) {
+      h = s->h;
+      s->h = NULL;
+      mFreeSlots.push_back(s - &mHandles[0]);
+   }
+   pthread_mutex_unlock(&mOpenLock);
+   return h;
+}
+
+void UsbService::configure(int devfd, int config, int iface, int alt)
+{
+   pthread_mutex_lock(&mOpenLock);
+   Handle* s = slot(devfd);
+   if(s == NULL) {
+      pthread_mutex_unlock(&mOpenLock);
+      return;
+   }
+
+   // Drop changed endpoints
+   for(int i = 0; i < 32; ++i) {
+      if(iface < 0 || s->ep[i].iface == iface)
+         memset(&s->ep[i], 0, sizeof(Endpoint));
+   }
+   if(iface < 0)
+      s->config = config;
+
+   // Find active configuration
+   struct usb_device* dev = s->h->device;
+   struct usb_config_descriptor* cfg = NULL;
+   for(int i = 0; s->config > 0 && dev->config != NULL && i < dev->descriptor.bNumConfigurations; ++i) {
+      if(dev->config[i].bConfigurationValue == s->config)
+         cfg = &dev->config[i];
+   }
+
+   // Unknown configuration, endpoints won't be checked
+   if(cfg == NULL) {
+      if(s->config > 0)
+         s->config = -1;
+      pthread_mutex_unlock(&mOpenLock);
+      return;
+   }
+
+   // Cache endpoints of active altsettings, altsetting 0 after configuration change
+   for(int i = 0; i < cfg->bNumInterfaces; ++i) {
+      struct usb_interface* intf = &cfg->interface[i];
+      for(int j = 0; j < intf->num_altsetting; ++j) {
+         struct usb_interface_descriptor* d = &intf->altsetting[j];
+         if(iface < 0 ? (d->bAlternateSetting != 0)
+                      : (d->bInterfaceNumber != iface || d->bAlternateSetting != alt))
+            continue;
+
+         for(int k = 0; k < d->bNumEndpoints; ++k) {
+            struct usb_endpoint_descriptor* e = &d->endpoint[k];
+            Endpoint& ep = s->ep[usb_epindex(e->bEndpointAddress)];
+            ep.maxpacket = e->wMaxPacketSize;
+            ep.type = e->bmAttributes & USB_ENDPOINT_TYPE_MASK;
+            ep.iface = d->bInterfaceNumber;
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&mOpenLock);
+}
+
+usb_dev_handle* UsbService::device(int devfd)
+{
+   // Find open device
+   pthread_mutex_lock(&mOpenLock);
+   Handle* s = slot(devfd);
+   usb_dev_handle* h = (s != NULL) ? s->h : NULL;
+   pthread_mutex_unlock(&mOpenLock);
+
+   return h;
+}
+
+usb_dev_handle* UsbService::device(int devfd, int ep, int* res)
+{
+   // Find open device
+   pthread_mutex_lock(&mOpenLock);
+   Handle* s = slot(devfd);
+   usb_dev_handle* h = (s != NULL) ? s->h : NULL;
+
+   // Endpoint not in known active configuration
+   if(h != NULL && s->config >= 0 && s->ep[usb_epindex(ep)].maxpacket == 0) {
+      *res = -ENOENT;
+      h = NULL;
+   }
+   pthread_mutex_unlock(&mOpenLock);
+
+   return h;
+}
+
+uint32_t UsbService::endpoints(int devfd)
+{
+   // Endpoints in known active configuration
+   uint32_t mask = 0xffffffff;
+   pthread_mutex_lock(&mOpenLock);
+   Handle* s = slot(devfd);
+   if(s != NULL && s->config >= 0) {
+      mask = 0;
+      for(int i = 0; i < 32; ++i) {
+         if(s->ep[i].maxpacket != 0)
+            mask |= 1U << i;
+      }
+   }
+   pthread_mutex_unlock(&mOpenLock);
+
+   return mask;
+}
+
+void UsbService::reply(int fd, Packet& pkt, bool link)
+{
+   mStats.sent(pkt.size());
+
+   // Batched call, append to batch reply
+   Packet* batch = (Packet*) pthread_getspecific(mBatchKey);
+   if(batch != NULL) {
+      uint32_t size = pkt.payloadSize();
+      char* dst = batch->alloc(UsbBatchEntrySize + size);
+      dst = schema_put_u8(dst, pkt.op());
+      dst = schema_put_u32(dst, size);
+      memcpy(dst, pkt.payload(), size);
+      return;
+   }
+
+   // Record reply
+   if(mTrace.fd >= 0)
+      trace_write(&mTrace, fd, TraceReply, pkt.op(), pkt.id(), pkt.payload(), pkt.payloadSize());
+
+   pthread_mutex_t* lock = &mSendLock[fd % SendLocks];
+   pthread_mutex_lock(lock);
+
+   // Find negotiated compressor
+   Compressor* z = NULL;
+   pthread_mutex_lock(&mCodecLock);
+   std::map<int, Compressor*>::iterator i = mCodecs.find(fd);
+   if(i != mCodecs.end())
+      z = i->second;
+   pthread_mutex_unlock(&mCodecLock);
+
+   pkt.send(fd, z, link);
+   pthread_mutex_unlock(lock);
+}
+
+UsbService::Worker* UsbService::worker(int devfd, bool create)
+{
+   // Find existing
+   std::map<int, Worker*>::iterator i = mWorkers.find(devfd);
+   if(i != mWorkers.end())
+      return i->second;
+
+   if(!create)
+      return NULL;
+
+   // Start new worker
+   Worker* w = new Worker;
+   w->service = this;
+   w->devfd = devfd;
+   w->runFd = -1;
+   w->runId = 0;
+   w->stop = false;
+   pthread_mutex_init(&w->lock, NULL);
+   pthread_cond_init(&w->cond, NULL);
+   if(pthread_create(&w->thread, NULL, &worker_run, w) != 0) {
+      error_msg("%s: failed to start worker for fd %d", __func__, devfd);
+      pthread_mutex_destroy(&w->lock);
+      pthread_cond_destroy(&w->cond);
+      delete w;
+      return NULL;
+   }
+
+   debug_msg("started worker for fd %d", devfd);
+   mWorkers[devfd] = w;
+   return w;
+}
+
+UsbService::Worker* UsbService::current(int devfd)
+{
+   // Find device worker
+   pthread_mutex_lock(&mWorkerLock);
+   Worker* w = worker(devfd);
+   pthread_mutex_unlock(&mWorkerLock);
+
+   // Check calling thread
+   if(w != NULL && !pthread_equal(w->thread, pthread_self()))
+      w = NULL;
+
+   return w;
+}
+
+void* UsbService::worker_run(void* arg)
+{
+   Worker* w = (Worker*) arg;
+   UsbService* self = w->service;
+   bool pending = false;
+
+   pthread_mutex_lock(&w->lock);
+   for(;;) {
+
+      // Wait for work, keep serving streams with credits
+      while(w->queue.empty() && w->done.empty() && !w->stop && !pending)
+         pthread_cond_wait(&w->cond, &w->lock);
+
+      if(w->queue.empty() && w->stop)
+         break;
+
+      // Execute queued call
+      if(!w->queue.empty()) {
+         Job job = w->queue.front();
+         w->queue.pop_front();
+         if(job.pkt != NULL) {
+            w->runFd = job.fd;
+            w->runId = job.pkt->id();
+         }
+         pthread_mutex_unlock(&w->lock);
+
+         if(job.pkt != NULL) {
+            pthread_setspecific(self->mLinkKey, job.link ? w : NULL);
+            self->dispatch(job.fd, *job.pkt);
+            pthread_setspecific(self->mLinkKey, NULL);
+            delete job.pkt;
+         }
+         else
+            self->drop(w, job.fd, -1);
+
+         self->release(job.fd);
+
+         pthread_mutex_lock(&w->lock);
+         w->runFd = -1;
+      }
+
+      // Push completed transfers
+      if(!w->done.empty()) {
+         std::list<StreamTransfer*> done;
+         done.swap(w->done);
+         pthread_mutex_unlock(&w->lock);
+         std::list<StreamTransfer*>::iterator i;
+         for(i = done.begin(); i != done.end(); ++i)
+            self->complete(w, *i);
+         pthread_mutex_lock(&w->lock);
+      }
+
+      // Serve read-ahead
+      pending = false;
+      if(!w->streams.empty() && !w->stop) {
+         pthread_mutex_unlock(&w->lock);
+         pending = self->serve(w);
+         pthread_mutex_lock(&w->lock);
+      }
+   }
+   pthread_mutex_unlock(&w->lock);
+
+   // Finish transfers in flight
+   if(!w->streams.empty())
+      self->drop(w, -1, -1);
+
+   // Worker is detached when removed by device close
+   debug_msg("stopped worker for fd %d", w->devfd);
+   pthread_mutex_destroy(&w->lock);
+   pthread_cond_destroy(&w->cond);
+   delete w;
+   return NULL;
+}
+
+bool UsbService::serve(Worker* w)
+{
+   // Asynchronous backend keeps transfers in flight instead
+   if(mBackend->async()) {
+      submit(w);
+      return false;
+   }
+
+   // Serve one transfer per stream with credits
+   bool pending = false;
+   std::list<Stream>::iterator i = w->streams.begin();
+   while(i != w->streams.end()) {
+      if(i->credits <= 0 || i->paused) {
+         ++i;
+         continue;
+      }
+
+      // Transfers are recorded as stream calls
+      ServerStats::Call call;
+      mStats.begin(call, UsbBulkStream, 0);
+
+      // Read directly to pushed packet, stream keeps the buffer
+      Packet pkt;
+      pkt.swapBuffer(i->buf);
+      pkt.reset(UsbBulkStreamData);
+      int pos = pkt.currentPos();
+      char* data = pkt.alloc(UsbBulkStreamDataMsgSize + i->size) + UsbBulkStreamDataMsgSize;
+      int res = mBackend->bulkRead(i->h, i->ep, data, i->size, i->timeout);
+      pkt.truncate(pos + UsbBulkStreamDataMsgSize + ((res < 0) ? 0 : res));
+      --i->credits;
+
+      // Write result in front of data
+      UsbBulkStreamDataMsg msg = { w->devfd, i->ep, res, NULL, 0 };
+      UsbBulkStreamDataMsg_pack(pkt.at(pos), &msg);
+
+      // Push buffer
+      reply(i->fd, pkt, i->link);
+      pkt.swapBuffer(i->buf);
+      mStats.end(call);
+
+      // Error other than timeout ends stream
+      if(res < 0 && res != -ETIMEDOUT) {
+         debug_msg("stream fd %d, ep 0x%02x ended (%d)", w->devfd, i->ep, res);
+         release(i->fd);
+         i = w->streams.erase(i);
+         continue;
+      }
+
+      // Timeout pauses stream until client reads it
+      if(res == -ETIMEDOUT)
+         i->paused = true;
+
+      pending |= (i->credits > 0 && !i->paused);
+      ++i;
+   }
+
+   return pending;
+}
+
+void UsbService::submit(Worker* w)
+{
+   // Submit transfer per credit
+   std::list<Stream>::iterator i;
+   for(i = w->streams.begin(); i != w->streams.end(); ++i) {
+      while(i->credits > 0 && !i->ended && !i->paused) {
+
+         // Read directly to pushed packet in pool buffer
+         StreamTransfer* st = new StreamTransfer;
+         st->w = w;
+         st->stream = &*i;
+         st->buf = w->pool.take(i->size + TransferOverhead);
+         st->pkt.swapBuffer(*st->buf);
+         st->pkt.reset(UsbBulkStreamData);
+         st->pos = st->pkt.currentPos();
+         char* data = st->pkt.alloc(UsbBulkStreamDataMsgSize + i->size) + UsbBulkStreamDataMsgSize;
+         UsbTransfer t = { i->h, USB_ENDPOINT_TYPE_BULK, i->ep | USB_ENDPOINT_IN, data, i->size,
+                           i->timeout, 0, &UsbService::completed, st, NULL };
+         st->t = t;
+         st->start = ServerStats::now();
+         --i->credits;
+         i->inflight.push_back(st);
+
+         // Failed submit completes with error
+         int res = mBackend->submit(&st->t);
+         if(res < 0) {
+            st->t.res = res;
+            completed(&st->t);
+            break;
+         }
+      }
+   }
+}
+
+void UsbService::completed(UsbTransfer* t)
+{
+   // Called from thread handling backend events
+   StreamTransfer* st = (StreamTransfer*) t->data;
+   Worker* w = st->w;
+   pthread_mutex_lock(&w->lock);
+   w->done.push_back(st);
+   pthread_cond_signal(&w->cond);
+   pthread_mutex_unlock(&w->lock);
+}
+
+void UsbService::complete(Worker* w, StreamTransfer* st)
+{
+   Stream* s = st->stream;
+   s->inflight.remove(st);
+   int res = st->t.res;
+
+   // Push result, completions of ended stream are discarded
+   if(!s->ended) {
+
+      // Transfers are recorded as stream calls
+      ServerStats::Call call;
+      mStats.begin(call, UsbBulkStream, 0);
+      call.start = st->start;
+      mStats.device(s->h, ServerStats::now() - st->start, res < 0);
+
+      // Write result in front of data
+      st->pkt.truncate(st->pos + UsbBulkStreamDataMsgSize + ((res < 0) ? 0 : res));
+      UsbBulkStreamDataMsg msg = { w->devfd, s->ep, res, NULL, 0 };
+      UsbBulkStreamDataMsg_pack(st->pkt.at(st->pos), &msg);
+      reply(s->fd, st->pkt, s->link);
+      mStats.end(call);
+
+      // Error other than timeout ends stream
+      if(res < 0 && res != -ETIMEDOUT) {
+         debug_msg("stream fd %d, ep 0x%02x ended (%d)", w->devfd, s->ep, res);
+         cancel(*s);
+      }
+
+      // Timeout pauses stream until client reads it
+      if(res == -ETIMEDOUT)
+         s->paused = true;
+   }
+
+   // Return buffer to pool
+   st->pkt.swapBuffer(*st->buf);
+   w->pool.give(st->buf);
+   delete st;
+
+   // Erase ended stream after last completion
+   if(s->ended && s->inflight.empty()) {
+      std::list<Stream>::iterator i;
+      for(i = w->streams.begin(); i != w->streams.end(); ++i) {
+         if(&*i == s) {
+            release(i->fd);
+            w->streams.erase(i);
+            break;
+         }
+      }
+   }
+}
+
+void UsbService::cancel(Stream& s)
+{
+   s.ended = true;
+   std::list<StreamTransfer*>::iterator i;
+   for(i = s.inflight.begin(); i != s.inflight.end(); ++i)
+      mBackend->cancel(&(*i)->t);
+}
+
+void UsbService::drain(Worker* w)
+{
+   for(;;) {
+
+      // Find ended stream
+      bool ended = false;
+      std::list<Stream>::iterator i;
+      for(i = w->streams.begin(); i != w->streams.end() && !ended; ++i)
+         ended = i->ended;
+      if(!ended)
+         break;
+
+      // Take completed transfers, handle events if there are none
+      std::list<StreamTransfer*> done;
+      pthread_mutex_lock(&w->lock);
+      done.swap(w->done);
+      pthread_mutex_unlock(&w->lock);
+      if(done.empty()) {
+         mBackend->handleEvents(DrainWait);
+         continue;
+      }
+
+      std::list<StreamTransfer*>::iterator t;
+      for(t = done.begin(); t != done.end(); ++t)
+         complete(w, *t);
+   }
+}
+
+UsbService::BufferPool::~BufferPool()
+{
+   for(int c = 0; c < Classes; ++c) {
+      for(size_t i = 0; i < mFree[c].size(); ++i)
+         delete mFree[c][i];
+   }
+}
+
+ByteBuffer* UsbService::BufferPool::take(size_t size)
+{
+   // Find size class
+   int c = 0;
+   while(c < Classes && ((size_t) 1 << (MinShift + c)) < size)
+      ++c;
+
+   // Reuse free buffer
+   if(c < Classes && !mFree[c].empty()) {
+      ByteBuffer* buf = mFree[c].back();
+      mFree[c].pop_back();
+      return buf;
+   }
+
+   // Allocate new, oversized buffers are not pooled
+   ByteBuffer* buf = new ByteBuffer;
+   buf->reserve((c < Classes) ? ((size_t) 1 << (MinShift + c)) : size);
+   return buf;
+}
+
+void UsbService::BufferPool::give(ByteBuffer* buf)
+{
+   // Find size class by capacity
+   int c = Classes - 1;
+   while(c >= 0 && ((size_t) 1 << (MinShift + c)) > buf->capacity())
+      --c;
+
+   // Keep limited number of free buffers
+   if(c < 0 || mFree[c].size() >= MaxFree) {
+      delete buf;
+      return;
+   }
+
+   mFree[c].push_back(buf);
+}
+
+void UsbService::drop(Worker* w, int fd, int ep)
+{
+   bool pending = false;
+   std::list<Stream>::iterator i = w->streams.begin();
+   while(i != w->streams.end()) {
+      if((fd == -1 || i->fd == fd) && (ep == -1 || i->ep == ep)) {
+
+         // Stream with transfers in flight is erased after last completion
+         if(!i->inflight.empty()) {
+            cancel(*i);
+            pending = true;
+            ++i;
+            continue;
+         }
+
+         release(i->fd);
+         i = w->streams.erase(i);
+      }
+      else
+         ++i;
+   }
+
+   // Wait for cancelled transfers
+   if(pending)
+      drain(w);
+}
+
+void UsbService::event(int fd)
+{
+   // Worker handling events rearms fd when it's done
+   if(mBackend->handleEvents())
+      rearm(fd);
+}
+
+void UsbService::events_ready(void* arg)
+{
+   UsbService* self = (UsbService*) arg;
+   self->rearm(self->mBackend->eventFd());
+}
+
+void UsbService::disconnected(int fd)
+{
+   // Record session end
+   if(mTrace.fd >= 0)
+      trace_write(&mTrace, fd, TraceClose, 0, 0, NULL, 0);
+
+   // Drop client streams in all workers
+   pthread_mutex_lock(&mWorkerLock);
+   std::map<int, Worker*>::iterator w;
+   for(w = mWorkers.begin(); w != mWorkers.end(); ++w) {
+      Job job;
+      job.fd = fd;
+      job.pkt = NULL;
+      job.link = false;
+      retain(fd);
+      pthread_mutex_lock(&w->second->lock);
+      w->second->queue.push_back(job);
+      pthread_cond_signal(&w->second->cond);
+      pthread_mutex_unlock(&w->second->lock);
+   }
+   pthread_mutex_unlock(&mWorkerLock);
+
+   // Free compressor
+   pthread_mutex_t* lock = &mSendLock[fd % SendLocks];
+   pthread_mutex_lock(lock);
+   pthread_mutex_lock(&mCodecLock);
+   std::map<int, Compressor*>::iterator z = mCodecs.find(fd);
+   if(z != mCodecs.end()) {
+      codec_free(z->second);
+      delete z->second;
+      mCodecs.erase(z);
+   }
+   pthread_mutex_unlock(&mCodecLock);
+
+   // Stop link thread
+   ShmLink* link = shm_link_get(fd);
+   if(link != NULL)
+      shm_link_close(link);
+   pthread_mutex_unlock(lock);
 }
 
-void UsbService::usb_init(int fd, Packet& in)
+void* UsbService::link_run(void* arg)
+{
+   Link* l = (Link*) arg;
+   UsbService* self = l->service;
+   debug_msg("receiving from link on fd %d", l->fd);
+
+   // Receive until link is closed, replies go to link
+   pthread_setspecific(self->mLinkKey, l);
+   RecvBuf rb;
+   rbuf_init(&rb, RECVBUF_SIZE);
+   rb.link = l->link;
+   for(;;) {
+      Packet pkt;
+      if(pkt.recv(l->fd, &rb) < 0)
+         break;
+
+      self->handle(l->fd, pkt);
+   }
+   rbuf_free(&rb);
+
+   // Detach link, late replies go to socket
+   pthread_mutex_t* lock = &self->mSendLock[l->fd % SendLocks];
+   pthread_mutex_lock(lock);
+   shm_link_attach(l->fd, NULL);
+   pthread_mutex_unlock(lock);
+   shm_link_free(l->link);
+   debug_msg("link on fd %d closed", l->fd);
+
+   self->release(l->fd);
+   delete l;
+   return NULL;
+}
+
+void UsbService::usb_init(int fd, Packet& in, UsbInitReq& req)
 {
    // Call, no ACK
    debug_msg("called");
-   ::usb_init();
+   mBackend->init();
 }
 
-void UsbService::usb_find_busses(int fd, Packet& in)
+void UsbService::usb_find_busses(int fd, Packet& in, UsbFindBussesReq& req)
 {
    // Call
    // Can't guarantee correct number in case of multi-client environment
-   int res = ::usb_find_busses();
-   debug_msg("returned %d", res);
+   UsbFindBussesRep rep = { mBackend->findBusses(), NULL, 0 };
+   debug_msg("returned %d", rep.res);
 
    // Send result
-   Packet pkt(UsbFindBusses);
-   pkt.addInt32(res);
-   pkt.send(fd);
+   Packet pkt(UsbFindBusses, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_find_devices(int fd, Packet& in)
+/** Serialize bus with devices and descriptors. */
+static void write_bus(ByteBuffer& blob, struct usb_bus* bus)
 {
-   // Can't guarantee correct result in case of multi-client environment,
-   // but anything >=0 should be fine.
-   int res = ::usb_find_devices();
-   debug_msg("returned %d", res);
+   Struct root(blob, 0);
+   Struct block = root.writeBlock(StructureType);
+   block.addString(bus->dirname);
+   block.addUInt32(bus->location);
+
+   //! \todo Implement device children ptrs.
+   for(struct usb_device* dev = bus->devices; dev; dev = dev->next) {
+
+      Struct devBlock = block.writeBlock(SequenceType);
+      devBlock.addString(dev->filename);
+      devBlock.addUInt8(dev->devnum);
+
+      // Copy device descriptor
+      // Convert byte-order for 16/32bit values
+      struct usb_device_descriptor desc_m;
+      memcpy(&desc_m, &dev->descriptor, sizeof(struct usb_device_descriptor));
+      desc_m.bcdUSB = htons(desc_m.bcdUSB);
+      desc_m.idVendor = htons(desc_m.idVendor);
+      desc_m.idProduct = htons(desc_m.idProduct);
+      desc_m.bcdDevice = htons(desc_m.bcdDevice);
+      devBlock.addData((const char*) &desc_m, sizeof(struct usb_device_descriptor));
+
+      // Add configurations
+      for(unsigned c = 0; c < dev->descriptor.bNumConfigurations; ++c) {
+         struct usb_config_descriptor* cfg = &dev->config[c];
+
+         // Copy config descriptor
+         struct usb_config_descriptor cfg_m;
+         memcpy(&cfg_m, cfg, sizeof(struct usb_config_descriptor));
+         cfg_m.wTotalLength = htons(cfg_m.wTotalLength);
+         devBlock.addData((const char*) &cfg_m, sizeof(struct usb_config_descriptor));
+
+         // Add interfaces
+         for(unsigned i = 0; i < cfg->bNumInterfaces; ++i) {
+            struct usb_interface* iface = &cfg->interface[i];
+            devBlock.addInt32(iface->num_altsetting);
+
+            // Add interface settings
+            for(unsigned j = 0; j < iface->num_altsetting; ++j) {
+               struct usb_interface_descriptor* altsetting = &iface->altsetting[j];
+
+               // Copy altsetting - no conversions apply
+               devBlock.addData((const char*) altsetting, sizeof(struct usb_interface_descriptor));
+
+               // Add endpoints
+               for(unsigned k = 0; k < altsetting->bNumEndpoints; ++k) {
+                  struct usb_endpoint_descriptor* endpoint = &altsetting->endpoint[k];
+
+                  // Copy endpoint
+                  struct usb_endpoint_descriptor endpoint_m;
+                  memcpy(&endpoint_m, endpoint, sizeof(struct usb_endpoint_descriptor));
+                  endpoint_m.wMaxPacketSize = htons(endpoint_m.wMaxPacketSize);
+                  devBlock.addData((const char*) &endpoint_m, sizeof(struct usb_endpoint_descriptor));
+               }
 
-   // Prepare result packet
-   Packet pkt(UsbFindDevices);
-   pkt.addInt32(res);
-
-   // Add existing busses and devices
-   struct usb_bus* bus = 0;
-   for(bus = ::usb_get_busses(); bus; bus = bus->next) {
-
-      Struct block = pkt.writeBlock(StructureType);
-      block.addString(bus->dirname);
-      block.addUInt32(bus->location);
-
-      //! \todo Implement device children ptrs.
-      for(struct usb_device* dev = bus->devices; dev; dev = dev->next) {
-
-         Struct devBlock = block.writeBlock(SequenceType);
-         devBlock.addString(dev->filename);
-         devBlock.addUInt8(dev->devnum);
-
-         // Copy device descriptor
-         // Convert byte-order for 16/32bit values
-         struct usb_device_descriptor desc_m;
-         memcpy(&desc_m, &dev->descriptor, sizeof(struct usb_device_descriptor));
-         desc_m.bcdUSB = htons(desc_m.bcdUSB);
-         desc_m.idVendor = htons(desc_m.idVendor);
-         desc_m.idProduct = htons(desc_m.idProduct);
-         desc_m.bcdDevice = htons(desc_m.bcdDevice);
-         devBlock.addData((const char*) &desc_m, sizeof(struct usb_device_descriptor));
-
-         // Add configurations
-         for(unsigned c = 0; c < dev->descriptor.bNumConfigurations; ++c) {
-            struct usb_config_descriptor* cfg = &dev->config[c];
-
-            // Copy config descriptor
-            struct usb_config_descriptor cfg_m;
-            memcpy(&cfg_m, cfg, sizeof(struct usb_config_descriptor));
-            cfg_m.wTotalLength = htons(cfg_m.wTotalLength);
-            devBlock.addData((const char*) &cfg_m, sizeof(struct usb_config_descriptor));
-
-            // Add interfaces
-            for(unsigned i = 0; i < cfg->bNumInterfaces; ++i) {
-               struct usb_interface* iface = &cfg->interface[i];
-               devBlock.addInt32(iface->num_altsetting);
-
-               // Add interface settings
-               for(unsigned j = 0; j < iface->num_altsetting; ++j) {
-                  struct usb_interface_descriptor* altsetting = &iface->altsetting[j];
-
-                  // Copy altsetting - no conversions apply
-                  devBlock.addData((const char*) altsetting, sizeof(struct usb_interface_descriptor));
-
-                  // Add endpoints
-                  for(unsigned k = 0; k < altsetting->bNumEndpoints; ++k) {
-                     struct usb_endpoint_descriptor* endpoint = &altsetting->endpoint[k];
-
-                     // Copy endpoint
-                     struct usb_endpoint_descriptor endpoint_m;
-                     memcpy(&endpoint_m, endpoint, sizeof(struct usb_endpoint_descriptor));
-                     endpoint_m.wMaxPacketSize = htons(endpoint_m.wMaxPacketSize);
-                     devBlock.addData((const char*) &endpoint_m, sizeof(struct usb_endpoint_descriptor));
-                  }
-
-                  // Add extra interface descriptors
-                  if(altsetting->extralen > 0){
-                     devBlock.addInt32(altsetting->extralen);
-                     devBlock.addData((const char*)altsetting->extra, altsetting->extralen);
-                  }
-                  else
-                     devBlock.addInt32(0);
+               // Add extra interface descriptors
+               if(altsetting->extralen > 0){
+                  devBlock.addInt32(altsetting->extralen);
+                  devBlock.addData((const char*)altsetting->extra, altsetting->extralen);
                }
+               else
+                  devBlock.addInt32(0);
             }
          }
-
-         devBlock.finalize();
       }
 
-      // Finalize block
-      block.finalize();
+      devBlock.finalize();
+   }
+
+   // Finalize block
+   block.finalize();
+}
+
+void UsbService::usb_find_devices(int fd, Packet& in, UsbFindDevicesReq& req)
+{
+   // Client topology generation, 0 if none
+   uint32_t cached = req.generation;
+
+   // Can't guarantee correct result in case of multi-client environment,
+   // but anything >=0 should be fine.
+   int res = mBackend->findDevices();
+   debug_msg("returned %d", res);
+
+   // Update cached busses, changed bus gets new generation
+   std::list<BusCache> cache;
+   for(struct usb_bus* bus = mBackend->busses(); bus; bus = bus->next) {
+      BusCache entry;
+      entry.location = bus->location;
+      write_bus(entry.blob, bus);
+
+      // Find previous state
+      std::list<BusCache>::iterator i = mBusCache.begin();
+      while(i != mBusCache.end() && i->location != bus->location)
+         ++i;
+
+      if(i != mBusCache.end() && i->blob == entry.blob)
+         entry.generation = i->generation;
+      else
+         entry.generation = ++mGeneration;
+
+      cache.push_back(entry);
    }
 
+   // Removed bus changes topology
+   if(cache.size() != mBusCache.size())
+      ++mGeneration;
+   mBusCache.swap(cache);
+
+   // Prepare result packet
+   UsbFindDevicesRep rep = { res, mGeneration, NULL, 0 };
+   Packet pkt(UsbFindDevices, in.id());
+   pkt.addMessage(rep);
+
+   // Not modified, reply only generation
+   // Changed busses are sent whole, unchanged as location only
+   if(cached != mGeneration) {
+      std::list<BusCache>::iterator i;
+      for(i = mBusCache.begin(); i != mBusCache.end(); ++i) {
+         if(cached != 0 && cached <= mGeneration && i->generation <= cached)
+            pkt.addUInt32(i->location);
+         else
+            pkt.append(i->blob.data(), i->blob.size());
+      }
+   }
+
+   debug_msg("generation %u (client %u)", mGeneration, cached);
+
    // Send result
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_open(int fd, Packet& in)
+void UsbService::usb_open(int fd, Packet& in, UsbOpenReq& req)
 {
-   Iterator it(in);
-   unsigned busid = it.getUInt();
-   unsigned devid = it.getUInt();
+   unsigned busid = req.location;
+   unsigned devid = req.devnum;
 
    // Find device
    struct usb_device* rdev = NULL;
-   for(struct usb_bus* bus = ::usb_get_busses(); bus; bus = bus->next) {
+   for(struct usb_bus* bus = mBackend->busses(); bus; bus = bus->next) {
 
       // Find bus
       if(bus->location == busid) {
@@ -226,10 +1056,11 @@ void UsbService::usb_open(int fd, Packet& in)
    usb_dev_handle* udev = NULL;
    if(rdev != NULL) {
       // Check successful open
-      if((udev = ::usb_open(rdev)) != NULL) {
-         mOpenList.push_back(udev);
-         res = 0;
-         openfd = udev->fd;
+      if((udev = mBackend->open(rdev)) != NULL) {
+         if((openfd = attach(udev)) >= 0)
+            res = 0;
+         else
+            mBackend->close(udev);
       }
    }
 
@@ -237,466 +1068,724 @@ void UsbService::usb_open(int fd, Packet& in)
    debug_msg("bus_id %u, dev_id %u = %d (fd %d)", busid, devid, res, openfd);
 
    // Return result
-   Packet pkt(UsbOpen);
-   pkt.addInt8(res);
-   pkt.addInt32(openfd);
-   pkt.send(fd);
+   UsbOpenRep rep = { res, openfd, NULL, 0 };
+   Packet pkt(UsbOpen, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_close(int fd, Packet& in)
+void UsbService::usb_close(int fd, Packet& in, UsbCloseReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
+   int devfd = req.devfd;
 
-   // Find open device
+   // Find and remove open device together with its worker
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         mOpenList.erase(i);
-         res = ::usb_close(h);
-         break;
-      }
+   pthread_mutex_lock(&mWorkerLock);
+   usb_dev_handle* h = detach(devfd);
+   Worker* w = worker(devfd);
+   if(w != NULL && pthread_equal(w->thread, pthread_self()))
+      mWorkers.erase(devfd);
+   else
+      w = NULL;
+   pthread_mutex_unlock(&mWorkerLock);
+
+   // Drop device streams and retire worker
+   if(w != NULL) {
+      drop(w, -1, -1);
+      pthread_mutex_lock(&w->lock);
+      w->stop = true;
+      pthread_mutex_unlock(&w->lock);
+      pthread_detach(w->thread);
    }
 
+   // Close device
+   if(h != NULL)
+      res = mBackend->close(h);
+
    debug_msg("fd %d = %d", devfd, res);
 
    // Return result
-   Packet pkt(UsbClose);
-   pkt.addInt8(res);
-   pkt.send(fd);
+   UsbCloseRep rep = { res, NULL, 0 };
+   Packet pkt(UsbClose, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_set_configuration(int fd, Packet &in)
+void UsbService::usb_set_configuration(int fd, Packet &in, UsbSetConfigurationReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   int configuration = it.getInt();
+   int devfd = req.devfd;
+   int configuration = req.configuration;
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_set_configuration(h, configuration);
-         configuration = h->config;
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->setConfiguration(h, configuration);
+      configuration = h->config;
+
+      // Cache active endpoints
+      configure(devfd, (res == 0) ? configuration : -1);
    }
 
    debug_msg("fd %d, configuration %d = %d", devfd, configuration, res);
 
    // Return result
-   Packet pkt(UsbSetConfiguration);
-   pkt.addInt32(res);
-   pkt.addInt32(configuration);
-   pkt.send(fd);
+   UsbSetConfigurationRep rep = { res, configuration, NULL, 0 };
+   Packet pkt(UsbSetConfiguration, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_set_altinterface(int fd, Packet &in)
+void UsbService::usb_set_altinterface(int fd, Packet &in, UsbSetAltInterfaceReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   int alternate = it.getInt();
+   int devfd = req.devfd;
+   int interface = req.interface;
+   int alternate = req.alternate;
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_set_altinterface(h, alternate);
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->setAltInterface(h, interface, alternate);
+      if(interface == h->interface)
          alternate = h->altsetting;
-         break;
-      }
+
+      // Cache active endpoints of interface
+      if(res == 0)
+         configure(devfd, -1, interface, alternate);
+      else
+         configure(devfd, -1);
    }
 
-   debug_msg("fd %d, alternate %d = %d", devfd, alternate, res);
+   debug_msg("fd %d, interface %d, alternate %d = %d", devfd, interface, alternate, res);
 
    // Return result
-   Packet pkt(UsbSetAltInterface);
-   pkt.addInt32(res);
-   pkt.addInt32(alternate);
-   pkt.send(fd);
+   UsbSetAltInterfaceRep rep = { res, alternate, NULL, 0 };
+   Packet pkt(UsbSetAltInterface, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_resetep(int fd, Packet &in)
+void UsbService::usb_resetep(int fd, Packet &in, UsbResetEpReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   unsigned int ep = it.getUInt();
+   int devfd = req.devfd;
+   unsigned int ep = req.ep;
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_resetep(h, ep);
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->resetEp(h, ep);
    }
 
    debug_msg("fd %d, ep %d = %d", devfd, ep, res);
 
    // Return result
-   Packet pkt(UsbResetEp);
-   pkt.addInt32(res);
-   pkt.send(fd);
+   UsbResetEpRep rep = { res, NULL, 0 };
+   Packet pkt(UsbResetEp, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_clear_halt(int fd, Packet &in)
+void UsbService::usb_clear_halt(int fd, Packet &in, UsbClearHaltReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   unsigned int ep = it.getUInt();
+   int devfd = req.devfd;
+   unsigned int ep = req.ep;
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_clear_halt(h, ep);
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->clearHalt(h, ep);
    }
 
    debug_msg("fd %d, ep %d = %d", devfd, ep, res);
 
    // Return result
-   Packet pkt(UsbClearHalt);
-   pkt.addInt32(res);
-   pkt.send(fd);
+   UsbClearHaltRep rep = { res, NULL, 0 };
+   Packet pkt(UsbClearHalt, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_reset(int fd, Packet &in)
+void UsbService::usb_reset(int fd, Packet &in, UsbResetReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
+   int devfd = req.devfd;
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_reset(h);
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->reset(h);
+
+      // Configuration is unknown after reset
+      configure(devfd, -1);
    }
 
    debug_msg("fd %d = %d", devfd, res);
 
    // Return result
-   Packet pkt(UsbReset);
-   pkt.addInt32(res);
-   pkt.send(fd);
+   UsbResetRep rep = { res, NULL, 0 };
+   Packet pkt(UsbReset, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_claim_interface(int fd, Packet &in)
+void UsbService::usb_claim_interface(int fd, Packet &in, UsbClaimInterfaceReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   int index = it.getInt();
+   int devfd = req.devfd;
+   int index = req.interface;
    int res = -1;
 
    // Find open device
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_claim_interface(h, index);
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->claimInterface(h, index);
    }
 
    debug_msg("fd %d = %d", devfd, res);
 
    // Return result
-   Packet pkt(UsbClaimInterface);
-   pkt.addInt32((int32_t) res);
-   pkt.send(fd);
+   UsbClaimInterfaceRep rep = { res, NULL, 0 };
+   Packet pkt(UsbClaimInterface, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_release_interface(int fd, Packet &in)
+void UsbService::usb_release_interface(int fd, Packet &in, UsbReleaseInterfaceReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   int index = it.getInt();
+   int devfd = req.devfd;
+   int index = req.interface;
    int res = -1;
 
    // Find open device
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_release_interface(h, index);
-         res = 0;
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->releaseInterface(h, index);
+      res = 0;
    }
 
    debug_msg("fd %d = %d", devfd, res);
 
    // Return result
-   Packet pkt(UsbReleaseInterface);
-   pkt.addInt32((int32_t) res);
-   pkt.send(fd);
+   UsbReleaseInterfaceRep rep = { res, NULL, 0 };
+   Packet pkt(UsbReleaseInterface, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_get_kernel_driver(int fd, Packet &in)
+void UsbService::usb_get_kernel_driver(int fd, Packet &in, UsbGetKernelDriverReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   int index = it.getInt();
-   unsigned namelen = it.getUInt();
+   int devfd = req.devfd;
+   int index = req.interface;
+   unsigned namelen = req.namelen;
 
    // Create buffer
    std::string buf;
-   buf.resize(namelen);
+   buf.resize(namelen + 1);
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-#if LIBUSB_HAS_GET_DRIVER_NP
-         res = ::usb_get_driver_np(h, index, (char*) buf.data(), namelen);
-#else
-         res = -1;
-#endif
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->getDriver(h, index, (char*) buf.data(), namelen);
    }
 
-   buf.at(namelen - 1) = '\0';
+   buf.at(namelen) = '\0';
    debug_msg("fd %d, index %d, namelen %u = %d", devfd, index, namelen, res);
 
-   // Return result
-   Packet pkt(UsbGetKernelDriver);
-   pkt.addInt32((int32_t) res);
-   pkt.addString(buf.data());
-   pkt.send(fd);
+   // Return result with name
+   UsbGetKernelDriverRep rep = { res, buf.data(), (uint32_t) strlen(buf.data()) + 1 };
+   Packet pkt(UsbGetKernelDriver, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_detach_kernel_driver(int fd, Packet &in)
+void UsbService::usb_detach_kernel_driver(int fd, Packet &in, UsbDetachKernelDriverReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-   int index = it.getInt();
+   int devfd = req.devfd;
+   int index = req.interface;
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-#if LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
-         res = ::usb_detach_kernel_driver_np(h, index);
-#else
-         res = 0;
-#endif
-         break;
-      }
+   usb_dev_handle* h = device(devfd);
+   if(h != NULL) {
+      res = mBackend->detachKernelDriver(h, index);
    }
 
    debug_msg("fd %d, index %d = %d", devfd, index, res);
 
    // Return result
-   Packet pkt(UsbDetachKernelDriver);
-   pkt.addInt32((int32_t) res);
-   pkt.send(fd);
+   UsbDetachKernelDriverRep rep = { res, NULL, 0 };
+   Packet pkt(UsbDetachKernelDriver, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_control_msg(int fd, Packet& in)
+void UsbService::usb_control_msg(int fd, Packet& in, UsbControlMsgReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
-
    // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
-   }
+   usb_dev_handle* h = device(req.devfd);
+
+   // IN transfer is read directly to reply, OUT transfer data is in request
+   bool input = (req.requesttype & USB_ENDPOINT_IN);
+   int size = input ? req.size : req.len;
+   Packet pkt(UsbControlMsg, in.id());
+   int pos = pkt.currentPos();
+   char* data = pkt.alloc(UsbControlMsgRepSize + (input ? size : 0));
+   data = input ? data + UsbControlMsgRepSize : (char*) req.data;
 
    // Device not found
    int res = -1;
-   char* data = NULL;
    if(h != NULL) {
 
       // Call function
-      int reqtype = it.getInt();
-      int request = it.getInt();
-      int value   = it.getInt();
-      int index   = it.getInt();
-      int size    = it.length();
-      data  = (char*) it.getByteArray();
-      int timeout = it.getInt();
-
-      res = ::usb_control_msg(h, reqtype, request, value, index, data, size, timeout);
-      debug_msg("fd %d = %d", devfd, res);
+      res = mBackend->controlMsg(h, req.requesttype, req.request, req.value, req.index,
+                                 data, size, req.timeout);
+      debug_msg("fd %d = %d", req.devfd, res);
    }
 
    // Return packet
-   Packet pkt(UsbControlMsg);
-   pkt.addInt32(res);
-   pkt.addData(data, (res < 0) ? 0 : res, OctetType);
-   pkt.send(fd);
+   pkt.truncate(pos + UsbControlMsgRepSize + ((input && res > 0) ? res : 0));
+   UsbControlMsgRep rep = { res, NULL, 0 };
+   UsbControlMsgRep_pack(pkt.at(pos), &rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_bulk_read(int fd, Packet &in)
+void UsbService::usb_bulk_read(int fd, Packet &in, UsbBulkReadReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
+   int devfd = req.devfd;
+   int size = req.size;
 
-   // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
+   // Find open device, IN endpoint is implied
+   int res = -1;
+   usb_dev_handle* h = device(devfd, req.ep | USB_ENDPOINT_IN, &res);
+
+   // Borrow reply buffer from worker pool
+   Worker* w = current(devfd);
+   ByteBuffer* buf = NULL;
+   Packet pkt;
+   if(w != NULL && size > 0) {
+      buf = w->pool.take(size + TransferOverhead);
+      pkt.swapBuffer(*buf);
    }
 
+   // Prepare reply, result is written after transfer
+   pkt.reset(UsbBulkRead, in.id());
+   int pos = pkt.currentPos();
+   pkt.alloc(UsbBulkReadRepSize);
+
    // Device not found
-   int res = -1;
-   char* data = NULL;
-   int ep = it.getInt();
-   int size = it.getInt();
-   int timeout = it.getInt();
    if(h != NULL && size > 0) {
 
-      // Call function
-      data = new char[size];
-      res = ::usb_bulk_read(h, ep, data, size, timeout);
+      // Call function, read directly to reply
+      char* data = pkt.alloc(size);
+      res = mBackend->bulkRead(h, req.ep, data, size, req.timeout);
+      pkt.truncate(pos + UsbBulkReadRepSize + ((res < 0) ? 0 : res));
       debug_msg("fd %d = %d", devfd, res);
    }
 
    // Return packet
-   Packet pkt(UsbBulkRead);
-   pkt.addInt32(res);
-   pkt.addData(data, (res < 0) ? 0 : res, OctetType);
-   pkt.send(fd);
+   UsbBulkReadRep rep = { res, NULL, 0 };
+   UsbBulkReadRep_pack(pkt.at(pos), &rep);
+   reply(fd, pkt);
+
+   // Return buffer
+   if(buf != NULL) {
+      pkt.swapBuffer(*buf);
+      w->pool.give(buf);
+   }
+}
+
+void UsbService::usb_bulk_write(int fd, Packet &in, UsbBulkWriteReq& req)
+{
+   // Find open device
+   int res = -1;
+   usb_dev_handle* h = device(req.devfd, req.ep, &res);
 
-   // Free data
-   if(data != NULL)
-      delete data;
+   // Device not found
+   if(h != NULL && req.len > 0) {
+
+      // Call function
+      res = mBackend->bulkWrite(h, req.ep, (char*) req.data, req.len, req.timeout);
+      debug_msg("fd %d = %d", req.devfd, res);
+   }
+
+   // Return packet
+   UsbBulkWriteRep rep = { res, NULL, 0 };
+   Packet pkt(UsbBulkWrite, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_bulk_write(int fd, Packet &in)
+void UsbService::usb_bulk_stream(int fd, Packet &in, UsbBulkStreamReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
+   int devfd = req.devfd;
+   int ep = req.ep;
+   int size = req.size;
+   int timeout = req.timeout;
+   int depth = req.depth;
+
+   // Stop existing streams, ep -1 matches all endpoints
+   Worker* w = current(devfd);
+   if(w != NULL)
+      drop(w, fd, ep);
+
+   // Find open device, stopped streams don't need endpoint
+   int res = (depth > 0) ? -1 : 0;
+   usb_dev_handle* h = (depth > 0) ? device(devfd, ep | USB_ENDPOINT_IN, &res) : device(devfd);
+
+   // Start stream, served by device worker
+   if(w != NULL && h != NULL && depth > 0 && size > 0 && retain(fd)) {
+      Stream stream;
+      stream.fd = fd;
+      stream.h = h;
+      stream.ep = ep;
+      stream.size = size;
+      stream.timeout = timeout;
+      stream.credits = depth;
+      stream.paused = false;
+      stream.link = (pthread_getspecific(mLinkKey) != NULL);
+      stream.ended = false;
+      w->streams.push_back(stream);
+      if(!mBackend->async())
+         w->streams.back().buf.reserve(size + TransferOverhead);
+      res = 0;
+   }
 
-   // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
+   debug_msg("fd %d, ep 0x%02x, %d x %dB = %d", devfd, ep, depth, size, res);
+
+   // Return result
+   UsbBulkStreamRep rep = { res, NULL, 0 };
+   Packet pkt(UsbBulkStream, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
+}
+
+void UsbService::usb_bulk_stream_ack(int fd, Packet &in, UsbBulkStreamAckReq& req)
+{
+   // Return credits, no ACK
+   Worker* w = current(req.devfd);
+   if(w == NULL)
+      return;
+
+   std::list<Stream>::iterator i;
+   for(i = w->streams.begin(); i != w->streams.end(); ++i) {
+      if(i->fd == fd && i->ep == req.ep) {
+         i->credits += req.credits;
+         i->paused = false;
          break;
       }
    }
+}
 
-   // Device not found
+void UsbService::usb_interrupt_write(int fd, Packet &in, UsbInterruptWriteReq& req)
+{
+   // Find open device
    int res = -1;
-   int ep = it.getInt();
-   int size = it.length();
-   char* data = (char*) it.getByteArray();
-   int timeout = it.getInt();
-   if(h != NULL && size > 0) {
+   usb_dev_handle* h = device(req.devfd, req.ep, &res);
+
+   // Device not found
+   if(h != NULL && req.len > 0) {
 
       // Call function
-      res = ::usb_bulk_write(h, ep, data, size, timeout);
-      debug_msg("fd %d = %d", devfd, res);
+      res = mBackend->interruptWrite(h, req.ep, (char*) req.data, req.len, req.timeout);
+      debug_msg("fd %d = %d", req.devfd, res);
    }
 
    // Return packet
-   Packet pkt(UsbBulkWrite);
-   pkt.addInt32(res);
-   pkt.send(fd);
+   UsbInterruptWriteRep rep = { res, NULL, 0 };
+   Packet pkt(UsbInterruptWrite, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_interrupt_write(int fd, Packet &in)
+void UsbService::usb_interrupt_read(int fd, Packet &in, UsbInterruptReadReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
+   int devfd = req.devfd;
+   int size = req.size;
 
-   // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
+   // Find open device, IN endpoint is implied
+   int res = -1;
+   usb_dev_handle* h = device(devfd, req.ep | USB_ENDPOINT_IN, &res);
+
+   // Borrow reply buffer from worker pool
+   Worker* w = current(devfd);
+   ByteBuffer* buf = NULL;
+   Packet pkt;
+   if(w != NULL && size > 0) {
+      buf = w->pool.take(size + TransferOverhead);
+      pkt.swapBuffer(*buf);
    }
 
+   // Prepare reply, result is written after transfer
+   pkt.reset(UsbInterruptRead, in.id());
+   int pos = pkt.currentPos();
+   pkt.alloc(UsbInterruptReadRepSize);
+
    // Device not found
-   int res = -1;
-   int ep = it.getInt();
-   int size = it.length();
-   char* data = (char*) it.getByteArray();
-   int timeout = it.getInt();
    if(h != NULL && size > 0) {
 
-      // Call function
-      res = ::usb_interrupt_write(h, ep, data, size, timeout);
+      // Call function, read directly to reply
+      char* data = pkt.alloc(size);
+      res = mBackend->interruptRead(h, req.ep, data, size, req.timeout);
+      pkt.truncate(pos + UsbInterruptReadRepSize + ((res < 0) ? 0 : res));
       debug_msg("fd %d = %d", devfd, res);
    }
 
    // Return packet
-   Packet pkt(UsbInterruptWrite);
-   pkt.addInt32(res);
-   pkt.send(fd);
+   UsbInterruptReadRep rep = { res, NULL, 0 };
+   UsbInterruptReadRep_pack(pkt.at(pos), &rep);
+   reply(fd, pkt);
+
+   // Return buffer
+   if(buf != NULL) {
+      pkt.swapBuffer(*buf);
+      w->pool.give(buf);
+   }
 }
 
-void UsbService::usb_interrupt_read(int fd, Packet &in)
+void UsbService::usb_hello(int fd, Packet &in, UsbHelloReq& req)
 {
-   Iterator it(in);
-   int devfd = it.getInt();
+   // Pick codec supported by both sides
+   int codec = codec_pick(req.codecs);
+   debug_msg("fd %d codecs 0x%x = 0x%x", fd, req.codecs, codec);
+
+   // Reply raw, client enables decompression after reply
+   UsbHelloRep rep = { (uint32_t) codec, NULL, 0 };
+   Packet pkt(UsbHello, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
+
+   // Compress following replies
+   if(codec == CodecNone)
+      return;
+
+   Compressor* z = new Compressor;
+   codec_init(z, codec);
+   pthread_mutex_t* lock = &mSendLock[fd % SendLocks];
+   pthread_mutex_lock(lock);
+   pthread_mutex_lock(&mCodecLock);
+   std::map<int, Compressor*>::iterator i = mCodecs.find(fd);
+   if(i != mCodecs.end()) {
+      codec_free(i->second);
+      delete i->second;
+   }
+   mCodecs[fd] = z;
+   pthread_mutex_unlock(&mCodecLock);
+   pthread_mutex_unlock(lock);
+}
 
-   // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
+void UsbService::usb_shm_link(int fd, Packet &in, UsbShmLinkReq& req)
+{
+   // Map client link, fd must be attachable
+   ShmLink* link = NULL;
+   if(req.len > 0 && req.data[req.len - 1] == '\0' &&
+      shm_link_get(fd) == NULL && shm_link_attach(fd, NULL))
+      link = shm_link_open(req.data, fd);
+
+   // Reply over socket, client switches to link after reply
+   debug_msg("fd %d link %s: %s", fd, req.data, link != NULL ? "ok" : "refused");
+   UsbShmLinkRep rep = { link != NULL ? 0 : -1, NULL, 0 };
+   Packet pkt(UsbShmLink, in.id());
+   pkt.addMessage(rep);
+   reply(fd, pkt);
+   if(link == NULL)
+      return;
+
+   // Following replies go to link
+   pthread_mutex_t* lock = &mSendLock[fd % SendLocks];
+   pthread_mutex_lock(lock);
+   shm_link_attach(fd, link);
+   pthread_mutex_unlock(lock);
+
+   // Start receiving from link, closed link fails the client session
+   Link* l = new Link;
+   l->service = this;
+   l->fd = fd;
+   l->link = link;
+   pthread_t thread;
+   if(!retain(fd)) {
+      delete l;
+      l = NULL;
+   }
+   else if(pthread_create(&thread, NULL, &link_run, l) != 0) {
+      error_msg("%s: failed to start link thread for fd %d", __func__, fd);
+      release(fd);
+      delete l;
+      l = NULL;
+   }
+
+   if(l == NULL) {
+      pthread_mutex_lock(lock);
+      shm_link_attach(fd, NULL);
+      pthread_mutex_unlock(lock);
+      shm_link_free(link);
+      return;
+   }
+
+   pthread_detach(thread);
+}
+
+void UsbService::usb_stats(int fd, Packet &in, UsbStatsReq& req)
+{
+   // Snapshot counters
+   Packet pkt(UsbStats, in.id());
+   mStats.snapshot(pkt, req.flags & StatsReset);
+   debug_msg("flags 0x%x, %u bytes", req.flags, (unsigned) pkt.size());
+
+   // Return packet
+   reply(fd, pkt);
+}
+
+void UsbService::usb_batch(int fd, Packet &in, UsbBatchReq& req)
+{
+   // Prepare reply, count is written after execution
+   Packet pkt(UsbBatch, in.id());
+   int pos = pkt.currentPos();
+   pkt.alloc(UsbBatchRepSize);
+
+   // Execute calls in order, replies are collected
+   pthread_setspecific(mBatchKey, &pkt);
+   const char* p = req.data;
+   uint32_t left = req.len;
+   uint32_t count = 0;
+   while(count < req.count && left >= UsbBatchEntrySize) {
+
+      // Read call header
+      uint8_t op = schema_get_u8(p);
+      uint32_t size = schema_get_u32(p + 1);
+      p += UsbBatchEntrySize;
+      left -= UsbBatchEntrySize;
+      if(size > left)
          break;
+
+      // Batch runs on device worker, so only calls on the same device
+      // are executed, nested batches are ignored
+      int mark = pkt.currentPos();
+      bool valid = (call_flags(op) & SchemaDevice) && size >= SCHEMA_SIZE_i32 &&
+                   schema_get_i32(p) == req.devfd;
+      if(valid && op != UsbBatch) {
+         Packet call(op, in.id());
+         memcpy(call.alloc(size), p, size);
+         dispatch(fd, call);
+      }
+
+      // Refused call has error result
+      if(!valid) {
+         char* dst = pkt.alloc(UsbBatchEntrySize + SCHEMA_SIZE_i32);
+         dst = schema_put_u8(dst, op);
+         dst = schema_put_u32(dst, SCHEMA_SIZE_i32);
+         schema_put_i32(dst, -EINVAL);
+         debug_msg("fd %d refused batched call 0x%02x", req.devfd, op);
+      }
+
+      // Call without reply has empty entry
+      if(pkt.currentPos() == mark) {
+         char* dst = pkt.alloc(UsbBatchEntrySize);
+         dst = schema_put_u8(dst, op);
+         schema_put_u32(dst, 0);
       }
+
+      p += size;
+      left -= size;
+      ++count;
    }
+   pthread_setspecific(mBatchKey, NULL);
+   debug_msg("fd %d executed %u/%u calls", req.devfd, count, req.count);
+
+   // Return packet
+   UsbBatchRep rep = { count, NULL, 0 };
+   UsbBatchRep_pack(pkt.at(pos), &rep);
+   reply(fd, pkt);
+}
+
+void UsbService::usb_program(int fd, Packet &in, UsbProgramReq& req)
+{
+   // Find open device
+   usb_dev_handle* h = device(req.devfd);
+
+   // Prepare reply, result is written after run
+   Packet pkt(UsbProgram, in.id());
+   int pos = pkt.currentPos();
+   pkt.alloc(UsbProgramRepSize);
 
    // Device not found
-   int res = -1;
-   char* data = NULL;
-   int ep = it.getInt();
-   int size = it.getInt();
-   int timeout = it.getInt();
-   if(h != NULL && size > 0) {
+   int res = -1, result = 0;
+   uint32_t pc = 0, steps = 0, outsize = 0;
+   if(h != NULL) {
 
-      // Call function
-      data = new char[size];
-      res = ::usb_interrupt_read(h, ep, data, size, timeout);
-      debug_msg("fd %d = %d", devfd, res);
+      // Check layout, memory lives in reply
+      res = -EINVAL;
+      if(req.codesize <= req.len && req.memsize <= ProgMaxMem && req.outsize <= req.memsize) {
+         uint32_t init = req.len - req.codesize;
+         if(init > req.memsize)
+            init = req.memsize;
+         char* mem = pkt.alloc(req.memsize);
+         memcpy(mem, req.data + req.codesize, init);
+         memset(mem + init, 0, req.memsize - init);
+
+         // Run program, transfers are checked against active endpoints
+         DeviceProgram prog(mBackend, h, req.timeout, endpoints(req.devfd));
+         if(prog.load(req.data, req.codesize, mem, req.memsize)) {
+            res = prog.run(req.steps);
+            result = prog.result();
+            pc = prog.pc();
+            steps = prog.steps();
+         }
+
+         outsize = req.outsize;
+         pkt.truncate(pos + UsbProgramRepSize + outsize);
+      }
+
+      debug_msg("fd %d = %d, result %d (pc %u, %u steps)", req.devfd, res, result, pc, steps);
    }
 
    // Return packet
-   Packet pkt(UsbInterruptRead);
-   pkt.addInt32(res);
-   pkt.addData(data, (res < 0) ? 0 : res, OctetType);
-   pkt.send(fd);
-
-   // Free data
-   if(data != NULL)
-      delete data;
+   UsbProgramRep rep = { res, result, pc, steps, NULL, 0 };
+   UsbProgramRep_pack(pkt.at(pos), &rep);
+   reply(fd, pkt);
+}
+
+void UsbService::usb_cancel(int fd, Packet &in, UsbCancelReq& req)
+{
+   // Calls without reply can't be cancelled
+   if(req.id == 0)
+      return;
+
+   // Find worker of device
+   Job job = { fd, NULL, false };
+   int res = -ENOENT;
+   pthread_mutex_lock(&mWorkerLock);
+   usb_dev_handle* h = device(req.devfd);
+   Worker* w = worker(req.devfd);
+   if(w != NULL && h != NULL) {
+      pthread_mutex_lock(&w->lock);
+
+      // Drop queued call
+      std::list<Job>::iterator i;
+      for(i = w->queue.begin(); i != w->queue.end(); ++i) {
+         if(i->fd == fd && i->pkt != NULL && i->pkt->id() == req.id) {
+            job = *i;
+            w->queue.erase(i);
+            res = 0;
+            break;
+         }
+      }
+
+      // Abort running call, device stays open until worker is done
+      if(res != 0 && w->runFd == fd && w->runId == req.id)
+         res = mBackend->abort(h);
+      pthread_mutex_unlock(&w->lock);
+   }
+   pthread_mutex_unlock(&mWorkerLock);
+
+   // Release dropped call
+   if(job.pkt != NULL) {
+      delete job.pkt;
+      release(fd);
+   }
+
+   debug_msg("fd %d, request %u cancelled (%d)", req.devfd, req.id, res);
 }
 /** @} */
@@ -25,59 +25,358 @@
 #ifndef __usbservice_hpp__
 #define __usbservice_hpp__
 #include "serversocket.hpp"
+#include "usbbackend.hpp"
+#include "serverstats.hpp"
 #include "usbnet.h"
+#include "trace.h"
 #include <list>
+#include <map>
+#include <vector>
+#include <pthread.h>
 using namespace Proto;
 
+/** Calls on open devices are executed by per-device worker threads,
+  * so a blocking transfer stalls only calls on the same device.
+  * Calls without device (device enumeration, open) and calls on unknown
+  * devices are handled in place, in the event loop thread or in the thread
+  * receiving from a shared memory link, one at a time.
+  * With asynchronous backend, read-ahead streams keep a transfer in flight
+  * per credit, backend events are handled in the event loop and completed
+  * transfers are pushed by the device worker.
+  */
+
 class UsbService : public ServerSocket
 {
    public:
-   UsbService(int fd = -1);
+   /** Create service on device backend, backend is owned by caller. */
+   UsbService(UsbBackend* backend, int fd = -1);
    ~UsbService();
 
    /** Reimplemented packet handling.
+     * Queues calls on open devices to device worker.
      */
    virtual bool handle(int fd, Packet& pkt);
 
+   /** Reimplemented client disconnect, drops client streams.
+     */
+   virtual void disconnected(int fd);
+
+   /** Reimplemented watched fd event, handles backend events without blocking.
+     */
+   virtual void event(int fd);
+
+   /** Record exchanged packets to trace file, see trace.h.
+     * \return false if trace can't be opened
+     */
+   bool record(const char* path);
+
    protected:
 
+   /** Execute call.
+     * \param fd source fd
+     * \param pkt incoming packet
+     * \return false on unknown call
+     */
+   bool dispatch(int fd, Packet& pkt);
+
+   /** Return open device handle or NULL.
+     */
+   usb_dev_handle* device(int devfd);
+
+   /** Return open device handle for transfer on endpoint.
+     * Endpoint is checked against cached active configuration,
+     * libusb is not called for endpoints known to be inactive.
+     * \param res set to -ENOENT if endpoint is not active
+     * \return device handle or NULL
+     */
+   usb_dev_handle* device(int devfd, int ep, int* res);
+
+   /** Return mask of active endpoints, bit per usb_epindex().
+     * All endpoints are allowed if active configuration is unknown.
+     */
+   uint32_t endpoints(int devfd);
+
+   /** Send reply, serialized with other threads sending to the same socket.
+     * Replies of batched calls are appended to the batch reply instead.
+     * Reply goes the way the request came, so processes sharing a linked
+     * socket without using the link get replies over the socket.
+     */
+   void reply(int fd, Packet& pkt) {
+      reply(fd, pkt, pthread_getspecific(mLinkKey) != NULL);
+   }
+
+   /** Send reply to shared memory link attached to socket or to the socket.
+     */
+   void reply(int fd, Packet& pkt, bool link);
+
    /* libusb implementations.
+    * Called by dispatch() with decoded request, see usbschema.h.
     */
 
    /* (1) Core functions. */
-   void usb_init(int fd, Packet& in);
-   void usb_find_busses(int fd, Packet& in);
-   void usb_find_devices(int fd, Packet& in);
+   void usb_init(int fd, Packet& in, UsbInitReq& req);
+   void usb_find_busses(int fd, Packet& in, UsbFindBussesReq& req);
+   void usb_find_devices(int fd, Packet& in, UsbFindDevicesReq& req);
 
    /* (2) Device controls. */
-   void usb_open(int fd, Packet& in);
-   void usb_close(int fd, Packet& in);
-   void usb_set_configuration(int fd, Packet& in);
-   void usb_set_altinterface(int fd, Packet& in);
-   void usb_resetep(int fd, Packet& in);
-   void usb_clear_halt(int fd, Packet& in);
-   void usb_reset(int fd, Packet& in);
-   void usb_claim_interface(int fd, Packet& in);
-   void usb_release_interface(int fd, Packet& in);
+   void usb_open(int fd, Packet& in, UsbOpenReq& req);
+   void usb_close(int fd, Packet& in, UsbCloseReq& req);
+   void usb_set_configuration(int fd, Packet& in, UsbSetConfigurationReq& req);
+   void usb_set_altinterface(int fd, Packet& in, UsbSetAltInterfaceReq& req);
+   void usb_resetep(int fd, Packet& in, UsbResetEpReq& req);
+   void usb_clear_halt(int fd, Packet& in, UsbClearHaltReq& req);
+   void usb_reset(int fd, Packet& in, UsbResetReq& req);
+   void usb_claim_interface(int fd, Packet& in, UsbClaimInterfaceReq& req);
+   void usb_release_interface(int fd, Packet& in, UsbReleaseInterfaceReq& req);
 
    /* (3) Control transfers. */
-   void usb_control_msg(int fd, Packet& in);
+   void usb_control_msg(int fd, Packet& in, UsbControlMsgReq& req);
 
    /* (4) Bulk transfers. */
-   void usb_bulk_read(int fd, Packet& in);
-   void usb_bulk_write(int fd, Packet& in);
+   void usb_bulk_read(int fd, Packet& in, UsbBulkReadReq& req);
+   void usb_bulk_write(int fd, Packet& in, UsbBulkWriteReq& req);
+   void usb_bulk_stream(int fd, Packet& in, UsbBulkStreamReq& req);
+   void usb_bulk_stream_ack(int fd, Packet& in, UsbBulkStreamAckReq& req);
 
    /* (5) Interrupt transfers. */
-   void usb_interrupt_read(int fd, Packet& in);
-   void usb_interrupt_write(int fd, Packet& in);
+   void usb_interrupt_read(int fd, Packet& in, UsbInterruptReadReq& req);
+   void usb_interrupt_write(int fd, Packet& in, UsbInterruptWriteReq& req);
 
    /* (6) Non-portable. */
-   void usb_get_kernel_driver(int fd, Packet& in);
-   void usb_detach_kernel_driver(int fd, Packet& in);
+   void usb_get_kernel_driver(int fd, Packet& in, UsbGetKernelDriverReq& req);
+   void usb_detach_kernel_driver(int fd, Packet& in, UsbDetachKernelDriverReq& req);
+
+   /* (7) Session options. */
+   void usb_hello(int fd, Packet& in, UsbHelloReq& req);
+   void usb_batch(int fd, Packet& in, UsbBatchReq& req);
+   void usb_program(int fd, Packet& in, UsbProgramReq& req);
+   void usb_shm_link(int fd, Packet& in, UsbShmLinkReq& req);
+   void usb_stats(int fd, Packet& in, UsbStatsReq& req);
+   void usb_cancel(int fd, Packet& in, UsbCancelReq& req);
 
    private:
-   /* libusb data storage */
-   std::list<usb_dev_handle*> mOpenList;
+
+   /** Reply size reserved on top of transfer size. */
+   enum { TransferOverhead = 32 };
+
+   /** Reusable transfer buffers.
+     * Size classes are powers of two (4kB - 1MB), larger buffers are not pooled.
+     * Not thread-safe, each worker owns a pool.
+     */
+   class BufferPool {
+      public:
+      ~BufferPool();
+
+      /** Take buffer with capacity of at least given size. */
+      ByteBuffer* take(size_t size);
+
+      /** Return buffer to pool. */
+      void give(ByteBuffer* buf);
+
+      private:
+      enum { MinShift = 12, Classes = 9, MaxFree = 4 };
+      std::vector<ByteBuffer*> mFree[Classes];
+   };
+
+   /** Wait for backend events while draining streams (ms). */
+   enum { DrainWait = 10 };
+
+   struct StreamTransfer;
+
+   /** Bulk read-ahead stream. */
+   struct Stream {
+      int fd;            // Client socket, referenced
+      usb_dev_handle* h; // Open device
+      int ep, size, timeout;
+      int credits;       // Transfers client can accept
+      bool paused;       // Timed out, resumed by client acknowledgement
+      bool link;         // Started over shared memory link, pushed there
+      ByteBuffer buf;    // Pushed packet storage
+      bool ended;        // Cancelled, erased after last completion
+      std::list<StreamTransfer*> inflight; // Submitted transfers
+   };
+
+   struct Worker;
+
+   /** Submitted stream transfer, reads directly to pushed packet. */
+   struct StreamTransfer {
+      UsbTransfer t;
+      Worker* w;         // Owning worker
+      Stream* stream;
+      ByteBuffer* buf;   // Pool buffer swapped to packet
+      Packet pkt;        // Pushed packet
+      int pos;           // Message position in packet
+      uint64_t start;    // Submit time (ns)
+   };
+
+   /** Queued call, NULL packet drops client streams.
+     * Holds client socket reference.
+     */
+   struct Job {
+      int fd;            // Client socket
+      Packet* pkt;       // Incoming packet
+      bool link;         // Received from shared memory link
+   };
+
+   /** Device worker. */
+   struct Worker {
+      UsbService* service;
+      int devfd;
+      pthread_t thread;
+      pthread_mutex_t lock;
+      pthread_cond_t cond;
+      std::list<Job> queue;      // Pending calls, guarded by lock
+      int runFd;                 // Client socket of running call or -1, guarded by lock
+      uint16_t runId;            // Request id of running call, guarded by lock
+      std::list<StreamTransfer*> done; // Completed transfers, guarded by lock
+      std::list<Stream> streams; // Read-ahead streams, worker thread only
+      BufferPool pool;           // Transfer buffers, worker thread only
+      bool stop;                 // Finish queued calls and exit
+   };
+
+   /** Execute call in place, serialized with other in-place calls. */
+   bool dispatchLocal(int fd, Packet& pkt);
+
+   /** Shared memory link receiver, holds client socket reference. */
+   struct Link {
+      UsbService* service;
+      int fd;            // Client socket
+      ShmLink* link;     // Attached link
+   };
+
+   /** Link thread main loop, handles requests received from link. */
+   static void* link_run(void* arg);
+
+   /** Return device worker, optionally create new.
+     * \warning Call with mWorkerLock held.
+     */
+   Worker* worker(int devfd, bool create = false);
+
+   /** Return device worker if called from its thread, NULL otherwise.
+     * Worker streams are accessed only from the worker thread.
+     */
+   Worker* current(int devfd);
+
+   /** Worker thread main loop. */
+   static void* worker_run(void* arg);
+
+   /** Drop worker streams, -1 matches all clients/endpoints.
+     * Releases client socket references held by streams,
+     * waits for cancelled transfers in flight.
+     */
+   void drop(Worker* w, int fd, int ep);
+
+   /** Serve one transfer per worker stream with credits.
+     * \return true if more transfers are pending
+     */
+   bool serve(Worker* w);
+
+   /** Submit transfer per credit of worker streams, asynchronous backend. */
+   void submit(Worker* w);
+
+   /** Transfer completion callback, queues transfer to its worker. */
+   static void completed(UsbTransfer* t);
+
+   /** Backend events left to worker were handled, rearms event fd. */
+   static void events_ready(void* arg);
+
+   /** Push completed transfer, erase ended stream after last completion. */
+   void complete(Worker* w, StreamTransfer* st);
+
+   /** Cancel stream transfers, stream ends. */
+   void cancel(Stream& s);
+
+   /** Complete transfers until cancelled streams are erased. */
+   void drain(Worker* w);
+
+   /* Device access, timed for statistics */
+   ServerStats mStats;
+   StatsBackend mTimed;
+   UsbBackend* mBackend;
+
+   /** Serialized bus, for topology change detection. */
+   struct BusCache {
+      unsigned location;
+      ByteBuffer blob;     // Bus block with devices
+      uint32_t generation; // Topology generation of last change
+   };
+
+   /* Topology, event loop thread only.
+    * Generation starts at server start time, so it won't match
+    * generations cached by clients of previous server instance.
+    */
+   std::list<BusCache> mBusCache;
+   uint32_t mGeneration;
+
+   /** Cached endpoint of active configuration. */
+   struct Endpoint {
+      uint16_t maxpacket; // Max packet size, 0 if not active
+      uint8_t type;       // Transfer type (USB_ENDPOINT_TYPE_*)
+      uint8_t iface;      // Interface number
+   };
+
+   /** Open device slot.
+     * Device id is slot index tagged with slot generation,
+     * so stale ids of closed devices don't match reused slots.
+     */
+   struct Handle {
+      usb_dev_handle* h;   // Open device, NULL if slot is free
+      uint16_t gen;        // Slot generation
+      int config;          // Active configuration, -1 if unknown
+      Endpoint ep[32];     // Active endpoints, see usb_epindex()
+   };
+
+   enum { SlotBits = 16, MaxGen = 0x7fff };
+
+   /** Return slot of open device or NULL.
+     * \warning Call with mOpenLock held.
+     */
+   Handle* slot(int devfd);
+
+   /** Add open device to table.
+     * \return device id
+     */
+   int attach(usb_dev_handle* h);
+
+   /** Remove device from table.
+     * \return device handle or NULL if not open
+     */
+   usb_dev_handle* detach(int devfd);
+
+   /** Update cached endpoints after configuration or altsetting change.
+     * \param config configuration value, -1 if unknown
+     * \param iface interface with changed altsetting, -1 on configuration change
+     */
+   void configure(int devfd, int config, int iface = -1, int alt = 0);
+
+   /* Open devices, slots are reused */
+   std::vector<Handle> mHandles;
+   std::vector<int> mFreeSlots;
+   pthread_mutex_t mOpenLock;
+
+   /* Device workers */
+   std::map<int, Worker*> mWorkers;
+   pthread_mutex_t mWorkerLock;
+
+   /* In-place calls */
+   pthread_mutex_t mLocalLock;
+
+   /* Socket send locks, striped by fd, also guard link attachment */
+   enum { SendLocks = 16 };
+   pthread_mutex_t mSendLock[SendLocks];
+
+   /* Reply compressors by client fd, used with client send lock held */
+   std::map<int, Compressor*> mCodecs;
+   pthread_mutex_t mCodecLock;
+
+   /* Batch reply collected by current thread */
+   pthread_key_t mBatchKey;
+
+   /* Current thread handles request received from link */
+   pthread_key_t mLinkKey;
+
+   /* Packet trace, closed if not recording */
+   TraceWriter mTrace;
 };
 
 #endif // __usbservice_hpp__
@@ -23,8 +23,9 @@
 
 /** Symbolic constants.
   */
-#define SHM_KEY  (0x2a2a2a2a)
-#define SHM_SIZE (512) // At least size of int, SHMMIN may be enforced (!)
+#define IPC_ENV "USBNET_SESSION"       // Session socket path
+#define IPC_DAEMON_ENV "USBNET_DAEMON" // Multiplexer socket path, see usbnetd
+#define IPC_LOGLEVEL_ENV "USBNET_LOGLEVEL" // Wrapper loglevel with multiplexer
 
 /** Log level.
   */
@@ -27,8 +27,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 #include "usbnet.h"
 #include "protocol.h"
+#include "shmlink.h"
+#include "trace.h"
+#include "usbtiming.h"
 
 #ifdef USE_USB_CONST_BUFFERS
 typedef const char *usb_buf_t;
@@ -45,22 +51,57 @@ static void usb_destroy_configuration(struct usb_device *dev);
 //! Remote socket filedescriptor
 static int __remote_fd = -1;
 
+//! Bulk read-ahead depth (0 = disabled)
+static int __readahead = 0;
+
+//! Bulk/interrupt write-behind window (0 = disabled)
+static int __writebehind = 0;
+
+//! Auto-batching limit, calls per batch (0 = disabled)
+static int __autobatch = 0;
+
+//! Auto batch is sent at latest after this delay (ms)
+static int __batch_delay = 5;
+
+//! Request compressor, guarded by send lock
+static Compressor __compressor = { CodecNone, NULL, 0, 0, 0, 1 };
+
+//! Packet trace, session is process id (fd -1 = disabled)
+static TraceWriter __trace = { -1, PTHREAD_MUTEX_INITIALIZER };
+
 //! Remote USB busses with devices
 static struct usb_bus* __orig_bus   = NULL;
 static struct usb_bus* __remote_bus = NULL;
 extern struct usb_bus* usb_busses;
 
+//! Remote topology generation (0 = unknown)
+static uint32_t __topology_gen = 0;
+
+//! Virtual bus lock
+static pthread_mutex_t __bus_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! Batches collecting calls, see batch_add()
+struct batch_t;
+static struct batch_t* __batches = NULL;
+static void batch_flush(int fd, int devfd);
+static void batch_flush_all(int fd);
+static void batch_settle(usb_dev_handle* dev, int join);
+static int batch_collects(uint8_t op);
+
 void session_teardown() {
 
+   // Send collected calls
+   if(__remote_fd != -1)
+      batch_flush_all(__remote_fd);
+
+   // Print call timing
+   timing_report();
+   trace_close(&__trace);
+
    // Unhook global variable
    debug_msg("unhooking virtual bus ...");
    usb_busses = __orig_bus;
 
-   // Free global packet
-   debug_msg("deallocating shared packet ...");
-   if(pkt_shared() != NULL)
-      pkt_free(pkt_shared());
-
    // Free busses
    debug_msg("freeing busses ...");
    struct usb_bus* cur = NULL;
@@ -88,19 +129,49 @@ void session_teardown() {
    }
 }
 
+static void session_hello(int fd, int codecs);
+static int session_link(int fd);
+
+static void session_init() {
+
+   // Hook exit function
+   atexit(&session_teardown);
+
+   // Receive remote socket from wrapper session
+   __remote_fd = ipc_get_remote();
+
+   // Enable call timing and recording
+   timing_init();
+   const char* opt = getenv("USBNET_RECORD");
+   if(opt != NULL)
+      trace_open(&__trace, opt);
+
+   // Read session options
+   if((opt = getenv("USBNET_READAHEAD")) != NULL)
+      __readahead = atoi(opt);
+   if((opt = getenv("USBNET_WRITEBEHIND")) != NULL)
+      __writebehind = atoi(opt);
+   if((opt = getenv("USBNET_BATCH")) != NULL)
+      __autobatch = atoi(opt);
+   if((opt = getenv("USBNET_BATCH_DELAY")) != NULL)
+      __batch_delay = atoi(opt);
+
+   // Switch to shared memory with local server, not with multiplexer
+   int linked = 0;
+   opt = getenv("USBNET_SHM");
+   if((opt == NULL || atoi(opt) != 0) && __remote_fd != -1 && getenv(IPC_DAEMON_ENV) == NULL)
+      linked = session_link(__remote_fd);
+
+   // Negotiate compression, not worth it over shared memory
+   if((opt = getenv("USBNET_COMPRESS")) != NULL && __remote_fd != -1 && !linked)
+      session_hello(__remote_fd, codec_parse(opt));
+}
+
 int session_get() {
 
-   // Check exit function
-   static char exitf_hooked = 0;
-   if(!exitf_hooked) {
-      atexit(&session_teardown);
-      exitf_hooked = 1;
-   }
-
-   // Retrieve remote sock from SHM
-   if(__remote_fd == -1) {
-      __remote_fd = ipc_get_remote();
-   }
+   // Initialize once
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once(&once, &session_init);
 
    if(__remote_fd == -1) {
       error_msg("IPC: unable to access remote fd");
@@ -110,6 +181,1160 @@ int session_get() {
    return __remote_fd;
 }
 
+/* Session multiplexing.
+ * Each request carries an id, replies are routed to the waiting caller
+ * by id, so calls from multiple threads may be in flight at once.
+ * There is no dedicated receiving thread, one of the waiting callers
+ * receives and routes packets for all of them (leader/follower).
+ * Packets with id 0 are not replies, but buffers pushed by server.
+ * Session state below is guarded by __session_mutex.
+ */
+
+/** Caller waiting for reply. */
+typedef struct waiter_t {
+   struct waiter_t* next;
+   uint16_t id;   //! Request id
+   Packet* pkt;   //! Reply destination
+   int done;      //! Reply received
+} waiter_t;
+
+//! Session lock and state change condition
+static pthread_mutex_t __session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  __session_cond = PTHREAD_COND_INITIALIZER;
+
+//! Send lock, packets must not interleave
+static pthread_mutex_t __send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! Waiting callers
+static waiter_t* __waiters = NULL;
+
+//! Last request id
+static uint16_t __last_id = 0;
+
+//! Some caller is receiving
+static int __receiving = 0;
+
+//! Connection failed
+static int __broken = 0;
+
+//! Receive buffers of the receiving caller
+static Packet* __rx = NULL;
+static RecvBuf __rxbuf;
+
+/** Return new request id, 0 is reserved. */
+static uint16_t session_newid()
+{
+   if(++__last_id == 0)
+      ++__last_id;
+
+   return __last_id;
+}
+
+/** Return call flags, see usbschema.h. */
+static int call_flags(uint8_t op)
+{
+   switch(op) {
+#define CALL_FLAGS(op, handler, f) case op: return (f);
+      SCHEMA_CALLS(CALL_FLAGS)
+#undef CALL_FLAGS
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+/** Send packet, no reply is expected for request id 0. */
+static void session_send(int fd, Packet* pkt)
+{
+   // Calls collected on the same device go first
+   uint8_t op = pkt_op(pkt);
+   if(__batches != NULL && op != UsbBatch && pkt->size >= SCHEMA_SIZE_i32 &&
+      (call_flags(op) & SchemaDevice))
+      batch_flush(fd, schema_get_i32(pkt->buf));
+
+   pthread_mutex_lock(&__send_mutex);
+   if(__trace.fd >= 0)
+      trace_write(&__trace, getpid(), TraceRequest, op, pkt->id, pkt->buf, pkt->size);
+   pkt_sendz(pkt, fd, &__compressor);
+   pthread_mutex_unlock(&__send_mutex);
+}
+
+/* Bulk read-ahead streams.
+ * Server keeps up to __readahead transfers of given size in flight
+ * and pushes completed buffers as UsbBulkStreamData packets.
+ * Buffers are queued locally until read by usb_bulk_read().
+ */
+
+/** Read-ahead buffer. */
+typedef struct stream_buf {
+   struct stream_buf* next;
+   Packet* pkt;  //! Received packet
+   char* data;   //! Transfer data
+   int res;      //! Transfer result
+   int pos;      //! Consumed bytes
+} stream_buf;
+
+/** Read-ahead stream. */
+typedef struct stream_t {
+   struct stream_t* next;
+   int devfd, ep;
+   int size, timeout;       //! Transfer parameters
+   int stopped;             //! Stopped on remote, buffers are still read
+   int paused;              //! Timed out on remote, resumed by next read
+   int acks;                //! Consumed buffers, not yet acknowledged
+   stream_buf *head, *tail; //! Buffer queue
+} stream_t;
+
+//! Active streams
+static stream_t* __streams = NULL;
+
+//! Unused stream buffers
+static stream_buf* __stream_pool = NULL;
+
+static stream_t* stream_find(int devfd, int ep)
+{
+   stream_t* s = __streams;
+   while(s != NULL && (s->devfd != devfd || s->ep != ep))
+      s = s->next;
+
+   return s;
+}
+
+/** Remove local streams on device, ep -1 matches all endpoints. */
+static void stream_drop(int devfd, int ep)
+{
+   stream_t** p = &__streams;
+   while(*p != NULL) {
+      stream_t* s = *p;
+      if(s->devfd != devfd || (ep != -1 && s->ep != ep)) {
+         p = &s->next;
+         continue;
+      }
+
+      // Return buffers to pool
+      if(s->tail != NULL) {
+         s->tail->next = __stream_pool;
+         __stream_pool = s->head;
+      }
+
+      debug_msg("dropped stream fd %d, ep 0x%02x", s->devfd, s->ep);
+      *p = s->next;
+      free(s);
+   }
+}
+
+/** Queue pushed buffer to its stream.
+  * Packet buffer is swapped with pooled buffer, no copy is made.
+  */
+static void stream_push(Packet* pkt)
+{
+   UsbBulkStreamDataMsg msg;
+   if(!UsbBulkStreamDataMsg_unpack(pkt->buf, pkt->size, &msg))
+      return;
+
+   stream_t* s = stream_find(msg.devfd, msg.ep);
+   if(s == NULL) {
+      debug_msg("dropped buffer for unknown stream fd %d, ep 0x%02x", msg.devfd, msg.ep);
+      return;
+   }
+
+   // Get buffer from pool
+   stream_buf* b = __stream_pool;
+   if(b != NULL)
+      __stream_pool = b->next;
+   else {
+      b = malloc(sizeof(stream_buf));
+      b->pkt = pkt_new(BUF_FRAGLEN, 0x00);
+   }
+
+   // Swap packet buffers
+   Packet tmp = *b->pkt;
+   *b->pkt = *pkt;
+   *pkt = tmp;
+
+   // Data stays in swapped buffer
+   b->res = msg.res;
+   b->data = b->pkt->buf + UsbBulkStreamDataMsgSize;
+   b->pos = 0;
+
+   // Enqueue
+   b->next = NULL;
+   if(s->tail != NULL)
+      s->tail->next = b;
+   else
+      s->head = b;
+   s->tail = b;
+}
+
+/* Bulk/interrupt write-behind.
+ * Writes are sent without waiting for result, up to __writebehind
+ * writes may be unacknowledged. Results are matched with pending
+ * writes by request id. Failed result is saved to the device handle
+ * and reported by the next call on the device or usb_close().
+ */
+
+/** Client-side device handle data (usb_dev_handle::impl_info). */
+typedef struct {
+   int error; //! Deferred write error
+} handle_info;
+
+/** Pending write. */
+typedef struct {
+   uint16_t id;         //! Request id, 0 if unused
+   usb_dev_handle* dev;
+   int size;
+} wb_entry;
+
+//! Pending writes
+static wb_entry* __wb_queue = NULL;
+static int __wb_count = 0;
+
+/** Find pending write by request id. */
+static wb_entry* writeback_find(uint16_t id)
+{
+   int i = 0;
+   for(i = 0; i < __writebehind; ++i) {
+      if(__wb_queue[i].id == id)
+         return &__wb_queue[i];
+   }
+
+   return NULL;
+}
+
+/** Process result of pending write. */
+static void writeback_ack(wb_entry* e, Packet* pkt)
+{
+   e->id = 0;
+   --__wb_count;
+
+   // Read result
+   int res = -1;
+   UsbBulkWriteRep bulk;
+   UsbInterruptWriteRep intr;
+   if(pkt_op(pkt) == UsbBulkWrite && UsbBulkWriteRep_unpack(pkt->buf, pkt->size, &bulk))
+      res = bulk.res;
+   else if(pkt_op(pkt) == UsbInterruptWrite && UsbInterruptWriteRep_unpack(pkt->buf, pkt->size, &intr))
+      res = intr.res;
+   else
+      error_msg("%s: unexpected packet 0x%02x", __func__, pkt_op(pkt));
+
+   // Save first error, short write is reported as I/O error
+   handle_info* info = (handle_info*) e->dev->impl_info;
+   if(res != e->size && info->error == 0) {
+      info->error = (res < 0) ? res : -EIO;
+      debug_msg("deferred write on fd %d failed (%d)", e->dev->fd, res);
+   }
+}
+
+/** Return and clear deferred write error.
+  * \warning Call with session lock held.
+  */
+static int writeback_take(usb_dev_handle* dev)
+{
+   handle_info* info = (handle_info*) dev->impl_info;
+   int res = info->error;
+   info->error = 0;
+   return res;
+}
+
+/** Return and clear deferred write error. */
+static int writeback_error(usb_dev_handle* dev)
+{
+   pthread_mutex_lock(&__session_mutex);
+   int res = writeback_take(dev);
+   pthread_mutex_unlock(&__session_mutex);
+   return res;
+}
+
+/** Report deferred error at start of device call.
+  * On error, thread packet is released and call time is recorded.
+  * \return deferred error or 0
+  */
+static int writeback_report(usb_dev_handle* dev, uint8_t op, const char* name, uint64_t start)
+{
+   batch_settle(dev, batch_collects(op));
+   int res = writeback_error(dev);
+   if(res < 0) {
+      pkt_release();
+      timing_end(op, name, start, res, 0);
+      debug_msg("%s: returned deferred error %d", name, res);
+   }
+
+   return res;
+}
+
+/* Batched calls.
+ * Calls on a device are collected to a single UsbBatch request,
+ * which server executes in order and answers with a single reply.
+ * Explicit batch is started by usb_batch_begin() and finished by
+ * usb_batch_end(), which waits for results. With auto-batching
+ * (up to __autobatch calls), calls which rarely have their result
+ * checked are collected without explicit batch and failures are
+ * reported like deferred writes. Auto batch is sent when full, before
+ * any call on the same device which can't join it, or by timer thread
+ * after __batch_delay, so an idle application doesn't keep it.
+ * Collected calls are sent before any other call on the same device.
+ * Batches are guarded by __session_mutex.
+ */
+
+/** Batched call. */
+typedef struct {
+   char* bytes;  //! Control IN transfer destination
+   int size;     //! Destination size
+   int res;      //! Call result
+} batch_call;
+
+/** Batch of calls on a device. */
+typedef struct batch_t {
+   struct batch_t* next;
+   usb_dev_handle* dev;
+   Packet* pkt;         //! UsbBatch request
+   batch_call* calls;
+   int count, cap;
+   int manual;          //! Started by usb_batch_begin()
+   int done;            //! Reply received
+   uint16_t id;         //! Request id of sent batch
+   uint64_t deadline;   //! Auto batch send time (timing_now())
+} batch_t;
+
+//! Sent batches waiting for reply
+static batch_t* __batches_sent = NULL;
+
+//! Auto batch timer thread is running, its wakeup condition
+static int __batch_timer = 0;
+static pthread_cond_t __batch_cond;
+
+static void* batch_run(void* arg);
+static int session_pump(int fd);
+
+/** Create batch collecting calls on device. */
+static batch_t* batch_new(usb_dev_handle* dev, int manual)
+{
+   batch_t* b = malloc(sizeof(batch_t));
+   memset(b, 0, sizeof(batch_t));
+   b->dev = dev;
+   b->manual = manual;
+
+   // Fixed fields are written when sent
+   b->pkt = pkt_new(BUF_FRAGLEN, UsbBatch);
+   pkt_alloc(b->pkt, UsbBatchReqSize);
+   b->next = __batches;
+   __batches = b;
+
+   // Auto batch is sent by timer at latest
+   if(!manual) {
+      b->deadline = timing_now() + (uint64_t) __batch_delay * 1000000ULL;
+      if(!__batch_timer) {
+         pthread_condattr_t attr;
+         pthread_condattr_init(&attr);
+         pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+         pthread_cond_init(&__batch_cond, &attr);
+         pthread_condattr_destroy(&attr);
+
+         pthread_t thread;
+         if(pthread_create(&thread, NULL, &batch_run, (void*)(long) __remote_fd) == 0) {
+            pthread_detach(thread);
+            __batch_timer = 1;
+         }
+         else {
+            pthread_cond_destroy(&__batch_cond);
+            error_msg("%s: failed to start batch timer", __func__);
+         }
+      }
+      else
+         pthread_cond_signal(&__batch_cond);
+   }
+
+   return b;
+}
+
+/** Free batch. */
+static void batch_free(batch_t* b)
+{
+   pkt_free(b->pkt);
+   free(b->calls);
+   free(b);
+}
+
+/** Find batch on device in list. */
+static batch_t* batch_find(batch_t* list, int devfd)
+{
+   while(list != NULL && list->dev->fd != devfd)
+      list = list->next;
+
+   return list;
+}
+
+/** Remove batch from list. */
+static void batch_unlink(batch_t** list, batch_t* b)
+{
+   while(*list != b)
+      list = &(*list)->next;
+   *list = b->next;
+}
+
+/** Send calls collected on device without waiting for reply. */
+static void batch_flush(int fd, int devfd)
+{
+   pthread_mutex_lock(&__session_mutex);
+   batch_t* b = batch_find(__batches, devfd);
+   if(b == NULL) {
+      pthread_mutex_unlock(&__session_mutex);
+      return;
+   }
+
+   // Move to sent batches
+   batch_unlink(&__batches, b);
+   b->id = b->pkt->id = session_newid();
+   b->next = __batches_sent;
+   __batches_sent = b;
+
+   // Write fixed fields
+   UsbBatchReq req = { devfd, b->count, NULL, 0 };
+   UsbBatchReq_pack(b->pkt->buf, &req);
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Send request, batch is not freed until reply
+   debug_msg("sending %d calls on fd %d", b->count, devfd);
+   session_send(fd, b->pkt);
+}
+
+/** Send calls collected on all devices. */
+static void batch_flush_all(int fd)
+{
+   pthread_mutex_lock(&__session_mutex);
+   while(__batches != NULL) {
+      int devfd = __batches->dev->fd;
+      pthread_mutex_unlock(&__session_mutex);
+      batch_flush(fd, devfd);
+      pthread_mutex_lock(&__session_mutex);
+   }
+   pthread_mutex_unlock(&__session_mutex);
+}
+
+/** Send auto batches after their deadline. */
+static void* batch_run(void* arg)
+{
+   int fd = (int)(long) arg;
+
+   pthread_mutex_lock(&__session_mutex);
+   for(;;) {
+
+      // Find earliest auto batch
+      batch_t* first = NULL;
+      batch_t* b = NULL;
+      for(b = __batches; b != NULL; b = b->next) {
+         if(!b->manual && (first == NULL || b->deadline < first->deadline))
+            first = b;
+      }
+
+      // Wait for batch or its deadline
+      if(first == NULL) {
+         pthread_cond_wait(&__batch_cond, &__session_mutex);
+         continue;
+      }
+      if(first->deadline > timing_now()) {
+         struct timespec ts;
+         ts.tv_sec = first->deadline / 1000000000ULL;
+         ts.tv_nsec = first->deadline % 1000000000ULL;
+         pthread_cond_timedwait(&__batch_cond, &__session_mutex, &ts);
+         continue;
+      }
+
+      // Send expired batch
+      int devfd = first->dev->fd;
+      pthread_mutex_unlock(&__session_mutex);
+      batch_flush(fd, devfd);
+      pthread_mutex_lock(&__session_mutex);
+   }
+
+   return NULL;
+}
+
+/** Collect call to device batch.
+  * \param pkt call request
+  * \param bytes control IN destination or NULL
+  * \param autook call may be collected by auto-batching
+  * \return 1 if collected, 0 if call is to be sent now
+  */
+static int batch_add(int fd, usb_dev_handle* dev, Packet* pkt, char* bytes, int size, int autook)
+{
+   // Batching not used
+   if(__batches == NULL && __autobatch == 0)
+      return 0;
+
+   // Find or start batch
+   pthread_mutex_lock(&__session_mutex);
+   batch_t* b = batch_find(__batches, dev->fd);
+   if(b == NULL && autook && __autobatch > 0)
+      b = batch_new(dev, 0);
+   if(b == NULL || (!b->manual && !autook)) {
+      pthread_mutex_unlock(&__session_mutex);
+      return 0;
+   }
+
+   // Append call
+   if(b->count == b->cap) {
+      b->cap = (b->cap > 0) ? b->cap * 2 : 8;
+      b->calls = realloc(b->calls, b->cap * sizeof(batch_call));
+   }
+   batch_call* c = &b->calls[b->count++];
+   c->bytes = bytes;
+   c->size = size;
+   c->res = -1;
+
+   char* dst = pkt_alloc(b->pkt, UsbBatchEntrySize + pkt->size);
+   dst = schema_put_u8(dst, pkt_op(pkt));
+   dst = schema_put_u32(dst, pkt->size);
+   memcpy(dst, pkt->buf, pkt->size);
+
+   // Auto batch is full
+   int full = !b->manual && b->count >= __autobatch;
+   pthread_mutex_unlock(&__session_mutex);
+   if(full)
+      batch_flush(fd, dev->fd);
+
+   return 1;
+}
+
+/** Process batch reply.
+  * Auto batch is freed, first failure is saved to device handle.
+  */
+static void batch_ack(batch_t* b, Packet* pkt)
+{
+   // Read replies in call order, replies start with result
+   UsbBatchRep rep;
+   if(pkt_op(pkt) == UsbBatch && UsbBatchRep_unpack(pkt->buf, pkt->size, &rep)) {
+      const char* p = rep.data;
+      uint32_t left = rep.len;
+      int i = 0;
+      for(i = 0; i < b->count && i < (int) rep.count && left >= UsbBatchEntrySize; ++i) {
+         uint8_t op = schema_get_u8(p);
+         uint32_t size = schema_get_u32(p + 1);
+         p += UsbBatchEntrySize;
+         left -= UsbBatchEntrySize;
+         if(size > left)
+            break;
+
+         batch_call* c = &b->calls[i];
+         if(size >= SCHEMA_SIZE_i32)
+            c->res = schema_get_i32(p);
+
+         // Control IN data
+         UsbControlMsgRep ctl;
+         if(op == UsbControlMsg && c->bytes != NULL && c->res > 0 &&
+            UsbControlMsgRep_unpack(p, size, &ctl)) {
+            int minlen = (c->res > c->size) ? c->size : c->res;
+            if(minlen > (int) ctl.len)
+               minlen = ctl.len;
+            memcpy(c->bytes, ctl.data, minlen);
+         }
+
+         p += size;
+         left -= size;
+      }
+   }
+   else
+      error_msg("%s: unexpected packet 0x%02x", __func__, pkt_op(pkt));
+
+   b->done = 1;
+   if(b->manual)
+      return;
+
+   // Save first error
+   handle_info* info = (handle_info*) b->dev->impl_info;
+   int i = 0;
+   for(i = 0; i < b->count && info->error == 0; ++i) {
+      if(b->calls[i].res < 0) {
+         info->error = b->calls[i].res;
+         debug_msg("batched call on fd %d failed (%d)", b->dev->fd, info->error);
+      }
+   }
+
+   batch_unlink(&__batches_sent, b);
+   batch_free(b);
+}
+
+/** Return 1 if auto-batching may collect call. */
+static int batch_collects(uint8_t op)
+{
+   switch(op) {
+   case UsbSetConfiguration:
+   case UsbSetAltInterface:
+   case UsbResetEp:
+   case UsbClearHalt:
+   case UsbClaimInterface:
+   case UsbReleaseInterface:
+   case UsbControlMsg:
+      return 1;
+   default:
+      break;
+   }
+
+   return 0;
+}
+
+/** Settle auto batches on device before deferred error is checked.
+  * Collected calls are sent unless the call may join them,
+  * then sent auto batches are waited for, so their failure is
+  * reported by this call.
+  * \param join call may be collected by auto-batching
+  */
+static void batch_settle(usb_dev_handle* dev, int join)
+{
+   if(__autobatch == 0)
+      return;
+
+   // Send auto batch, manual batch is kept until usb_batch_end()
+   int fd = session_get();
+   pthread_mutex_lock(&__session_mutex);
+   batch_t* b = batch_find(__batches, dev->fd);
+   int flush = !join && b != NULL && !b->manual;
+   pthread_mutex_unlock(&__session_mutex);
+   if(flush)
+      batch_flush(fd, dev->fd);
+
+   // Wait for sent auto batches
+   pthread_mutex_lock(&__session_mutex);
+   for(;;) {
+      batch_t* b = __batches_sent;
+      while(b != NULL && (b->dev != dev || b->manual))
+         b = b->next;
+      if(b == NULL || !session_pump(fd))
+         break;
+   }
+   pthread_mutex_unlock(&__session_mutex);
+}
+
+/** Drop batches on closed device.
+  * \warning Call with session lock held.
+  */
+static void batch_drop(usb_dev_handle* dev)
+{
+   batch_t* b = NULL;
+   while((b = batch_find(__batches_sent, dev->fd)) != NULL) {
+      batch_unlink(&__batches_sent, b);
+      batch_free(b);
+   }
+   while((b = batch_find(__batches, dev->fd)) != NULL) {
+      batch_unlink(&__batches, b);
+      batch_free(b);
+   }
+}
+
+/* Asynchronous transfers.
+ * Transfers submitted by usb_submit_async() are sent without waiting,
+ * results are routed to pending transfers by request id.
+ * While transfers are pending, receiver thread pumps the session,
+ * so results are delivered without any caller waiting.
+ * Pending transfers are guarded by __session_mutex.
+ */
+
+//! Pending transfers
+static usb_async* __async = NULL;
+
+//! Receiver thread is running
+static int __async_receiver = 0;
+
+/** Unlink pending transfer.
+  * \return 1 if transfer was pending, 0 otherwise
+  */
+static int async_unlink(usb_async* a)
+{
+   usb_async** p = &__async;
+   while(*p != NULL && *p != a)
+      p = &(*p)->next;
+   if(*p == NULL)
+      return 0;
+
+   *p = a->next;
+   return 1;
+}
+
+/** Find pending transfer by request id. */
+static usb_async* async_find(uint16_t id)
+{
+   usb_async* a = __async;
+   while(a != NULL && a->id != id)
+      a = a->next;
+
+   return a;
+}
+
+/** Return timing name of asynchronous transfer. */
+static const char* async_name(uint8_t op)
+{
+   switch(op) {
+   case UsbControlMsg:     return "usb_control_msg (async)";
+   case UsbBulkRead:       return "usb_bulk_read (async)";
+   case UsbBulkWrite:      return "usb_bulk_write (async)";
+   case UsbInterruptRead:  return "usb_interrupt_read (async)";
+   case UsbInterruptWrite: return "usb_interrupt_write (async)";
+   default:
+      break;
+   }
+
+   return "usb_submit_async";
+}
+
+/** Complete pending transfer with received result. */
+static void async_ack(usb_async* a, Packet* pkt)
+{
+   async_unlink(a);
+
+   // Read result, transfer replies share layout
+   int res = -1;
+   UsbBulkReadRep rep;
+   uint8_t op = pkt_op(pkt);
+   if((op == UsbControlMsg || op == UsbBulkRead || op == UsbBulkWrite ||
+       op == UsbInterruptRead || op == UsbInterruptWrite) &&
+      UsbBulkReadRep_unpack(pkt->buf, pkt->size, &rep)) {
+      res = rep.res;
+
+      // Copy IN data
+      if(res > 0 && rep.len > 0) {
+         int minlen = (res > a->size) ? a->size : res;
+         if(minlen > rep.len)
+            minlen = rep.len;
+         memcpy(a->bytes, rep.data, minlen);
+      }
+   }
+   else
+      error_msg("%s: unexpected packet 0x%02x", __func__, op);
+
+   // Complete transfer
+   a->res = res;
+   timing_end(op, async_name(op), a->start, res, (res > 0) ? res : 0);
+   a->complete(a);
+}
+
+/** Route received packet to its destination. */
+static void session_route(Packet* pkt)
+{
+   // Read-ahead buffer
+   if(pkt->id == 0) {
+      if(pkt_op(pkt) == UsbBulkStreamData)
+         stream_push(pkt);
+      else
+         debug_msg("unexpected packet 0x%02x", pkt_op(pkt));
+      return;
+   }
+
+   // Waiting caller, swap buffers
+   waiter_t* w = __waiters;
+   while(w != NULL && w->id != pkt->id)
+      w = w->next;
+   if(w != NULL) {
+      Packet tmp = *w->pkt;
+      *w->pkt = *pkt;
+      *pkt = tmp;
+      w->done = 1;
+      return;
+   }
+
+   // Batch result
+   batch_t* b = __batches_sent;
+   while(b != NULL && b->id != pkt->id)
+      b = b->next;
+   if(b != NULL) {
+      batch_ack(b, pkt);
+      return;
+   }
+
+   // Asynchronous transfer result
+   usb_async* a = async_find(pkt->id);
+   if(a != NULL) {
+      async_ack(a, pkt);
+      return;
+   }
+
+   // Deferred write result
+   wb_entry* e = NULL;
+   if(__wb_count > 0 && (e = writeback_find(pkt->id)) != NULL) {
+      writeback_ack(e, pkt);
+      return;
+   }
+
+   debug_msg("unexpected reply 0x%02x (id %u)", pkt_op(pkt), pkt->id);
+}
+
+/** Wait for session state change.
+  * Receive and route one packet if no other caller is receiving.
+  * \warning Call with session lock held.
+  * \return 1 on success, 0 on connection error
+  */
+static int session_pump(int fd)
+{
+   if(__broken)
+      return 0;
+
+   // Someone else is receiving
+   if(__receiving) {
+      pthread_cond_wait(&__session_cond, &__session_mutex);
+      return !__broken;
+   }
+
+   // Receive packet unlocked
+   __receiving = 1;
+   if(__rx == NULL) {
+      __rx = pkt_new(BUF_FRAGLEN, 0x00);
+      rbuf_init(&__rxbuf, RECVBUF_SIZE);
+   }
+   pthread_mutex_unlock(&__session_mutex);
+   uint32_t size = pkt_recvbuf(fd, &__rxbuf, __rx);
+   pthread_mutex_lock(&__session_mutex);
+   __receiving = 0;
+
+   // Route packet
+   if(size > 0) {
+      if(__trace.fd >= 0)
+         trace_write(&__trace, getpid(), TraceReply, pkt_op(__rx), __rx->id, __rx->buf, __rx->size);
+      session_route(__rx);
+   }
+   else {
+      error_msg("%s: connection failed", __func__);
+      __broken = 1;
+   }
+
+   // Wake up waiting callers
+   pthread_cond_broadcast(&__session_cond);
+   return !__broken;
+}
+
+/** Send request and wait for reply.
+  * Reply is received to the same packet.
+  * \return reply size on success, 0 on error
+  */
+static uint32_t session_call(int fd, Packet* pkt)
+{
+   // Register caller
+   waiter_t w;
+   pthread_mutex_lock(&__session_mutex);
+   w.id = pkt->id = session_newid();
+   w.pkt = pkt;
+   w.done = 0;
+   w.next = __waiters;
+   __waiters = &w;
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Send request
+   session_send(fd, pkt);
+
+   // Wait for reply
+   pthread_mutex_lock(&__session_mutex);
+   while(!w.done && session_pump(fd))
+      ;
+
+   // Unregister caller
+   waiter_t** p = &__waiters;
+   while(*p != &w)
+      p = &(*p)->next;
+   *p = w.next;
+   pthread_mutex_unlock(&__session_mutex);
+
+   return w.done ? pkt->size : 0;
+}
+
+/* Client stubs, generated from call schema (see usbschema.h).
+ * <op>_request() initializes packet with request,
+ * <op>_call() sends request and decodes reply received to the same packet,
+ * reply data points to packet buffer,
+ * <op>_batch() collects request to device batch, see batch_add().
+ */
+#define CALL_STUB(op, handler, flags) \
+static inline void op##_request(Packet* pkt, const op##Req* req) { \
+   pkt_init(pkt, op); \
+   char* dst = pkt_alloc(pkt, op##ReqSize + req->len); \
+   if(dst != NULL) \
+      op##Req_pack(dst, req); \
+} \
+static inline int op##_call(int fd, Packet* pkt, const op##Req* req, op##Rep* rep) { \
+   op##_request(pkt, req); \
+   if(session_call(fd, pkt) == 0 || pkt_op(pkt) != op) \
+      return 0; \
+   return op##Rep_unpack(pkt->buf, pkt->size, rep); \
+} \
+static inline int op##_batch(int fd, usb_dev_handle* dev, Packet* pkt, const op##Req* req, \
+                             char* bytes, int size, int autook) { \
+   op##_request(pkt, req); \
+   return batch_add(fd, dev, pkt, bytes, size, autook); \
+}
+
+SCHEMA_CALLS(CALL_STUB)
+#undef CALL_STUB
+
+/** Negotiate payload compression.
+  * Server compresses replies once it answers, requests are compressed
+  * after reply is received.
+  */
+static void session_hello(int fd, int codecs)
+{
+   codecs &= codec_supported();
+   if(codecs == CodecNone)
+      return;
+
+   Packet* pkt = pkt_new(BUF_FRAGLEN, UsbHello);
+   UsbHelloReq req = { (uint32_t) codecs, NULL, 0 };
+   UsbHelloRep rep;
+   if(UsbHello_call(fd, pkt, &req, &rep) && rep.codec != CodecNone) {
+      pthread_mutex_lock(&__send_mutex);
+      codec_init(&__compressor, rep.codec);
+      pthread_mutex_unlock(&__send_mutex);
+   }
+
+   pkt_free(pkt);
+   debug_msg("codecs 0x%x = 0x%x", codecs, __compressor.codec);
+}
+
+/** Switch session to shared memory link if server is local.
+  * Server maps the link before it replies, requests are sent over
+  * the link once reply is received. Socket is kept for hangup detection.
+  * \return 1 if link is used, 0 if session stays on socket
+  */
+static int session_link(int fd)
+{
+   if(!shm_link_local(fd))
+      return 0;
+
+   // Create link
+   char name[SHMLINK_NAMELEN];
+   ShmLink* link = shm_link_create(name, SHMLINK_SIZE, fd);
+   if(link == NULL)
+      return 0;
+
+   // Let server map it, name is no longer needed afterwards
+   Packet* pkt = pkt_new(BUF_FRAGLEN, UsbShmLink);
+   UsbShmLinkReq req = { name, strlen(name) + 1 };
+   UsbShmLinkRep rep;
+   int res = UsbShmLink_call(fd, pkt, &req, &rep) && rep.res == 0;
+   shm_link_unlink(name);
+   pkt_free(pkt);
+   if(!res || !shm_link_attach(fd, link)) {
+      debug_msg("staying on socket");
+      shm_link_free(link);
+      return 0;
+   }
+
+   // Receive from link
+   pthread_mutex_lock(&__session_mutex);
+   __rxbuf.link = link;
+   pthread_mutex_unlock(&__session_mutex);
+   debug_msg("using shared memory link %s", name);
+   return 1;
+}
+
+/** Send write without waiting for result.
+  * Blocks while write-behind window is full.
+  * \return size on success, deferred error or -1 on connection error
+  */
+static int writeback_send(int fd, Packet* pkt, usb_dev_handle* dev, int size)
+{
+   pthread_mutex_lock(&__session_mutex);
+
+   // Allocate queue
+   if(__wb_queue == NULL) {
+      __wb_queue = malloc(__writebehind * sizeof(wb_entry));
+      memset(__wb_queue, 0, __writebehind * sizeof(wb_entry));
+   }
+
+   // Wait for free slot
+   while(__wb_count >= __writebehind && session_pump(fd))
+      ;
+
+   // Window may have completed with error
+   int res = writeback_take(dev);
+   if(__wb_count >= __writebehind)
+      res = -1;
+   if(res < 0) {
+      pthread_mutex_unlock(&__session_mutex);
+      return res;
+   }
+
+   // Register pending write
+   wb_entry* e = writeback_find(0);
+   e->id = pkt->id = session_newid();
+   e->dev = dev;
+   e->size = size;
+   ++__wb_count;
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Send request
+   session_send(fd, pkt);
+   return size;
+}
+
+/** Start read-ahead stream on remote.
+  * \return 0 on success, -1 if refused
+  */
+static int stream_start(int fd, Packet* pkt, int devfd, int ep, int size, int timeout)
+{
+   // Register stream before any buffer arrives
+   stream_t* s = malloc(sizeof(stream_t));
+   memset(s, 0, sizeof(stream_t));
+   s->devfd = devfd;
+   s->ep = ep;
+   s->size = size;
+   s->timeout = timeout;
+   pthread_mutex_lock(&__session_mutex);
+   s->next = __streams;
+   __streams = s;
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Get response
+   UsbBulkStreamReq req = { devfd, ep, size, timeout, __readahead, NULL, 0 };
+   UsbBulkStreamRep rep;
+   int res = -1;
+   if(UsbBulkStream_call(fd, pkt, &req, &rep))
+      res = rep.res;
+
+   // Refused
+   if(res < 0) {
+      pthread_mutex_lock(&__session_mutex);
+      stream_drop(devfd, ep);
+      pthread_mutex_unlock(&__session_mutex);
+      return -1;
+   }
+
+   debug_msg("started stream fd %d, ep 0x%02x (%d x %dB)", devfd, ep, __readahead, size);
+   return 0;
+}
+
+/** Stop read-ahead streams on device, ep -1 matches all endpoints.
+  */
+static void stream_stop(int fd, Packet* pkt, int devfd, int ep)
+{
+   // Check active streams
+   pthread_mutex_lock(&__session_mutex);
+   stream_t* s = __streams;
+   while(s != NULL && (s->devfd != devfd || (ep != -1 && s->ep != ep)))
+      s = s->next;
+   pthread_mutex_unlock(&__session_mutex);
+   if(s == NULL)
+      return;
+
+   // Wait for confirmation, buffers pushed in meantime are discarded
+   UsbBulkStreamReq req = { devfd, ep, 0, 0, 0, NULL, 0 };
+   UsbBulkStreamRep rep;
+   if(!UsbBulkStream_call(fd, pkt, &req, &rep))
+      error_msg("%s: failed to stop stream on fd %d", __func__, devfd);
+
+   pthread_mutex_lock(&__session_mutex);
+   stream_drop(devfd, ep);
+   pthread_mutex_unlock(&__session_mutex);
+}
+
+/** Stop read-ahead stream on remote, received buffers are kept for reading.
+  * \return 0 if stream has buffers left, -1 if stream was removed
+  */
+static int stream_end(int fd, Packet* pkt, int devfd, int ep)
+{
+   // Wait for confirmation, buffers pushed in meantime are queued
+   UsbBulkStreamReq req = { devfd, ep, 0, 0, 0, NULL, 0 };
+   UsbBulkStreamRep rep;
+   if(!UsbBulkStream_call(fd, pkt, &req, &rep))
+      error_msg("%s: failed to stop stream on fd %d", __func__, devfd);
+
+   // Remove drained stream
+   int res = -1;
+   pthread_mutex_lock(&__session_mutex);
+   stream_t* s = stream_find(devfd, ep);
+   if(s != NULL) {
+      s->stopped = 1;
+      if(s->head != NULL)
+         res = 0;
+      else
+         stream_drop(devfd, ep);
+   }
+   pthread_mutex_unlock(&__session_mutex);
+   return res;
+}
+
+/** Read from read-ahead stream, block until buffer is available.
+  * \return transfer result, -1 if stream is not active
+  */
+static int stream_read(int fd, Packet* pkt, int devfd, int ep, char* bytes, int size)
+{
+   // Resume timed out stream, unless buffers are left
+   pthread_mutex_lock(&__session_mutex);
+   stream_t* s = stream_find(devfd, ep);
+   if(s != NULL && s->paused && s->head == NULL) {
+      UsbBulkStreamAckReq req = { devfd, ep, s->acks, NULL, 0 };
+      s->acks = 0;
+      s->paused = 0;
+      pthread_mutex_unlock(&__session_mutex);
+      UsbBulkStreamAck_request(pkt, &req);
+      session_send(fd, pkt);
+      pthread_mutex_lock(&__session_mutex);
+   }
+
+   // Wait for buffer
+   while((s = stream_find(devfd, ep)) != NULL && s->head == NULL && !s->stopped) {
+      if(!session_pump(fd))
+         break;
+   }
+
+   if(s == NULL || s->head == NULL) {
+      pthread_mutex_unlock(&__session_mutex);
+      return -1;
+   }
+
+   // Copy data
+   stream_buf* b = s->head;
+   int res = b->res;
+   if(res >= 0) {
+      res -= b->pos;
+      if(res > size)
+         res = size;
+
+      memcpy(bytes, b->data + b->pos, res);
+      b->pos += res;
+
+      // Buffer is not exhausted
+      if(b->pos < b->res) {
+         pthread_mutex_unlock(&__session_mutex);
+         return res;
+      }
+   }
+
+   // Dequeue buffer, timeouts queued after timeout are stale
+   int timeouts = 0;
+   do {
+      b = s->head;
+      s->head = b->next;
+      b->next = __stream_pool;
+      __stream_pool = b;
+      if(b->res == -ETIMEDOUT)
+         ++timeouts;
+   } while(timeouts > 0 && s->head != NULL && s->head->res == -ETIMEDOUT);
+   if(s->head == NULL)
+      s->tail = NULL;
+
+   // Error other than timeout ends stream on both sides,
+   // stopped stream ends when drained,
+   // timeout pauses remote stream until next read
+   int acks = 0;
+   if((res < 0 && res != -ETIMEDOUT) || (s->stopped && s->head == NULL))
+      stream_drop(devfd, ep);
+   else if(timeouts > 0) {
+      s->acks += timeouts;
+      s->paused = 1;
+   }
+   else if(!s->stopped && ++s->acks >= (__readahead + 1) / 2 && !s->paused) {
+      acks = s->acks;
+      s->acks = 0;
+   }
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Return consumed credits in batches
+   if(acks > 0) {
+      UsbBulkStreamAckReq req = { devfd, ep, acks, NULL, 0 };
+      UsbBulkStreamAck_request(pkt, &req);
+      session_send(fd, pkt);
+   }
+
+   return res;
+}
 
 /* libusb functions reimplementation.
  * \see http://libusb.sourceforge.net/doc/functions.html
@@ -125,11 +1350,14 @@ void usb_init(void)
    // Initialize packet & remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
 
    // Create buffer
-   pkt_init(pkt, UsbInit);
-   pkt_send(pkt, fd);
+   UsbInitReq req = { NULL, 0 };
+   UsbInit_request(pkt, &req);
+   session_send(fd, pkt);
    pkt_release();
+   timing_end(UsbInit, __func__, start, 0, 0);
 
    // Initialize locally
    debug_msg("called");
@@ -143,256 +1371,293 @@ int usb_find_busses(void)
   // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
-
-   // Initialize pkt
-   pkt_init(pkt, UsbFindBusses);
-   pkt_send(pkt, fd);
+   uint64_t start = timing_begin();
 
    // Get number of changes
+   UsbFindBussesReq req = { NULL, 0 };
+   UsbFindBussesRep rep;
    int res = 0;
-   Iterator it;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbFindBusses) {
-      if(pkt_begin(pkt, &it) != NULL) {
-         res = iter_getint(&it);
-      }
-   }
+   if(UsbFindBusses_call(fd, pkt, &req, &rep))
+      res = rep.res;
 
    // Return remote result
    pkt_release();
+   timing_end(UsbFindBusses, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
 
-/** Find devices on remote host.
-  * Create new devices on local virtual bus.
-  * \warning Function replaces global usb_busses variable from libusb.
+/** Update local virtual bus from remote host.
+  * \param stale set if cached topology is out of sync and call must be repeated
+  * \return remote result
   */
-int usb_find_devices(void)
+static int find_devices(int* stale)
 {
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
-   // Create buffer
-   pkt_init(pkt, UsbFindDevices);
-   pkt_send(pkt, fd);
-
-   // Get number of changes
+   // Get number of changes, one caller updates virtual bus at a time
+   pthread_mutex_lock(&__bus_mutex);
+   UsbFindDevicesReq req = { __topology_gen, NULL, 0 };
+   UsbFindDevicesRep rep;
    int res = 0;
+   *stale = 0;
    Iterator it;
-   if(pkt_recv(fd, pkt) > 0) {
-      pkt_begin(pkt, &it);
+   if(UsbFindDevices_call(fd, pkt, &req, &rep)) {
+      iter_begin(&it, rep.data, rep.len);
 
       // Get return value
-      res = iter_getint(&it);
-
-      // Allocate virtualbus
-      struct usb_bus vbus;
-      vbus.next = __remote_bus;
-      struct usb_bus* rbus = &vbus;
+      res = rep.res;
 
-      // Get busses
-      while(!iter_end(&it)) {
-
-         // Evaluate
-         if(it.type == StructureType) {
-            iter_enter(&it);
-
-            // Allocate bus
-            if(rbus->next == NULL) {
-
-               // Allocate next item
-               struct usb_bus* nbus = malloc(sizeof(struct usb_bus));
-               memset(nbus, 0, sizeof(struct usb_bus));
-               rbus->next = nbus;
-               nbus->prev = rbus;
-               rbus = nbus;
-            }
-            else
-               rbus = rbus->next;
+      // Read topology generation
+      uint32_t gen = rep.generation;
+      if(gen != 0 && gen == __topology_gen) {
+         debug_msg("topology generation %u not modified", gen);
+      }
+      else {
 
-            // Read dirname
-            strcpy(rbus->dirname, iter_getstr(&it));
+         // Allocate virtualbus
+         struct usb_bus vbus;
+         vbus.next = __remote_bus;
+         struct usb_bus* rbus = &vbus;
 
-            // Read location
-            rbus->location = iter_getuint(&it);
+         // Get busses
+         while(!iter_end(&it)) {
 
-            // Read devices
-            struct usb_device vdev;
-            vdev.next = rbus->devices;
-            struct usb_device* dev = &vdev;
-            while(it.type == SequenceType) {
+            // Evaluate
+            if(it.type == StructureType) {
                iter_enter(&it);
 
-               // Initialize
-               if(dev->next == NULL) {
-                  dev->next = malloc(sizeof(struct usb_device));
-                  memset(dev->next, 0, sizeof(struct usb_device));
-                  dev->next->bus = rbus;
-                  if(dev != &vdev)
-                     dev->next->prev = dev;
-                  if(rbus->devices == NULL)
-                     rbus->devices = dev->next;
+               // Allocate bus
+               if(rbus->next == NULL) {
+
+                  // Allocate next item
+                  struct usb_bus* nbus = malloc(sizeof(struct usb_bus));
+                  memset(nbus, 0, sizeof(struct usb_bus));
+                  rbus->next = nbus;
+                  nbus->prev = rbus;
+                  rbus = nbus;
                }
+               else
+                  rbus = rbus->next;
+
+               // Read dirname
+               strcpy(rbus->dirname, iter_getstr(&it));
+
+               // Read location
+               rbus->location = iter_getuint(&it);
+
+               // Read devices
+               struct usb_device vdev;
+               vdev.next = rbus->devices;
+               struct usb_device* dev = &vdev;
+               while(it.type == SequenceType) {
+                  iter_enter(&it);
+
+                  // Initialize
+                  if(dev->next == NULL) {
+                     dev->next = malloc(sizeof(struct usb_device));
+                     memset(dev->next, 0, sizeof(struct usb_device));
+                     dev->next->bus = rbus;
+                     if(dev != &vdev)
+                        dev->next->prev = dev;
+                     if(rbus->devices == NULL)
+                        rbus->devices = dev->next;
+                  }
 
-               dev = dev->next;
+                  dev = dev->next;
 
-               // Read filename
-               strcpy(dev->filename, iter_getstr(&it));
+                  // Read filename
+                  strcpy(dev->filename, iter_getstr(&it));
 
-               // Read devnum
-               dev->devnum = iter_getuint(&it);
+                  // Read devnum
+                  dev->devnum = iter_getuint(&it);
 
-               // Read descriptor
-               // Apply byte-order conversion for 16/32bit integers
-               memcpy(&dev->descriptor, it.val, it.len);
-               dev->descriptor.bcdUSB = ntohs(dev->descriptor.bcdUSB);
-               dev->descriptor.idVendor = ntohs(dev->descriptor.idVendor);
-               dev->descriptor.idProduct = ntohs(dev->descriptor.idProduct);
-               dev->descriptor.bcdDevice = ntohs(dev->descriptor.bcdDevice);
-               iter_next(&it);
+                  // Read descriptor
+                  // Apply byte-order conversion for 16/32bit integers
+                  memcpy(&dev->descriptor, it.val, it.len);
+                  dev->descriptor.bcdUSB = ntohs(dev->descriptor.bcdUSB);
+                  dev->descriptor.idVendor = ntohs(dev->descriptor.idVendor);
+                  dev->descriptor.idProduct = ntohs(dev->descriptor.idProduct);
+                  dev->descriptor.bcdDevice = ntohs(dev->descriptor.bcdDevice);
+                  iter_next(&it);
 
-               // Alloc configurations
-               unsigned cfgid = 0, cfgnum = dev->descriptor.bNumConfigurations;
-               dev->config = NULL;
-               if(cfgnum > 0) {
-                  dev->config = malloc(cfgnum * sizeof(struct usb_config_descriptor));
-                  memset(dev->config, 0, cfgnum * sizeof(struct usb_config_descriptor));
-               }
+                  // Alloc configurations
+                  unsigned cfgid = 0, cfgnum = dev->descriptor.bNumConfigurations;
+                  dev->config = NULL;
+                  if(cfgnum > 0) {
+                     dev->config = malloc(cfgnum * sizeof(struct usb_config_descriptor));
+                     memset(dev->config, 0, cfgnum * sizeof(struct usb_config_descriptor));
+                  }
 
-               // Read config
-               while(it.type == RawType && cfgid < cfgnum) {
-                  struct usb_config_descriptor* cfg = &dev->config[cfgid];
-                  ++cfgid;
+                  // Read config
+                  while(it.type == RawType && cfgid < cfgnum) {
+                     struct usb_config_descriptor* cfg = &dev->config[cfgid];
+                     ++cfgid;
 
-                  // Ensure struct under/overlap
-                  int szlen = sizeof(struct usb_config_descriptor);
-                  if(szlen > it.len)
-                     szlen = it.len;
+                     // Ensure struct under/overlap
+                     int szlen = sizeof(struct usb_config_descriptor);
+                     if(szlen > it.len)
+                        szlen = it.len;
 
-                  // Read config and apply byte-order conversion
-                  memcpy(cfg, it.val, szlen);
-                  cfg->wTotalLength = ntohs(cfg->wTotalLength);
+                     // Read config and apply byte-order conversion
+                     memcpy(cfg, it.val, szlen);
+                     cfg->wTotalLength = ntohs(cfg->wTotalLength);
 
-                  // Allocate interfaces
-                  cfg->interface = NULL;
-                  if(cfg->bNumInterfaces > 0) {
-                     cfg->interface = malloc(cfg->bNumInterfaces * sizeof(struct usb_interface));
-                  }
+                     // Allocate interfaces
+                     cfg->interface = NULL;
+                     if(cfg->bNumInterfaces > 0) {
+                        cfg->interface = malloc(cfg->bNumInterfaces * sizeof(struct usb_interface));
+                     }
 
-                  //! \test Implement usb_device extra interfaces - are they needed?
-                  cfg->extralen = 0;
-                  cfg->extra = NULL;
-                  iter_next(&it);
+                     //! \test Implement usb_device extra interfaces - are they needed?
+                     cfg->extralen = 0;
+                     cfg->extra = NULL;
+                     iter_next(&it);
 
-                  // Load interfaces
-                  unsigned i, j, k;
-                  for(i = 0; i < cfg->bNumInterfaces; ++i) {
-                     struct usb_interface* iface = &cfg->interface[i];
+                     // Load interfaces
+                     unsigned i, j, k;
+                     for(i = 0; i < cfg->bNumInterfaces; ++i) {
+                        struct usb_interface* iface = &cfg->interface[i];
 
-                     // Read altsettings count
-                     iface->num_altsetting = iter_getint(&it);
+                        // Read altsettings count
+                        iface->num_altsetting = iter_getint(&it);
 
-                     // Allocate altsettings
-                     if(iface->num_altsetting > 0) {
-                        iface->altsetting = malloc(iface->num_altsetting * sizeof(struct usb_interface_descriptor));
-                     }
-
-                     // Load altsettings
-                     for(j = 0; j < iface->num_altsetting; ++j) {
-
-                        // Ensure struct under/overlap
-                        struct usb_interface_descriptor* as = &iface->altsetting[j];
-                        int szlen = sizeof(struct usb_interface_descriptor);
-                        if(szlen > it.len)
-                           szlen = it.len;
-
-                        // Read altsettings - no conversions apply
-                        memcpy(as, it.val, szlen);
-                        iter_next(&it);
-
-                        // Allocate endpoints
-                        as->endpoint = NULL;
-                        if(as->bNumEndpoints > 0) {
-                           size_t epsize = as->bNumEndpoints * sizeof(struct usb_endpoint_descriptor);
-                           as->endpoint = malloc(epsize);
-                           memset(as->endpoint, 0, epsize);
+                        // Allocate altsettings
+                        if(iface->num_altsetting > 0) {
+                           iface->altsetting = malloc(iface->num_altsetting * sizeof(struct usb_interface_descriptor));
                         }
 
-                        // Load endpoints
-                        for(k = 0; k < as->bNumEndpoints; ++k) {
-                           struct usb_endpoint_descriptor* endpoint = &as->endpoint[k];
-                           int szlen = sizeof(struct usb_endpoint_descriptor);
+                        // Load altsettings
+                        for(j = 0; j < iface->num_altsetting; ++j) {
+
+                           // Ensure struct under/overlap
+                           struct usb_interface_descriptor* as = &iface->altsetting[j];
+                           int szlen = sizeof(struct usb_interface_descriptor);
                            if(szlen > it.len)
                               szlen = it.len;
 
-                           // Read endpoint and apply conversion
-                           memcpy(endpoint, it.val, szlen);
-                           endpoint->wMaxPacketSize = ntohs(endpoint->wMaxPacketSize);
+                           // Read altsettings - no conversions apply
+                           memcpy(as, it.val, szlen);
                            iter_next(&it);
 
-                           // Null extra descriptors.
-                           endpoint->extralen = 0;
-                           endpoint->extra = NULL;
-                        }
-
-                        // Read extra interface descriptors
-                        as->extralen = as_int(it.val, it.len);
-                        iter_next(&it);
+                           // Allocate endpoints
+                           as->endpoint = NULL;
+                           if(as->bNumEndpoints > 0) {
+                              size_t epsize = as->bNumEndpoints * sizeof(struct usb_endpoint_descriptor);
+                              as->endpoint = malloc(epsize);
+                              memset(as->endpoint, 0, epsize);
+                           }
+
+                           // Load endpoints
+                           for(k = 0; k < as->bNumEndpoints; ++k) {
+                              struct usb_endpoint_descriptor* endpoint = &as->endpoint[k];
+                              int szlen = sizeof(struct usb_endpoint_descriptor);
+                              if(szlen > it.len)
+                                 szlen = it.len;
+
+                              // Read endpoint and apply conversion
+                              memcpy(endpoint, it.val, szlen);
+                              endpoint->wMaxPacketSize = ntohs(endpoint->wMaxPacketSize);
+                              iter_next(&it);
+
+                              // Null extra descriptors.
+                              endpoint->extralen = 0;
+                              endpoint->extra = NULL;
+                           }
+
+                           // Read extra interface descriptors
+                           as->extralen = as_int(it.val, it.len);
+                           iter_next(&it);
 
-                        if(as->extralen > 0){
-                            as->extra = malloc(as->extralen);
+                           if(as->extralen > 0){
+                               as->extra = malloc(as->extralen);
 
-                            int szlen = as->extralen;
-                            if(szlen > it.len)
-                                szlen = it.len;
+                               int szlen = as->extralen;
+                               if(szlen > it.len)
+                                   szlen = it.len;
 
-                            memcpy(as->extra, it.val, szlen);
-                            iter_next(&it);
+                               memcpy(as->extra, it.val, szlen);
+                               iter_next(&it);
+                           }
+                           else
+                               as->extra = NULL;
                         }
-                        else
-                            as->extra = NULL;
                      }
                   }
+
+                  //log_msg("Bus %s Device %s: ID %04x:%04x", rbus->dirname, dev->filename, dev->descriptor.idVendor, dev->descriptor.idProduct);
+               }
+
+               // Free unused devices
+               while(dev->next != NULL) {
+                  struct usb_device* ddev = dev->next;
+                  debug_msg("deleting device %03d", ddev->devnum);
+                  dev->next = ddev->next;
+                  free(ddev);
                }
 
-               //log_msg("Bus %s Device %s: ID %04x:%04x", rbus->dirname, dev->filename, dev->descriptor.idVendor, dev->descriptor.idProduct);
             }
+            else if(it.type == UnsignedType) {
+
+               // Unchanged bus, keep cached copy
+               unsigned location = iter_getuint(&it);
+               if(rbus->next == NULL || rbus->next->location != location) {
+                  debug_msg("bus %03d not in cache, refreshing", location);
+                  *stale = 1;
+                  break;
+               }
 
-            // Free unused devices
-            while(dev->next != NULL) {
-               struct usb_device* ddev = dev->next;
-               debug_msg("deleting device %03d", ddev->devnum);
-               dev->next = ddev->next;
-               free(ddev);
+               rbus = rbus->next;
+            }
+            else {
+               debug_msg("unexpected item identifier 0x%02x", it.type);
+               iter_next(&it);
             }
+         }
 
+         // Deallocate unnecessary busses
+         while(rbus->next != NULL) {
+            debug_msg("deleting bus %03d", rbus->next->location);
+            struct usb_bus* bus = rbus->next;
+            rbus->next = bus->next;
          }
-         else {
-            debug_msg("unexpected item identifier 0x%02x", it.type);
-            iter_next(&it);
+
+         // Save busses
+         if(__remote_bus == NULL) {
+            __orig_bus = usb_busses;
+            debug_msg("overriding global usb_busses from %p to %p", usb_busses, vbus.next);
          }
-      }
 
-      // Deallocate unnecessary busses
-      while(rbus->next != NULL) {
-         debug_msg("deleting bus %03d", rbus->next->location);
-         struct usb_bus* bus = rbus->next;
-         rbus->next = bus->next;
-      }
+         __remote_bus = vbus.next;
+         usb_busses = __remote_bus;
 
-      // Save busses
-      if(__remote_bus == NULL) {
-         __orig_bus = usb_busses;
-         debug_msg("overriding global usb_busses from %p to %p", usb_busses, vbus.next);
+         // Cache out of sync, next call requests full topology
+         __topology_gen = *stale ? 0 : gen;
       }
-
-      __remote_bus = vbus.next;
-      usb_busses = __remote_bus;
    }
+   pthread_mutex_unlock(&__bus_mutex);
 
    // Return remote result
    pkt_release();
+   return res;
+}
+
+/** Find devices on remote host.
+  * Create new devices on local virtual bus.
+  * \warning Function replaces global usb_busses variable from libusb.
+  */
+int usb_find_devices(void)
+{
+   // Repeat with full topology if cache is out of sync
+   uint64_t start = timing_begin();
+   int stale = 0;
+   int res = find_devices(&stale);
+   while(stale)
+      res = find_devices(&stale);
+
+   timing_end(UsbFindDevices, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -415,20 +1680,15 @@ usb_dev_handle *usb_open(struct usb_device *dev)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
-
-   // Send packet
-   pkt_init(pkt, UsbOpen);
-   pkt_adduint(pkt, dev->bus->location);
-   pkt_adduint(pkt, dev->devnum);
-   pkt_send(pkt, fd);
+   uint64_t start = timing_begin();
 
    // Get response
+   UsbOpenReq req = { dev->bus->location, dev->devnum, NULL, 0 };
+   UsbOpenRep rep;
    int res = -1, devfd = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbOpen) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-      devfd = iter_getint(&it);
+   if(UsbOpen_call(fd, pkt, &req, &rep)) {
+      res = rep.res;
+      devfd = rep.devfd;
    }
 
    // Evaluate
@@ -439,9 +1699,12 @@ usb_dev_handle *usb_open(struct usb_device *dev)
       udev->device = dev;
       udev->bus = dev->bus;
       udev->config = udev->interface = udev->altsetting = -1;
+      udev->impl_info = malloc(sizeof(handle_info));
+      memset(udev->impl_info, 0, sizeof(handle_info));
    }
 
    pkt_release();
+   timing_end(UsbOpen, __func__, start, res, 0);
    debug_msg("returned %d (fd %d)", res, devfd);
    return udev;
 }
@@ -451,24 +1714,35 @@ int usb_close(usb_dev_handle *dev)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
 
    // Send packet
-   pkt_init(pkt, UsbClose);
-   pkt_addint(pkt, dev->fd);
-   pkt_send(pkt, fd);
+   int devfd = dev->fd;
+   UsbCloseReq req = { devfd, NULL, 0 };
+   UsbCloseRep rep;
+
+   // Get response, pending writes are completed before
+   int res = -1;
+   if(UsbClose_call(fd, pkt, &req, &rep))
+      res = rep.res;
+
+   // Report deferred write error
+   int err = writeback_error(dev);
+   if(err < 0)
+      res = err;
+
+   // Remote streams are closed with device
+   pthread_mutex_lock(&__session_mutex);
+   stream_drop(devfd, -1);
+   batch_drop(dev);
+   pthread_mutex_unlock(&__session_mutex);
 
    // Free device
+   free(dev->impl_info);
    free(dev);
 
-   // Get response
-   int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClose) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-   }
-
    pkt_release();
+   timing_end(UsbClose, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -478,24 +1752,31 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbSetConfiguration, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Stop read-ahead on device
+   stream_stop(fd, pkt, dev->fd, -1);
 
    // Prepare packet
-   pkt_init(pkt, UsbSetConfiguration);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, configuration);
-   pkt_send(pkt, fd);
+   UsbSetConfigurationReq req = { dev->fd, configuration, NULL, 0 };
+   UsbSetConfigurationRep rep;
 
-   // Get response
+   // Collect to batch or get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbSetConfiguration) {
-      Iterator it;
-      pkt_begin(pkt, &it);
+   if(UsbSetConfiguration_batch(fd, dev, pkt, &req, NULL, 0, 1))
+      res = 0;
+   else if(UsbSetConfiguration_call(fd, pkt, &req, &rep)) {
 
       // Read result
-      res = iter_getint(&it);
+      res = rep.res;
 
       // Read callback configuration
-      configuration = iter_getint(&it);
+      configuration = rep.configuration;
    }
 
    // Save configuration
@@ -503,6 +1784,7 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration)
 
    // Return response
    pkt_release();
+   timing_end(UsbSetConfiguration, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -512,24 +1794,31 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
 
-   // Prepare packet
-   pkt_init(pkt, UsbSetAltInterface);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, alternate);
-   pkt_send(pkt, fd);
+   // Report deferred error
+   int err = writeback_report(dev, UsbSetAltInterface, __func__, start);
+   if(err < 0)
+      return err;
 
-   // Get response
+   // Stop read-ahead on device
+   stream_stop(fd, pkt, dev->fd, -1);
+
+   // Prepare packet, alternate setting of last claimed interface
+   UsbSetAltInterfaceReq req = { dev->fd, dev->interface, alternate, NULL, 0 };
+   UsbSetAltInterfaceRep rep;
+
+   // Collect to batch or get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbSetAltInterface) {
-      Iterator it;
-      pkt_begin(pkt, &it);
+   if(UsbSetAltInterface_batch(fd, dev, pkt, &req, NULL, 0, 1))
+      res = 0;
+   else if(UsbSetAltInterface_call(fd, pkt, &req, &rep)) {
 
       // Read result
-      res = iter_getint(&it);
+      res = rep.res;
 
       // Read callback configuration
-      alternate = iter_getint(&it);
+      alternate = rep.alternate;
    }
 
    // Save configuration
@@ -537,6 +1826,7 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate)
 
    // Return response
    pkt_release();
+   timing_end(UsbSetAltInterface, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -546,25 +1836,30 @@ int usb_resetep(usb_dev_handle *dev, unsigned int ep)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbResetEp, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Stop read-ahead on endpoint
+   stream_stop(fd, pkt, dev->fd, ep);
 
    // Prepare packet
-   pkt_init(pkt, UsbResetEp);
-   pkt_addint(pkt,  dev->fd);
-   pkt_adduint(pkt, ep);
-   pkt_send(pkt, fd);
+   UsbResetEpReq req = { dev->fd, ep, NULL, 0 };
+   UsbResetEpRep rep;
 
-   // Get response
+   // Collect to batch or get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbResetEp) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-
-      // Read result
-      res = iter_getint(&it);
-   }
+   if(UsbResetEp_batch(fd, dev, pkt, &req, NULL, 0, 1))
+      res = 0;
+   else if(UsbResetEp_call(fd, pkt, &req, &rep))
+      res = rep.res;
 
    // Return response
    pkt_release();
+   timing_end(UsbResetEp, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -574,25 +1869,30 @@ int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbClearHalt, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Stop read-ahead on endpoint
+   stream_stop(fd, pkt, dev->fd, ep);
 
    // Prepare packet
-   pkt_init(pkt, UsbClearHalt);
-   pkt_addint(pkt, dev->fd);
-   pkt_adduint(pkt, ep);
-   pkt_send(pkt, fd);
+   UsbClearHaltReq req = { dev->fd, ep, NULL, 0 };
+   UsbClearHaltRep rep;
 
-   // Get response
+   // Collect to batch or get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClearHalt) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-
-      // Read result
-      res = iter_getint(&it);
-   }
+   if(UsbClearHalt_batch(fd, dev, pkt, &req, NULL, 0, 1))
+      res = 0;
+   else if(UsbClearHalt_call(fd, pkt, &req, &rep))
+      res = rep.res;
 
    // Return response
    pkt_release();
+   timing_end(UsbClearHalt, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -602,24 +1902,28 @@ int usb_reset(usb_dev_handle *dev)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbReset, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Stop read-ahead on device
+   stream_stop(fd, pkt, dev->fd, -1);
 
    // Prepare packet
-   pkt_init(pkt, UsbReset);
-   pkt_addint(pkt, dev->fd);
-   pkt_send(pkt, fd);
+   UsbResetReq req = { dev->fd, NULL, 0 };
+   UsbResetRep rep;
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbReset) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-
-      // Read result
-      res = iter_getint(&it);
-   }
+   if(UsbReset_call(fd, pkt, &req, &rep))
+      res = rep.res;
 
    // Return response
    pkt_release();
+   timing_end(UsbReset, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -629,22 +1933,30 @@ int usb_claim_interface(usb_dev_handle *dev, int interface)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbClaimInterface, __func__, start);
+   if(err < 0)
+      return err;
 
    // Send packet
-   pkt_init(pkt, UsbClaimInterface);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, interface);
-   pkt_send(pkt, fd);
+   UsbClaimInterfaceReq req = { dev->fd, interface, NULL, 0 };
+   UsbClaimInterfaceRep rep;
 
-   // Get response
+   // Collect to batch or get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClaimInterface) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-   }
+   if(UsbClaimInterface_batch(fd, dev, pkt, &req, NULL, 0, 1))
+      res = 0;
+   else if(UsbClaimInterface_call(fd, pkt, &req, &rep))
+      res = rep.res;
+
+   // Save last claimed interface
+   if(res >= 0)
+      dev->interface = interface;
 
    pkt_release();
+   timing_end(UsbClaimInterface, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -654,22 +1966,33 @@ int usb_release_interface(usb_dev_handle *dev, int interface)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbReleaseInterface, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Stop read-ahead on device
+   stream_stop(fd, pkt, dev->fd, -1);
 
    // Send packet
-   pkt_init(pkt, UsbReleaseInterface);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, interface);
-   pkt_send(pkt, fd);
+   UsbReleaseInterfaceReq req = { dev->fd, interface, NULL, 0 };
+   UsbReleaseInterfaceRep rep;
 
-   // Get response
+   // Collect to batch or get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbReleaseInterface) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-   }
+   if(UsbReleaseInterface_batch(fd, dev, pkt, &req, NULL, 0, 1))
+      res = 0;
+   else if(UsbReleaseInterface_call(fd, pkt, &req, &rep))
+      res = rep.res;
+
+   // Forget released interface
+   if(res >= 0 && dev->interface == interface)
+      dev->interface = -1;
 
    pkt_release();
+   timing_end(UsbReleaseInterface, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -684,34 +2007,44 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
 
-   // Prepare packet
-   pkt_init(pkt, UsbControlMsg);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, requesttype);
-   pkt_addint(pkt, request);
-   pkt_addint(pkt, value);
-   pkt_addint(pkt, index);
-   pkt_addstr(pkt, size, bytes);
-   pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   // Control IN doesn't join auto batch, collected calls are sent first
+   int input = (requesttype & USB_ENDPOINT_IN);
+   if(input)
+      batch_settle(dev, 0);
 
-   // Get response
+   // Report deferred error
+   int err = writeback_report(dev, UsbControlMsg, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Prepare packet, only OUT transfer sends data
+   UsbControlMsgReq req = { dev->fd, requesttype, request, value, index, size, timeout,
+                            bytes, input ? 0 : size };
+   UsbControlMsgRep rep;
+
+   // Collect to batch, IN data is copied when batch completes
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbControlMsg) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
+   if(UsbControlMsg_batch(fd, dev, pkt, &req, input ? bytes : NULL, size, !input))
+      res = size;
 
-      if(res > 0) {
+   // Get response
+   else if(UsbControlMsg_call(fd, pkt, &req, &rep)) {
+      res = rep.res;
+
+      if(input && res > 0) {
          int minlen = (res > size) ? size : res;
-         memcpy(bytes, it.val, minlen);
+         if(minlen > rep.len)
+            minlen = rep.len;
+         memcpy(bytes, rep.data, minlen);
       }
 
    }
 
    // Return response
    pkt_release();
+   timing_end(UsbControlMsg, __func__, start, res, (res > 0) ? res : 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -725,32 +2058,58 @@ int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeou
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int res = writeback_report(dev, UsbBulkRead, __func__, start);
+   if(res < 0)
+      return res;
+
+   // Serve from read-ahead stream
+   if(__readahead > 0) {
+      pthread_mutex_lock(&__session_mutex);
+      stream_t* s = stream_find(dev->fd, ep);
+      int restart = (s != NULL && !s->stopped && (s->size != size || s->timeout != timeout));
+      res = (s != NULL) ? 0 : -1;
+      pthread_mutex_unlock(&__session_mutex);
+
+      // Restart stream with new transfer size or timeout,
+      // buffers received so far are read first
+      if(restart)
+         res = stream_end(fd, pkt, dev->fd, ep);
+      if(res < 0)
+         res = stream_start(fd, pkt, dev->fd, ep, size, timeout);
+
+      if(res == 0) {
+         res = stream_read(fd, pkt, dev->fd, ep, bytes, size);
+         pkt_release();
+         timing_end(UsbBulkRead, __func__, start, res, (res > 0) ? res : 0);
+         debug_msg("returned %d (read-ahead)", res);
+         return res;
+      }
+   }
 
    // Prepare packet
-   pkt_init(pkt, UsbBulkRead);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, ep);
-   pkt_addint(pkt, size);
-   pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   UsbBulkReadReq req = { dev->fd, ep, size, timeout, NULL, 0 };
+   UsbBulkReadRep rep;
 
    // Get response
-   int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbBulkRead) {
-
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
+   res = -1;
+   if(UsbBulkRead_call(fd, pkt, &req, &rep)) {
+      res = rep.res;
 
       if(res > 0) {
          int minlen = (res > size) ? size : res;
-         memcpy(bytes, it.val, minlen);
+         if(minlen > rep.len)
+            minlen = rep.len;
+         memcpy(bytes, rep.data, minlen);
       }
 
    }
 
    // Return response
    pkt_release();
+   timing_end(UsbBulkRead, __func__, start, res, (res > 0) ? res : 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -760,25 +2119,36 @@ int usb_bulk_write(usb_dev_handle *dev, int ep, usb_buf_t bytes, int size, int t
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbBulkWrite, __func__, start);
+   if(err < 0)
+      return err;
 
    // Prepare packet
-   pkt_init(pkt, UsbBulkWrite);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, ep);
-   pkt_addstr(pkt, size,        bytes);
-   pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   UsbBulkWriteReq req = { dev->fd, ep, timeout, bytes, size };
+   UsbBulkWriteRep rep;
+   UsbBulkWrite_request(pkt, &req);
+
+   // Write-behind
+   if(__writebehind > 0) {
+      int res = writeback_send(fd, pkt, dev, size);
+      pkt_release();
+      timing_end(UsbBulkWrite, __func__, start, res, (res > 0) ? res : 0);
+      debug_msg("returned %d (write-behind)", res);
+      return res;
+   }
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbBulkWrite) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-   }
+   if(session_call(fd, pkt) > 0 && pkt_op(pkt) == UsbBulkWrite &&
+      UsbBulkWriteRep_unpack(pkt->buf, pkt->size, &rep))
+      res = rep.res;
 
    // Return response
    pkt_release();
+   timing_end(UsbBulkWrite, __func__, start, res, (res > 0) ? res : 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -791,25 +2161,36 @@ int usb_interrupt_write(usb_dev_handle *dev, int ep, usb_buf_t bytes, int size,
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbInterruptWrite, __func__, start);
+   if(err < 0)
+      return err;
 
    // Prepare packet
-   pkt_init(pkt, UsbInterruptWrite);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, ep);
-   pkt_addstr(pkt, size, bytes);
-   pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   UsbInterruptWriteReq req = { dev->fd, ep, timeout, bytes, size };
+   UsbInterruptWriteRep rep;
+   UsbInterruptWrite_request(pkt, &req);
+
+   // Write-behind
+   if(__writebehind > 0) {
+      int res = writeback_send(fd, pkt, dev, size);
+      pkt_release();
+      timing_end(UsbInterruptWrite, __func__, start, res, (res > 0) ? res : 0);
+      debug_msg("returned %d (write-behind)", res);
+      return res;
+   }
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptWrite) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-   }
+   if(session_call(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptWrite &&
+      UsbInterruptWriteRep_unpack(pkt->buf, pkt->size, &rep))
+      res = rep.res;
 
    // Return response
    pkt_release();
+   timing_end(UsbInterruptWrite, __func__, start, res, (res > 0) ? res : 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -819,31 +2200,34 @@ int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int t
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int res = writeback_report(dev, UsbInterruptRead, __func__, start);
+   if(res < 0)
+      return res;
 
    // Prepare packet
-   pkt_init(pkt, UsbInterruptRead);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, ep);
-   pkt_addint(pkt, size);
-   pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   UsbInterruptReadReq req = { dev->fd, ep, size, timeout, NULL, 0 };
+   UsbInterruptReadRep rep;
 
    // Get response
-   int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptRead) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
+   res = -1;
+   if(UsbInterruptRead_call(fd, pkt, &req, &rep)) {
+      res = rep.res;
 
       if(res > 0) {
          int minlen = (res > size) ? size : res;
-         memcpy(bytes, it.val, minlen);
+         if(minlen > rep.len)
+            minlen = rep.len;
+         memcpy(bytes, rep.data, minlen);
       }
 
    }
 
    // Return response
    pkt_release();
+   timing_end(UsbInterruptRead, __func__, start, res, (res > 0) ? res : 0);
    debug_msg("returned %d", res);
    return res;
 }
@@ -866,20 +2250,21 @@ int usb_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned i
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbGetKernelDriver, __func__, start);
+   if(err < 0)
+      return err;
 
    // Send packet
-   pkt_init(pkt, UsbGetKernelDriver);
-   pkt_addint(pkt,  dev->fd);
-   pkt_addint(pkt,  interface);
-   pkt_adduint(pkt, namelen);
-   pkt_send(pkt, fd);
+   UsbGetKernelDriverReq req = { dev->fd, interface, namelen, NULL, 0 };
+   UsbGetKernelDriverRep rep;
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbGetKernelDriver) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
+   if(UsbGetKernelDriver_call(fd, pkt, &req, &rep)) {
+      res = rep.res;
 
       // Error
       if(res) {
@@ -887,11 +2272,13 @@ int usb_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned i
       }
 
       // Save string
-      strncpy(name, iter_getstr(&it), namelen - 1);
-      name[namelen - 1] = '\0';
+      unsigned len = (rep.len < namelen) ? rep.len : namelen - 1;
+      memcpy(name, rep.data, len);
+      name[len] = '\0';
    }
 
    pkt_release();
+   timing_end(UsbGetKernelDriver, __func__, start, res, 0);
    debug_msg("returned %d (%s)", res, name);
    return res;
 }
@@ -903,27 +2290,263 @@ int usb_detach_kernel_driver_np(usb_dev_handle *dev, int interface)
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbDetachKernelDriver, __func__, start);
+   if(err < 0)
+      return err;
 
    // Send packet
-   pkt_init(pkt, UsbDetachKernelDriver);
-   pkt_addint(pkt, dev->fd);
-   pkt_addint(pkt, interface);
-   pkt_send(pkt, fd);
+   UsbDetachKernelDriverReq req = { dev->fd, interface, NULL, 0 };
+   UsbDetachKernelDriverRep rep;
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbDetachKernelDriver) {
-      Iterator it;
-      pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-   }
+   if(UsbDetachKernelDriver_call(fd, pkt, &req, &rep))
+      res = rep.res;
 
    pkt_release();
+   timing_end(UsbDetachKernelDriver, __func__, start, res, 0);
    debug_msg("returned %d", res);
    return res;
 }
 #endif
 
+/* libusbnet extensions:
+ * Batched calls.
+ */
+
+int usb_batch_begin(usb_dev_handle *dev)
+{
+   int fd = session_get();
+
+   // Send calls collected by auto-batching
+   batch_flush(fd, dev->fd);
+
+   // Start batch
+   pthread_mutex_lock(&__session_mutex);
+   batch_new(dev, 1);
+   pthread_mutex_unlock(&__session_mutex);
+   debug_msg("started batch on fd %d", dev->fd);
+   return 0;
+}
+
+int usb_batch_end(usb_dev_handle *dev, int *results, int count)
+{
+   int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Send collected calls
+   batch_flush(fd, dev->fd);
+
+   // Find sent batch
+   pthread_mutex_lock(&__session_mutex);
+   batch_t* b = __batches_sent;
+   while(b != NULL && (b->dev != dev || !b->manual))
+      b = b->next;
+   if(b == NULL) {
+      pthread_mutex_unlock(&__session_mutex);
+      timing_end(UsbBatch, __func__, start, -1, 0);
+      return -1;
+   }
+
+   // Wait for reply
+   while(!b->done && session_pump(fd))
+      ;
+
+   // Return results
+   int res = -1;
+   if(b->done) {
+      res = b->count;
+      int i = 0;
+      for(i = 0; i < count && i < b->count; ++i)
+         results[i] = b->calls[i].res;
+   }
+
+   batch_unlink(&__batches_sent, b);
+   batch_free(b);
+   pthread_mutex_unlock(&__session_mutex);
+   timing_end(UsbBatch, __func__, start, res, 0);
+   debug_msg("returned %d", res);
+   return res;
+}
+
+/* libusbnet extensions:
+ * Device programs.
+ */
+
+int usb_program_run(usb_dev_handle *dev, usb_program *prog)
+{
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+   uint64_t start = timing_begin();
+
+   // Report deferred error
+   int err = writeback_report(dev, UsbProgram, __func__, start);
+   if(err < 0)
+      return err;
+
+   // Prepare packet, code is followed by initial memory
+   UsbProgramReq req = { dev->fd, prog->timeout, prog->steps, prog->codesize,
+                         prog->memsize, prog->outsize, NULL, 0 };
+   pkt_init(pkt, UsbProgram);
+   char* dst = pkt_alloc(pkt, UsbProgramReqSize + prog->codesize + prog->memsize);
+   if(dst == NULL) {
+      pkt_release();
+      timing_end(UsbProgram, __func__, start, -1, 0);
+      return -1;
+   }
+   dst = UsbProgramReq_pack(dst, &req);
+   memcpy(dst, prog->code, prog->codesize);
+   memcpy(dst + prog->codesize, prog->mem, prog->memsize);
+
+   // Get response
+   int res = -1;
+   UsbProgramRep rep;
+   if(session_call(fd, pkt) > 0 && pkt_op(pkt) == UsbProgram &&
+      UsbProgramRep_unpack(pkt->buf, pkt->size, &rep)) {
+      res = rep.res;
+      prog->result = rep.result;
+      prog->pc = rep.pc;
+
+      // Write back returned memory
+      uint32_t len = (rep.len > prog->outsize) ? prog->outsize : rep.len;
+      memcpy(prog->mem, rep.data, len);
+   }
+
+   // Return response
+   pkt_release();
+   timing_end(UsbProgram, __func__, start, res, 0);
+   debug_msg("returned %d, result %d (pc %u)", res, prog->result, prog->pc);
+   return res;
+}
+
+/** Pump session while asynchronous transfers are pending.
+  * Pending transfers fail with -EIO when connection fails.
+  */
+static void* async_run(void* arg)
+{
+   int fd = (int)(long) arg;
+
+   pthread_mutex_lock(&__session_mutex);
+   for(;;) {
+
+      // Wait for pending transfers
+      while(__async == NULL && !__broken)
+         pthread_cond_wait(&__session_cond, &__session_mutex);
+
+      if(!session_pump(fd))
+         break;
+   }
+
+   // Fail pending transfers
+   while(__async != NULL) {
+      usb_async* a = __async;
+      __async = a->next;
+      a->res = -EIO;
+      a->complete(a);
+   }
+
+   pthread_mutex_unlock(&__session_mutex);
+   debug_msg("receiver finished");
+   return NULL;
+}
+
+int usb_submit_async(usb_async* a)
+{
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+   a->start = timing_begin();
+
+   // Prepare packet by transfer type and direction
+   int input = (a->ep & USB_ENDPOINT_IN);
+   switch(a->type) {
+   case USB_ENDPOINT_TYPE_CONTROL: {
+      input = (a->requesttype & USB_ENDPOINT_IN);
+      UsbControlMsgReq req = { a->dev->fd, a->requesttype, a->request, a->value, a->index,
+                               a->size, a->timeout, a->bytes, input ? 0 : a->size };
+      UsbControlMsg_request(pkt, &req);
+   }  break;
+   case USB_ENDPOINT_TYPE_BULK:
+      if(input) {
+         UsbBulkReadReq req = { a->dev->fd, a->ep, a->size, a->timeout, NULL, 0 };
+         UsbBulkRead_request(pkt, &req);
+      }
+      else {
+         UsbBulkWriteReq req = { a->dev->fd, a->ep, a->timeout, a->bytes, a->size };
+         UsbBulkWrite_request(pkt, &req);
+      }
+      break;
+   case USB_ENDPOINT_TYPE_INTERRUPT:
+      if(input) {
+         UsbInterruptReadReq req = { a->dev->fd, a->ep, a->size, a->timeout, NULL, 0 };
+         UsbInterruptRead_request(pkt, &req);
+      }
+      else {
+         UsbInterruptWriteReq req = { a->dev->fd, a->ep, a->timeout, a->bytes, a->size };
+         UsbInterruptWrite_request(pkt, &req);
+      }
+      break;
+   default:
+      pkt_release();
+      return -EINVAL;
+   }
+
+   // Register transfer, start receiver
+   int res = -1;
+   uint16_t id = 0;
+   pthread_mutex_lock(&__session_mutex);
+   if(!__broken && !__async_receiver) {
+      pthread_t thread;
+      if(pthread_create(&thread, NULL, &async_run, (void*)(long) fd) == 0) {
+         pthread_detach(thread);
+         __async_receiver = 1;
+      }
+      else
+         error_msg("%s: failed to start receiver", __func__);
+   }
+   if(!__broken && __async_receiver) {
+      id = a->id = pkt->id = session_newid();
+      a->next = __async;
+      __async = a;
+      pthread_cond_broadcast(&__session_cond);
+      res = 0;
+   }
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Send request
+   if(res == 0)
+      session_send(fd, pkt);
+
+   // Transfer may be completed already
+   pkt_release();
+   debug_msg("returned %d (id %u)", res, id);
+   return res;
+}
+
+int usb_cancel_async(usb_async* a)
+{
+   pthread_mutex_lock(&__session_mutex);
+   int res = async_unlink(a) ? 0 : -ENOENT;
+   pthread_mutex_unlock(&__session_mutex);
+
+   // Drop remote transfer, late result is ignored
+   if(res == 0) {
+      Packet* pkt = pkt_claim();
+      int fd = session_get();
+      UsbCancelReq req = { a->dev->fd, a->id, NULL, 0 };
+      UsbCancel_request(pkt, &req);
+      session_send(fd, pkt);
+      pkt_release();
+   }
+
+   debug_msg("returned %d (id %u)", res, a->id);
+   return res;
+}
+
 /** \private
  * Imported from libusb-0.1.12 for forward compatibility with libusb-1.0.
  * This overrides libusb-0.1 as well as libusb-1.0 calls.
@@ -52,10 +52,24 @@ typedef enum {
    UsbClearHalt          = CallType  + 17, // int usb_clear_halt()
    UsbReset              = CallType  + 18, // int usb_reset()
    UsbInterruptRead      = CallType  + 19, // int usb_interrupt_read()
-   UsbInterruptWrite     = CallType  + 20  // int usb_interrupt_write()
+   UsbInterruptWrite     = CallType  + 20, // int usb_interrupt_write()
+   UsbBulkStream         = CallType  + 21, // int bulk read-ahead start/stop
+   UsbBulkStreamData     = CallType  + 22, // read-ahead buffer pushed by server
+   UsbBulkStreamAck      = CallType  + 23, // read-ahead buffers consumed, no ACK
+   UsbHello              = CallType  + 24, // session options negotiation
+   UsbBatch              = CallType  + 25, // calls executed in order, single reply
+   UsbProgram            = CallType  + 26, // device program, see usbprogram.h
+   UsbShmLink            = CallType  + 27, // switch local session to shared memory
+   UsbStats              = CallType  + 28, // server statistics, see usbstats.h
+   UsbCancel             = CallType  + 29  // cancel queued or running call, no reply
 
 } Call;
 
+// Call schema
+#include "usbschema.h"
+#include "usbprogram.h"
+#include "usbstats.h"
+
 /** \private
     @from: libusb/usbi.h:41
     \warning Matches libusb-0.1.12, may loss binary compatibility.
@@ -74,5 +88,74 @@ struct usb_dev_handle {
    void *impl_info;
 };
 
+/** Start batch of calls on device (libusbnet extension).
+  * Configuration, interface, endpoint and control calls on the device
+  * are collected and sent at once by usb_batch_end(), they return
+  * 0 (transfer size for control transfers) immediately.
+  * Control IN data is written to caller buffer by usb_batch_end(),
+  * the buffer must stay valid until then.
+  * Other calls on the device send collected calls first.
+  * \return 0 on success
+  */
+int usb_batch_begin(usb_dev_handle *dev);
+
+/** Send batched calls and wait for results.
+  * \param results destination for results in call order, may be NULL if count is 0
+  * \param count results capacity
+  * \return number of batched calls, -1 on error
+  */
+int usb_batch_end(usb_dev_handle *dev, int *results, int count);
+
+/** Run program on device in a single call (libusbnet extension).
+  * Program memory prefix (outsize) is written back to prog->mem.
+  * Program result is stored to prog->result.
+  * \return 0 when program ended, -EINVAL/-EFAULT/-ETIMEDOUT if program
+  *         failed (prog->pc is faulting instruction), -1 on error
+  */
+int usb_program_run(usb_dev_handle *dev, usb_program *prog);
+
+/** Asynchronous transfer (libusbnet extension).
+  * Fields up to "private" are set by caller, see usb_submit_async().
+  */
+typedef struct usb_async {
+   usb_dev_handle* dev;
+   int type;           //! USB_ENDPOINT_TYPE_CONTROL, _BULK or _INTERRUPT
+   int ep;             //! Endpoint, direction of control transfer is in requesttype
+   int requesttype;    //! Control transfer setup
+   int request;
+   int value;
+   int index;
+   char* bytes;
+   int size;
+   int timeout;
+   void (*complete)(struct usb_async* a); //! Completion callback
+   void* data;         //! Caller data
+   int res;            //! Transfer result, valid on completion
+
+   /* private */
+   struct usb_async* next;
+   uint16_t id;
+   uint64_t start;
+} usb_async;
+
+/** Submit asynchronous transfer (libusbnet extension).
+  * Request is sent without waiting for reply, transfers are pipelined.
+  * On completion, a->res is set like result of the synchronous call,
+  * IN data is written to a->bytes and a->complete() is called
+  * from library thread with session lock held, it must not call the library.
+  * Transfer and its buffer must stay valid until completion.
+  * \return 0 on success, -EINVAL on bad transfer type, -1 on connection error
+  */
+int usb_submit_async(usb_async* a);
+
+/** Cancel asynchronous transfer (libusbnet extension).
+  * Transfer is cancelled locally and server is asked to drop the queued
+  * request or abort the running transfer (libusb-0.1 server backend can't,
+  * it runs to completion or timeout). Its result is discarded,
+  * a->complete() is not called.
+  * \return 0 if cancelled, -ENOENT if transfer is not pending
+  */
+int usb_cancel_async(usb_async* a);
+
 #endif // __usbnet_h__
 /** @} */
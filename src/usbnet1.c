@@ -0,0 +1,1161 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbnet1.c
+    \brief libusb-1.0 API over usbnet protocol.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup libusbnet
+    @{
+  */
+#define _GNU_SOURCE
+#include <libusb.h>
+#include "usbnet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* libusb-1.0 calls are implemented by libusb-0.1 calls of libusbnet,
+ * so remote devices, read-ahead and write-behind work the same way.
+ * Asynchronous transfers are sent as pipelined requests, see usb_submit_async().
+ * Completed transfers are queued to their context and signalled on its
+ * eventfd, callbacks are called from libusb_handle_events*() in caller thread.
+ * Timeouts are applied by server, so there are no pending timeouts.
+ */
+
+/** Queued transfer data, precedes struct libusb_transfer in memory. */
+typedef struct transfer_priv {
+   struct transfer_priv* next;  //! Completed transfers
+   libusb_context* ctx;
+   usb_async a;
+   int submitted;               //! Transfer is pending or queued
+} transfer_priv;
+
+#define TRANSFER_PRIV(t) ((transfer_priv*)(t) - 1)
+#define PRIV_TRANSFER(p) ((struct libusb_transfer*)((p) + 1))
+
+struct libusb_context {
+   int refs;                    //! Default context references
+   int efd;                     //! Completion eventfd
+   struct libusb_pollfd pollfd;
+
+   pthread_mutex_t lock;        //! Guards completed transfers
+   transfer_priv* done;
+   transfer_priv* done_tail;
+
+   pthread_mutex_t events_lock; //! Event handling lock, see libusb_lock_events()
+   pthread_mutex_t waiters_lock;
+   pthread_cond_t  waiters_cond;
+   int handling;
+};
+
+struct libusb_device {
+   struct libusb_device* next;
+   libusb_context* ctx;
+   int refs;
+   uint32_t location;           //! Bus location
+   uint8_t devnum;
+   char filename[PATH_MAX + 1];
+   struct usb_device_descriptor descriptor;
+};
+
+struct libusb_device_handle {
+   libusb_device* dev;
+   usb_dev_handle* h;
+};
+
+//! Default context
+static libusb_context* __default_ctx = NULL;
+
+//! Referenced devices, guards context references
+static libusb_device* __devices = NULL;
+static pthread_mutex_t __dev_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Return context, NULL is default context. */
+static libusb_context* context(libusb_context* ctx)
+{
+   return (ctx != NULL) ? ctx : __default_ctx;
+}
+
+/** Convert libusb-0.1 result to libusb-1.0 error code. */
+static int usb1_error(int res)
+{
+   switch(res) {
+   case -ETIMEDOUT: return LIBUSB_ERROR_TIMEOUT;
+   case -EPIPE:     return LIBUSB_ERROR_PIPE;
+   case -ENODEV:    return LIBUSB_ERROR_NO_DEVICE;
+   case -ENOENT:    return LIBUSB_ERROR_NOT_FOUND;
+   case -EBUSY:     return LIBUSB_ERROR_BUSY;
+   case -EACCES:
+   case -EPERM:     return LIBUSB_ERROR_ACCESS;
+   case -EINVAL:    return LIBUSB_ERROR_INVALID_PARAM;
+   case -EOVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+   case -EINTR:     return LIBUSB_ERROR_INTERRUPTED;
+   case -ENOMEM:    return LIBUSB_ERROR_NO_MEM;
+   case -ENOSYS:    return LIBUSB_ERROR_NOT_SUPPORTED;
+   default: break;
+   }
+
+   return LIBUSB_ERROR_IO;
+}
+
+/** Convert libusb-0.1 result to transfer status. */
+static enum libusb_transfer_status usb1_status(int res)
+{
+   switch(res) {
+   case -ETIMEDOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+   case -EPIPE:     return LIBUSB_TRANSFER_STALL;
+   case -ENODEV:    return LIBUSB_TRANSFER_NO_DEVICE;
+   case -EOVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+   case -ECANCELED: return LIBUSB_TRANSFER_CANCELLED;
+   default: break;
+   }
+
+   return (res < 0) ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+}
+
+/* Library and contexts. */
+
+int LIBUSB_CALL libusb_init(libusb_context** pctx)
+{
+   // Reference default context
+   pthread_mutex_lock(&__dev_mutex);
+   if(pctx == NULL && __default_ctx != NULL) {
+      ++__default_ctx->refs;
+      pthread_mutex_unlock(&__dev_mutex);
+      return LIBUSB_SUCCESS;
+   }
+   pthread_mutex_unlock(&__dev_mutex);
+
+   // Create context
+   libusb_context* ctx = calloc(1, sizeof(libusb_context));
+   if(ctx == NULL)
+      return LIBUSB_ERROR_NO_MEM;
+   ctx->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+   if(ctx->efd < 0) {
+      error_msg("%s: failed to create eventfd", __func__);
+      free(ctx);
+      return LIBUSB_ERROR_OTHER;
+   }
+   ctx->refs = 1;
+   ctx->pollfd.fd = ctx->efd;
+   ctx->pollfd.events = POLLIN;
+   pthread_mutex_init(&ctx->lock, NULL);
+   pthread_mutex_init(&ctx->events_lock, NULL);
+   pthread_mutex_init(&ctx->waiters_lock, NULL);
+   pthread_cond_init(&ctx->waiters_cond, NULL);
+
+   // Initialize remote session
+   usb_init();
+
+   // Save context
+   if(pctx != NULL)
+      *pctx = ctx;
+   else {
+      pthread_mutex_lock(&__dev_mutex);
+      if(__default_ctx == NULL)
+         __default_ctx = ctx;
+      else {
+         ++__default_ctx->refs;
+         close(ctx->efd);
+         free(ctx);
+      }
+      pthread_mutex_unlock(&__dev_mutex);
+   }
+
+   debug_msg("created context %p", pctx ? (void*) *pctx : (void*) __default_ctx);
+   return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context* ctx)
+{
+   // Release default context reference
+   pthread_mutex_lock(&__dev_mutex);
+   if(ctx == NULL) {
+      ctx = __default_ctx;
+      if(ctx == NULL || --ctx->refs > 0) {
+         pthread_mutex_unlock(&__dev_mutex);
+         return;
+      }
+      __default_ctx = NULL;
+   }
+
+   // Detach devices
+   libusb_device* dev = __devices;
+   for(; dev != NULL; dev = dev->next) {
+      if(dev->ctx == ctx)
+         dev->ctx = NULL;
+   }
+   pthread_mutex_unlock(&__dev_mutex);
+
+   // Free context
+   close(ctx->efd);
+   pthread_mutex_destroy(&ctx->lock);
+   pthread_mutex_destroy(&ctx->events_lock);
+   pthread_mutex_destroy(&ctx->waiters_lock);
+   pthread_cond_destroy(&ctx->waiters_cond);
+   free(ctx);
+}
+
+void LIBUSB_CALL libusb_set_debug(libusb_context* ctx, int level)
+{
+   (void) ctx;
+   (void) level;
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
+int LIBUSB_CALL libusb_set_option(libusb_context* ctx, enum libusb_option option, ...)
+{
+   (void) ctx;
+   return (option == LIBUSB_OPTION_LOG_LEVEL) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_SUPPORTED;
+}
+#endif
+
+const struct libusb_version* LIBUSB_CALL libusb_get_version(void)
+{
+   static const struct libusb_version version = { 1, 0, 0, 0, "", "libusbnet" };
+   return &version;
+}
+
+int LIBUSB_CALL libusb_has_capability(uint32_t capability)
+{
+   return (capability == LIBUSB_CAP_HAS_CAPABILITY ||
+           capability == LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER);
+}
+
+const char* LIBUSB_CALL libusb_error_name(int errcode)
+{
+   switch(errcode) {
+   case LIBUSB_SUCCESS:             return "LIBUSB_SUCCESS";
+   case LIBUSB_ERROR_IO:            return "LIBUSB_ERROR_IO";
+   case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+   case LIBUSB_ERROR_ACCESS:        return "LIBUSB_ERROR_ACCESS";
+   case LIBUSB_ERROR_NO_DEVICE:     return "LIBUSB_ERROR_NO_DEVICE";
+   case LIBUSB_ERROR_NOT_FOUND:     return "LIBUSB_ERROR_NOT_FOUND";
+   case LIBUSB_ERROR_BUSY:          return "LIBUSB_ERROR_BUSY";
+   case LIBUSB_ERROR_TIMEOUT:       return "LIBUSB_ERROR_TIMEOUT";
+   case LIBUSB_ERROR_OVERFLOW:      return "LIBUSB_ERROR_OVERFLOW";
+   case LIBUSB_ERROR_PIPE:          return "LIBUSB_ERROR_PIPE";
+   case LIBUSB_ERROR_INTERRUPTED:   return "LIBUSB_ERROR_INTERRUPTED";
+   case LIBUSB_ERROR_NO_MEM:        return "LIBUSB_ERROR_NO_MEM";
+   case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+   case LIBUSB_ERROR_OTHER:         return "LIBUSB_ERROR_OTHER";
+   default: break;
+   }
+
+   return "**UNKNOWN**";
+}
+
+/* Devices.
+ * Devices are identified by bus location, device number and filename
+ * and keep a copy of device descriptor. Remote bus list frees or reuses
+ * libusb-0.1 devices when it changes, so the live device is looked up
+ * when it's needed and device removed from remote host is not found.
+ */
+
+/** Return live libusb-0.1 device or NULL if it's gone. */
+static struct usb_device* device_find(libusb_device* dev)
+{
+   struct usb_bus* bus = NULL;
+   struct usb_device* udev = NULL;
+   for(bus = usb_get_busses(); bus != NULL; bus = bus->next) {
+      if(bus->location != dev->location)
+         continue;
+
+      for(udev = bus->devices; udev != NULL; udev = udev->next) {
+         if(udev->devnum == dev->devnum &&
+            strcmp(udev->filename, dev->filename) == 0 &&
+            udev->descriptor.idVendor == dev->descriptor.idVendor &&
+            udev->descriptor.idProduct == dev->descriptor.idProduct)
+            return udev;
+      }
+   }
+
+   return NULL;
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context* ctx, libusb_device*** list)
+{
+   ctx = context(ctx);
+
+   // Refresh remote devices
+   usb_find_busses();
+   usb_find_devices();
+
+   // Count devices
+   ssize_t count = 0;
+   struct usb_bus* bus = NULL;
+   struct usb_device* udev = NULL;
+   for(bus = usb_get_busses(); bus != NULL; bus = bus->next) {
+      for(udev = bus->devices; udev != NULL; udev = udev->next)
+         ++count;
+   }
+
+   // Create list, terminated by NULL
+   libusb_device** res = calloc(count + 1, sizeof(libusb_device*));
+   if(res == NULL)
+      return LIBUSB_ERROR_NO_MEM;
+
+   // Reference existing or create devices
+   ssize_t i = 0;
+   pthread_mutex_lock(&__dev_mutex);
+   for(bus = usb_get_busses(); bus != NULL; bus = bus->next) {
+      for(udev = bus->devices; udev != NULL && i < count; udev = udev->next) {
+         libusb_device* dev = __devices;
+         while(dev != NULL && (dev->ctx != ctx || device_find(dev) != udev))
+            dev = dev->next;
+         if(dev == NULL) {
+            if((dev = calloc(1, sizeof(libusb_device))) == NULL)
+               continue;
+            dev->ctx = ctx;
+            dev->location = bus->location;
+            dev->devnum = udev->devnum;
+            strcpy(dev->filename, udev->filename);
+            dev->descriptor = udev->descriptor;
+            dev->next = __devices;
+            __devices = dev;
+         }
+         ++dev->refs;
+         res[i++] = dev;
+      }
+   }
+   pthread_mutex_unlock(&__dev_mutex);
+
+   *list = res;
+   debug_msg("returned %zd devices", i);
+   return i;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device** list, int unref_devices)
+{
+   if(list == NULL)
+      return;
+
+   libusb_device** dev = list;
+   if(unref_devices) {
+      for(; *dev != NULL; ++dev)
+         libusb_unref_device(*dev);
+   }
+
+   free(list);
+}
+
+libusb_device* LIBUSB_CALL libusb_ref_device(libusb_device* dev)
+{
+   pthread_mutex_lock(&__dev_mutex);
+   ++dev->refs;
+   pthread_mutex_unlock(&__dev_mutex);
+   return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device* dev)
+{
+   if(dev == NULL)
+      return;
+
+   // Unlink and free last reference
+   pthread_mutex_lock(&__dev_mutex);
+   if(--dev->refs == 0) {
+      libusb_device** p = &__devices;
+      while(*p != dev)
+         p = &(*p)->next;
+      *p = dev->next;
+      free(dev);
+   }
+   pthread_mutex_unlock(&__dev_mutex);
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device* dev)
+{
+   return dev->location;
+}
+
+uint8_t LIBUSB_CALL libusb_get_port_number(libusb_device* dev)
+{
+   (void) dev;
+   return 0;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device* dev, uint8_t* port_numbers, int port_numbers_len)
+{
+   (void) dev;
+   (void) port_numbers;
+   (void) port_numbers_len;
+   return 0;
+}
+
+libusb_device* LIBUSB_CALL libusb_get_parent(libusb_device* dev)
+{
+   (void) dev;
+   return NULL;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device* dev)
+{
+   return dev->devnum;
+}
+
+int LIBUSB_CALL libusb_get_device_speed(libusb_device* dev)
+{
+   (void) dev;
+   return LIBUSB_SPEED_UNKNOWN;
+}
+
+int LIBUSB_CALL libusb_get_max_packet_size(libusb_device* dev, unsigned char endpoint)
+{
+   struct usb_device* udev = device_find(dev);
+   if(udev == NULL)
+      return LIBUSB_ERROR_NO_DEVICE;
+
+   // Find endpoint in first configuration
+   struct usb_config_descriptor* cfg = udev->config;
+   if(cfg == NULL || udev->descriptor.bNumConfigurations == 0)
+      return LIBUSB_ERROR_NOT_FOUND;
+
+   int i = 0, j = 0, k = 0;
+   for(i = 0; i < cfg->bNumInterfaces; ++i) {
+      struct usb_interface* iface = &cfg->interface[i];
+      for(j = 0; j < iface->num_altsetting; ++j) {
+         struct usb_interface_descriptor* alt = &iface->altsetting[j];
+         for(k = 0; k < alt->bNumEndpoints; ++k) {
+            if(alt->endpoint[k].bEndpointAddress == endpoint)
+               return alt->endpoint[k].wMaxPacketSize;
+         }
+      }
+   }
+
+   return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Descriptors. */
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+   struct usb_device_descriptor* src = &dev->descriptor;
+   desc->bLength            = src->bLength;
+   desc->bDescriptorType    = src->bDescriptorType;
+   desc->bcdUSB             = src->bcdUSB;
+   desc->bDeviceClass       = src->bDeviceClass;
+   desc->bDeviceSubClass    = src->bDeviceSubClass;
+   desc->bDeviceProtocol    = src->bDeviceProtocol;
+   desc->bMaxPacketSize0    = src->bMaxPacketSize0;
+   desc->idVendor           = src->idVendor;
+   desc->idProduct          = src->idProduct;
+   desc->bcdDevice          = src->bcdDevice;
+   desc->iManufacturer      = src->iManufacturer;
+   desc->iProduct           = src->iProduct;
+   desc->iSerialNumber      = src->iSerialNumber;
+   desc->bNumConfigurations = src->bNumConfigurations;
+   return LIBUSB_SUCCESS;
+}
+
+/** Return copy of extra descriptors. */
+static const unsigned char* extra_dup(const unsigned char* extra, int len)
+{
+   if(extra == NULL || len <= 0)
+      return NULL;
+
+   unsigned char* res = malloc(len);
+   if(res != NULL)
+      memcpy(res, extra, len);
+
+   return res;
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(struct libusb_config_descriptor* config)
+{
+   if(config == NULL)
+      return;
+
+   // Free interfaces, allocated in order of conversion
+   int i = 0, j = 0, k = 0;
+   struct libusb_interface* iface = (struct libusb_interface*) config->interface;
+   for(i = 0; iface != NULL && i < config->bNumInterfaces; ++i) {
+      struct libusb_interface_descriptor* alt = (struct libusb_interface_descriptor*) iface[i].altsetting;
+      for(j = 0; alt != NULL && j < iface[i].num_altsetting; ++j) {
+         struct libusb_endpoint_descriptor* ep = (struct libusb_endpoint_descriptor*) alt[j].endpoint;
+         for(k = 0; ep != NULL && k < alt[j].bNumEndpoints; ++k)
+            free((void*) ep[k].extra);
+         free(ep);
+         free((void*) alt[j].extra);
+      }
+      free(alt);
+   }
+   free(iface);
+   free((void*) config->extra);
+   free(config);
+}
+
+/** Convert libusb-0.1 configuration descriptor.
+  * \return new descriptor or NULL if out of memory
+  */
+static struct libusb_config_descriptor* config_convert(const struct usb_config_descriptor* src)
+{
+   struct libusb_config_descriptor* cfg = calloc(1, sizeof(struct libusb_config_descriptor));
+   if(cfg == NULL)
+      return NULL;
+
+   cfg->bLength             = src->bLength;
+   cfg->bDescriptorType     = src->bDescriptorType;
+   cfg->wTotalLength        = src->wTotalLength;
+   cfg->bConfigurationValue = src->bConfigurationValue;
+   cfg->iConfiguration      = src->iConfiguration;
+   cfg->bmAttributes        = src->bmAttributes;
+   cfg->MaxPower            = src->MaxPower;
+   cfg->extra               = extra_dup(src->extra, src->extralen);
+   cfg->extra_length        = cfg->extra ? src->extralen : 0;
+
+   // Convert interfaces, free on partial conversion
+   struct libusb_interface* iface = calloc(src->bNumInterfaces + 1, sizeof(struct libusb_interface));
+   cfg->interface = iface;
+   if(iface == NULL) {
+      libusb_free_config_descriptor(cfg);
+      return NULL;
+   }
+
+   int i = 0, j = 0, k = 0;
+   for(i = 0; i < src->bNumInterfaces; ++i) {
+      cfg->bNumInterfaces = i + 1;
+      struct usb_interface* siface = &src->interface[i];
+      struct libusb_interface_descriptor* alt = calloc(siface->num_altsetting + 1, sizeof(struct libusb_interface_descriptor));
+      iface[i].altsetting = alt;
+      if(alt == NULL) {
+         libusb_free_config_descriptor(cfg);
+         return NULL;
+      }
+
+      for(j = 0; j < siface->num_altsetting; ++j) {
+         iface[i].num_altsetting = j + 1;
+         struct usb_interface_descriptor* salt = &siface->altsetting[j];
+         alt[j].bLength            = salt->bLength;
+         alt[j].bDescriptorType    = salt->bDescriptorType;
+         alt[j].bInterfaceNumber   = salt->bInterfaceNumber;
+         alt[j].bAlternateSetting  = salt->bAlternateSetting;
+         alt[j].bInterfaceClass    = salt->bInterfaceClass;
+         alt[j].bInterfaceSubClass = salt->bInterfaceSubClass;
+         alt[j].bInterfaceProtocol = salt->bInterfaceProtocol;
+         alt[j].iInterface         = salt->iInterface;
+         alt[j].extra              = extra_dup(salt->extra, salt->extralen);
+         alt[j].extra_length       = alt[j].extra ? salt->extralen : 0;
+
+         struct libusb_endpoint_descriptor* ep = calloc(salt->bNumEndpoints + 1, sizeof(struct libusb_endpoint_descriptor));
+         alt[j].endpoint = ep;
+         if(ep == NULL) {
+            libusb_free_config_descriptor(cfg);
+            return NULL;
+         }
+
+         for(k = 0; k < salt->bNumEndpoints; ++k) {
+            alt[j].bNumEndpoints = k + 1;
+            struct usb_endpoint_descriptor* sep = &salt->endpoint[k];
+            ep[k].bLength          = sep->bLength;
+            ep[k].bDescriptorType  = sep->bDescriptorType;
+            ep[k].bEndpointAddress = sep->bEndpointAddress;
+            ep[k].bmAttributes     = sep->bmAttributes;
+            ep[k].wMaxPacketSize   = sep->wMaxPacketSize;
+            ep[k].bInterval        = sep->bInterval;
+            ep[k].bRefresh         = sep->bRefresh;
+            ep[k].bSynchAddress    = sep->bSynchAddress;
+            ep[k].extra            = extra_dup(sep->extra, sep->extralen);
+            ep[k].extra_length     = ep[k].extra ? sep->extralen : 0;
+         }
+      }
+   }
+
+   return cfg;
+}
+
+int LIBUSB_CALL libusb_get_config_descriptor(libusb_device* dev, uint8_t config_index, struct libusb_config_descriptor** config)
+{
+   struct usb_device* udev = device_find(dev);
+   if(udev == NULL)
+      return LIBUSB_ERROR_NO_DEVICE;
+   if(udev->config == NULL || config_index >= udev->descriptor.bNumConfigurations)
+      return LIBUSB_ERROR_NOT_FOUND;
+
+   *config = config_convert(&udev->config[config_index]);
+   return (*config != NULL) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+}
+
+int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device* dev, uint8_t bConfigurationValue, struct libusb_config_descriptor** config)
+{
+   struct usb_device* udev = device_find(dev);
+   if(udev == NULL)
+      return LIBUSB_ERROR_NO_DEVICE;
+
+   int i = 0;
+   for(i = 0; udev->config != NULL && i < udev->descriptor.bNumConfigurations; ++i) {
+      if(udev->config[i].bConfigurationValue == bConfigurationValue)
+         return libusb_get_config_descriptor(dev, i, config);
+   }
+
+   return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device* dev, struct libusb_config_descriptor** config)
+{
+   // Active configuration is not known without handle, assume first
+   return libusb_get_config_descriptor(dev, 0, config);
+}
+
+/* Device handles. */
+
+int LIBUSB_CALL libusb_open(libusb_device* dev, libusb_device_handle** dev_handle)
+{
+   libusb_device_handle* handle = malloc(sizeof(libusb_device_handle));
+   if(handle == NULL)
+      return LIBUSB_ERROR_NO_MEM;
+
+   // Open remote device, if it's still there
+   struct usb_device* udev = device_find(dev);
+   if(udev == NULL) {
+      free(handle);
+      return LIBUSB_ERROR_NO_DEVICE;
+   }
+
+   handle->h = usb_open(udev);
+   if(handle->h == NULL) {
+      free(handle);
+      return LIBUSB_ERROR_ACCESS;
+   }
+
+   handle->dev = libusb_ref_device(dev);
+   *dev_handle = handle;
+   return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle* dev_handle)
+{
+   if(dev_handle == NULL)
+      return;
+
+   usb_close(dev_handle->h);
+   libusb_unref_device(dev_handle->dev);
+   free(dev_handle);
+}
+
+libusb_device* LIBUSB_CALL libusb_get_device(libusb_device_handle* dev_handle)
+{
+   return dev_handle->dev;
+}
+
+libusb_device_handle* LIBUSB_CALL libusb_open_device_with_vid_pid(libusb_context* ctx, uint16_t vendor_id, uint16_t product_id)
+{
+   libusb_device** list = NULL;
+   if(libusb_get_device_list(ctx, &list) < 0)
+      return NULL;
+
+   // Open first matching device
+   libusb_device_handle* handle = NULL;
+   libusb_device** dev = list;
+   for(; *dev != NULL; ++dev) {
+      struct usb_device_descriptor* desc = &(*dev)->descriptor;
+      if(desc->idVendor == vendor_id && desc->idProduct == product_id) {
+         if(libusb_open(*dev, &handle) != LIBUSB_SUCCESS)
+            handle = NULL;
+         break;
+      }
+   }
+
+   libusb_free_device_list(list, 1);
+   return handle;
+}
+
+int LIBUSB_CALL libusb_get_configuration(libusb_device_handle* dev_handle, int* config)
+{
+   // Ask device for active configuration
+   unsigned char value = 0;
+   int res = usb_control_msg(dev_handle->h, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_CONFIGURATION,
+                             0, 0, (char*) &value, 1, 1000);
+   if(res < 0)
+      return usb1_error(res);
+   if(res != 1)
+      return LIBUSB_ERROR_IO;
+
+   *config = value;
+   return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_set_configuration(libusb_device_handle* dev_handle, int configuration)
+{
+   int res = usb_set_configuration(dev_handle->h, configuration);
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+   int res = usb_claim_interface(dev_handle->h, interface_number);
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+   int res = usb_release_interface(dev_handle->h, interface_number);
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle* dev_handle, int interface_number, int alternate_setting)
+{
+   // libusb-0.1 selects alternate setting of last claimed interface,
+   // which is sent to server, select given interface for this call
+   usb_dev_handle* h = dev_handle->h;
+   int claimed = h->interface, altsetting = h->altsetting;
+   h->interface = interface_number;
+   int res = usb_set_altinterface(h, alternate_setting);
+   h->interface = claimed;
+   if(interface_number != claimed)
+      h->altsetting = altsetting;
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle* dev_handle, unsigned char endpoint)
+{
+   int res = usb_clear_halt(dev_handle->h, endpoint);
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle* dev_handle)
+{
+   int res = usb_reset(dev_handle->h);
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle* dev_handle, int interface_number)
+{
+   char name[256];
+   int res = usb_get_driver_np(dev_handle->h, interface_number, name, sizeof(name));
+   if(res == -ENODATA)
+      return 0;
+
+   return (res < 0) ? usb1_error(res) : 1;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle* dev_handle, int interface_number)
+{
+   int res = usb_detach_kernel_driver_np(dev_handle->h, interface_number);
+   if(res == -ENODATA)
+      return LIBUSB_ERROR_NOT_FOUND;
+
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle* dev_handle, int interface_number)
+{
+   (void) dev_handle;
+   (void) interface_number;
+   return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int LIBUSB_CALL libusb_set_auto_detach_kernel_driver(libusb_device_handle* dev_handle, int enable)
+{
+   (void) dev_handle;
+   (void) enable;
+   return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/* Synchronous transfers. */
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle* dev_handle, uint8_t request_type, uint8_t bRequest,
+                                        uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength,
+                                        unsigned int timeout)
+{
+   int res = usb_control_msg(dev_handle->h, request_type, bRequest, wValue, wIndex,
+                             (char*) data, wLength, timeout);
+   return (res < 0) ? usb1_error(res) : res;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle* dev_handle, unsigned char endpoint, unsigned char* data,
+                                     int length, int* actual_length, unsigned int timeout)
+{
+   int res = 0;
+   if(endpoint & LIBUSB_ENDPOINT_IN)
+      res = usb_bulk_read(dev_handle->h, endpoint, (char*) data, length, timeout);
+   else
+      res = usb_bulk_write(dev_handle->h, endpoint, (char*) data, length, timeout);
+
+   if(actual_length != NULL)
+      *actual_length = (res > 0) ? res : 0;
+
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle* dev_handle, unsigned char endpoint, unsigned char* data,
+                                          int length, int* actual_length, unsigned int timeout)
+{
+   int res = 0;
+   if(endpoint & LIBUSB_ENDPOINT_IN)
+      res = usb_interrupt_read(dev_handle->h, endpoint, (char*) data, length, timeout);
+   else
+      res = usb_interrupt_write(dev_handle->h, endpoint, (char*) data, length, timeout);
+
+   if(actual_length != NULL)
+      *actual_length = (res > 0) ? res : 0;
+
+   return (res < 0) ? usb1_error(res) : LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle* dev_handle, uint8_t desc_index,
+                                                   unsigned char* data, int length)
+{
+   int res = usb_get_string_simple(dev_handle->h, desc_index, (char*) data, length);
+   return (res < 0) ? usb1_error(res) : res;
+}
+
+/* Asynchronous transfers. */
+
+struct libusb_transfer* LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+   // Transfer follows private data, isochronous packets follow transfer
+   size_t size = sizeof(transfer_priv) + sizeof(struct libusb_transfer) +
+                 iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+   transfer_priv* p = calloc(1, size);
+   if(p == NULL)
+      return NULL;
+
+   struct libusb_transfer* t = PRIV_TRANSFER(p);
+   t->num_iso_packets = iso_packets;
+   return t;
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer* transfer)
+{
+   if(transfer == NULL)
+      return;
+
+   if((transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) && transfer->buffer != NULL)
+      free(transfer->buffer);
+
+   free(TRANSFER_PRIV(transfer));
+}
+
+/** Queue completed transfer to its context.
+  * \warning Called from library thread with session lock held.
+  */
+static void transfer_done(usb_async* a)
+{
+   transfer_priv* p = (transfer_priv*) a->data;
+   libusb_context* ctx = p->ctx;
+
+   pthread_mutex_lock(&ctx->lock);
+   p->next = NULL;
+   if(ctx->done_tail != NULL)
+      ctx->done_tail->next = p;
+   else
+      ctx->done = p;
+   ctx->done_tail = p;
+   pthread_mutex_unlock(&ctx->lock);
+
+   // Signal event
+   uint64_t one = 1;
+   if(write(ctx->efd, &one, sizeof(one)) < 0)
+      error_msg("%s: failed to signal completion", __func__);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer* transfer)
+{
+   transfer_priv* p = TRANSFER_PRIV(transfer);
+   if(p->submitted)
+      return LIBUSB_ERROR_BUSY;
+
+   // Prepare transfer
+   libusb_device_handle* handle = transfer->dev_handle;
+   usb_async* a = &p->a;
+   memset(a, 0, sizeof(usb_async));
+   a->dev = handle->h;
+   a->ep = transfer->endpoint;
+   a->bytes = (char*) transfer->buffer;
+   a->size = transfer->length;
+   a->timeout = transfer->timeout;
+   a->complete = &transfer_done;
+   a->data = p;
+   switch(transfer->type) {
+   case LIBUSB_TRANSFER_TYPE_CONTROL: {
+
+      // Setup packet precedes data, fields are little endian
+      const unsigned char* setup = transfer->buffer;
+      if(transfer->length < LIBUSB_CONTROL_SETUP_SIZE)
+         return LIBUSB_ERROR_INVALID_PARAM;
+      a->type = USB_ENDPOINT_TYPE_CONTROL;
+      a->requesttype = setup[0];
+      a->request = setup[1];
+      a->value = setup[2] | (setup[3] << 8);
+      a->index = setup[4] | (setup[5] << 8);
+      a->size = setup[6] | (setup[7] << 8);
+      a->bytes += LIBUSB_CONTROL_SETUP_SIZE;
+      if(a->size > transfer->length - LIBUSB_CONTROL_SETUP_SIZE)
+         return LIBUSB_ERROR_INVALID_PARAM;
+   }  break;
+   case LIBUSB_TRANSFER_TYPE_BULK:
+      a->type = USB_ENDPOINT_TYPE_BULK;
+      break;
+   case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+      a->type = USB_ENDPOINT_TYPE_INTERRUPT;
+      break;
+   default:
+      return LIBUSB_ERROR_NOT_SUPPORTED;
+   }
+
+   // Submit to device context
+   p->ctx = context(handle->dev->ctx);
+   if(p->ctx == NULL)
+      return LIBUSB_ERROR_INVALID_PARAM;
+
+   p->submitted = 1;
+   int res = usb_submit_async(a);
+   if(res < 0) {
+      p->submitted = 0;
+      return (res == -1) ? LIBUSB_ERROR_NO_DEVICE : usb1_error(res);
+   }
+
+   return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer* transfer)
+{
+   // Completion is queued already
+   transfer_priv* p = TRANSFER_PRIV(transfer);
+   if(!p->submitted || usb_cancel_async(&p->a) != 0)
+      return LIBUSB_ERROR_NOT_FOUND;
+
+   // Queue cancelled transfer, remote result is discarded
+   p->a.res = -ECANCELED;
+   transfer_done(&p->a);
+   return LIBUSB_SUCCESS;
+}
+
+/** Call callback of completed transfer. */
+static void transfer_finish(transfer_priv* p)
+{
+   struct libusb_transfer* t = PRIV_TRANSFER(p);
+   int res = p->a.res;
+   p->submitted = 0;
+
+   // Update transfer
+   t->status = usb1_status(res);
+   t->actual_length = (res > 0) ? res : 0;
+   if(t->status == LIBUSB_TRANSFER_COMPLETED && (t->flags & LIBUSB_TRANSFER_SHORT_NOT_OK)) {
+      int length = t->length;
+      if(t->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+         length -= LIBUSB_CONTROL_SETUP_SIZE;
+      if(t->actual_length < length)
+         t->status = LIBUSB_TRANSFER_ERROR;
+   }
+
+   // Transfer may be freed by callback
+   int free_transfer = (t->flags & LIBUSB_TRANSFER_FREE_TRANSFER);
+   if(t->callback != NULL)
+      t->callback(t);
+   if(free_transfer)
+      libusb_free_transfer(t);
+}
+
+/* Event handling.
+ * Any number of threads may handle events, each completed transfer
+ * is delivered once. Event lock is provided for applications
+ * implementing libusb-1.0 event handling scheme.
+ */
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context* ctx, struct timeval* tv, int* completed)
+{
+   ctx = context(ctx);
+   if(ctx == NULL)
+      return LIBUSB_ERROR_INVALID_PARAM;
+
+   // Wait for completion unless caller's transfer completed
+   if(completed == NULL || !*completed) {
+      int timeout = -1;
+      if(tv != NULL)
+         timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+      struct pollfd pfd = { ctx->efd, POLLIN, 0 };
+      if(poll(&pfd, 1, timeout) < 0)
+         return (errno == EINTR) ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+   }
+
+   // Take completed transfers
+   uint64_t count = 0;
+   if(read(ctx->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      return LIBUSB_ERROR_IO;
+   pthread_mutex_lock(&ctx->lock);
+   transfer_priv* p = ctx->done;
+   ctx->done = ctx->done_tail = NULL;
+   pthread_mutex_unlock(&ctx->lock);
+   if(p == NULL)
+      return LIBUSB_SUCCESS;
+
+   // Call callbacks
+   while(p != NULL) {
+      transfer_priv* next = p->next;
+      transfer_finish(p);
+      p = next;
+   }
+
+   // Wake up event waiters
+   pthread_mutex_lock(&ctx->waiters_lock);
+   pthread_cond_broadcast(&ctx->waiters_cond);
+   pthread_mutex_unlock(&ctx->waiters_lock);
+   return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout(libusb_context* ctx, struct timeval* tv)
+{
+   return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int LIBUSB_CALL libusb_handle_events_completed(libusb_context* ctx, int* completed)
+{
+   struct timeval tv = { 60, 0 };
+   return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+int LIBUSB_CALL libusb_handle_events(libusb_context* ctx)
+{
+   return libusb_handle_events_completed(ctx, NULL);
+}
+
+int LIBUSB_CALL libusb_handle_events_locked(libusb_context* ctx, struct timeval* tv)
+{
+   return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int LIBUSB_CALL libusb_try_lock_events(libusb_context* ctx)
+{
+   ctx = context(ctx);
+   if(pthread_mutex_trylock(&ctx->events_lock) != 0)
+      return 1;
+
+   ctx->handling = 1;
+   return 0;
+}
+
+void LIBUSB_CALL libusb_lock_events(libusb_context* ctx)
+{
+   ctx = context(ctx);
+   pthread_mutex_lock(&ctx->events_lock);
+   ctx->handling = 1;
+}
+
+void LIBUSB_CALL libusb_unlock_events(libusb_context* ctx)
+{
+   ctx = context(ctx);
+   ctx->handling = 0;
+   pthread_mutex_unlock(&ctx->events_lock);
+
+   // Wake up waiters to take over event handling
+   pthread_mutex_lock(&ctx->waiters_lock);
+   pthread_cond_broadcast(&ctx->waiters_cond);
+   pthread_mutex_unlock(&ctx->waiters_lock);
+}
+
+int LIBUSB_CALL libusb_event_handling_ok(libusb_context* ctx)
+{
+   (void) ctx;
+   return 1;
+}
+
+int LIBUSB_CALL libusb_event_handler_active(libusb_context* ctx)
+{
+   return context(ctx)->handling;
+}
+
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context* ctx)
+{
+   // Wake up poll on eventfd
+   uint64_t one = 1;
+   if(write(context(ctx)->efd, &one, sizeof(one)) < 0)
+      error_msg("%s: failed to signal event", __func__);
+}
+
+void LIBUSB_CALL libusb_lock_event_waiters(libusb_context* ctx)
+{
+   pthread_mutex_lock(&context(ctx)->waiters_lock);
+}
+
+void LIBUSB_CALL libusb_unlock_event_waiters(libusb_context* ctx)
+{
+   pthread_mutex_unlock(&context(ctx)->waiters_lock);
+}
+
+int LIBUSB_CALL libusb_wait_for_event(libusb_context* ctx, struct timeval* tv)
+{
+   ctx = context(ctx);
+   if(tv == NULL) {
+      pthread_cond_wait(&ctx->waiters_cond, &ctx->waiters_lock);
+      return 0;
+   }
+
+   // Wait with timeout
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += tv->tv_sec;
+   ts.tv_nsec += tv->tv_usec * 1000;
+   if(ts.tv_nsec >= 1000000000) {
+      ts.tv_nsec -= 1000000000;
+      ++ts.tv_sec;
+   }
+
+   return pthread_cond_timedwait(&ctx->waiters_cond, &ctx->waiters_lock, &ts) == ETIMEDOUT;
+}
+
+/* Poll integration.
+ * Context has a single eventfd, which is readable when transfers complete.
+ * Set of file descriptors never changes and there are no pending timeouts.
+ */
+
+int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context* ctx)
+{
+   (void) ctx;
+   return 1;
+}
+
+int LIBUSB_CALL libusb_get_next_timeout(libusb_context* ctx, struct timeval* tv)
+{
+   (void) ctx;
+   (void) tv;
+   return 0;
+}
+
+const struct libusb_pollfd** LIBUSB_CALL libusb_get_pollfds(libusb_context* ctx)
+{
+   ctx = context(ctx);
+   const struct libusb_pollfd** res = calloc(2, sizeof(struct libusb_pollfd*));
+   if(res != NULL)
+      res[0] = &ctx->pollfd;
+
+   return res;
+}
+
+void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd** pollfds)
+{
+   free(pollfds);
+}
+
+void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context* ctx, libusb_pollfd_added_cb added_cb,
+                                             libusb_pollfd_removed_cb removed_cb, void* user_data)
+{
+   (void) ctx;
+   (void) added_cb;
+   (void) removed_cb;
+   (void) user_data;
+}
+
+/** @} */
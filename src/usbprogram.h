@@ -0,0 +1,122 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbprogram.h
+    \brief Device program instruction set shared by client and server.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup libusbnet
+    @{
+  */
+#ifndef __usbprogram_h__
+#define __usbprogram_h__
+#include "usbschema.h"
+
+/** \page program_page
+    <h2>Device programs</h2>
+    Short transfer sequences (e.g. command, status polling, data read)
+    may run on the server in a single call, see usb_program_run().
+    Program runs on an open device in a sandbox with 8 integer registers
+    and a memory buffer initialized by client. Transfers read and write
+    the memory, memory prefix is returned to client when program ends.
+
+    Each instruction is 8 bytes, in network byte-order:
+    \code
+       op(1B) | a(1B, register) | b(2B, register/offset/endpoint) | imm(4B)
+    \endcode
+    Multi-byte memory values (Load16, Store16, ...) are little-endian,
+    as in USB descriptors and setup packets.
+    Jump targets are instruction indexes. Program fails if it accesses
+    memory out of bounds, runs out of instruction budget or time,
+    the fault is returned separately from the program result.
+    Transfer on endpoint not in active configuration results in -ENOENT.
+
+    Example, poll status bit and read data:
+    \code
+       0: Set       r0, 0              // status poll limit
+       1: Control   r1, b=0, imm=8     // setup at mem[0], 1B status to mem[8]
+       2: Load8     r2, imm=8
+       3: And       r2, imm=0x01
+       4: JumpNonZero r2, imm=8        // ready
+       5: Add       r0, imm=1
+       6: Sleep     imm=1000
+       7: Jump      imm=1              // (limit check omitted)
+       8: Set       r3, 512
+       9: Bulk      r3, b=0x81, imm=16 // read 512B to mem[16]
+      10: End       r3
+    \endcode
+  */
+
+/** Instruction size. */
+enum { ProgInsnSize = 8 };
+
+/** Limits enforced by server. */
+enum {
+   ProgRegs     = 8,         //! Registers
+   ProgMaxMem   = 64 * 1024, //! Memory size
+   ProgMaxSteps = 1 << 20,   //! Executed instructions
+   ProgMaxSleep = 100000,    //! Single Sleep (us)
+   ProgMaxTime  = 10000      //! Total run time (ms)
+};
+
+/** Instructions. */
+typedef enum {
+   ProgEnd = 0,     //! End, result is r[a]
+   ProgSet,         //! r[a] = imm
+   ProgAdd,         //! r[a] += imm
+   ProgAnd,         //! r[a] &= imm
+   ProgLoad8,       //! r[a] = mem[imm]
+   ProgLoad16,      //! r[a] = mem[imm..+2]
+   ProgLoad32,      //! r[a] = mem[imm..+4]
+   ProgStore8,      //! mem[imm] = r[a]
+   ProgStore16,     //! mem[imm..+2] = r[a]
+   ProgStore32,     //! mem[imm..+4] = r[a]
+   ProgJump,        //! pc = imm
+   ProgJumpZero,    //! pc = imm if r[a] == 0
+   ProgJumpNonZero, //! pc = imm if r[a] != 0
+   ProgJumpLess,    //! pc = imm if r[a] < r[b]
+   ProgControl,     //! r[a] = control transfer, setup packet at mem[b], data at mem[imm]
+   ProgBulk,        //! r[a] = bulk transfer of r[a] bytes on endpoint b, data at mem[imm]
+   ProgInterrupt,   //! r[a] = interrupt transfer, as ProgBulk
+   ProgSleep        //! Sleep imm microseconds
+} ProgOp;
+
+/** Write instruction.
+  * \return ptr past written instruction
+  */
+static inline char* prog_insn(char* p, uint8_t op, uint8_t a, uint16_t b, int32_t imm) {
+   p = schema_put_u8(p, op);
+   p = schema_put_u8(p, a);
+   p = schema_put_u16(p, b);
+   return schema_put_i32(p, imm);
+}
+
+/** Program to run on device, see usb_program_run(). */
+typedef struct {
+   const char* code;  //! Instructions, see prog_insn()
+   uint32_t codesize; //! Code size in bytes
+   char* mem;         //! Initial memory, returned memory is written back
+   uint32_t memsize;  //! Memory size
+   uint32_t outsize;  //! Memory prefix returned
+   uint32_t steps;    //! Instruction budget, 0 for server limit
+   int timeout;       //! Transfer timeout (ms)
+   uint32_t pc;       //! Last executed instruction, set on return
+   int result;        //! Program result (End register), set on return
+} usb_program;
+
+#endif // __usbprogram_h__
+/** @} */
@@ -0,0 +1,354 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbschema.h
+    \brief Call schema shared by client and server.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup libusbnet
+    @{
+  */
+#ifndef __usbschema_h__
+#define __usbschema_h__
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/** \page schema_page
+    <h2>Call schema</h2>
+    Each call is described once, by its request and reply fields.
+    Payload is a fixed layout of fields in network byte-order,
+    followed by optional raw data (transfer data, topology blocks).
+    Fields are read at known offsets, there are no per-field headers.
+
+    For each call, the schema generates:
+    \code
+       typedef struct { int32_t devfd; const char* data; uint32_t len; } UsbCloseReq;
+       enum { UsbCloseReqSize = 4 };                     // Fixed part size
+       char* UsbCloseReq_pack(char* dst, const UsbCloseReq* m);     // Write fields and data
+       int   UsbCloseReq_unpack(const char* src, uint32_t size, UsbCloseReq* m);
+    \endcode
+    Unpacked data points to the source buffer, no copy is made.
+    Client stubs and server dispatch are generated from SCHEMA_CALLS.
+  */
+
+/* Field types. */
+#define SCHEMA_CTYPE_i8  int8_t
+#define SCHEMA_CTYPE_u8  uint8_t
+#define SCHEMA_CTYPE_i16 int16_t
+#define SCHEMA_CTYPE_u16 uint16_t
+#define SCHEMA_CTYPE_i32 int32_t
+#define SCHEMA_CTYPE_u32 uint32_t
+#define SCHEMA_CTYPE_u64 uint64_t
+
+#define SCHEMA_SIZE_i8   1
+#define SCHEMA_SIZE_u8   1
+#define SCHEMA_SIZE_i16  2
+#define SCHEMA_SIZE_u16  2
+#define SCHEMA_SIZE_i32  4
+#define SCHEMA_SIZE_u32  4
+#define SCHEMA_SIZE_u64  8
+
+/* Field codecs, values are unaligned and in network byte-order. */
+static inline char* schema_put_u8(char* p, uint8_t v) {
+   *p = (char) v;
+   return p + 1;
+}
+
+static inline char* schema_put_u16(char* p, uint16_t v) {
+   v = htons(v);
+   memcpy(p, &v, sizeof(v));
+   return p + sizeof(v);
+}
+
+static inline char* schema_put_u32(char* p, uint32_t v) {
+   v = htonl(v);
+   memcpy(p, &v, sizeof(v));
+   return p + sizeof(v);
+}
+
+static inline uint8_t schema_get_u8(const char* p) {
+   return (uint8_t) *p;
+}
+
+static inline uint16_t schema_get_u16(const char* p) {
+   uint16_t v;
+   memcpy(&v, p, sizeof(v));
+   return ntohs(v);
+}
+
+static inline uint32_t schema_get_u32(const char* p) {
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return ntohl(v);
+}
+
+static inline char* schema_put_u64(char* p, uint64_t v) {
+   p = schema_put_u32(p, (uint32_t) (v >> 32));
+   return schema_put_u32(p, (uint32_t) v);
+}
+
+static inline uint64_t schema_get_u64(const char* p) {
+   return ((uint64_t) schema_get_u32(p) << 32) | schema_get_u32(p + 4);
+}
+
+/** Check payload holds given message size.
+  * Function, so messages without fields don't compare unsigned size < 0.
+  */
+static inline int schema_fits(uint32_t size, uint32_t need) {
+   return size >= need;
+}
+
+#define schema_put_i8(p, v)  schema_put_u8((p), (uint8_t) (v))
+#define schema_put_i16(p, v) schema_put_u16((p), (uint16_t) (v))
+#define schema_put_i32(p, v) schema_put_u32((p), (uint32_t) (v))
+#define schema_get_i8(p)     ((int8_t) schema_get_u8(p))
+#define schema_get_i16(p)    ((int16_t) schema_get_u16(p))
+#define schema_get_i32(p)    ((int32_t) schema_get_u32(p))
+
+/** Call flags. */
+enum {
+   SchemaDevice = 1 << 0, //! First request field is device fd
+   SchemaNoReply = 1 << 1 //! Call is not replied
+};
+
+/** Calls: X(opcode, server handler, flags).
+  * Request fields are listed in <opcode>_REQ, reply fields in <opcode>_REP.
+  */
+#define SCHEMA_CALLS(X) \
+   X(UsbInit,               usb_init,                 SchemaNoReply) \
+   X(UsbFindBusses,         usb_find_busses,          0) \
+   X(UsbFindDevices,        usb_find_devices,         0) \
+   X(UsbOpen,               usb_open,                 0) \
+   X(UsbClose,              usb_close,                SchemaDevice) \
+   X(UsbControlMsg,         usb_control_msg,          SchemaDevice) \
+   X(UsbClaimInterface,     usb_claim_interface,      SchemaDevice) \
+   X(UsbReleaseInterface,   usb_release_interface,    SchemaDevice) \
+   X(UsbGetKernelDriver,    usb_get_kernel_driver,    SchemaDevice) \
+   X(UsbDetachKernelDriver, usb_detach_kernel_driver, SchemaDevice) \
+   X(UsbBulkRead,           usb_bulk_read,            SchemaDevice) \
+   X(UsbBulkWrite,          usb_bulk_write,           SchemaDevice) \
+   X(UsbSetConfiguration,   usb_set_configuration,    SchemaDevice) \
+   X(UsbSetAltInterface,    usb_set_altinterface,     SchemaDevice) \
+   X(UsbResetEp,            usb_resetep,              SchemaDevice) \
+   X(UsbClearHalt,          usb_clear_halt,           SchemaDevice) \
+   X(UsbReset,              usb_reset,                SchemaDevice) \
+   X(UsbInterruptRead,      usb_interrupt_read,       SchemaDevice) \
+   X(UsbInterruptWrite,     usb_interrupt_write,      SchemaDevice) \
+   X(UsbBulkStream,         usb_bulk_stream,          SchemaDevice) \
+   X(UsbBulkStreamAck,      usb_bulk_stream_ack,      SchemaDevice|SchemaNoReply) \
+   X(UsbHello,              usb_hello,                0) \
+   X(UsbBatch,              usb_batch,                SchemaDevice) \
+   X(UsbProgram,            usb_program,              SchemaDevice) \
+   X(UsbShmLink,            usb_shm_link,             0) \
+   X(UsbStats,              usb_stats,                0) \
+   X(UsbCancel,             usb_cancel,               SchemaDevice|SchemaNoReply)
+
+/* Fields: F(type, name), data follows fixed fields. */
+#define UsbInit_REQ(F)
+#define UsbInit_REP(F)
+
+#define UsbFindBusses_REQ(F)
+#define UsbFindBusses_REP(F) F(i32, res)
+
+// Data: bus blocks, see usb_find_devices()
+#define UsbFindDevices_REQ(F) F(u32, generation)
+#define UsbFindDevices_REP(F) F(i32, res) F(u32, generation)
+
+#define UsbOpen_REQ(F) F(u32, location) F(u8, devnum)
+#define UsbOpen_REP(F) F(i32, res) F(i32, devfd)
+
+#define UsbClose_REQ(F) F(i32, devfd)
+#define UsbClose_REP(F) F(i32, res)
+
+// Data: OUT transfer data in request, IN transfer data in reply
+#define UsbControlMsg_REQ(F) \
+   F(i32, devfd) F(u8, requesttype) F(u8, request) \
+   F(u16, value) F(u16, index) F(u16, size) F(i32, timeout)
+#define UsbControlMsg_REP(F) F(i32, res)
+
+#define UsbClaimInterface_REQ(F) F(i32, devfd) F(i32, interface)
+#define UsbClaimInterface_REP(F) F(i32, res)
+
+#define UsbReleaseInterface_REQ(F) F(i32, devfd) F(i32, interface)
+#define UsbReleaseInterface_REP(F) F(i32, res)
+
+// Data: driver name
+#define UsbGetKernelDriver_REQ(F) F(i32, devfd) F(i32, interface) F(u32, namelen)
+#define UsbGetKernelDriver_REP(F) F(i32, res)
+
+#define UsbDetachKernelDriver_REQ(F) F(i32, devfd) F(i32, interface)
+#define UsbDetachKernelDriver_REP(F) F(i32, res)
+
+// Data: transfer data in reply
+#define UsbBulkRead_REQ(F) F(i32, devfd) F(u8, ep) F(i32, size) F(i32, timeout)
+#define UsbBulkRead_REP(F) F(i32, res)
+
+// Data: transfer data in request
+#define UsbBulkWrite_REQ(F) F(i32, devfd) F(u8, ep) F(i32, timeout)
+#define UsbBulkWrite_REP(F) F(i32, res)
+
+#define UsbSetConfiguration_REQ(F) F(i32, devfd) F(i32, configuration)
+#define UsbSetConfiguration_REP(F) F(i32, res) F(i32, configuration)
+
+#define UsbSetAltInterface_REQ(F) F(i32, devfd) F(i32, interface) F(i32, alternate)
+#define UsbSetAltInterface_REP(F) F(i32, res) F(i32, alternate)
+
+#define UsbResetEp_REQ(F) F(i32, devfd) F(u8, ep)
+#define UsbResetEp_REP(F) F(i32, res)
+
+#define UsbClearHalt_REQ(F) F(i32, devfd) F(u8, ep)
+#define UsbClearHalt_REP(F) F(i32, res)
+
+#define UsbReset_REQ(F) F(i32, devfd)
+#define UsbReset_REP(F) F(i32, res)
+
+// Data: transfer data in reply
+#define UsbInterruptRead_REQ(F) F(i32, devfd) F(u8, ep) F(i32, size) F(i32, timeout)
+#define UsbInterruptRead_REP(F) F(i32, res)
+
+// Data: transfer data in request
+#define UsbInterruptWrite_REQ(F) F(i32, devfd) F(u8, ep) F(i32, timeout)
+#define UsbInterruptWrite_REP(F) F(i32, res)
+
+// Stream ep -1 matches all endpoints, depth 0 stops streams
+#define UsbBulkStream_REQ(F) \
+   F(i32, devfd) F(i32, ep) F(i32, size) F(i32, timeout) F(i32, depth)
+#define UsbBulkStream_REP(F) F(i32, res)
+
+#define UsbBulkStreamAck_REQ(F) F(i32, devfd) F(i32, ep) F(i32, credits)
+#define UsbBulkStreamAck_REP(F)
+
+// Client codecs mask, server replies with codec used by both sides
+#define UsbHello_REQ(F) F(u32, codecs)
+#define UsbHello_REP(F) F(u32, codec)
+
+// Data: calls, each op(u8) | size(u32) | request fields and data
+#define UsbBatch_REQ(F) F(i32, devfd) F(u32, count)
+// Data: replies in call order, same layout, empty for calls without reply
+#define UsbBatch_REP(F) F(u32, count)
+
+/** Batched call or reply header size. */
+enum { UsbBatchEntrySize = 5 };
+
+// Data: code followed by initial memory, see usbprogram.h
+#define UsbProgram_REQ(F) \
+   F(i32, devfd) F(i32, timeout) F(u32, steps) \
+   F(u32, codesize) F(u32, memsize) F(u32, outsize)
+// Data: returned memory prefix
+// res: 0 or program fault, result: program result (End register)
+#define UsbProgram_REP(F) F(i32, res) F(i32, result) F(u32, pc) F(u32, steps)
+
+// Data: shared memory object name, see shmlink.h
+#define UsbShmLink_REQ(F)
+#define UsbShmLink_REP(F) F(i32, res)
+
+// Flags, see usbstats.h
+#define UsbStats_REQ(F) F(u32, flags)
+// Data: calls UsbStatsCallMsg entries, then devices UsbStatsDeviceMsg entries
+#define UsbStats_REP(F) F(u32, uptime) F(u32, calls) F(u32, devices)
+
+// Request id of cancelled call on device
+#define UsbCancel_REQ(F) F(i32, devfd) F(u16, id)
+#define UsbCancel_REP(F)
+
+/** Call statistics, times in ns.
+  * Followed by usbbuckets then totalbuckets UsbStatsBucketMsg entries.
+  */
+#define UsbStatsCall_MSG(F) \
+   F(u8, op) F(u64, calls) F(u64, errors) F(u64, bytesin) F(u64, bytesout) \
+   F(u64, usbtime) F(u64, totaltime) F(u16, usbbuckets) F(u16, totalbuckets)
+
+/** Non-empty latency histogram bucket. */
+#define UsbStatsBucket_MSG(F) F(u16, index) F(u64, count)
+
+/** Device statistics, times in ns. */
+#define UsbStatsDevice_MSG(F) \
+   F(u32, location) F(u8, devnum) F(u16, vendor) F(u16, product) \
+   F(u64, calls) F(u64, errors) F(u64, bytesin) F(u64, bytesout) \
+   F(u64, usbtime) F(u64, totaltime)
+
+/** Server push, request id 0.
+  * Data: transfer data
+  */
+#define UsbBulkStreamData_MSG(F) F(i32, devfd) F(i32, ep) F(i32, res)
+
+/* Message generators. */
+#define SCHEMA_MEMBER(t, n) SCHEMA_CTYPE_##t n;
+#define SCHEMA_SIZEOF(t, n) + SCHEMA_SIZE_##t
+#define SCHEMA_PUT(t, n)    p = schema_put_##t(p, m->n);
+#define SCHEMA_GET(t, n)    m->n = schema_get_##t(p); p += SCHEMA_SIZE_##t;
+
+/** Declare message type, size and codecs. */
+#define SCHEMA_MESSAGE(name, FIELDS) \
+   typedef struct { \
+      FIELDS(SCHEMA_MEMBER) \
+      const char* data; \
+      uint32_t len; \
+   } name; \
+   enum { name##Size = 0 FIELDS(SCHEMA_SIZEOF) }; \
+   static inline char* name##_pack(char* p, const name* m) { \
+      FIELDS(SCHEMA_PUT) \
+      if(m->len > 0) \
+         memcpy(p, m->data, m->len); \
+      return p + m->len; \
+   } \
+   static inline int name##_unpack(const char* p, uint32_t size, name* m) { \
+      if(!schema_fits(size, name##Size)) \
+         return 0; \
+      FIELDS(SCHEMA_GET) \
+      m->data = p; \
+      m->len = size - name##Size; \
+      return 1; \
+   }
+
+#define SCHEMA_DECLARE(op, handler, flags) \
+   SCHEMA_MESSAGE(op##Req, op##_REQ) \
+   SCHEMA_MESSAGE(op##Rep, op##_REP)
+
+SCHEMA_CALLS(SCHEMA_DECLARE)
+SCHEMA_MESSAGE(UsbBulkStreamDataMsg, UsbBulkStreamData_MSG)
+SCHEMA_MESSAGE(UsbStatsCallMsg, UsbStatsCall_MSG)
+SCHEMA_MESSAGE(UsbStatsBucketMsg, UsbStatsBucket_MSG)
+SCHEMA_MESSAGE(UsbStatsDeviceMsg, UsbStatsDevice_MSG)
+
+#ifdef __cplusplus
+/* Overloads for generic C++ code. */
+#define SCHEMA_OVERLOAD(name) \
+   inline uint32_t schema_size(const name& m) { \
+      return name##Size + m.len; \
+   } \
+   inline char* schema_pack(char* p, const name& m) { \
+      return name##_pack(p, &m); \
+   } \
+   inline int schema_unpack(const char* p, uint32_t size, name& m) { \
+      return name##_unpack(p, size, &m); \
+   }
+
+#define SCHEMA_DECLARE_OVERLOAD(op, handler, flags) \
+   SCHEMA_OVERLOAD(op##Req) \
+   SCHEMA_OVERLOAD(op##Rep)
+
+SCHEMA_CALLS(SCHEMA_DECLARE_OVERLOAD)
+SCHEMA_OVERLOAD(UsbBulkStreamDataMsg)
+SCHEMA_OVERLOAD(UsbStatsCallMsg)
+SCHEMA_OVERLOAD(UsbStatsBucketMsg)
+SCHEMA_OVERLOAD(UsbStatsDeviceMsg)
+#endif
+
+#endif // __usbschema_h__
+/** @} */
@@ -0,0 +1,82 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbstats.h
+    \brief Server statistics shared by client and server.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup libusbnet
+    @{
+  */
+#ifndef __usbstats_h__
+#define __usbstats_h__
+#include <stdint.h>
+
+/** \page stats_page
+    <h2>Server statistics</h2>
+    Server counts calls, failed device calls and bytes received and sent
+    per call and per device, and measures time spent in device calls
+    (libusb) and in the whole call handler. Snapshot is returned by UsbStats
+    call, see UsbStats_REP in usbschema.h.
+
+    Latencies are kept in log-linear histograms: values below 16 ns have
+    a bucket each, each higher power of two is split into 8 buckets,
+    so bucket bounds are within 12.5 % of the value. Values above 2^36 ns
+    (about 68 s) fall into the last bucket.
+  */
+
+/** UsbStats request flags. */
+enum {
+   StatsReset = 1 << 0 //! Reset counters after snapshot
+};
+
+/** Histogram layout. */
+enum {
+   StatsLinear = 16,   //! Buckets with single value
+   StatsSubBits = 3,   //! Sub-buckets per power of two (log2)
+   StatsMaxShift = 36, //! Values above 2^36 fall into last bucket
+   StatsBuckets = StatsLinear + (StatsMaxShift - 4) * (1 << StatsSubBits)
+};
+
+/** Return histogram bucket of value. */
+static inline int stats_bucket(uint64_t val)
+{
+   if(val < StatsLinear)
+      return (int) val;
+
+   int shift = 63 - __builtin_clzll(val);
+   if(shift >= StatsMaxShift)
+      return StatsBuckets - 1;
+
+   int sub = (int) (val >> (shift - StatsSubBits)) & ((1 << StatsSubBits) - 1);
+   return StatsLinear + ((shift - 4) << StatsSubBits) + sub;
+}
+
+/** Return lowest value of histogram bucket. */
+static inline uint64_t stats_bucket_value(int index)
+{
+   if(index < StatsLinear)
+      return index;
+
+   index -= StatsLinear;
+   int shift = (index >> StatsSubBits) + 4;
+   uint64_t base = (1 << StatsSubBits) + (index & ((1 << StatsSubBits) - 1));
+   return base << (shift - StatsSubBits);
+}
+
+#endif // __usbstats_h__
+/** @} */
@@ -0,0 +1,286 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbtiming.c
+    \brief Client call timing.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup libusbnet
+    @{
+  */
+#include "usbtiming.h"
+#include "usbnet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/** Maximum recorded calls. */
+#define TIMING_CALLS 64
+
+/** Call histograms of single thread. */
+typedef struct {
+   uint8_t op;                    //! Call opcode
+   const char* name;              //! Intercepted function
+   uint64_t calls;                //! Finished calls
+   uint64_t errors;               //! Calls with negative result
+   uint64_t bytes;                //! Payload bytes
+   uint64_t time;                 //! Total time (ns)
+   uint64_t maxtime;              //! Longest call (ns)
+   uint32_t rtt[StatsBuckets];    //! Call time histogram
+   uint32_t size[StatsBuckets];   //! Payload size histogram
+} timing_call;
+
+/** Thread table, never freed so exited threads are reported.
+  * Lock is taken by its thread on update and by timing_report().
+  */
+typedef struct timing_table {
+   struct timing_table* next;
+   unsigned thread;
+   pthread_mutex_t lock;
+   unsigned count;
+   timing_call calls[TIMING_CALLS];
+} timing_table;
+
+int __timing_enabled = 0;
+
+//! JSON lines output (NULL = disabled or closed), __timing_mutex held
+static FILE* __timing_json = NULL;
+static int __timing_stream = 0;
+
+//! Timing start
+static uint64_t __timing_start = 0;
+
+//! Thread tables and JSON output
+static timing_table* __timing_tables = NULL;
+static unsigned __timing_threads = 0;
+static pthread_mutex_t __timing_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t __timing_key;
+
+uint64_t timing_now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void timing_init()
+{
+   const char* opt = getenv("USBNET_TIMING");
+   if(opt != NULL && atoi(opt) != 0)
+      __timing_enabled = 1;
+
+   // Open JSON lines output
+   if((opt = getenv("USBNET_TIMING_JSON")) != NULL) {
+      if(strcmp(opt, "-") == 0)
+         __timing_json = stderr;
+      else if((__timing_json = fopen(opt, "a")) == NULL)
+         error_msg("Timing: unable to open '%s'", opt);
+      if(__timing_json != NULL)
+         __timing_enabled = __timing_stream = 1;
+   }
+
+   if(__timing_enabled) {
+      pthread_key_create(&__timing_key, NULL);
+      __timing_start = timing_now();
+   }
+}
+
+/** Return thread table, registered on first use. */
+static timing_table* timing_thread()
+{
+   timing_table* t = pthread_getspecific(__timing_key);
+   if(t == NULL) {
+      t = calloc(1, sizeof(timing_table));
+      pthread_mutex_init(&t->lock, NULL);
+      pthread_mutex_lock(&__timing_mutex);
+      t->thread = ++__timing_threads;
+      t->next = __timing_tables;
+      __timing_tables = t;
+      pthread_mutex_unlock(&__timing_mutex);
+      pthread_setspecific(__timing_key, t);
+   }
+
+   return t;
+}
+
+/** Return histograms of call or NULL if table is full.
+  * Calls sharing opcode are kept apart by name.
+  */
+static timing_call* timing_find(timing_call* calls, unsigned* count, uint8_t op, const char* name)
+{
+   unsigned i = 0;
+   for(i = 0; i < *count; ++i) {
+      if(calls[i].op == op && (calls[i].name == name || strcmp(calls[i].name, name) == 0))
+         return &calls[i];
+   }
+
+   if(*count == TIMING_CALLS)
+      return NULL;
+
+   timing_call* c = &calls[(*count)++];
+   c->op = op;
+   c->name = name;
+   return c;
+}
+
+void timing_record(uint8_t op, const char* name, uint64_t start, int res, uint32_t bytes)
+{
+   uint64_t now = timing_now();
+   uint64_t elapsed = now - start;
+
+   // Find call histograms
+   timing_table* t = timing_thread();
+   pthread_mutex_lock(&t->lock);
+   timing_call* c = timing_find(t->calls, &t->count, op, name);
+   if(c != NULL) {
+
+      // Update
+      ++c->calls;
+      if(res < 0)
+         ++c->errors;
+      c->bytes += bytes;
+      c->time += elapsed;
+      if(elapsed > c->maxtime)
+         c->maxtime = elapsed;
+      ++c->rtt[stats_bucket(elapsed)];
+      ++c->size[stats_bucket(bytes)];
+   }
+   pthread_mutex_unlock(&t->lock);
+
+   // Stream call, output is closed by report
+   if(__timing_stream) {
+      pthread_mutex_lock(&__timing_mutex);
+      if(__timing_json != NULL) {
+         fprintf(__timing_json, "{\"call\": \"%s\", \"thread\": %u, \"start_ns\": %llu, "
+                 "\"ns\": %llu, \"res\": %d, \"bytes\": %u}\n", name, t->thread,
+                 (unsigned long long) (start - __timing_start),
+                 (unsigned long long) elapsed, res, bytes);
+      }
+      pthread_mutex_unlock(&__timing_mutex);
+   }
+}
+
+/** Return lower bound of histogram percentile. */
+static uint64_t timing_percentile(const uint64_t* hist, uint64_t count, double pct)
+{
+   uint64_t rank = (uint64_t) (count * pct);
+   int i = 0;
+   for(i = 0; i < StatsBuckets; ++i) {
+      if(rank < hist[i])
+         return stats_bucket_value(i);
+      rank -= hist[i];
+   }
+
+   return 0;
+}
+
+void timing_report()
+{
+   if(!__timing_enabled)
+      return;
+
+   // Merge thread tables by call
+   typedef struct {
+      timing_call sum;
+      uint64_t rtt[StatsBuckets];
+      uint64_t size[StatsBuckets];
+   } merged_call;
+   merged_call* calls = calloc(TIMING_CALLS, sizeof(merged_call));
+   timing_call* keys = calloc(TIMING_CALLS, sizeof(timing_call));
+   if(calls == NULL || keys == NULL) {
+      free(calls);
+      free(keys);
+      return;
+   }
+
+   unsigned count = 0;
+   pthread_mutex_lock(&__timing_mutex);
+   timing_table* t = NULL;
+   for(t = __timing_tables; t != NULL; t = t->next) {
+      unsigned i = 0;
+      int k = 0;
+      pthread_mutex_lock(&t->lock);
+      for(i = 0; i < t->count; ++i) {
+         timing_call* c = &t->calls[i];
+         timing_call* key = timing_find(keys, &count, c->op, c->name);
+         if(key == NULL)
+            continue;
+
+         merged_call* m = &calls[key - keys];
+         m->sum.name = c->name;
+         m->sum.calls += c->calls;
+         m->sum.errors += c->errors;
+         m->sum.bytes += c->bytes;
+         m->sum.time += c->time;
+         if(c->maxtime > m->sum.maxtime)
+            m->sum.maxtime = c->maxtime;
+         for(k = 0; k < StatsBuckets; ++k) {
+            m->rtt[k] += c->rtt[k];
+            m->size[k] += c->size[k];
+         }
+      }
+      pthread_mutex_unlock(&t->lock);
+   }
+   unsigned threads = __timing_threads;
+
+   // Print table, busiest first, calls may still stream
+   fprintf(stderr, "libusbnet: call timing, %u threads\n", threads);
+   fprintf(stderr, "%-26s %10s %8s %12s %10s %9s %9s %9s %9s %9s\n",
+           "Call", "Calls", "Errors", "Bytes", "Total ms", "p50 us", "p99 us", "max us",
+           "B p50", "B p99");
+   for(;;) {
+      merged_call* m = NULL;
+      unsigned i = 0;
+      for(i = 0; i < count; ++i) {
+         if(calls[i].sum.calls > 0 && (m == NULL || calls[i].sum.time > m->sum.time))
+            m = &calls[i];
+      }
+      if(m == NULL)
+         break;
+
+      uint64_t n = m->sum.calls;
+      double p50 = timing_percentile(m->rtt, n, 0.5) / 1000.0;
+      double p99 = timing_percentile(m->rtt, n, 0.99) / 1000.0;
+      unsigned long long b50 = timing_percentile(m->size, n, 0.5);
+      unsigned long long b99 = timing_percentile(m->size, n, 0.99);
+      fprintf(stderr, "%-26s %10llu %8llu %12llu %10.1f %9.1f %9.1f %9.1f %9llu %9llu\n",
+              m->sum.name, (unsigned long long) n, (unsigned long long) m->sum.errors,
+              (unsigned long long) m->sum.bytes, m->sum.time / 1e6, p50, p99,
+              m->sum.maxtime / 1000.0, b50, b99);
+      if(__timing_json != NULL) {
+         fprintf(__timing_json, "{\"summary\": \"%s\", \"calls\": %llu, \"errors\": %llu, "
+                 "\"bytes\": %llu, \"total_ms\": %.3f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                 "\"max_us\": %.1f, \"bytes_p50\": %llu, \"bytes_p99\": %llu}\n",
+                 m->sum.name, (unsigned long long) n, (unsigned long long) m->sum.errors,
+                 (unsigned long long) m->sum.bytes, m->sum.time / 1e6, p50, p99,
+                 m->sum.maxtime / 1000.0, b50, b99);
+      }
+
+      m->sum.calls = 0;
+   }
+
+   if(__timing_json != NULL && __timing_json != stderr)
+      fclose(__timing_json);
+   __timing_json = NULL;
+   pthread_mutex_unlock(&__timing_mutex);
+   free(calls);
+   free(keys);
+}
+
+/** @} */
@@ -0,0 +1,89 @@
+/***************************************************************************
+*   Copyright (C) 2009 Marek Vavrusa <marek@vavrusa.com>                  *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU Library General Public License as       *
+*   published by the Free Software Foundation; either version 2 of the    *
+*   License, or (at your option) any later version.                       *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU Library General Public     *
+*   License along with this program; if not, write to the                 *
+*   Free Software Foundation, Inc.,                                       *
+*   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+***************************************************************************/
+/*! \file usbtiming.h
+    \brief Client call timing.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup libusbnet
+    @{
+  */
+#ifndef __usbtiming_h__
+#define __usbtiming_h__
+#include <stdint.h>
+
+/** \page timing_page
+    <h2>Client call timing</h2>
+    With USBNET_TIMING=1, every intercepted call is timed from entry to return
+    and the time and payload size are recorded in per-thread histograms
+    (same buckets as server statistics, see usbstats.h). Histograms are merged
+    and summary table is printed to stderr by session_teardown().
+    USBNET_TIMING_JSON=file enables timing as well and writes a JSON line
+    per call and summary JSON lines to file, "-" writes to stderr.
+    When timing is disabled, each call only tests a flag.
+  */
+
+/** Timing enabled flag, set by timing_init(). */
+extern int __timing_enabled;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Read timing options from environment.
+  */
+void timing_init();
+
+/** Return monotonic time (ns).
+  */
+uint64_t timing_now();
+
+/** Record finished call to thread histograms.
+  * \param op call opcode
+  * \param name intercepted function name
+  * \param start call start time
+  * \param res call result, negative on error
+  * \param bytes payload bytes transferred
+  */
+void timing_record(uint8_t op, const char* name, uint64_t start, int res, uint32_t bytes);
+
+/** Print summary of all threads.
+  */
+void timing_report();
+
+/** Return call start time or 0 if timing is disabled.
+  */
+static inline uint64_t timing_begin()
+{
+   return __timing_enabled ? timing_now() : 0;
+}
+
+/** Record call started by timing_begin().
+  */
+static inline void timing_end(uint8_t op, const char* name, uint64_t start, int res, uint32_t bytes)
+{
+   if(start != 0)
+      timing_record(op, name, start, res, bytes);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __usbtiming_h__
+/** @} */